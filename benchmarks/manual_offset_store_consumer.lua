@@ -69,29 +69,19 @@ local function consume()
 
     local before = clock.monotonic64()
     local counter = 0
-    local out, err = consumer:output()
-    if err ~= nil then
-        print(string.format("got fatal error '%s'", err))
-        return
-    end
 
     while counter < MSG_COUNT do
-        if out:is_closed() then
-            return
-        end
-
-        local msg = out:get()
-        if msg ~= nil then
-            counter = counter + 1
-            err = consumer:store_offset(msg)
+        local msgs = consumer:poll_batch(10000, 1)
+        if #msgs > 0 then
+            counter = counter + #msgs
+            -- one call per batch instead of one per message
+            err = consumer:store_offsets(msgs)
             if err ~= nil then
                 print(err)
             end
-        end
-        if counter % 10000 == 0 then
             log.info("done %d", counter)
-            fiber.yield()
         end
+        fiber.yield()
     end
 
     print("closing")
@@ -0,0 +1,315 @@
+local fiber = require('fiber')
+local box = require('box')
+local os = require('os')
+local log = require('log')
+local ffi = require('ffi')
+local json = require('json')
+local clock = require('clock')
+local tnt_kafka = require('kafka')
+
+-- Benchmark of produce, sync produce and consume paths against in-process mock cluster of librdkafka,
+-- so results depend on the module and librdkafka only and may be compared between builds.
+-- Parameters are taken from environment:
+--   BENCH_CASES        comma separated cases: produce, sync_produce, consume
+--   BENCH_MSG_COUNT    messages per case
+--   BENCH_MSG_SIZE     value size in bytes
+--   BENCH_KEYS         count of distinct keys, 0 for keyless messages
+--   BENCH_TOPICS       count of topics
+--   BENCH_PARTITIONS   partitions per topic
+--   BENCH_BROKERS      brokers of mock cluster
+--   BENCH_CONCURRENCY  producing fibers
+--   BENCH_JSON         print results as JSON lines when set
+
+local function env_number(name, default)
+    local value = os.getenv(name)
+    if value == nil or value == '' then
+        return default
+    end
+    return tonumber(value)
+end
+
+local CONFIG = {
+    cases = os.getenv('BENCH_CASES') or 'produce,sync_produce,consume',
+    msg_count = env_number('BENCH_MSG_COUNT', 1000000),
+    msg_size = env_number('BENCH_MSG_SIZE', 100),
+    keys = env_number('BENCH_KEYS', 1000),
+    topics = env_number('BENCH_TOPICS', 1),
+    partitions = env_number('BENCH_PARTITIONS', 4),
+    brokers = env_number('BENCH_BROKERS', 3),
+    concurrency = env_number('BENCH_CONCURRENCY', 100),
+    json = os.getenv('BENCH_JSON') ~= nil,
+}
+
+box.cfg{}
+
+-- allocations of Lua are counted by LuaJIT metrics when they are available
+local has_misc, misc = pcall(require, 'misc')
+local function lua_allocated()
+    if has_misc and misc.getmetrics ~= nil then
+        return misc.getmetrics().gc_allocated
+    end
+    return nil
+end
+
+local function fail(err)
+    log.error(err)
+    os.exit(1)
+end
+
+local cluster, err = tnt_kafka.MockCluster.create({brokers = CONFIG.brokers})
+if err ~= nil then
+    fail(err)
+end
+local brokers = cluster:bootstraps()
+
+local topics = {}
+for i = 1, CONFIG.topics do
+    topics[i] = string.format('benchmark_%d', i)
+    err = cluster:create_topic(topics[i], CONFIG.partitions, math.min(CONFIG.brokers, 3))
+    if err ~= nil then
+        fail(err)
+    end
+end
+
+local keys = {}
+for i = 1, CONFIG.keys do
+    keys[i] = string.format('key_%d', i)
+end
+
+local payload = string.rep('x', CONFIG.msg_size)
+
+-- clock of consumed values is encoded in fixed width prefix of value
+local TIMESTAMP_WIDTH = 16
+local function timestamped_payload()
+    local prefix = string.format('%016d', tonumber(clock.realtime64() / 1000))
+    if CONFIG.msg_size <= TIMESTAMP_WIDTH then
+        return prefix
+    end
+    return prefix .. payload:sub(TIMESTAMP_WIDTH + 1)
+end
+
+local function fill_msg(msg, i)
+    msg.topic = topics[i % #topics + 1]
+    if #keys > 0 then
+        msg.key = keys[i % #keys + 1]
+    end
+end
+
+-- latencies are kept out of Lua heap, so they do not affect allocations of measured path
+local function new_latencies(count)
+    return {values = ffi.new('double[?]', count), count = 0, capacity = count}
+end
+
+local function add_latency(latencies, value)
+    if latencies.count < latencies.capacity then
+        latencies.values[latencies.count] = value
+        latencies.count = latencies.count + 1
+    end
+end
+
+local function percentiles(latencies)
+    local sorted = {}
+    for i = 0, latencies.count - 1 do
+        sorted[i + 1] = latencies.values[i]
+    end
+    table.sort(sorted)
+    local function at(q)
+        if #sorted == 0 then
+            return 0
+        end
+        return sorted[math.max(1, math.ceil(#sorted * q))]
+    end
+    return at(0.5), at(0.99), at(0.999)
+end
+
+local function measure(name, count, latencies, fun)
+    collectgarbage()
+    local allocated = lua_allocated()
+    local cpu = clock.proc64()
+    local started = clock.monotonic64()
+
+    fun()
+
+    local elapsed = tonumber(clock.monotonic64() - started) / 1e9
+    cpu = tonumber(clock.proc64() - cpu) / 1e3
+    local p50, p99, p999 = percentiles(latencies)
+    local result = {
+        case = name,
+        msgs = count,
+        seconds = elapsed,
+        msgs_per_sec = count / elapsed,
+        mb_per_sec = count * CONFIG.msg_size / elapsed / (1024 * 1024),
+        p50_us = p50,
+        p99_us = p99,
+        p999_us = p999,
+        -- process CPU time including librdkafka threads
+        cpu_us_per_msg = cpu / count,
+    }
+    if allocated ~= nil then
+        result.lua_bytes_per_msg = tonumber(lua_allocated() - allocated) / count
+    end
+
+    if CONFIG.json then
+        print(json.encode(result))
+    else
+        print(string.format(
+            '%-12s %10.0f msg/s %8.2f MB/s  p50 %8.0f us  p99 %8.0f us  p999 %8.0f us  cpu %6.2f us/msg  lua %s bytes/msg',
+            name, result.msgs_per_sec, result.mb_per_sec, p50, p99, p999, result.cpu_us_per_msg,
+            result.lua_bytes_per_msg ~= nil and string.format('%.1f', result.lua_bytes_per_msg) or 'n/a'))
+    end
+end
+
+local function run_fibers(count, fun)
+    local per_fiber = math.ceil(count / CONFIG.concurrency)
+    local done = fiber.channel(CONFIG.concurrency)
+    local started = 0
+    for from = 1, count, per_fiber do
+        local to = math.min(from + per_fiber - 1, count)
+        started = started + 1
+        fiber.create(function()
+            fun(from, to)
+            done:put(true)
+        end)
+    end
+    for _ = 1, started do
+        done:get()
+    end
+end
+
+local function produce_async_all(producer, count, make_value)
+    run_fibers(count, function(from, to)
+        -- message table is reused, so only the module allocates per message
+        local msg = {value = payload}
+        for i = from, to do
+            fill_msg(msg, i)
+            if make_value ~= nil then
+                msg.value = make_value()
+            end
+            while producer:produce_async(msg) ~= nil do
+                -- queue of librdkafka is full
+                fiber.sleep(0.001)
+            end
+            if i % 1000 == 0 then
+                fiber.yield()
+            end
+        end
+    end)
+end
+
+local cases = {}
+
+function cases.produce(count)
+    local latencies = new_latencies(count)
+    local reported = 0
+    local producer, err = tnt_kafka.Producer.create({
+        brokers = brokers,
+        delivery_report_callback = function(reports)
+            for _, report in ipairs(reports) do
+                add_latency(latencies, report.latency)
+            end
+            reported = reported + #reports
+        end,
+    })
+    if err ~= nil then
+        fail(err)
+    end
+
+    measure('produce', count, latencies, function()
+        produce_async_all(producer, count)
+        while reported < count do
+            fiber.sleep(0.01)
+        end
+    end)
+    producer:close()
+end
+
+function cases.sync_produce(count)
+    local latencies = new_latencies(count)
+    local producer, err = tnt_kafka.Producer.create({brokers = brokers, options = {["linger.ms"] = "1"}})
+    if err ~= nil then
+        fail(err)
+    end
+
+    measure('sync_produce', count, latencies, function()
+        run_fibers(count, function(from, to)
+            local msg = {value = payload}
+            for i = from, to do
+                fill_msg(msg, i)
+                local started = clock.monotonic64()
+                local err = producer:produce(msg)
+                if err ~= nil then
+                    fail(err)
+                end
+                add_latency(latencies, tonumber(clock.monotonic64() - started) / 1e3)
+            end
+        end)
+    end)
+    producer:close()
+end
+
+-- latency of consume path is end to end one from produce call until message is taken by application
+function cases.consume(count)
+    local latencies = new_latencies(count)
+    local consumer, err = tnt_kafka.Consumer.create({
+        brokers = brokers,
+        options = {
+            ["group.id"] = string.format('benchmark_%d', os.time()),
+            ["auto.offset.reset"] = "latest",
+            ["enable.partition.eof"] = "false",
+        },
+    })
+    if err ~= nil then
+        fail(err)
+    end
+    err = consumer:subscribe(topics)
+    if err ~= nil then
+        fail(err)
+    end
+
+    local producer
+    producer, err = tnt_kafka.Producer.create({brokers = brokers, options = {["linger.ms"] = "1"}})
+    if err ~= nil then
+        fail(err)
+    end
+
+    -- waiting for assignment, so produced messages are not skipped by latest offset reset
+    local deadline = fiber.clock() + 30
+    while #(consumer:lag() or {partitions = {}}).partitions == 0 and fiber.clock() < deadline do
+        fiber.sleep(0.1)
+    end
+
+    measure('consume', count, latencies, function()
+        local producing = fiber.create(function()
+            produce_async_all(producer, count, timestamped_payload)
+        end)
+        producing:name('benchmark_producer')
+
+        local consumed = 0
+        while consumed < count do
+            local msgs = consumer:poll_batch(1000, 1)
+            local now = tonumber(clock.realtime64() / 1000)
+            for _, msg in ipairs(msgs) do
+                local sent = tonumber(msg:value():sub(1, TIMESTAMP_WIDTH))
+                if sent ~= nil then
+                    add_latency(latencies, now - sent)
+                end
+            end
+            consumed = consumed + #msgs
+        end
+    end)
+
+    producer:close()
+    consumer:close()
+end
+
+log.info('benchmark config: %s', json.encode(CONFIG))
+for name in CONFIG.cases:gmatch('[^,%s]+') do
+    local case = cases[name]
+    if case == nil then
+        fail(string.format("unknown benchmark case '%s'", name))
+    end
+    case(CONFIG.msg_count)
+end
+
+cluster:close()
+os.exit(0)
@@ -0,0 +1,122 @@
+#ifndef TNT_KAFKA_ABI_H
+#define TNT_KAFKA_ABI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <librdkafka/rdkafka.h>
+
+#include <consumer.h>
+#include <consumer_msg.h>
+#include <producer.h>
+#include <partitioner.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Stable C ABI for LuaJIT FFI, declarations are mirrored by ffi.cdef in kafka/abi.lua.
+ * Functions neither yield nor call Lua, so fiber loops calling them are compiled by JIT entirely.
+ * All functions must be called from TX thread only. Handles are valid until close of consumer or producer.
+ */
+
+#define TNT_KAFKA_API __attribute__ ((visibility("default")))
+
+/**
+ * Take up to n already polled messages without waiting
+ * @param consumer
+ * @param buf
+ * @param n
+ * @return count of messages written to buf, caller owns them and frees with tnt_kafka_msg_free
+ */
+TNT_KAFKA_API int
+tnt_kafka_consumer_poll_into(consumer_t *consumer, msg_t **buf, int n);
+
+/**
+ * @param consumer
+ * @return 1 if poll_into would return any message
+ */
+TNT_KAFKA_API int
+tnt_kafka_consumer_has_msgs(consumer_t *consumer);
+
+/**
+ * @param consumer
+ * @param msg
+ * @return librdkafka error code, 0 on success
+ */
+TNT_KAFKA_API int
+tnt_kafka_consumer_store_offset(consumer_t *consumer, const msg_t *msg);
+
+TNT_KAFKA_API const char *
+tnt_kafka_msg_topic(const msg_t *msg);
+
+TNT_KAFKA_API int32_t
+tnt_kafka_msg_partition(const msg_t *msg);
+
+TNT_KAFKA_API int64_t
+tnt_kafka_msg_offset(const msg_t *msg);
+
+/**
+ * @param msg
+ * @param len
+ * @return pointer to key or NULL if message has no key
+ */
+TNT_KAFKA_API const char *
+tnt_kafka_msg_key(const msg_t *msg, size_t *len);
+
+/**
+ * @param msg
+ * @param len
+ * @return pointer to value or NULL if message has no value
+ */
+TNT_KAFKA_API const char *
+tnt_kafka_msg_value(const msg_t *msg, size_t *len);
+
+/**
+ * @param msg
+ * @param len
+ * @return pointer to msgpack of value decoded by consumer codec or NULL
+ */
+TNT_KAFKA_API const char *
+tnt_kafka_msg_msgpack(const msg_t *msg, size_t *len);
+
+TNT_KAFKA_API void
+tnt_kafka_msg_free(msg_t *msg);
+
+/**
+ * Find or create topic handle, handle is owned by producer
+ * @param producer
+ * @param name
+ * @return NULL on failure
+ */
+TNT_KAFKA_API rd_kafka_topic_t *
+tnt_kafka_producer_topic(producer_t *producer, const char *name);
+
+/**
+ * Produce message to partition chosen by partitioner without delivery report.
+ * Key and value are copied.
+ * @return librdkafka error code, 0 on success
+ */
+TNT_KAFKA_API int
+tnt_kafka_produce_raw(producer_t *producer, rd_kafka_topic_t *topic,
+                      const char *key, size_t key_len, const char *value, size_t value_len);
+
+TNT_KAFKA_API const char *
+tnt_kafka_err2str(int err);
+
+/**
+ * Register payload codec from other C module, see codec.h
+ * @param codec must outlive all consumers and producers using it
+ * @return 0 on success, -1 when name is taken or registry is full
+ */
+TNT_KAFKA_API int
+tnt_kafka_register_codec(const codec_t *codec);
+
+/**
+ * Register custom partitioner from other C module, see partitioner.h.
+ * Producers use it when 'partitioner' of default topic options is its name.
+ * @param partitioner must outlive all producers using it
+ * @return 0 on success, -1 when name is taken or registry is full
+ */
+TNT_KAFKA_API int
+tnt_kafka_register_partitioner(const partitioner_t *partitioner);
+
+#endif // TNT_KAFKA_ABI_H
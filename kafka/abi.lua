@@ -0,0 +1,163 @@
+local ffi = require('ffi')
+
+-- mirrors kafka/abi.h
+ffi.cdef[[
+struct tnt_kafka_consumer;
+struct tnt_kafka_producer;
+struct tnt_kafka_msg;
+struct tnt_kafka_topic;
+
+int tnt_kafka_consumer_poll_into(struct tnt_kafka_consumer *consumer, struct tnt_kafka_msg **buf, int n);
+int tnt_kafka_consumer_has_msgs(struct tnt_kafka_consumer *consumer);
+int tnt_kafka_consumer_store_offset(struct tnt_kafka_consumer *consumer, const struct tnt_kafka_msg *msg);
+
+const char *tnt_kafka_msg_topic(const struct tnt_kafka_msg *msg);
+int32_t tnt_kafka_msg_partition(const struct tnt_kafka_msg *msg);
+int64_t tnt_kafka_msg_offset(const struct tnt_kafka_msg *msg);
+const char *tnt_kafka_msg_key(const struct tnt_kafka_msg *msg, size_t *len);
+const char *tnt_kafka_msg_value(const struct tnt_kafka_msg *msg, size_t *len);
+const char *tnt_kafka_msg_msgpack(const struct tnt_kafka_msg *msg, size_t *len);
+void tnt_kafka_msg_free(struct tnt_kafka_msg *msg);
+
+struct tnt_kafka_topic *tnt_kafka_producer_topic(struct tnt_kafka_producer *producer, const char *name);
+int tnt_kafka_produce_raw(struct tnt_kafka_producer *producer, struct tnt_kafka_topic *topic,
+                          const char *key, size_t key_len, const char *value, size_t value_len);
+const char *tnt_kafka_err2str(int err);
+]]
+
+-- module is already loaded by kafka.init, so the same library instance is returned
+local lib = ffi.load(package.searchpath('kafka.tntkafka', package.cpath))
+
+local len_buf = ffi.new('size_t[1]')
+
+local msg_methods = {}
+
+function msg_methods:topic()
+    return ffi.string(lib.tnt_kafka_msg_topic(self))
+end
+
+function msg_methods:partition()
+    return lib.tnt_kafka_msg_partition(self)
+end
+
+function msg_methods:offset()
+    return lib.tnt_kafka_msg_offset(self)
+end
+
+function msg_methods:key_ptr()
+    local ptr = lib.tnt_kafka_msg_key(self, len_buf)
+    if ptr == nil then
+        return nil, 0
+    end
+    return ptr, tonumber(len_buf[0])
+end
+
+function msg_methods:key()
+    local ptr, len = self:key_ptr()
+    if ptr == nil then
+        return nil
+    end
+    return ffi.string(ptr, len)
+end
+
+function msg_methods:value_ptr()
+    local ptr = lib.tnt_kafka_msg_value(self, len_buf)
+    if ptr == nil then
+        return nil, 0
+    end
+    return ptr, tonumber(len_buf[0])
+end
+
+function msg_methods:value()
+    local ptr, len = self:value_ptr()
+    if ptr == nil then
+        return nil
+    end
+    return ffi.string(ptr, len)
+end
+
+function msg_methods:value_msgpack_ptr()
+    local ptr = lib.tnt_kafka_msg_msgpack(self, len_buf)
+    if ptr == nil then
+        return nil, 0
+    end
+    return ptr, tonumber(len_buf[0])
+end
+
+function msg_methods:free()
+    -- message is freed explicitly, so finalizer must not free it once again
+    ffi.gc(self, nil)
+    lib.tnt_kafka_msg_free(self)
+end
+
+ffi.metatype('struct tnt_kafka_msg', { __index = msg_methods })
+
+local function consumer_handle(consumer)
+    return ffi.cast('struct tnt_kafka_consumer *', consumer._consumer:_raw())
+end
+
+local function producer_handle(producer)
+    return ffi.cast('struct tnt_kafka_producer *', producer._producer:_raw())
+end
+
+local function msg_buf(n)
+    -- raw array is filled by C code, messages are taken into Lua table with finalizers
+    return {raw = ffi.new('struct tnt_kafka_msg *[?]', n), count = 0}
+end
+
+local function poll_into(handle, buf, n)
+    local raw = buf.raw
+    local count = lib.tnt_kafka_consumer_poll_into(handle, raw, n)
+    for i = 0, count - 1 do
+        -- message is freed by gc when Lua error happens before msg:free(), so it does not pin consumer
+        buf[i] = ffi.gc(raw[i], lib.tnt_kafka_msg_free)
+    end
+    -- messages of previous poll are not left in buffer
+    for i = count, buf.count - 1 do
+        buf[i] = nil
+    end
+    buf.count = count
+    return count
+end
+
+local function has_msgs(handle)
+    return lib.tnt_kafka_consumer_has_msgs(handle) ~= 0
+end
+
+local function store_offset(handle, msg)
+    local err = lib.tnt_kafka_consumer_store_offset(handle, msg)
+    if err ~= 0 then
+        return ffi.string(lib.tnt_kafka_err2str(err))
+    end
+    return nil
+end
+
+local function topic(handle, name)
+    local rd_topic = lib.tnt_kafka_producer_topic(handle, name)
+    if rd_topic == nil then
+        return nil, "failed to create topic " .. name
+    end
+    return rd_topic
+end
+
+local function produce_raw(handle, rd_topic, key, value)
+    local key_len = key ~= nil and #key or 0
+    local value_len = value ~= nil and #value or 0
+    local err = lib.tnt_kafka_produce_raw(handle, rd_topic, key, key_len, value, value_len)
+    if err ~= 0 then
+        return ffi.string(lib.tnt_kafka_err2str(err))
+    end
+    return nil
+end
+
+return {
+    lib = lib,
+    consumer_handle = consumer_handle,
+    producer_handle = producer_handle,
+    msg_buf = msg_buf,
+    poll_into = poll_into,
+    has_msgs = has_msgs,
+    store_offset = store_offset,
+    topic = topic,
+    produce_raw = produce_raw,
+}
@@ -1,7 +1,9 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -11,6 +13,9 @@
 
 #include <common.h>
 #include <queue.h>
+#include <notifier.h>
+#include <consumer_msg.h>
+#include <stats.h>
 #include <callbacks.h>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -23,35 +28,34 @@
  */
 
 log_msg_t *
-new_log_msg(int level, const char *fac, const char *buf) {
-    log_msg_t *msg = malloc(sizeof(log_msg_t));
+new_log_msg(slab_cache_t *slab, int level, const char *fac, const char *buf) {
+    size_t fac_len = strlen(fac) + 1;
+    size_t buf_len = strlen(buf) + 1;
+    log_msg_t *msg = slab_alloc(slab, sizeof(log_msg_t) + fac_len + buf_len);
     if (msg == NULL) {
         return NULL;
     }
     msg->level = level;
-    msg->fac = malloc(sizeof(char) * strlen(fac) + 1);
-    strcpy(msg->fac, fac);
-    msg->buf = malloc(sizeof(char) * strlen(buf) + 1);
-    strcpy(msg->buf, buf);
+    msg->fac = (char *)msg + sizeof(log_msg_t);
+    memcpy(msg->fac, fac, fac_len);
+    msg->buf = msg->fac + fac_len;
+    memcpy(msg->buf, buf, buf_len);
     return msg;
 }
 
 void
 destroy_log_msg(log_msg_t *msg) {
-    if (msg->fac != NULL)
-        free(msg->fac);
-    if (msg->buf != NULL)
-        free(msg->buf);
-    free(msg);
+    slab_free(msg);
 }
 
 void
 log_callback(const rd_kafka_t *rd_kafka, int level, const char *fac, const char *buf) {
     event_queues_t *event_queues = rd_kafka_opaque(rd_kafka);
     if (event_queues != NULL && event_queues->queues[LOG_QUEUE] != NULL) {
-        log_msg_t *msg = new_log_msg(level, fac, buf);
+        log_msg_t *msg = new_log_msg(event_queues->slab, level, fac, buf);
         if (msg != NULL && queue_push(event_queues->queues[LOG_QUEUE], msg) != 0) {
             destroy_log_msg(msg);
+            metrics_inc(&event_queues->metrics.dropped_callback_msgs, 1);
         }
     }
 }
@@ -59,16 +63,29 @@ log_callback(const rd_kafka_t *rd_kafka, int level, const char *fac, const char
 int
 stats_callback(rd_kafka_t *rd_kafka, char *json, size_t json_len, void *opaque) {
     (void)opaque;
-    (void)json_len;
     event_queues_t *event_queues = rd_kafka_opaque(rd_kafka);
-    if (event_queues != NULL && event_queues->queues[STATS_QUEUE] != NULL) {
-        if (json != NULL) {
-            if (queue_push(event_queues->queues[STATS_QUEUE], json) != 0)
-                return 0; // destroy json after return
-            return 1; // json should be freed manually
+    if (event_queues == NULL || event_queues->queues[STATS_QUEUE] == NULL || json == NULL)
+        return 0;
+
+    // selected fields are parsed here, so TX thread does not spend time on whole JSON
+    if (event_queues->stats_filter != NULL) {
+        stats_msg_t *msg = new_filtered_stats_msg(event_queues->stats_filter, json, json_len);
+        if (msg != NULL && queue_push(event_queues->queues[STATS_QUEUE], msg) != 0) {
+            destroy_stats_msg(msg);
+            metrics_inc(&event_queues->metrics.dropped_callback_msgs, 1);
         }
+        return 0; // destroy json after return
     }
-    return 0;
+
+    stats_msg_t *msg = new_raw_stats_msg(json);
+    if (msg == NULL)
+        return 0;
+    if (queue_push(event_queues->queues[STATS_QUEUE], msg) != 0) {
+        free(msg); // json is destroyed by librdkafka
+        metrics_inc(&event_queues->metrics.dropped_callback_msgs, 1);
+        return 0;
+    }
+    return 1; // json should be freed manually
 }
 
 /**
@@ -76,30 +93,31 @@ stats_callback(rd_kafka_t *rd_kafka, char *json, size_t json_len, void *opaque)
  */
 
 error_msg_t *
-new_error_msg(int err, const char *reason) {
-    error_msg_t *msg = malloc(sizeof(error_msg_t));
+new_error_msg(slab_cache_t *slab, int err, const char *reason) {
+    size_t reason_len = strlen(reason) + 1;
+    error_msg_t *msg = slab_alloc(slab, sizeof(error_msg_t) + reason_len);
     if (msg == NULL)
         return NULL;
     msg->err = err;
-    msg->reason = malloc(sizeof(char) * strlen(reason) + 1);
-    strcpy(msg->reason, reason);
+    msg->reason = (char *)msg + sizeof(error_msg_t);
+    memcpy(msg->reason, reason, reason_len);
     return msg;
 }
 
 void
 destroy_error_msg(error_msg_t *msg) {
-    if (msg->reason != NULL)
-        free(msg->reason);
-    free(msg);
+    slab_free(msg);
 }
 
 void
 error_callback(rd_kafka_t *UNUSED(rd_kafka), int err, const char *reason, void *opaque) {
     event_queues_t *event_queues = opaque;
     if (event_queues != NULL && event_queues->queues[ERROR_QUEUE] != NULL) {
-        error_msg_t *msg = new_error_msg(err, reason);
-        if (msg != NULL && queue_push(event_queues->queues[ERROR_QUEUE], msg) != 0)
+        error_msg_t *msg = new_error_msg(event_queues->slab, err, reason);
+        if (msg != NULL && queue_push(event_queues->queues[ERROR_QUEUE], msg) != 0) {
             destroy_error_msg(msg);
+            metrics_inc(&event_queues->metrics.dropped_callback_msgs, 1);
+        }
     }
 }
 
@@ -113,9 +131,9 @@ push_log_cb_args(struct lua_State *L, const log_msg_t *msg)
 }
 
 int
-push_stats_cb_args(struct lua_State *L, const char *msg)
+push_stats_cb_args(struct lua_State *L, const stats_msg_t *msg)
 {
-    lua_pushstring(L, msg);
+    lua_push_stats_msg(L, msg);
     return 1;
 }
 
@@ -131,215 +149,352 @@ push_errors_cb_args(struct lua_State *L, const error_msg_t *msg)
  */
 
 dr_msg_t *
-new_dr_msg(int dr_callback, int err) {
+new_dr_msg(slab_cache_t *slab, int dr_callback, int err) {
     dr_msg_t *dr_msg;
-    dr_msg = malloc(sizeof(dr_msg_t));
+    dr_msg = slab_alloc(slab, sizeof(dr_msg_t));
+    if (dr_msg == NULL)
+        return NULL;
     dr_msg->dr_callback = dr_callback;
     dr_msg->err = err;
+    dr_msg->fiber = NULL;
+    dr_msg->done = 0;
+    dr_msg->prev = NULL;
+    dr_msg->next = NULL;
     return dr_msg;
 }
 
 void
 destroy_dr_msg(dr_msg_t *dr_msg) {
-    free(dr_msg);
+    slab_free(dr_msg);
+}
+
+/**
+ * Wait while TX thread drains full queue, but no longer than DELIVERY_QUEUE_WAIT_US
+ * @return 0 on success, -1 when queue is still full
+ */
+static int
+delivery_queue_push(event_queues_t *event_queues, queue_t *queue, void *value) {
+    for (int waited_us = 0; queue_push(queue, value) != 0; waited_us += 1000) {
+        if (waited_us >= DELIVERY_QUEUE_WAIT_US)
+            return -1;
+        metrics_inc(&event_queues->metrics.sleeps, 1);
+        usleep(1000);
+    }
+    return 0;
 }
 
 void
 msg_delivery_callback(rd_kafka_t *UNUSED(producer), const rd_kafka_message_t *msg, void *opaque) {
     event_queues_t *event_queues = opaque;
-    if (msg->_private != NULL && event_queues != NULL && event_queues->delivery_queue != NULL) {
+    if (event_queues == NULL)
+        return;
+
+    int64_t latency = rd_kafka_message_latency(msg);
+    if (latency >= 0)
+        metrics_histogram_observe(&event_queues->metrics.delivery_lag_us, latency);
+
+    if (msg->_private != NULL && event_queues->delivery_queue != NULL) {
         dr_msg_t *dr_msg = msg->_private;
-        if (dr_msg != NULL) {
-            if (msg->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
-                dr_msg->err = msg->err;
-            }
-            queue_push(event_queues->delivery_queue, dr_msg);
+        if (msg->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            dr_msg->err = msg->err;
+        }
+        // callbacks and waiting fibers must not be lost, so delivery message goes to unbounded overflow queue
+        // when TX thread does not drain bounded one, librdkafka thread is not blocked forever anyway
+        if (delivery_queue_push(event_queues, event_queues->delivery_queue, dr_msg) != 0) {
+            metrics_inc(&event_queues->metrics.delivery_overflows, 1);
+            queue_t *queue = event_queues->delivery_overflow != NULL ? event_queues->delivery_overflow :
+                                                                       event_queues->delivery_queue;
+            while (queue_push(queue, dr_msg) != 0)
+                usleep(1000);
+        }
+    }
+
+    if (event_queues->queues[DELIVERY_REPORT_QUEUE] != NULL) {
+        dr_report_t *report = new_dr_report(event_queues->slab, msg);
+        if (report != NULL &&
+            delivery_queue_push(event_queues, event_queues->queues[DELIVERY_REPORT_QUEUE], report) != 0) {
+            metrics_inc(&event_queues->metrics.dropped_reports, 1);
+            destroy_dr_report(report);
         }
     }
 }
 
+dr_report_t *
+new_dr_report(slab_cache_t *slab, const rd_kafka_message_t *msg) {
+    dr_report_t *report = slab_alloc(slab, sizeof(dr_report_t));
+    if (report == NULL)
+        return NULL;
+    report->topic = msg->rkt;
+    report->partition = msg->partition;
+    report->offset = msg->offset;
+    report->err = msg->err;
+    report->latency = rd_kafka_message_latency(msg);
+    return report;
+}
+
+void
+destroy_dr_report(dr_report_t *report) {
+    slab_free(report);
+}
+
 /**
  * Handle rebalance callbacks from RDKafka
  */
 
 rebalance_msg_t *
-new_rebalance_revoke_msg(rd_kafka_topic_partition_list_t *revoked) {
+new_rebalance_msg(rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *partitions, int cooperative) {
     rebalance_msg_t *msg = malloc(sizeof(rebalance_msg_t));
     if (msg == NULL) {
         return NULL;
     }
 
-    pthread_mutex_t lock;
-    if (pthread_mutex_init(&lock, NULL) != 0) {
-        free(msg);
-        return NULL;
-    }
-
-    msg->lock = lock;
-
-    pthread_cond_t sync;
-    if (pthread_cond_init(&sync, NULL) != 0) {
-        free(msg);
-        return NULL;
-    }
-
-    msg->sync = sync;
-    msg->revoked = revoked;
+    msg->revoked = NULL;
     msg->assigned = NULL;
     msg->err = RD_KAFKA_RESP_ERR_NO_ERROR;
-    return msg;
-}
-
-rebalance_msg_t *
-new_rebalance_assign_msg(rd_kafka_topic_partition_list_t *assigned) {
-    rebalance_msg_t *msg = malloc(sizeof(rebalance_msg_t));
-    if (msg == NULL) {
-        return NULL;
+    msg->cooperative = cooperative;
+
+    // partitions are owned by librdkafka only until callback returns
+    rd_kafka_topic_partition_list_t *copy = NULL;
+    if (partitions != NULL) {
+        copy = rd_kafka_topic_partition_list_copy(partitions);
+        if (copy == NULL) {
+            free(msg);
+            return NULL;
+        }
     }
 
-    pthread_mutex_t lock;
-    if (pthread_mutex_init(&lock, NULL) != 0) {
-        free(msg);
-        return NULL;
+    switch (err) {
+        case RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS:
+            msg->assigned = copy;
+            break;
+        case RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS:
+            msg->revoked = copy;
+            break;
+        default:
+            if (copy != NULL)
+                rd_kafka_topic_partition_list_destroy(copy);
+            msg->err = err;
+            break;
     }
+    return msg;
+}
 
-    msg->lock = lock;
-
-    pthread_cond_t sync;
-    if (pthread_cond_init(&sync, NULL) != 0) {
-        free(msg);
-        return NULL;
-    }
+void
+destroy_rebalance_msg(rebalance_msg_t *rebalance_msg) {
+    if (rebalance_msg->revoked != NULL)
+        rd_kafka_topic_partition_list_destroy(rebalance_msg->revoked);
+    if (rebalance_msg->assigned != NULL)
+        rd_kafka_topic_partition_list_destroy(rebalance_msg->assigned);
+    free(rebalance_msg);
+}
 
-    msg->sync = sync;
-    msg->revoked = NULL;
-    msg->assigned = assigned;
-    msg->err = RD_KAFKA_RESP_ERR_NO_ERROR;
-    return msg;
+static void
+rebalance_log_error(rd_kafka_t *consumer, event_queues_t *event_queues, rd_kafka_error_t *error) {
+    if (error == NULL)
+        return;
+    error_callback(consumer, rd_kafka_error_code(error), rd_kafka_error_string(error), event_queues);
+    rd_kafka_error_destroy(error);
 }
 
-rebalance_msg_t *
-new_rebalance_error_msg(rd_kafka_resp_err_t err) {
-    rebalance_msg_t *msg = malloc(sizeof(rebalance_msg_t));
-    if (msg == NULL) {
-        return NULL;
+/**
+ * Revoke whole current assignment
+ */
+static void
+rebalance_unassign_all(rd_kafka_t *consumer, event_queues_t *event_queues, int cooperative) {
+    if (!cooperative) {
+        rd_kafka_assign(consumer, NULL);
+        return;
     }
 
-    pthread_mutex_t lock;
-    if (pthread_mutex_init(&lock, NULL) != 0) {
-        free(msg);
-        return NULL;
+    // assign with NULL is not allowed with cooperative protocol
+    rd_kafka_topic_partition_list_t *assignment = NULL;
+    rd_kafka_resp_err_t err = rd_kafka_assignment(consumer, &assignment);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        error_callback(consumer, err, rd_kafka_err2str(err), event_queues);
+        return;
     }
+    rebalance_log_error(consumer, event_queues, rd_kafka_incremental_unassign(consumer, assignment));
+    rd_kafka_topic_partition_list_destroy(assignment);
+}
 
-    msg->lock = lock;
+/**
+ * Apply assignment after Lua callback is invoked or right away when there is no callback
+ */
+static void
+rebalance_finish(rd_kafka_t *consumer, event_queues_t *event_queues, rd_kafka_resp_err_t err,
+                 rd_kafka_topic_partition_list_t *partitions, int cooperative) {
+    switch (err)
+    {
+        case RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS:
+            if (cooperative)
+                rebalance_log_error(consumer, event_queues, rd_kafka_incremental_assign(consumer, partitions));
+            else
+                rd_kafka_assign(consumer, partitions);
+            // pause applies to whole assignment, not only to partitions assigned before
+            pthread_mutex_lock(&event_queues->pause.lock);
+            if (atomic_load(&event_queues->pause.auto_paused) || atomic_load(&event_queues->pause.user_paused))
+                rd_kafka_pause_partitions(consumer, partitions);
+            pthread_mutex_unlock(&event_queues->pause.lock);
+            if (event_queues->on_assign != NULL)
+                event_queues->on_assign(event_queues->rebalance_arg, partitions);
+            break;
 
-    pthread_cond_t sync;
-    if (pthread_cond_init(&sync, NULL) != 0) {
-        free(msg);
-        return NULL;
-    }
+        case RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS:
+            if (event_queues->on_revoke != NULL)
+                event_queues->on_revoke(event_queues->rebalance_arg, partitions);
+            if (cooperative)
+                rebalance_log_error(consumer, event_queues, rd_kafka_incremental_unassign(consumer, partitions));
+            else
+                rd_kafka_assign(consumer, NULL);
+            break;
 
-    msg->sync = sync;
-    msg->revoked = NULL;
-    msg->assigned = NULL;
-    msg->err = err;
-    return msg;
+        default:
+            if (event_queues->on_revoke != NULL)
+                event_queues->on_revoke(event_queues->rebalance_arg, NULL);
+            rebalance_unassign_all(consumer, event_queues, cooperative);
+            break;
+    }
 }
 
 void
-destroy_rebalance_msg(rebalance_msg_t *rebalance_msg) {
-    pthread_mutex_destroy(&rebalance_msg->lock);
-    pthread_cond_destroy(&rebalance_msg->sync);
-    free(rebalance_msg);
+rebalance_complete(rd_kafka_t *consumer, event_queues_t *event_queues, rebalance_msg_t *msg) {
+    if (msg->assigned != NULL)
+        rebalance_finish(consumer, event_queues, RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS, msg->assigned, msg->cooperative);
+    else if (msg->revoked != NULL)
+        rebalance_finish(consumer, event_queues, RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS, msg->revoked, msg->cooperative);
+    else
+        rebalance_finish(consumer, event_queues, msg->err, NULL, msg->cooperative);
 }
 
 void
 rebalance_callback(rd_kafka_t *consumer, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *partitions, void *opaque) {
     event_queues_t *event_queues = opaque;
-    rebalance_msg_t *msg = NULL;
-    switch (err)
-    {
-        case RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS:
-            msg = new_rebalance_assign_msg(partitions);
-            if (msg != NULL) {
-
-                pthread_mutex_lock(&msg->lock);
-
-                if (queue_push(event_queues->queues[REBALANCE_QUEUE], msg) == 0) {
-                    // waiting while main TX thread invokes rebalance callback
-                    pthread_cond_wait(&msg->sync, &msg->lock);
-                }
-
-                pthread_mutex_unlock(&msg->lock);
-
-                destroy_rebalance_msg(msg);
-            }
-            rd_kafka_assign(consumer, partitions);
-            break;
+    // with cooperative protocol only moved partitions are passed, the rest ones are consumed as usual
+    const char *protocol = rd_kafka_rebalance_protocol(consumer);
+    int cooperative = protocol != NULL && strcmp(protocol, "COOPERATIVE") == 0;
+
+    if (err != RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS)
+        atomic_fetch_add(&event_queues->revokes, 1);
+    if (err == RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS)
+        rd_kafka_commit(consumer, partitions, 1); // async commit, thread serving consumer is not blocked
+
+    // librdkafka waits for assign call, so rebalance is completed by TX thread after Lua callback
+    // and the calling thread, which may be shared by other handles, goes on right away
+    if (event_queues->queues[REBALANCE_QUEUE] != NULL) {
+        rebalance_msg_t *msg = new_rebalance_msg(err, partitions, cooperative);
+        if (msg != NULL && queue_push(event_queues->queues[REBALANCE_QUEUE], msg) == 0)
+            return;
+        if (msg != NULL)
+            destroy_rebalance_msg(msg);
+    }
 
-        case RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS:
-            rd_kafka_commit(consumer, partitions, 0); // sync commit
+    rebalance_finish(consumer, event_queues, err, partitions, cooperative);
+}
 
-            msg = new_rebalance_revoke_msg(partitions);
-            if (msg != NULL) {
+/**
+ * Structure which contains all queues for communication between main TX thread and
+ * RDKafka callbacks from background threads
+ */
 
-                pthread_mutex_lock(&msg->lock);
+queue_t *
+new_callback_queue(int queue_no, size_t capacity) {
+    // rebalances are rare and synchronous, so there is no reason to preallocate ring for them
+    if (capacity == 0 || queue_no == REBALANCE_QUEUE)
+        return new_queue();
+    // logs are pushed from internal librdkafka threads and errors from poller and close threads
+    return new_ring_queue(capacity, QUEUE_F_MULTI_PRODUCER);
+}
 
-                if (queue_push(event_queues->queues[REBALANCE_QUEUE], msg) == 0) {
-                    // waiting while main TX thread invokes rebalance callback
-                    pthread_cond_wait(&msg->sync, &msg->lock);
-                }
+void
+offset_commit_callback(rd_kafka_t *UNUSED(consumer), rd_kafka_resp_err_t UNUSED(err),
+                       rd_kafka_topic_partition_list_t *offsets, void *opaque) {
+    // commit may fail partially, so offsets are checked one by one
+    if (offsets != NULL)
+        committed_offsets_update(opaque, offsets);
+}
 
-                pthread_mutex_unlock(&msg->lock);
+void
+committed_offsets_update(event_queues_t *event_queues, const rd_kafka_topic_partition_list_t *offsets) {
+    pthread_mutex_lock(&event_queues->committed_lock);
+
+    if (event_queues->committed == NULL)
+        event_queues->committed = rd_kafka_topic_partition_list_new(offsets->cnt);
+    for (int i = 0; event_queues->committed != NULL && i < offsets->cnt; i++) {
+        const rd_kafka_topic_partition_t *tp = &offsets->elems[i];
+        if (tp->err != RD_KAFKA_RESP_ERR_NO_ERROR || tp->offset < 0)
+            continue;
+        rd_kafka_topic_partition_t *entry = rd_kafka_topic_partition_list_find(event_queues->committed,
+                                                                               tp->topic, tp->partition);
+        if (entry == NULL)
+            entry = rd_kafka_topic_partition_list_add(event_queues->committed, tp->topic, tp->partition);
+        entry->offset = tp->offset;
+    }
 
-                destroy_rebalance_msg(msg);
-            }
+    pthread_mutex_unlock(&event_queues->committed_lock);
+}
 
-            rd_kafka_assign(consumer, NULL);
-            break;
+int64_t
+committed_offsets_get(event_queues_t *event_queues, const char *topic, int32_t partition) {
+    int64_t offset = RD_KAFKA_OFFSET_INVALID;
 
-        default:
-            msg = new_rebalance_error_msg(err);
-            if (msg != NULL) {
+    pthread_mutex_lock(&event_queues->committed_lock);
 
-                pthread_mutex_lock(&msg->lock);
+    if (event_queues->committed != NULL) {
+        rd_kafka_topic_partition_t *entry = rd_kafka_topic_partition_list_find(event_queues->committed,
+                                                                               topic, partition);
+        if (entry != NULL)
+            offset = entry->offset;
+    }
 
-                if (queue_push(event_queues->queues[REBALANCE_QUEUE], msg) == 0) {
-                    // waiting while main TX thread invokes rebalance callback
-                    pthread_cond_wait(&msg->sync, &msg->lock);
-                }
+    pthread_mutex_unlock(&event_queues->committed_lock);
 
-                pthread_mutex_unlock(&msg->lock);
+    return offset;
+}
 
-                destroy_rebalance_msg(msg);
-            }
-            rd_kafka_assign(consumer, NULL);
-            break;
+void
+decode_msg_batch(rd_kafka_t *rd_consumer, event_queues_t *event_queues, msg_batch_t *batch) {
+    char errstr[256];
+    int failed = 0;
+    for (int i = 0; i < batch->count; i++) {
+        msg_t *msg = batch->msgs[i];
+        if (consumer_msg_decode(msg, event_queues->value_codec, errstr, sizeof(errstr)) == 0)
+            continue;
+        if (failed++ == 0) {
+            char reason[512];
+            snprintf(reason, sizeof(reason), "failed to decode message of topic '%s' partition %d offset %lld: %s",
+                     rd_kafka_topic_name(msg->topic), (int)msg->partition, (long long)msg->offset, errstr);
+            error_callback(rd_consumer, RD_KAFKA_RESP_ERR__BAD_MSG, reason, event_queues);
+        }
     }
+    if (failed > 0)
+        metrics_inc(&event_queues->metrics.decode_errors, failed);
 }
 
-/**
- * Structure which contains all queues for communication between main TX thread and
- * RDKafka callbacks from background threads
- */
-
 event_queues_t *
 new_event_queues() {
-    event_queues_t *event_queues = calloc(1, sizeof(event_queues_t));
+    // metrics updated by TX thread are aligned to cache line, size of aligned struct is multiple of alignment
+    event_queues_t *event_queues = aligned_alloc(METRICS_CACHE_LINE_SIZE, sizeof(event_queues_t));
+    if (event_queues == NULL)
+        return NULL;
+    memset(event_queues, 0, sizeof(event_queues_t));
     for (int i = 0; i < MAX_QUEUE; i++)
         event_queues->cb_refs[i] = LUA_REFNIL;
+    // falling back to malloc when cache is not created
+    event_queues->slab = new_slab_cache();
+    pthread_mutex_init(&event_queues->committed_lock, NULL);
+    pthread_mutex_init(&event_queues->pause.lock, NULL);
     return event_queues;
 }
 
 void
 destroy_event_queues(struct lua_State *L, event_queues_t *event_queues) {
     if (event_queues->consume_queue != NULL) {
-        rd_kafka_message_t *msg = NULL;
+        msg_batch_t *batch = NULL;
         while (true) {
-            msg = queue_pop(event_queues->consume_queue);
-            if (msg == NULL)
+            batch = queue_pop(event_queues->consume_queue);
+            if (batch == NULL)
                 break;
-            rd_kafka_message_destroy(msg);
+            destroy_msg_batch(batch);
         }
         destroy_queue(event_queues->consume_queue);
     }
@@ -354,6 +509,14 @@ destroy_event_queues(struct lua_State *L, event_queues_t *event_queues) {
         }
         destroy_queue(event_queues->delivery_queue);
     }
+    if (event_queues->delivery_overflow != NULL) {
+        dr_msg_t *msg = NULL;
+        while ((msg = queue_pop(event_queues->delivery_overflow)) != NULL) {
+            luaL_unref(L, LUA_REGISTRYINDEX, msg->dr_callback);
+            destroy_dr_msg(msg);
+        }
+        destroy_queue(event_queues->delivery_overflow);
+    }
 
     for (int i = 0; i < MAX_QUEUE; i++) {
         if (event_queues->queues[i] == NULL)
@@ -368,18 +531,18 @@ destroy_event_queues(struct lua_State *L, event_queues_t *event_queues) {
                     destroy_log_msg(msg);
                     break;
                 case STATS_QUEUE:
+                    destroy_stats_msg(msg);
                     break;
                 case ERROR_QUEUE:
                     destroy_error_msg(msg);
                     break;
-                case REBALANCE_QUEUE: {
-                    rebalance_msg_t *rebalance_msg = msg;
-                    pthread_mutex_lock(&rebalance_msg->lock);
-                    // allowing background thread proceed rebalancing
-                    pthread_cond_signal(&rebalance_msg->sync);
-                    pthread_mutex_unlock(&rebalance_msg->lock);
+                case DELIVERY_REPORT_QUEUE:
+                    destroy_dr_report(msg);
+                    break;
+                case REBALANCE_QUEUE:
+                    // handle is destroyed, so rebalance is not completed anymore
+                    destroy_rebalance_msg(msg);
                     break;
-                }
             }
         }
         destroy_queue(event_queues->queues[i]);
@@ -388,5 +551,19 @@ destroy_event_queues(struct lua_State *L, event_queues_t *event_queues) {
     for (int i = 0; i < MAX_QUEUE; i++)
         luaL_unref(L, LUA_REGISTRYINDEX, event_queues->cb_refs[i]);
 
+    destroy_notifier(event_queues->notifier);
+    destroy_notifier(event_queues->rebalance_notifier);
+    destroy_stats_filter(event_queues->stats_filter);
+    destroy_thread_options(event_queues->thread_options);
+    destroy_header_filter(event_queues->header_filter);
+    destroy_partitioner_ctx(event_queues->partitioner);
+    if (event_queues->committed != NULL)
+        rd_kafka_topic_partition_list_destroy(event_queues->committed);
+    pthread_mutex_destroy(&event_queues->committed_lock);
+    pthread_mutex_destroy(&event_queues->pause.lock);
+
+    // messages still referenced from lua keep their pools alive
+    destroy_slab_cache(event_queues->slab);
+
     free(event_queues);
 }
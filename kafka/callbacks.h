@@ -11,6 +11,14 @@
 #include <librdkafka/rdkafka.h>
 
 #include <queue.h>
+#include <notifier.h>
+#include <slab.h>
+#include <metrics.h>
+#include <stats.h>
+#include <thread_options.h>
+#include <headers.h>
+#include <codec.h>
+#include <partitioner.h>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 /**
@@ -27,8 +35,11 @@ typedef struct {
     char *buf;
 } log_msg_t;
 
+/**
+ * Facility and message strings are allocated in one block with message itself
+ */
 log_msg_t *
-new_log_msg(int level, const char *fac, const char *buf);
+new_log_msg(slab_cache_t *slab, int level, const char *fac, const char *buf);
 
 void
 destroy_log_msg(log_msg_t *msg);
@@ -47,7 +58,7 @@ int
 stats_callback(rd_kafka_t *rd_kafka, char *json, size_t json_len, void *opaque);
 
 int
-push_stats_cb_args(struct lua_State *L, const char *msg);
+push_stats_cb_args(struct lua_State *L, const stats_msg_t *msg);
 
 /**
  * Handle errors from RDKafka
@@ -59,7 +70,7 @@ typedef struct {
 } error_msg_t;
 
 error_msg_t *
-new_error_msg(int err, const char *reason);
+new_error_msg(slab_cache_t *slab, int err, const char *reason);
 
 void
 destroy_error_msg(error_msg_t *msg);
@@ -74,13 +85,22 @@ push_errors_cb_args(struct lua_State *L, const error_msg_t *msg);
  * Handle message delivery reports from RDKafka
  */
 
-typedef struct {
+struct fiber;
+
+typedef struct dr_msg_t {
+    // LUA_REFNIL when fiber waits for delivery report instead of callback
     int dr_callback;
     int err;
+    // waiting fiber or NULL when it has given up waiting
+    struct fiber *fiber;
+    int done;
+    // list of waiting messages, touched from TX thread only
+    struct dr_msg_t *prev;
+    struct dr_msg_t *next;
 } dr_msg_t;
 
 dr_msg_t *
-new_dr_msg(int dr_callback, int err);
+new_dr_msg(slab_cache_t *slab, int dr_callback, int err);
 
 void
 destroy_dr_msg(dr_msg_t *dr_msg);
@@ -88,29 +108,61 @@ destroy_dr_msg(dr_msg_t *dr_msg);
 void
 msg_delivery_callback(rd_kafka_t *UNUSED(producer), const rd_kafka_message_t *msg, void *opaque);
 
+/**
+ * Delivery report of any produced message, passed to Lua by batches
+ */
+typedef struct {
+    rd_kafka_topic_t *topic;
+    int32_t          partition;
+    int64_t          offset;
+    int              err;
+    // microseconds from produce call to broker acknowledgement, -1 if unknown
+    int64_t          latency;
+} dr_report_t;
+
+dr_report_t *
+new_dr_report(slab_cache_t *slab, const rd_kafka_message_t *msg);
+
+void
+destroy_dr_report(dr_report_t *report);
+
 
 /**
  * Handle rebalance callbacks from RDKafka
  */
 
 typedef struct {
-    pthread_mutex_t                  lock;
-    pthread_cond_t                   sync;
+    // copies of partitions passed to rebalance callback
     rd_kafka_topic_partition_list_t *revoked;
     rd_kafka_topic_partition_list_t *assigned;
     rd_kafka_resp_err_t              err;
+    // partitions are assigned and revoked incrementally
+    int                              cooperative;
 } rebalance_msg_t;
 
-rebalance_msg_t *new_rebalance_revoke_msg(rd_kafka_topic_partition_list_t *revoked);
-
-rebalance_msg_t *new_rebalance_assign_msg(rd_kafka_topic_partition_list_t *assigned);
-
-rebalance_msg_t *new_rebalance_error_msg(rd_kafka_resp_err_t err);
+/**
+ * @param err assign, revoke or error code of rebalance
+ * @param partitions copied, so message outlives rebalance callback
+ * @param cooperative
+ */
+rebalance_msg_t *new_rebalance_msg(rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *partitions,
+                                   int cooperative);
 
 void destroy_rebalance_msg(rebalance_msg_t *rebalance_msg);
 
 void rebalance_callback(rd_kafka_t *consumer, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *partitions, void *opaque);
 
+/**
+ * Pause state of consumer assignment changed by TX thread, poller and rebalance callback under lock
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    // paused by poller because of consume queue watermarks
+    _Atomic int     auto_paused;
+    // paused by user
+    _Atomic int     user_paused;
+} pause_state_t;
+
 /**
  * Structure which contains all queues for communication between main TX thread and
  * RDKafka callbacks from background threads
@@ -121,6 +173,7 @@ enum {
     STATS_QUEUE,
     ERROR_QUEUE,
     REBALANCE_QUEUE,
+    DELIVERY_REPORT_QUEUE,
     MAX_QUEUE,
 };
 
@@ -130,6 +183,7 @@ static const char *const queue2str[] = {
         [STATS_QUEUE] = "stats_callback",
         [ERROR_QUEUE] = "error_callback",
         [REBALANCE_QUEUE] = "rebalance_callback",
+        [DELIVERY_REPORT_QUEUE] = "delivery_report_callback",
 };
 
 #define LUA_RDKAFKA_POLL_FUNC(rd_type, name, queue_no, destroy_fn, push_args_fn)         \
@@ -178,11 +232,100 @@ lua_##rd_type##_##name(struct lua_State *L) {
 typedef struct {
     queue_t *consume_queue;
     queue_t *delivery_queue;
+    // unbounded queue of delivery messages which do not fit into full delivery queue in time
+    queue_t *delivery_overflow;
 
     queue_t *queues[MAX_QUEUE];
     int cb_refs[MAX_QUEUE];
+
+    // wakes up TX thread fiber waiting for consume or delivery queue
+    notifier_t *notifier;
+    // wakes up fiber of rebalance callback, so rebalance is completed as soon as possible
+    notifier_t *rebalance_notifier;
+
+    // allocator of messages passed between threads
+    slab_cache_t *slab;
+
+    // called when rebalance is completed right after assign and right before revoke of partitions
+    void (*on_assign)(void *arg, rd_kafka_topic_partition_list_t *partitions);
+    void (*on_revoke)(void *arg, rd_kafka_topic_partition_list_t *partitions);
+    // removes partitions which must stay paused from list of partitions to resume, called with pause lock
+    void (*on_resume)(void *arg, rd_kafka_topic_partition_list_t *partitions);
+    void *rebalance_arg;
+
+    // fields of statistics passed to stats callback, NULL for whole JSON
+    stats_filter_t *stats_filter;
+
+    // affinity and scheduling of poller threads, NULL for inherited ones
+    thread_options_t *thread_options;
+
+    // consumed messages are skipped by poller threads unless header matches, NULL for all messages
+    header_filter_t *header_filter;
+
+    // values are decoded to msgpack by poller threads, NULL for raw values
+    const codec_t *value_codec;
+
+    // partitioner of producer set up by the module, NULL for librdkafka ones
+    partitioner_ctx_t *partitioner;
+
+    // offsets of successful commits, so consumer lag is known without broker round trip
+    rd_kafka_topic_partition_list_t *committed;
+    pthread_mutex_t committed_lock;
+
+    // incremented by rebalance callback on every revoke, so TX thread knows that fetch positions are reset
+    _Atomic uint64_t revokes;
+
+    // pause state of consumer, partitions assigned while consumer is paused are paused as well
+    pause_state_t pause;
+
+    metrics_t metrics;
 } event_queues_t;
 
+/**
+ * Commit results, called from thread which polls consumer or commits synchronously
+ */
+void offset_commit_callback(rd_kafka_t *consumer, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *offsets, void *opaque);
+
+/**
+ * Remember offsets of successfully committed partitions
+ */
+void committed_offsets_update(event_queues_t *event_queues, const rd_kafka_topic_partition_list_t *offsets);
+
+/**
+ * @return the last committed offset known by consumer or RD_KAFKA_OFFSET_INVALID
+ */
+int64_t committed_offsets_get(event_queues_t *event_queues, const char *topic, int32_t partition);
+
+/**
+ * Decode values of batch with consumer codec, only the first error of batch is reported to error callback
+ */
+void
+decode_msg_batch(rd_kafka_t *rd_consumer, event_queues_t *event_queues, msg_batch_t *batch);
+
+/**
+ * Default capacity of ring based consume and delivery queues, may be changed with 'queue_capacity' option.
+ * Zero capacity means unbounded linked list queues.
+ */
+#define DEFAULT_QUEUE_CAPACITY 65536
+
+/**
+ * Time librdkafka thread waits while TX thread drains full delivery queue,
+ * then delivery message goes to overflow queue and delivery report is dropped
+ */
+#define DELIVERY_QUEUE_WAIT_US 100000
+
+/**
+ * Create queue for events of given type, falls back to linked list queue when capacity is 0,
+ * events which do not fit into full ring are dropped and counted in dropped_callback_msgs metric
+ */
+queue_t *new_callback_queue(int queue_no, size_t capacity);
+
+/**
+ * Assign or revoke partitions of rebalance after Lua callback is invoked, may block on librdkafka
+ * and must not be called from TX thread directly
+ */
+void rebalance_complete(rd_kafka_t *consumer, event_queues_t *event_queues, rebalance_msg_t *msg);
+
 event_queues_t *new_event_queues();
 
 void destroy_event_queues(struct lua_State *L, event_queues_t *event_queues);
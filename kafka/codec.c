@@ -0,0 +1,693 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <inttypes.h>
+
+#include <tarantool/module.h>
+#include <msgpuck.h>
+
+#include <common.h>
+#include <abi.h>
+
+#include <codec.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Output buffer
+ */
+
+char *
+codec_buf_reserve(codec_buf_t *buf, size_t n) {
+    if (buf->size + n > buf->capacity) {
+        size_t capacity = buf->capacity > 0 ? buf->capacity : 256;
+        while (capacity < buf->size + n)
+            capacity *= 2;
+        char *data = realloc(buf->data, capacity);
+        if (data == NULL)
+            return NULL;
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    return buf->data + buf->size;
+}
+
+static inline int
+codec_buf_append(codec_buf_t *buf, const char *data, size_t len) {
+    char *pos = codec_buf_reserve(buf, len);
+    if (pos == NULL)
+        return -1;
+    memcpy(pos, data, len);
+    buf->size += len;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * JSON to msgpack
+ */
+
+#define JSON_MAX_DEPTH 128
+
+typedef struct {
+    const char  *start;
+    const char  *pos;
+    const char  *end;
+    codec_buf_t *out;
+    char        *errstr;
+    size_t      errstr_size;
+} json_parser_t;
+
+static int
+json_error(json_parser_t *parser, const char *what) {
+    snprintf(parser->errstr, parser->errstr_size, "invalid JSON: %s at position %d", what,
+             (int)(parser->pos - parser->start));
+    return -1;
+}
+
+static inline void
+json_skip_spaces(json_parser_t *parser) {
+    while (parser->pos < parser->end &&
+           (*parser->pos == ' ' || *parser->pos == '\t' || *parser->pos == '\n' || *parser->pos == '\r'))
+        parser->pos++;
+}
+
+static int
+json_parse_value(json_parser_t *parser, int depth);
+
+static int
+json_parse_hex4(json_parser_t *parser, uint32_t *code) {
+    if (parser->end - parser->pos < 4)
+        return json_error(parser, "truncated unicode escape");
+    *code = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *parser->pos++;
+        *code <<= 4;
+        if (c >= '0' && c <= '9')
+            *code |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            *code |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            *code |= c - 'A' + 10;
+        else
+            return json_error(parser, "invalid unicode escape");
+    }
+    return 0;
+}
+
+static int
+json_append_utf8(codec_buf_t *out, uint32_t code) {
+    char utf8[4];
+    size_t len;
+    if (code < 0x80) {
+        utf8[0] = (char)code;
+        len = 1;
+    } else if (code < 0x800) {
+        utf8[0] = (char)(0xc0 | (code >> 6));
+        utf8[1] = (char)(0x80 | (code & 0x3f));
+        len = 2;
+    } else if (code < 0x10000) {
+        utf8[0] = (char)(0xe0 | (code >> 12));
+        utf8[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+        utf8[2] = (char)(0x80 | (code & 0x3f));
+        len = 3;
+    } else {
+        utf8[0] = (char)(0xf0 | (code >> 18));
+        utf8[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+        utf8[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+        utf8[3] = (char)(0x80 | (code & 0x3f));
+        len = 4;
+    }
+    return codec_buf_append(out, utf8, len);
+}
+
+static int
+json_parse_escape(json_parser_t *parser) {
+    if (parser->pos >= parser->end)
+        return json_error(parser, "truncated escape");
+    char c = *parser->pos++;
+    char unescaped;
+    switch (c) {
+        case '"': unescaped = '"'; break;
+        case '\\': unescaped = '\\'; break;
+        case '/': unescaped = '/'; break;
+        case 'b': unescaped = '\b'; break;
+        case 'f': unescaped = '\f'; break;
+        case 'n': unescaped = '\n'; break;
+        case 'r': unescaped = '\r'; break;
+        case 't': unescaped = '\t'; break;
+        case 'u': {
+            uint32_t code;
+            if (json_parse_hex4(parser, &code) != 0)
+                return -1;
+            if (code >= 0xd800 && code <= 0xdbff) {
+                // surrogate pair
+                uint32_t low;
+                if (parser->end - parser->pos < 2 || parser->pos[0] != '\\' || parser->pos[1] != 'u')
+                    return json_error(parser, "unpaired surrogate");
+                parser->pos += 2;
+                if (json_parse_hex4(parser, &low) != 0)
+                    return -1;
+                if (low < 0xdc00 || low > 0xdfff)
+                    return json_error(parser, "unpaired surrogate");
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            } else if (code >= 0xdc00 && code <= 0xdfff) {
+                return json_error(parser, "unpaired surrogate");
+            }
+            return json_append_utf8(parser->out, code);
+        }
+        default:
+            return json_error(parser, "invalid escape");
+    }
+    return codec_buf_append(parser->out, &unescaped, 1);
+}
+
+static int
+json_parse_string(json_parser_t *parser) {
+    // opening quote is already taken
+    const char *start = parser->pos;
+    int has_escapes = 0;
+    while (parser->pos < parser->end && *parser->pos != '"') {
+        if (*parser->pos == '\\') {
+            has_escapes = 1;
+            parser->pos++;
+        } else if ((unsigned char)*parser->pos < 0x20) {
+            return json_error(parser, "control character in string");
+        }
+        parser->pos++;
+    }
+    if (parser->pos >= parser->end)
+        return json_error(parser, "unterminated string");
+    size_t raw_len = parser->pos - start;
+
+    codec_buf_t *out = parser->out;
+    if (!has_escapes) {
+        char *pos = codec_buf_reserve(out, mp_sizeof_str(raw_len));
+        if (pos == NULL)
+            return json_error(parser, "out of memory");
+        out->size = mp_encode_str(pos, start, raw_len) - out->data;
+        parser->pos++;
+        return 0;
+    }
+
+    // unescaped string is not longer than raw one, so its length is patched into str32 header
+    size_t header = out->size;
+    if (codec_buf_reserve(out, 5) == NULL)
+        return json_error(parser, "out of memory");
+    out->size += 5;
+    parser->pos = start;
+    while (*parser->pos != '"') {
+        if (*parser->pos == '\\') {
+            parser->pos++;
+            if (json_parse_escape(parser) != 0)
+                return -1;
+        } else {
+            const char *run = parser->pos;
+            while (*parser->pos != '"' && *parser->pos != '\\')
+                parser->pos++;
+            if (codec_buf_append(out, run, parser->pos - run) != 0)
+                return json_error(parser, "out of memory");
+        }
+    }
+    parser->pos++;
+
+    char *pos = mp_store_u8(out->data + header, 0xdb);
+    mp_store_u32(pos, (uint32_t)(out->size - header - 5));
+    return 0;
+}
+
+static int
+json_parse_number(json_parser_t *parser) {
+    const char *start = parser->pos;
+    int is_float = 0;
+    while (parser->pos < parser->end) {
+        char c = *parser->pos;
+        if (c == '.' || c == 'e' || c == 'E')
+            is_float = 1;
+        else if (!(c >= '0' && c <= '9') && c != '-' && c != '+')
+            break;
+        parser->pos++;
+    }
+
+    char number[64];
+    size_t len = parser->pos - start;
+    if (len == 0 || len >= sizeof(number))
+        return json_error(parser, "invalid number");
+    memcpy(number, start, len);
+    number[len] = '\0';
+
+    codec_buf_t *out = parser->out;
+    char *pos = codec_buf_reserve(out, 9);
+    if (pos == NULL)
+        return json_error(parser, "out of memory");
+
+    char *end;
+    errno = 0;
+    if (!is_float) {
+        if (number[0] == '-') {
+            long long value = strtoll(number, &end, 10);
+            if (*end == '\0' && errno == 0) {
+                out->size = mp_encode_int(pos, value) - out->data;
+                return 0;
+            }
+        } else {
+            unsigned long long value = strtoull(number, &end, 10);
+            if (*end == '\0' && errno == 0) {
+                out->size = mp_encode_uint(pos, value) - out->data;
+                return 0;
+            }
+        }
+        // integers out of range are kept as doubles like in most JSON parsers
+        errno = 0;
+    }
+
+    double value = strtod(number, &end);
+    if (*end != '\0')
+        return json_error(parser, "invalid number");
+    out->size = mp_encode_double(pos, value) - out->data;
+    return 0;
+}
+
+static int
+json_parse_literal(json_parser_t *parser, const char *literal, size_t len) {
+    if ((size_t)(parser->end - parser->pos) < len || memcmp(parser->pos, literal, len) != 0)
+        return json_error(parser, "unexpected character");
+    parser->pos += len;
+
+    codec_buf_t *out = parser->out;
+    char *pos = codec_buf_reserve(out, 1);
+    if (pos == NULL)
+        return json_error(parser, "out of memory");
+    if (literal[0] == 'n')
+        pos = mp_encode_nil(pos);
+    else
+        pos = mp_encode_bool(pos, literal[0] == 't');
+    out->size = pos - out->data;
+    return 0;
+}
+
+/**
+ * Containers are written with 32 bit headers patched after parsing, which is still valid msgpack
+ */
+static int
+json_parse_container(json_parser_t *parser, int depth, int is_map) {
+    if (depth >= JSON_MAX_DEPTH)
+        return json_error(parser, "too deep nesting");
+    char close = is_map ? '}' : ']';
+
+    codec_buf_t *out = parser->out;
+    size_t header = out->size;
+    if (codec_buf_reserve(out, 5) == NULL)
+        return json_error(parser, "out of memory");
+    out->size += 5;
+
+    uint32_t count = 0;
+    json_skip_spaces(parser);
+    if (parser->pos < parser->end && *parser->pos == close) {
+        parser->pos++;
+    } else {
+        while (1) {
+            json_skip_spaces(parser);
+            if (is_map) {
+                if (parser->pos >= parser->end || *parser->pos != '"')
+                    return json_error(parser, "object key must be string");
+                parser->pos++;
+                if (json_parse_string(parser) != 0)
+                    return -1;
+                json_skip_spaces(parser);
+                if (parser->pos >= parser->end || *parser->pos != ':')
+                    return json_error(parser, "expected ':'");
+                parser->pos++;
+            }
+            if (json_parse_value(parser, depth + 1) != 0)
+                return -1;
+            count++;
+
+            json_skip_spaces(parser);
+            if (parser->pos >= parser->end)
+                return json_error(parser, "unterminated container");
+            char c = *parser->pos++;
+            if (c == close)
+                break;
+            if (c != ',')
+                return json_error(parser, "expected ','");
+        }
+    }
+
+    char *pos = mp_store_u8(out->data + header, is_map ? 0xdf : 0xdd);
+    mp_store_u32(pos, count);
+    return 0;
+}
+
+static int
+json_parse_value(json_parser_t *parser, int depth) {
+    json_skip_spaces(parser);
+    if (parser->pos >= parser->end)
+        return json_error(parser, "unexpected end");
+
+    switch (*parser->pos) {
+        case '{':
+            parser->pos++;
+            return json_parse_container(parser, depth, 1);
+        case '[':
+            parser->pos++;
+            return json_parse_container(parser, depth, 0);
+        case '"':
+            parser->pos++;
+            return json_parse_string(parser);
+        case 't':
+            return json_parse_literal(parser, "true", 4);
+        case 'f':
+            return json_parse_literal(parser, "false", 5);
+        case 'n':
+            return json_parse_literal(parser, "null", 4);
+        default:
+            return json_parse_number(parser);
+    }
+}
+
+static int
+json_decode(const char *data, size_t len, codec_buf_t *out, char *errstr, size_t errstr_size) {
+    json_parser_t parser = {
+            .start = data,
+            .pos = data,
+            .end = data + len,
+            .out = out,
+            .errstr = errstr,
+            .errstr_size = errstr_size,
+    };
+    if (json_parse_value(&parser, 0) != 0)
+        return CODEC_ERROR;
+    json_skip_spaces(&parser);
+    if (parser.pos != parser.end) {
+        json_error(&parser, "trailing characters");
+        return CODEC_ERROR;
+    }
+    return CODEC_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Msgpack to JSON
+ */
+
+static int
+json_encode_string(codec_buf_t *out, const char *str, uint32_t len) {
+    static const char hex[] = "0123456789abcdef";
+    if (codec_buf_append(out, "\"", 1) != 0)
+        return -1;
+    const char *run = str;
+    for (const char *pos = str; pos < str + len; pos++) {
+        unsigned char c = (unsigned char)*pos;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        if (codec_buf_append(out, run, pos - run) != 0)
+            return -1;
+        run = pos + 1;
+
+        char escaped[6] = {'\\', (char)c, 0, 0, 0, 0};
+        size_t escaped_len = 2;
+        switch (c) {
+            case '"': case '\\': break;
+            case '\b': escaped[1] = 'b'; break;
+            case '\f': escaped[1] = 'f'; break;
+            case '\n': escaped[1] = 'n'; break;
+            case '\r': escaped[1] = 'r'; break;
+            case '\t': escaped[1] = 't'; break;
+            default:
+                escaped[1] = 'u';
+                escaped[2] = '0';
+                escaped[3] = '0';
+                escaped[4] = hex[c >> 4];
+                escaped[5] = hex[c & 0xf];
+                escaped_len = 6;
+        }
+        if (codec_buf_append(out, escaped, escaped_len) != 0)
+            return -1;
+    }
+    if (codec_buf_append(out, run, str + len - run) != 0)
+        return -1;
+    return codec_buf_append(out, "\"", 1);
+}
+
+static int
+json_encode_number(codec_buf_t *out, double value, char *errstr, size_t errstr_size) {
+    if (!isfinite(value)) {
+        snprintf(errstr, errstr_size, "failed to encode JSON: number is not finite");
+        return -1;
+    }
+    // the shortest of precisions which still keeps the same double
+    char number[32];
+    int len = snprintf(number, sizeof(number), "%.15g", value);
+    if (strtod(number, NULL) != value)
+        len = snprintf(number, sizeof(number), "%.17g", value);
+    return codec_buf_append(out, number, len);
+}
+
+static int
+json_encode_value(const char **data, codec_buf_t *out, int depth, int is_key, char *errstr, size_t errstr_size) {
+    char number[32];
+    int len;
+    uint32_t count;
+
+    if (depth >= JSON_MAX_DEPTH) {
+        snprintf(errstr, errstr_size, "failed to encode JSON: too deep nesting");
+        return -1;
+    }
+
+    enum mp_type type = mp_typeof(**data);
+    if (is_key && type != MP_STR && type != MP_UINT && type != MP_INT) {
+        snprintf(errstr, errstr_size, "failed to encode JSON: map key must be string or integer");
+        return -1;
+    }
+
+    switch (type) {
+        case MP_NIL:
+            mp_decode_nil(data);
+            return codec_buf_append(out, "null", 4);
+        case MP_BOOL:
+            return mp_decode_bool(data) ? codec_buf_append(out, "true", 4) : codec_buf_append(out, "false", 5);
+        case MP_UINT:
+            len = snprintf(number, sizeof(number), is_key ? "\"%" PRIu64 "\"" : "%" PRIu64, mp_decode_uint(data));
+            return codec_buf_append(out, number, len);
+        case MP_INT:
+            len = snprintf(number, sizeof(number), is_key ? "\"%" PRId64 "\"" : "%" PRId64, mp_decode_int(data));
+            return codec_buf_append(out, number, len);
+        case MP_FLOAT:
+            return json_encode_number(out, mp_decode_float(data), errstr, errstr_size);
+        case MP_DOUBLE:
+            return json_encode_number(out, mp_decode_double(data), errstr, errstr_size);
+        case MP_STR: {
+            uint32_t str_len;
+            const char *str = mp_decode_str(data, &str_len);
+            return json_encode_string(out, str, str_len);
+        }
+        case MP_ARRAY:
+            count = mp_decode_array(data);
+            if (codec_buf_append(out, "[", 1) != 0)
+                return -1;
+            for (uint32_t i = 0; i < count; i++) {
+                if (i > 0 && codec_buf_append(out, ",", 1) != 0)
+                    return -1;
+                if (json_encode_value(data, out, depth + 1, 0, errstr, errstr_size) != 0)
+                    return -1;
+            }
+            return codec_buf_append(out, "]", 1);
+        case MP_MAP:
+            count = mp_decode_map(data);
+            if (codec_buf_append(out, "{", 1) != 0)
+                return -1;
+            for (uint32_t i = 0; i < count; i++) {
+                if (i > 0 && codec_buf_append(out, ",", 1) != 0)
+                    return -1;
+                if (json_encode_value(data, out, depth + 1, 1, errstr, errstr_size) != 0 ||
+                    codec_buf_append(out, ":", 1) != 0 ||
+                    json_encode_value(data, out, depth + 1, 0, errstr, errstr_size) != 0)
+                    return -1;
+            }
+            return codec_buf_append(out, "}", 1);
+        default:
+            snprintf(errstr, errstr_size, "failed to encode JSON: binary and extension values are not supported");
+            return -1;
+    }
+}
+
+static int
+json_encode(const char *data, size_t len, codec_buf_t *out, char *errstr, size_t errstr_size) {
+    const char *pos = data;
+    if (mp_check(&pos, data + len) != 0 || pos != data + len) {
+        snprintf(errstr, errstr_size, "failed to encode JSON: invalid msgpack");
+        return CODEC_ERROR;
+    }
+
+    errstr[0] = '\0';
+    pos = data;
+    if (json_encode_value(&pos, out, 0, 0, errstr, errstr_size) != 0) {
+        if (errstr[0] == '\0')
+            snprintf(errstr, errstr_size, "failed to encode JSON: out of memory");
+        return CODEC_ERROR;
+    }
+    return CODEC_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Msgpack values are only validated
+ */
+
+static int
+msgpack_decode(const char *data, size_t len, codec_buf_t *UNUSED(out), char *errstr, size_t errstr_size) {
+    const char *pos = data;
+    if (len == 0 || mp_check(&pos, data + len) != 0 || pos != data + len) {
+        snprintf(errstr, errstr_size, "invalid msgpack");
+        return CODEC_ERROR;
+    }
+    return CODEC_SAME;
+}
+
+static int
+msgpack_encode(const char *UNUSED(data), size_t UNUSED(len), codec_buf_t *UNUSED(out),
+               char *UNUSED(errstr), size_t UNUSED(errstr_size)) {
+    return CODEC_SAME;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Registry
+ */
+
+static const codec_t json_codec = {
+        .name = "json",
+        .decode = json_decode,
+        .encode = json_encode,
+};
+
+static const codec_t msgpack_codec = {
+        .name = "msgpack",
+        .decode = msgpack_decode,
+        .encode = msgpack_encode,
+};
+
+static const codec_t *codecs[CODEC_MAX_COUNT] = {
+        &json_codec,
+        &msgpack_codec,
+};
+
+int
+codec_register(const codec_t *codec) {
+    if (codec == NULL || codec->name == NULL || codec->decode == NULL || codec->encode == NULL)
+        return -1;
+    for (int i = 0; i < CODEC_MAX_COUNT; i++) {
+        if (codecs[i] == NULL) {
+            codecs[i] = codec;
+            return 0;
+        }
+        if (strcmp(codecs[i]->name, codec->name) == 0)
+            return -1;
+    }
+    return -1;
+}
+
+int
+tnt_kafka_register_codec(const codec_t *codec) {
+    return codec_register(codec);
+}
+
+const codec_t *
+codec_find(const char *name) {
+    for (int i = 0; i < CODEC_MAX_COUNT && codecs[i] != NULL; i++) {
+        if (strcmp(codecs[i]->name, name) == 0)
+            return codecs[i];
+    }
+    return NULL;
+}
+
+const char *
+lua_read_codec_option(struct lua_State *L, const codec_t **codec) {
+    *codec = NULL;
+
+    lua_pushstring(L, "value_codec");
+    lua_gettable(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    const char *name = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+    *codec = name != NULL ? codec_find(name) : NULL;
+    lua_pop(L, 1);
+
+    if (*codec == NULL)
+        return "config 'value_codec' must be name of registered codec, e.g. 'json' or 'msgpack'";
+    return NULL;
+}
+
+/**
+ * Msgpack of Lua value, buffer of tuple is reused as only TX thread encodes values
+ */
+static const char *
+lua_codec_msgpack(struct lua_State *L, int index, box_tuple_t **ref, size_t *len, char *errstr, size_t errstr_size) {
+    static codec_buf_t tuple_buf;
+
+    box_tuple_t *tuple = luaT_istuple(L, index);
+    if (tuple != NULL) {
+        size_t size = box_tuple_bsize(tuple);
+        if (codec_buf_reserve(&tuple_buf, size) == NULL) {
+            snprintf(errstr, errstr_size, "failed to allocate encoded value");
+            return NULL;
+        }
+        ssize_t rc = box_tuple_to_buf(tuple, tuple_buf.data, size);
+        if (rc < 0) {
+            snprintf(errstr, errstr_size, "%s", box_error_message(box_error_last()));
+            return NULL;
+        }
+        *len = (size_t)rc;
+        return tuple_buf.data;
+    }
+
+    // tuples are arrays only, so any Lua value is wrapped into one field tuple
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, index);
+    lua_rawseti(L, -2, 1);
+    tuple = luaT_tuple_new(L, -1, box_tuple_format_default());
+    lua_pop(L, 1);
+    if (tuple == NULL) {
+        snprintf(errstr, errstr_size, "%s", box_error_message(box_error_last()));
+        return NULL;
+    }
+    box_tuple_ref(tuple);
+    *ref = tuple;
+
+    const char *field = box_tuple_field(tuple, 0);
+    const char *end = field;
+    mp_next(&end);
+    *len = end - field;
+    return field;
+}
+
+int
+lua_codec_encode(struct lua_State *L, int index, const codec_t *codec, codec_buf_t *out,
+                 char *errstr, size_t errstr_size) {
+    out->size = 0;
+    // strings are treated as already encoded values
+    if (lua_type(L, index) == LUA_TSTRING)
+        return 0;
+    if (index < 0)
+        index = lua_gettop(L) + index + 1;
+
+    box_tuple_t *ref = NULL;
+    size_t len = 0;
+    const char *data = lua_codec_msgpack(L, index, &ref, &len, errstr, errstr_size);
+    if (data == NULL)
+        return -1;
+
+    int rc = codec->encode(data, len, out, errstr, errstr_size);
+    if (rc == CODEC_SAME && codec_buf_append(out, data, len) != 0) {
+        snprintf(errstr, errstr_size, "failed to allocate encoded value");
+        rc = CODEC_ERROR;
+    }
+    if (ref != NULL)
+        box_tuple_unref(ref);
+    return rc == CODEC_ERROR ? -1 : 0;
+}
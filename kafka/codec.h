@@ -0,0 +1,97 @@
+#ifndef TNT_KAFKA_CODEC_H
+#define TNT_KAFKA_CODEC_H
+
+#include <stddef.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Payload codecs converting message values from wire format to msgpack and back.
+ * Consumer decodes values in poller threads, so TX thread gets ready msgpack instead of parsing
+ * strings in Lua. Producer encodes msgpack of Lua values in C right before the produce call.
+ */
+
+#define CODEC_MAX_COUNT 16
+
+/**
+ * Growing output buffer of codec
+ */
+typedef struct {
+    char   *data;
+    size_t size;
+    size_t capacity;
+} codec_buf_t;
+
+/**
+ * Reserve space for n more bytes
+ * @param buf
+ * @param n
+ * @return pointer to end of data or NULL on allocation failure
+ */
+char *
+codec_buf_reserve(codec_buf_t *buf, size_t n);
+
+/**
+ * Codec returns CODEC_SAME when input is already in output format and may be used as is
+ */
+#define CODEC_OK 0
+#define CODEC_SAME 1
+#define CODEC_ERROR -1
+
+typedef struct codec_t {
+    const char *name;
+    /**
+     * Convert value to msgpack, called from poller threads concurrently
+     * @return CODEC_OK, CODEC_SAME or CODEC_ERROR with errstr filled
+     */
+    int (*decode)(const char *data, size_t len, codec_buf_t *out, char *errstr, size_t errstr_size);
+    /**
+     * Convert single msgpack value to wire format, called from TX thread
+     * @return CODEC_OK, CODEC_SAME or CODEC_ERROR with errstr filled
+     */
+    int (*encode)(const char *data, size_t len, codec_buf_t *out, char *errstr, size_t errstr_size);
+} codec_t;
+
+/**
+ * Register codec, e.g. Avro or Protobuf one with compiled schema from other module.
+ * Must be called from TX thread before creation of consumers and producers using it.
+ * @param codec must outlive all consumers and producers
+ * @return 0 on success, -1 when name is taken or registry is full
+ */
+int
+codec_register(const codec_t *codec);
+
+/**
+ * @param name
+ * @return NULL if there is no such codec
+ */
+const codec_t *
+codec_find(const char *name);
+
+/**
+ * Read codec name of 'value_codec' option of config table on top of the stack
+ * @param L
+ * @param codec NULL when option is not set
+ * @return error message or NULL
+ */
+const char *
+lua_read_codec_option(struct lua_State *L, const codec_t **codec);
+
+/**
+ * Encode Lua value at index with codec, tables and tuples are converted to msgpack first
+ * @param L
+ * @param index
+ * @param codec
+ * @param out encoded value, empty when value is string which is passed as is
+ * @param errstr
+ * @param errstr_size
+ * @return 0 on success
+ */
+int
+lua_codec_encode(struct lua_State *L, int index, const codec_t *codec, codec_buf_t *out,
+                 char *errstr, size_t errstr_size);
+
+#endif // TNT_KAFKA_CODEC_H
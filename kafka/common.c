@@ -7,6 +7,9 @@
 const char* const consumer_label = "__tnt_kafka_consumer";
 const char* const consumer_msg_label = "__tnt_kafka_consumer_msg";
 const char* const producer_label = "__tnt_kafka_producer";
+const char* const runtime_label = "__tnt_kafka_runtime";
+const char* const headers_label = "__tnt_kafka_headers";
+const char* const mock_cluster_label = "__tnt_kafka_mock_cluster";
 
 /**
  * Push native lua error with code -3
@@ -21,6 +21,9 @@
 extern const char* const consumer_label;
 extern const char* const consumer_msg_label;
 extern const char* const producer_label;
+extern const char* const runtime_label;
+extern const char* const headers_label;
+extern const char* const mock_cluster_label;
 
 int
 lua_librdkafka_version(struct lua_State *L);
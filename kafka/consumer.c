@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #include <librdkafka/rdkafka.h>
@@ -9,6 +10,7 @@
 #include <callbacks.h>
 #include <queue.h>
 #include <consumer_msg.h>
+#include <abi.h>
 
 #include "consumer.h"
 
@@ -18,90 +20,293 @@
  * Consumer poll thread
  */
 
+static int
+consumer_poller_should_stop(consumer_poller_t *poller) {
+    pthread_mutex_lock(&poller->lock);
+
+    int should_stop = poller->should_stop;
+
+    pthread_mutex_unlock(&poller->lock);
+
+    return should_stop;
+}
+
+static msg_batch_t *
+consumer_poll_batch(consumer_poller_t *poller, event_queues_t *event_queues, int timeout_ms, int *errors_count) {
+    rd_kafka_message_t **rd_msgs = poller->rd_msgs;
+
+    // blocking until first message arrives and then taking all already fetched ones without waiting,
+    // so batching does not add latency when traffic is low
+    rd_kafka_message_t *rd_msg = rd_kafka_consumer_poll(poller->rd_consumer, timeout_ms);
+    if (rd_msg == NULL) {
+        metrics_inc(&event_queues->metrics.empty_polls, 1);
+        return NULL;
+    }
+
+    rd_msgs[0] = rd_msg;
+    ssize_t count = 1;
+    if (poller->batch_size > 1) {
+        ssize_t rc = rd_kafka_consume_batch_queue(poller->rd_queue, 0, rd_msgs + 1, poller->batch_size - 1);
+        if (rc > 0)
+            count += rc;
+    }
+
+    msg_batch_t *batch = new_msg_batch(event_queues->slab, count);
+
+    for (ssize_t i = 0; i < count; i++) {
+        rd_msg = rd_msgs[i];
+        rd_kafka_resp_err_t err = rd_msg->err;
+        if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            // free rdkafka message instantly to prevent hang on close / destroy consumer
+            rd_kafka_message_destroy(rd_msg);
+
+            error_callback(poller->rd_consumer, err, rd_kafka_err2str(err), event_queues);
+
+            (*errors_count)++;
+            if (*errors_count >= 50 && poller->handle == NULL) {
+                // throttling calls with 100ms sleep when there are too many errors one by one,
+                // shared runtime thread must not sleep, it is throttled by its tick instead
+                usleep(100000);
+            }
+            continue;
+        }
+
+        *errors_count = 0;
+        if (batch == NULL) {
+            rd_kafka_message_destroy(rd_msg);
+            continue;
+        }
+
+        if (event_queues->header_filter != NULL && header_filter_skip(event_queues->header_filter, batch, rd_msg)) {
+            rd_kafka_message_destroy(rd_msg);
+            metrics_inc(&event_queues->metrics.filtered_msgs, 1);
+            continue;
+        }
+
+        msg_t *msg = take_consumer_msg(event_queues->slab, poller->tracker, rd_msg);
+        if (msg != NULL) {
+            batch->msgs[batch->count++] = msg;
+            batch->bytes += msg->value_len + msg->key_len;
+        }
+    }
+
+    if (batch != NULL && batch->count == 0) {
+        destroy_msg_batch(batch);
+        return NULL;
+    }
+    if (batch != NULL && event_queues->value_codec != NULL)
+        decode_msg_batch(poller->rd_consumer, event_queues, batch);
+    return batch;
+}
+
+static inline int
+consumer_poller_above_high_watermark(consumer_poller_t *poller) {
+    const consumer_watermarks_t *watermarks = &poller->watermarks;
+    if (watermarks->high_msgs > 0 &&
+        atomic_load_explicit(&poller->pending_msgs, memory_order_relaxed) >= watermarks->high_msgs)
+        return 1;
+    if (watermarks->high_bytes > 0 &&
+        atomic_load_explicit(&poller->pending_bytes, memory_order_relaxed) >= watermarks->high_bytes)
+        return 1;
+    return 0;
+}
+
+static inline int
+consumer_poller_below_low_watermark(consumer_poller_t *poller) {
+    const consumer_watermarks_t *watermarks = &poller->watermarks;
+    if (watermarks->high_msgs > 0 &&
+        atomic_load_explicit(&poller->pending_msgs, memory_order_relaxed) > watermarks->low_msgs)
+        return 0;
+    if (watermarks->high_bytes > 0 &&
+        atomic_load_explicit(&poller->pending_bytes, memory_order_relaxed) > watermarks->low_bytes)
+        return 0;
+    return 1;
+}
+
+/**
+ * Resume assignment except partitions paused for other reasons, must be called with pause lock
+ */
+static rd_kafka_resp_err_t
+consumer_resume_assignment(rd_kafka_t *rd_consumer) {
+    event_queues_t *event_queues = rd_kafka_opaque(rd_consumer);
+    if (event_queues->on_resume == NULL)
+        return kafka_resume(rd_consumer);
+
+    rd_kafka_topic_partition_list_t *partitions = NULL;
+    rd_kafka_resp_err_t err = rd_kafka_assignment(rd_consumer, &partitions);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR)
+        return err;
+
+    event_queues->on_resume(event_queues->rebalance_arg, partitions);
+    err = rd_kafka_resume_partitions(rd_consumer, partitions);
+    rd_kafka_topic_partition_list_destroy(partitions);
+    return err;
+}
+
+/**
+ * Pauses consumer when TX thread does not keep up and resumes it when consume queue is drained
+ */
+static void
+consumer_poller_apply_watermarks(consumer_poller_t *poller) {
+    pause_state_t *pause = poller->pause;
+    // lock is taken on transitions only
+    int auto_paused = atomic_load(&pause->auto_paused);
+    if (auto_paused ? !consumer_poller_below_low_watermark(poller) : !consumer_poller_above_high_watermark(poller))
+        return;
+
+    pthread_mutex_lock(&pause->lock);
+    if (!atomic_load(&pause->auto_paused)) {
+        if (consumer_poller_above_high_watermark(poller) &&
+            kafka_pause(poller->rd_consumer) == RD_KAFKA_RESP_ERR_NO_ERROR)
+            atomic_store(&pause->auto_paused, 1);
+    } else if (consumer_poller_below_low_watermark(poller)) {
+        // partitions paused by user stay paused
+        if (!atomic_load(&pause->user_paused))
+            consumer_resume_assignment(poller->rd_consumer);
+        atomic_store(&pause->auto_paused, 0);
+    }
+    pthread_mutex_unlock(&pause->lock);
+}
+
+/**
+ * Counters are increased before push, because TX thread decreases them right after pop
+ */
+static inline void
+consumer_poller_account_batch(consumer_poller_t *poller, event_queues_t *event_queues, msg_batch_t *batch) {
+    atomic_fetch_add_explicit(&poller->pending_msgs, batch->count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&poller->pending_bytes, batch->bytes, memory_order_relaxed);
+    metrics_inc(&event_queues->metrics.polled_msgs, batch->count);
+    metrics_inc(&event_queues->metrics.polled_bytes, batch->bytes);
+    batch->pushed_at = metrics_now_us();
+}
+
 static void *
 consumer_poll_loop(void *arg) {
-    set_thread_name("kafka_consumer");
-
     consumer_poller_t *poller = arg;
     event_queues_t *event_queues = rd_kafka_opaque(poller->rd_consumer);
-    rd_kafka_message_t *rd_msg = NULL;
-    rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
-    int count = 0;
+
+    char errstr[256];
+    if (thread_options_apply(event_queues->thread_options, "kafka_consumer", "kcons", errstr, sizeof(errstr)) != 0)
+        error_callback(poller->rd_consumer, RD_KAFKA_RESP_ERR__FAIL, errstr, event_queues);
     int errors_count = 0;
-    int should_stop = 0;
 
     while (true) {
-        {
-            pthread_mutex_lock(&poller->lock);
-
-            should_stop = poller->should_stop;
-
-            pthread_mutex_unlock(&poller->lock);
-
-            if (should_stop) {
-                break;
-            }
+        if (consumer_poller_should_stop(poller)) {
+            break;
         }
 
+        consumer_poller_apply_watermarks(poller);
+
         {
-            rd_msg = rd_kafka_consumer_poll(poller->rd_consumer, 1000);
-            if (rd_msg != NULL) {
-                err = rd_msg->err;
-                if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
-                    // free rdkafka message instantly to prevent hang on close / destroy consumer
-                    rd_kafka_message_destroy(rd_msg);
-                    rd_msg = NULL;
-
-                    error_callback(poller->rd_consumer, err, rd_kafka_err2str(err), event_queues);
-
-                    errors_count++;
-                    if (errors_count >= 50) {
-                        // throttling calls with 100ms sleep when there are too many errors one by one
-                        usleep(100000);
-                    }
-                } else {
-                    msg_t *msg = new_consumer_msg(rd_msg);
-                    // free rdkafka message instantly to prevent hang on close / destroy consumer
-                    rd_kafka_message_destroy(rd_msg);
-                    rd_msg = NULL;
-
-                    pthread_mutex_lock(&event_queues->consume_queue->lock);
-
-                    queue_lockfree_push(event_queues->consume_queue, msg);
-                    count = event_queues->consume_queue->count;
-
-                    pthread_mutex_unlock(&event_queues->consume_queue->lock);
-
-                    errors_count = 0;
-                    if (count >= 50000) {
-                        // throttling calls with 100ms sleep when there are too many messages pending in queue
-                        usleep(100000);
-                    }
+            // whole batch is passed to TX thread as single queue entry
+            // paused consumer polls more often to resume as soon as TX thread drains consume queue
+            int timeout_ms = atomic_load(&poller->pause->auto_paused) ? 100 : 1000;
+            msg_batch_t *batch = consumer_poll_batch(poller, event_queues, timeout_ms, &errors_count);
+            if (batch == NULL)
+                continue;
+
+            consumer_poller_account_batch(poller, event_queues, batch);
+
+            while (queue_push(event_queues->consume_queue, batch) != 0) {
+                // bounded queue is full, waiting while main TX thread drains it
+                if (consumer_poller_should_stop(poller)) {
+                    // messages of batch are released by close as well as queued ones
+                    poller->backlog = batch;
+                    break;
                 }
-            } else {
-                // throttling calls with 100ms sleep
-                usleep(100000);
+                metrics_inc(&event_queues->metrics.sleeps, 1);
+                usleep(1000);
             }
+            // there is no need to sleep on empty poll, rd_kafka_consumer_poll is woken up as soon as message arrives
         }
     }
 
     pthread_exit(NULL);
 }
 
+/**
+ * Serve consumer queue from shared runtime thread without blocking
+ */
+static int
+consumer_poller_serve(void *arg) {
+    consumer_poller_t *poller = arg;
+    event_queues_t *event_queues = rd_kafka_opaque(poller->rd_consumer);
+
+    // batch which did not fit into full queue goes first to keep order of messages
+    if (poller->backlog != NULL) {
+        if (queue_push(event_queues->consume_queue, poller->backlog) != 0) {
+            metrics_inc(&event_queues->metrics.sleeps, 1);
+            return 1;
+        }
+        poller->backlog = NULL;
+    }
+
+    consumer_poller_apply_watermarks(poller);
+
+    for (int i = 0; i < CONSUMER_SERVE_MAX_BATCHES; i++) {
+        msg_batch_t *batch = consumer_poll_batch(poller, event_queues, 0, &poller->errors_count);
+        if (batch == NULL) {
+            // paused consumer is served often to resume as soon as TX thread drains consume queue
+            return atomic_load(&poller->pause->auto_paused);
+        }
+
+        consumer_poller_account_batch(poller, event_queues, batch);
+        if (queue_push(event_queues->consume_queue, batch) != 0) {
+            poller->backlog = batch;
+            metrics_inc(&event_queues->metrics.sleeps, 1);
+            return 1;
+        }
+    }
+
+    // the rest of messages is taken after other queues of runtime thread are served
+    return 1;
+}
+
 static consumer_poller_t *
-new_consumer_poller(rd_kafka_t *rd_consumer) {
+new_consumer_poller(rd_kafka_t *rd_consumer, msg_tracker_t *tracker, int batch_size,
+                    const consumer_watermarks_t *watermarks, runtime_t *runtime) {
     consumer_poller_t *poller = malloc(sizeof(consumer_poller_t));
     if (poller == NULL)
         return NULL;
 
+    poller->rd_msgs = malloc(batch_size * sizeof(rd_kafka_message_t *));
+    if (poller->rd_msgs == NULL) {
+        free(poller);
+        return NULL;
+    }
+
     poller->rd_consumer = rd_consumer;
+    poller->rd_queue = rd_kafka_queue_get_consumer(rd_consumer);
+    poller->tracker = tracker;
+    poller->batch_size = batch_size;
+    poller->watermarks = *watermarks;
+    atomic_init(&poller->pending_msgs, 0);
+    atomic_init(&poller->pending_bytes, 0);
+    poller->pause = &((event_queues_t *)rd_kafka_opaque(rd_consumer))->pause;
     poller->should_stop = 0;
+    poller->handle = NULL;
+    poller->backlog = NULL;
+    poller->errors_count = 0;
 
     pthread_mutex_init(&poller->lock, NULL);
     pthread_attr_init(&poller->attr);
+
+    if (runtime != NULL) {
+        poller->handle = runtime_attach(runtime, poller->rd_queue, consumer_poller_serve, poller);
+        if (poller->handle == NULL) {
+            rd_kafka_queue_destroy(poller->rd_queue);
+            free(poller->rd_msgs);
+            free(poller);
+            return NULL;
+        }
+        return poller;
+    }
+
     pthread_attr_setdetachstate(&poller->attr, PTHREAD_CREATE_JOINABLE);
     int rc = pthread_create(&poller->thread, &poller->attr, consumer_poll_loop, (void *)poller);
     if (rc != 0) {
+        rd_kafka_queue_destroy(poller->rd_queue);
+        free(poller->rd_msgs);
         free(poller);
         return NULL;
     }
@@ -112,13 +317,27 @@ new_consumer_poller(rd_kafka_t *rd_consumer) {
 static ssize_t
 stop_poller(va_list args) {
     consumer_poller_t *poller = va_arg(args, consumer_poller_t *);
-    pthread_mutex_lock(&poller->lock);
+    if (poller->handle != NULL) {
+        runtime_detach(poller->handle);
+        poller->handle = NULL;
+    } else {
+        pthread_mutex_lock(&poller->lock);
 
-    poller->should_stop = 1;
+        poller->should_stop = 1;
 
-    pthread_mutex_unlock(&poller->lock);
+        pthread_mutex_unlock(&poller->lock);
+
+        // interrupting blocking poll
+        rd_kafka_yield(poller->rd_consumer);
+
+        pthread_join(poller->thread, NULL);
+    }
 
-    pthread_join(poller->thread, NULL);
+    // queue handle keeps reference to consumer, so it must be released before destroy
+    if (poller->rd_queue != NULL) {
+        rd_kafka_queue_destroy(poller->rd_queue);
+        poller->rd_queue = NULL;
+    }
 
     return 0;
 }
@@ -131,8 +350,11 @@ stop_consumer_poller(consumer_poller_t *poller) {
 
 static void
 destroy_consumer_poller(consumer_poller_t *poller) {
+    if (poller->backlog != NULL)
+        destroy_msg_batch(poller->backlog);
     pthread_attr_destroy(&poller->attr);
     pthread_mutex_destroy(&poller->lock);
+    free(poller->rd_msgs);
     free(poller);
 }
 
@@ -232,36 +454,249 @@ lua_consumer_tostring(struct lua_State *L) {
 }
 
 int
-lua_consumer_poll_msg(struct lua_State *L) {
-    if (lua_gettop(L) != 2)
-        luaL_error(L, "Usage: msgs = consumer:poll_msg(msgs_limit)");
-
+lua_consumer_raw(struct lua_State *L) {
     consumer_t *consumer = lua_check_consumer(L, 1);
+    *(void **)luaL_pushcdata(L, luaL_ctypeid(L, "void *")) = consumer;
+    return 1;
+}
+
+/**
+ * Messages of popped batch are pending until they are taken one by one
+ */
+static inline msg_t *
+consumer_take_pending_msg(consumer_t *consumer, msg_t *msg) {
+    if (msg != NULL && consumer->poller != NULL) {
+        atomic_fetch_sub_explicit(&consumer->poller->pending_msgs, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&consumer->poller->pending_bytes, msg->value_len + msg->key_len,
+                                  memory_order_relaxed);
+    }
+    return msg;
+}
+
+static msg_t *
+consumer_pop_queued_msg(consumer_t *consumer) {
+    msg_batch_t *batch = consumer->pending;
+    while (batch == NULL || batch->pos >= batch->count) {
+        if (batch != NULL)
+            destroy_msg_batch(batch);
+        batch = queue_pop(consumer->event_queues->consume_queue);
+        consumer->pending = batch;
+        if (batch == NULL) {
+            if (consumer->partitions == NULL)
+                return NULL;
+            return consumer_take_pending_msg(consumer, partition_pool_pop_msg(consumer->partitions));
+        }
+        metrics_histogram_observe(&consumer->event_queues->metrics.consume_wait_us,
+                                  metrics_now_us() - batch->pushed_at);
+    }
+    return consumer_take_pending_msg(consumer, batch->msgs[batch->pos++]);
+}
+
+/**
+ * Redelivered messages go first, so messages of partition are delivered in order of offsets
+ * @param partition NULL for any partition
+ */
+static msg_t *
+consumer_pop_replayed_msg(consumer_t *consumer, consumer_partition_t *partition, int *replaying) {
+    replay_buffer_t *replay = consumer->replay;
+    *replaying = 0;
+    if (replay == NULL || consumer->closed)
+        return NULL;
+
+    // message which is not copied because of allocation failure is taken by next call
+    msg_t *msg = partition != NULL ? replay_buffer_pop(replay, partition->topic, partition->partition, replaying) :
+                                     replay_buffer_pop(replay, NULL, 0, replaying);
+    if (msg != NULL)
+        metrics_inc(&consumer->event_queues->metrics.replayed_msgs, 1);
+    return msg;
+}
+
+static inline void
+consumer_remember_msg(consumer_t *consumer, const msg_t *msg) {
+    if (msg != NULL && consumer->replay != NULL && !consumer->closed)
+        replay_buffer_add(consumer->replay, msg, atomic_load(&consumer->event_queues->revokes));
+}
+
+msg_t *
+consumer_pop_msg(consumer_t *consumer) {
+    int replaying;
+    msg_t *msg = consumer_pop_replayed_msg(consumer, NULL, &replaying);
+    if (replaying)
+        return msg;
+
+    msg = consumer_pop_queued_msg(consumer);
+    consumer_remember_msg(consumer, msg);
+    return msg;
+}
+
+static msg_t *
+consumer_pop_partition_msg(consumer_t *consumer, consumer_partition_t *partition) {
+    int replaying;
+    msg_t *msg = consumer_pop_replayed_msg(consumer, partition, &replaying);
+    if (replaying)
+        return msg;
+
+    msg = consumer_take_pending_msg(consumer, consumer_partition_pop_msg(partition));
+    consumer_remember_msg(consumer, msg);
+    return msg;
+}
+
+int
+consumer_has_msgs(consumer_t *consumer) {
+    if (consumer->replay != NULL && !consumer->closed && replay_buffer_has_msgs(consumer->replay))
+        return 1;
+    if (consumer->pending != NULL && consumer->pending->pos < consumer->pending->count)
+        return 1;
+    if (queue_count(consumer->event_queues->consume_queue) > 0)
+        return 1;
+    return consumer->partitions != NULL && partition_pool_has_msgs(consumer->partitions);
+}
+
+void
+consumer_wait_msgs(consumer_t *consumer, double timeout) {
+    notifier_t *notifier = consumer->event_queues->notifier;
+    if (notifier == NULL) {
+        if (!consumer_has_msgs(consumer))
+            fiber_sleep(timeout);
+        return;
+    }
+
+    double deadline = fiber_clock() + timeout;
+    consumer->waiters++;
+    while (!consumer->closed && !fiber_is_cancelled() && !consumer_has_msgs(consumer)) {
+        double remaining = deadline - fiber_clock();
+        if (remaining <= 0)
+            break;
+
+        // notifier wakes up single fiber, so the rest ones wait until it is woken up
+        if (consumer->notifier_owned) {
+            fiber_cond_wait_timeout(consumer->msgs_cond, remaining);
+            continue;
+        }
+
+        consumer->notifier_owned = 1;
+        notifier_prepare(notifier);
+        if (consumer_has_msgs(consumer))
+            notifier_cancel(notifier);
+        else
+            notifier_wait(notifier, remaining);
+        consumer->notifier_owned = 0;
+
+        // parked fibers take messages or one of them waits for next notification
+        fiber_cond_broadcast(consumer->msgs_cond);
+    }
+    consumer->waiters--;
+}
+
+/**
+ * Offsets are stored when messages are handed to application, so messages which are only fetched
+ * are consumed again after restart
+ */
+static inline void
+consumer_auto_store_offset(consumer_t *consumer, const msg_t *msg) {
+    if (consumer->auto_offset_store)
+        rd_kafka_offset_store(msg->topic, msg->partition, msg->last_offset);
+}
+
+static int
+lua_consumer_push_msgs(struct lua_State *L, consumer_t *consumer, consumer_partition_t *partition, int msgs_limit) {
     int counter = 0;
-    int msgs_limit = lua_tonumber(L, 2);
 
     lua_createtable(L, msgs_limit, 0);
-    msg_t *msg = NULL;
     while (msgs_limit > counter) {
-        msg = queue_pop(consumer->event_queues->consume_queue);
-        if (msg == NULL) {
+        msg_t *msg = partition != NULL ? consumer_pop_partition_msg(consumer, partition) : consumer_pop_msg(consumer);
+        if (msg == NULL)
             break;
-        }
         counter += 1;
 
-        msg_t **msg_p = (msg_t **)lua_newuserdata(L, sizeof(msg));
-        *msg_p = msg;
+        consumer_auto_store_offset(consumer, msg);
+        lua_push_consumer_msg(L, msg, consumer->cache_msg_fields);
+        lua_rawseti(L, -2, counter);
+    }
+    return 1;
+}
+
+int
+lua_consumer_poll_msg(struct lua_State *L) {
+    if (lua_gettop(L) != 2 && lua_gettop(L) != 4)
+        luaL_error(L, "Usage: msgs = consumer:poll_msg(msgs_limit[, topic, partition])");
 
-        luaL_getmetatable(L, consumer_msg_label);
-        lua_setmetatable(L, -2);
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    int msgs_limit = lua_tonumber(L, 2);
 
-        lua_rawseti(L, -2, counter);
+    if (lua_gettop(L) == 2)
+        return lua_consumer_push_msgs(L, consumer, NULL, msgs_limit);
+
+    const char *topic = luaL_checkstring(L, 3);
+    int32_t partition_no = luaL_checkint(L, 4);
+    consumer_partition_t *partition = NULL;
+    if (consumer->partitions != NULL)
+        partition = partition_pool_get(consumer->partitions, topic, partition_no);
+    if (partition == NULL) {
+        // partition has never been assigned or consumer has no partition queues at all
+        lua_newtable(L);
+        return 1;
+    }
+    return lua_consumer_push_msgs(L, consumer, partition, msgs_limit);
+}
+
+int
+lua_consumer_poll_batch(struct lua_State *L) {
+    if (lua_gettop(L) != 3)
+        luaL_error(L, "Usage: msgs = consumer:poll_batch(msgs_limit, timeout)");
+
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    int msgs_limit = lua_tonumber(L, 2);
+    double timeout = lua_tonumber(L, 3);
+
+    if (!consumer_has_msgs(consumer) && timeout > 0) {
+        consumer_wait_msgs(consumer, timeout);
+        if (fiber_is_cancelled())
+            return luaL_error(L, "fiber is cancelled");
+    }
+
+    return lua_consumer_push_msgs(L, consumer, NULL, msgs_limit);
+}
+
+int
+lua_consumer_poll(struct lua_State *L) {
+    if (lua_gettop(L) != 2)
+        luaL_error(L, "Usage: msg = consumer:poll(timeout)");
+
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    double timeout = lua_tonumber(L, 2);
+
+    msg_t *msg = consumer_pop_msg(consumer);
+    if (msg == NULL && timeout > 0) {
+        consumer_wait_msgs(consumer, timeout);
+        if (fiber_is_cancelled())
+            return luaL_error(L, "fiber is cancelled");
+        msg = consumer_pop_msg(consumer);
     }
+    if (msg == NULL)
+        return 0;
+
+    consumer_auto_store_offset(consumer, msg);
+    lua_push_consumer_msg(L, msg, consumer->cache_msg_fields);
     return 1;
 }
 
+int
+lua_consumer_wait_msg(struct lua_State *L) {
+    if (lua_gettop(L) != 2)
+        luaL_error(L, "Usage: consumer:wait_msg(timeout)");
+
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    double timeout = lua_tonumber(L, 2);
+
+    consumer_wait_msgs(consumer, timeout);
+    if (fiber_is_cancelled())
+        return luaL_error(L, "fiber is cancelled");
+    return 0;
+}
+
 LUA_RDKAFKA_POLL_FUNC(consumer, poll_logs, LOG_QUEUE, destroy_log_msg, push_log_cb_args)
-LUA_RDKAFKA_POLL_FUNC(consumer, poll_stats, STATS_QUEUE, free, push_stats_cb_args)
+LUA_RDKAFKA_POLL_FUNC(consumer, poll_stats, STATS_QUEUE, destroy_stats_msg, push_stats_cb_args)
 LUA_RDKAFKA_POLL_FUNC(consumer, poll_errors, ERROR_QUEUE, destroy_error_msg, push_errors_cb_args)
 
 static int
@@ -341,6 +776,19 @@ lua_prepare_rebalance_callback_args_on_stack(struct lua_State *L, rebalance_msg_
     else {
         return -1;
     }
+
+    if (msg->cooperative) {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, "cooperative");
+    }
+    return 0;
+}
+
+static ssize_t
+wait_rebalance_complete(va_list args) {
+    rd_kafka_t *rd_consumer = va_arg(args, rd_kafka_t *);
+    rebalance_msg_t *msg = va_arg(args, rebalance_msg_t *);
+    rebalance_complete(rd_consumer, rd_kafka_opaque(rd_consumer), msg);
     return 0;
 }
 
@@ -370,8 +818,6 @@ lua_consumer_poll_rebalances(struct lua_State *L) {
         }
         count++;
 
-        pthread_mutex_lock(&msg->lock);
-
         // push callback on stack
         lua_rawgeti(L, LUA_REGISTRYINDEX, consumer->event_queues->cb_refs[REBALANCE_QUEUE]);
 
@@ -385,10 +831,9 @@ lua_consumer_poll_rebalances(struct lua_State *L) {
             err_str = "unknown error on rebalance callback args processing";
         }
 
-        // allowing background thread proceed rebalancing
-        pthread_cond_signal(&msg->sync);
-
-        pthread_mutex_unlock(&msg->lock);
+        // rebalance is completed even if callback fails, otherwise librdkafka waits for assign forever
+        coio_call(wait_rebalance_complete, consumer->rd_consumer, msg);
+        destroy_rebalance_msg(msg);
 
         if (err_str != NULL) {
             break;
@@ -404,13 +849,32 @@ lua_consumer_poll_rebalances(struct lua_State *L) {
     return 2;
 }
 
+int
+lua_consumer_wait_rebalance(struct lua_State *L) {
+    if (lua_gettop(L) != 2)
+        luaL_error(L, "Usage: consumer:wait_rebalance(timeout)");
+
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    double timeout = lua_tonumber(L, 2);
+
+    queue_t *queue = consumer->event_queues->queues[REBALANCE_QUEUE];
+    if (queue == NULL) {
+        fiber_sleep(timeout);
+    } else {
+        queue_wait(queue, timeout);
+    }
+    if (fiber_is_cancelled())
+        return luaL_error(L, "fiber is cancelled");
+    return 0;
+}
+
 int
 lua_consumer_store_offset(struct lua_State *L) {
     if (lua_gettop(L) != 2)
         luaL_error(L, "Usage: err = consumer:store_offset(msg)");
 
     const msg_t *msg = lua_check_consumer_msg(L, 2);
-    rd_kafka_resp_err_t err = rd_kafka_offset_store(msg->topic, msg->partition, msg->offset);
+    rd_kafka_resp_err_t err = rd_kafka_offset_store(msg->topic, msg->partition, msg->last_offset);
     if (err) {
         lua_pushstring(L, rd_kafka_err2str(err));
         return 1;
@@ -418,6 +882,196 @@ lua_consumer_store_offset(struct lua_State *L) {
     return 0;
 }
 
+rd_kafka_resp_err_t
+consumer_store_offsets(consumer_t *consumer, rd_kafka_topic_partition_list_t *offsets) {
+    rd_kafka_resp_err_t err = rd_kafka_offsets_store(consumer->rd_consumer, offsets);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR)
+        return err;
+    for (int i = 0; i < offsets->cnt; i++) {
+        if (offsets->elems[i].err != RD_KAFKA_RESP_ERR_NO_ERROR)
+            return offsets->elems[i].err;
+    }
+    return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+int
+lua_consumer_store_offsets(struct lua_State *L) {
+    if (lua_gettop(L) != 2 || !lua_istable(L, 2))
+        luaL_error(L, "Usage: err = consumer:store_offsets(msgs)");
+
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    int count = lua_objlen(L, 2);
+    if (count == 0)
+        return 0;
+
+    // unlike rd_kafka_offset_store offsets of next messages are stored
+    rd_kafka_topic_partition_list_t *list = lua_consumer_msgs_offsets(L, 2);
+    if (list == NULL)
+        luaL_error(L, "Out of memory: failed to allocate rd_kafka_topic_partition_list_t");
+
+    rd_kafka_resp_err_t err = consumer_store_offsets(consumer, list);
+    rd_kafka_topic_partition_list_destroy(list);
+
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        lua_pushstring(L, rd_kafka_err2str(err));
+        return 1;
+    }
+    return 0;
+}
+
+int
+lua_consumer_commit_async(struct lua_State *L) {
+    if (lua_gettop(L) != 1)
+        luaL_error(L, "Usage: err = consumer:commit_async()");
+
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    rd_kafka_resp_err_t err;
+    if (consumer->commit_queue != NULL)
+        err = rd_kafka_commit_queue(consumer->rd_consumer, NULL, consumer->commit_queue, NULL, NULL);
+    else
+        err = rd_kafka_commit(consumer->rd_consumer, NULL, 1);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        lua_pushstring(L, rd_kafka_err2str(err));
+        return 1;
+    }
+    return 0;
+}
+
+static ssize_t
+wait_consumer_commit(va_list args) {
+    rd_kafka_queue_t *rd_queue = va_arg(args, rd_kafka_queue_t *);
+    int timeout_ms = va_arg(args, int);
+    void *opaque = va_arg(args, void *);
+    rd_kafka_event_t **event = va_arg(args, rd_kafka_event_t **);
+    int64_t deadline = metrics_now_us() + timeout_ms * 1000LL;
+
+    // results of previous calls which are timed out may arrive to reused queue later
+    while (true) {
+        int remaining_ms = timeout_ms;
+        if (timeout_ms > 0) {
+            int64_t remaining_us = deadline - metrics_now_us();
+            remaining_ms = remaining_us > 0 ? (int)(remaining_us / 1000) : 0;
+        }
+        *event = rd_kafka_queue_poll(rd_queue, remaining_ms);
+        if (*event == NULL || rd_kafka_event_opaque(*event) == opaque)
+            return 0;
+        rd_kafka_event_destroy(*event);
+    }
+}
+
+int
+lua_consumer_commit_sync(struct lua_State *L) {
+    if (lua_gettop(L) != 2)
+        luaL_error(L, "Usage: err = consumer:commit_sync(timeout_ms)");
+
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    int timeout_ms = luaL_checkint(L, 2);
+
+    // result of commit is enqueued by librdkafka thread, so TX thread only waits for it in coio
+    rd_kafka_queue_t *rd_queue = consumer->commit_sync_queue;
+    if (rd_queue == NULL || consumer->commit_sync_busy) {
+        rd_queue = rd_kafka_queue_new(consumer->rd_consumer);
+        if (rd_queue == NULL)
+            luaL_error(L, "Out of memory: failed to allocate rd_kafka_queue_t");
+    } else {
+        consumer->commit_sync_busy = 1;
+    }
+    void *opaque = (void *)++consumer->commit_sync_seq;
+
+    rd_kafka_resp_err_t err = rd_kafka_commit_queue(consumer->rd_consumer, NULL, rd_queue, NULL, opaque);
+    if (err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+        rd_kafka_event_t *event = NULL;
+        coio_call(wait_consumer_commit, rd_queue, timeout_ms, opaque, &event);
+        if (event != NULL) {
+            err = rd_kafka_event_error(event);
+            const rd_kafka_topic_partition_list_t *list = rd_kafka_event_topic_partition_list(event);
+            if (list != NULL)
+                committed_offsets_update(consumer->event_queues, list);
+            rd_kafka_event_destroy(event);
+        } else {
+            err = RD_KAFKA_RESP_ERR__TIMED_OUT;
+        }
+    }
+    if (rd_queue == consumer->commit_sync_queue)
+        consumer->commit_sync_busy = 0;
+    else
+        rd_kafka_queue_destroy(rd_queue);
+
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        lua_pushstring(L, rd_kafka_err2str(err));
+        return 1;
+    }
+    return 0;
+}
+
+int
+lua_consumer_poll_commits(struct lua_State *L) {
+    if (lua_gettop(L) != 2)
+        return luaL_error(L, "Usage: count, err = consumer:poll_commits(limit)");
+
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    if (consumer->commit_queue == NULL) {
+        lua_pushnumber(L, 0);
+        lua_pushliteral(L, "consumer.poll_commits error: callback is not set");
+        return 2;
+    }
+
+    int limit = lua_tonumber(L, 2);
+    int count = 0;
+    char *err_str = NULL;
+    while (count < limit) {
+        // events are already in queue, so zero timeout never blocks TX thread
+        rd_kafka_event_t *event = rd_kafka_queue_poll(consumer->commit_queue, 0);
+        if (event == NULL)
+            break;
+        if (rd_kafka_event_type(event) != RD_KAFKA_EVENT_OFFSET_COMMIT) {
+            rd_kafka_event_destroy(event);
+            continue;
+        }
+
+        count++;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, consumer->commit_callback_ref);
+
+        rd_kafka_resp_err_t err = rd_kafka_event_error(event);
+        if (err != RD_KAFKA_RESP_ERR_NO_ERROR)
+            lua_pushstring(L, rd_kafka_err2str(err));
+        else
+            lua_pushnil(L);
+
+        const rd_kafka_topic_partition_list_t *list = rd_kafka_event_topic_partition_list(event);
+        if (list != NULL)
+            committed_offsets_update(consumer->event_queues, list);
+        lua_createtable(L, list != NULL ? list->cnt : 0, 0);
+        for (int i = 0; list != NULL && i < list->cnt; i++) {
+            const rd_kafka_topic_partition_t *tp = &list->elems[i];
+            lua_createtable(L, 0, 4);
+            lua_pushstring(L, tp->topic);
+            lua_setfield(L, -2, "topic");
+            lua_pushinteger(L, tp->partition);
+            lua_setfield(L, -2, "partition");
+            luaL_pushint64(L, tp->offset);
+            lua_setfield(L, -2, "offset");
+            if (tp->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+                lua_pushstring(L, rd_kafka_err2str(tp->err));
+                lua_setfield(L, -2, "err");
+            }
+            lua_rawseti(L, -2, i + 1);
+        }
+        rd_kafka_event_destroy(event);
+
+        if (lua_pcall(L, 2, 0, 0) != 0) { /* call (2 arguments, 0 result) */
+            err_str = (char *)lua_tostring(L, -1);
+            break;
+        }
+    }
+    lua_pushinteger(L, count);
+    if (err_str != NULL)
+        lua_pushstring(L, err_str);
+    else
+        lua_pushnil(L);
+    return 2;
+}
+
 static ssize_t
 wait_consumer_seek_partitions(va_list args) {
     rd_kafka_t *rk = va_arg(args, rd_kafka_t *);
@@ -441,6 +1095,9 @@ lua_consumer_seek_partitions(struct lua_State *L) {
 
     luaL_checktype(L, 2, LUA_TTABLE);
     int timeout_ms = luaL_checkint(L, 3);
+    consumer_t *consumer = *consumer_p;
+    uint64_t revokes = atomic_load(&consumer->event_queues->revokes);
+    int local_seeks = 0;
 
     size_t len = lua_objlen(L, 2);
     rd_kafka_topic_partition_list_t *list = rd_kafka_topic_partition_list_new(len);
@@ -464,48 +1121,109 @@ lua_consumer_seek_partitions(struct lua_State *L) {
         luaL_pushint64(L, 3);
         lua_gettable(L, -2);
         int64_t offset = luaL_toint64(L, -1);
-        lua_pop(L, 2);
 
-        rd_kafka_topic_partition_list_add(list, topic, partition)->offset = offset;
+        // seek inside window of replay buffer does not touch librdkafka, so prefetched messages are kept
+        if (consumer->replay != NULL && !consumer->closed && topic != NULL &&
+            replay_buffer_seek(consumer->replay, topic, partition, offset, revokes) == 0) {
+            local_seeks++;
+        } else {
+            rd_kafka_topic_partition_list_add(list, topic, partition)->offset = offset;
+        }
+        lua_pop(L, 2);
     }
 
+    // fibers waiting for new messages take redelivered ones
+    if (local_seeks > 0 && consumer->event_queues->notifier != NULL)
+        notifier_notify(consumer->event_queues->notifier);
+
     rd_kafka_error_t *err = NULL;
-    coio_call(wait_consumer_seek_partitions,
-              (*consumer_p)->rd_consumer, list, timeout_ms, &err);
+    if (list->cnt > 0)
+        coio_call(wait_consumer_seek_partitions, consumer->rd_consumer, list, timeout_ms, &err);
     rd_kafka_topic_partition_list_destroy(list);
     if (err != NULL) {
         lua_pushstring(L, rd_kafka_error_string(err));
+        rd_kafka_error_destroy(err);
         return 1;
     }
     return 0;
 }
 
+/**
+ * @return milliseconds left to deadline, but no more than limit_ms, negative deadline means no deadline
+ */
+static int
+consumer_close_remaining_ms(int64_t deadline, int limit_ms) {
+    if (deadline < 0)
+        return limit_ms;
+    int64_t remaining_ms = (deadline - metrics_now_us()) / 1000;
+    if (remaining_ms <= 0)
+        return 0;
+    return limit_ms >= 0 && remaining_ms > limit_ms ? limit_ms : (int)remaining_ms;
+}
+
+static rd_kafka_resp_err_t
+consumer_close_commit(rd_kafka_t *rd_consumer, rd_kafka_queue_t *rd_queue,
+                      const rd_kafka_topic_partition_list_t *offsets, int64_t deadline) {
+    rd_kafka_resp_err_t err = rd_kafka_commit_queue(rd_consumer, offsets, rd_queue, NULL, NULL);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR)
+        return err;
+    rd_kafka_event_t *event = rd_kafka_queue_poll(rd_queue, consumer_close_remaining_ms(deadline, -1));
+    if (event == NULL)
+        return RD_KAFKA_RESP_ERR__TIMED_OUT;
+    err = rd_kafka_event_error(event);
+    rd_kafka_event_destroy(event);
+    return err;
+}
+
 static ssize_t
 wait_consumer_close(va_list args) {
     rd_kafka_t *rd_consumer = va_arg(args, rd_kafka_t *);
+    int timeout_ms = va_arg(args, int);
+    const rd_kafka_topic_partition_list_t *released = va_arg(args, const rd_kafka_topic_partition_list_t *);
+    long *dropped = va_arg(args, long *);
     rd_kafka_message_t *rd_msg = NULL;
     rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
     int errors_count = 0;
+    int64_t deadline = timeout_ms >= 0 ? metrics_now_us() + timeout_ms * 1000LL : -1;
+
+    // commit of current offsets waits no longer than deadline, so unreachable broker does not block close
+    rd_kafka_queue_t *rd_queue = rd_kafka_queue_new(rd_consumer);
+    if (rd_queue != NULL) {
+        err = consumer_close_commit(rd_consumer, rd_queue, NULL, deadline);
+        // offsets of released messages may be behind already committed ones, so they are committed explicitly
+        if (released != NULL && released->cnt > 0) {
+            rd_kafka_resp_err_t released_err = consumer_close_commit(rd_consumer, rd_queue, released, deadline);
+            if (released_err != RD_KAFKA_RESP_ERR_NO_ERROR)
+                err = released_err;
+        }
+        rd_kafka_queue_destroy(rd_queue);
+        if (err != RD_KAFKA_RESP_ERR_NO_ERROR && err != RD_KAFKA_RESP_ERR__NO_OFFSET)
+            error_callback(rd_consumer, err, rd_kafka_err2str(err), rd_kafka_opaque(rd_consumer));
+    }
 
-    // cleanup consumer queue, because at other way close hangs forever
+    // cleanup consumer queue, because at other way close hangs forever,
+    // partitions are paused, so only already fetched messages are left there
     while (true) {
-        rd_msg = rd_kafka_consumer_poll(rd_consumer, 1000);
-        if (rd_msg != NULL) {
-            err = rd_msg->err;
-            rd_kafka_message_destroy(rd_msg);
-            if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
-                errors_count++;
-                error_callback(rd_consumer, err, rd_kafka_err2str(err), rd_kafka_opaque(rd_consumer));
-                // most likely there is no connection to the broker,
-                // so this cycle will go on forever without this condition
-                if (errors_count == 5) {
-                    break;
-                }
-            } else {
-                errors_count = 0;
+        int poll_timeout_ms = consumer_close_remaining_ms(deadline, 100);
+        if (poll_timeout_ms == 0)
+            break;
+        rd_msg = rd_kafka_consumer_poll(rd_consumer, poll_timeout_ms);
+        if (rd_msg == NULL)
+            break;
+
+        err = rd_msg->err;
+        rd_kafka_message_destroy(rd_msg);
+        if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            errors_count++;
+            error_callback(rd_consumer, err, rd_kafka_err2str(err), rd_kafka_opaque(rd_consumer));
+            // most likely there is no connection to the broker,
+            // so this cycle will go on forever without this condition
+            if (errors_count == 5) {
+                break;
             }
         } else {
-            break;
+            errors_count = 0;
+            (*dropped)++;
         }
     }
 
@@ -526,17 +1244,93 @@ wait_consumer_destroy(va_list args) {
     return 0;
 }
 
+static ssize_t
+wait_partition_pool_stop(va_list args) {
+    partition_pool_t *pool = va_arg(args, partition_pool_t *);
+    stop_partition_pool(pool);
+    return 0;
+}
+
 static void
-consumer_destroy(struct lua_State *L, consumer_t *consumer) {
-    if (consumer->rd_consumer != NULL) {
-        stop_consumer_poller(consumer->poller);
+consumer_stop_pollers(consumer_t *consumer) {
+    stop_consumer_poller(consumer->poller);
+    if (consumer->partitions != NULL)
+        coio_call(wait_partition_pool_stop, consumer->partitions);
+}
+
+/**
+ * Remember offset of the first released message of partition, stored offset goes back to it on close
+ */
+static void
+consumer_add_released_offset(rd_kafka_topic_partition_list_t *released, const msg_t *msg) {
+    if (released == NULL)
+        return;
+    const char *topic = rd_kafka_topic_name(msg->topic);
+    rd_kafka_topic_partition_t *tp = rd_kafka_topic_partition_list_find(released, topic, msg->partition);
+    if (tp == NULL) {
+        tp = rd_kafka_topic_partition_list_add(released, topic, msg->partition);
+        tp->offset = msg->offset;
+    } else if (tp->offset > msg->offset) {
+        tp->offset = msg->offset;
+    }
+}
+
+/**
+ * Release messages which are fetched but not taken by TX thread yet in order they were queued,
+ * must be called after pollers are stopped
+ * @return count of released messages
+ */
+static long
+consumer_release_queued_msgs(consumer_t *consumer, rd_kafka_topic_partition_list_t *released) {
+    long count = 0;
+    msg_t *msg;
+    while ((msg = consumer_pop_msg(consumer)) != NULL) {
+        consumer_add_released_offset(released, msg);
+        destroy_consumer_msg(msg);
+        count++;
     }
 
+    // batches which did not fit into full consume and partition queues follow queued ones
+    msg_batch_t *backlog = consumer->poller != NULL ? consumer->poller->backlog : NULL;
+    if (consumer->poller != NULL)
+        consumer->poller->backlog = NULL;
+    if (backlog == NULL && consumer->partitions != NULL)
+        backlog = partition_pool_take_backlog(consumer->partitions);
+    while (backlog != NULL) {
+        for (int i = backlog->pos; i < backlog->count; i++)
+            consumer_add_released_offset(released, backlog->msgs[i]);
+        count += backlog->count - backlog->pos;
+        destroy_msg_batch(backlog);
+        backlog = consumer->partitions != NULL ? partition_pool_take_backlog(consumer->partitions) : NULL;
+    }
+    return count;
+}
+
+static void
+consumer_destroy(struct lua_State *L, consumer_t *consumer) {
+    if (consumer->rd_consumer != NULL && !consumer->closed)
+        consumer_stop_pollers(consumer);
+
+    // rdkafka messages must not outlive consumer
+    if (consumer->tracker != NULL)
+        release_tracked_msgs(consumer->tracker);
+
     if (consumer->topics != NULL) {
         rd_kafka_topic_partition_list_destroy(consumer->topics);
         consumer->topics = NULL;
     }
 
+    // queue handles must not outlive librdkafka handle
+    if (consumer->commit_queue != NULL) {
+        rd_kafka_queue_destroy(consumer->commit_queue);
+        consumer->commit_queue = NULL;
+    }
+    if (consumer->commit_sync_queue != NULL) {
+        rd_kafka_queue_destroy(consumer->commit_sync_queue);
+        consumer->commit_sync_queue = NULL;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, consumer->commit_callback_ref);
+
     /*
      * Here we close consumer and only then destroys other stuff.
      * Otherwise raise condition is possible when e.g.
@@ -545,7 +1339,7 @@ consumer_destroy(struct lua_State *L, consumer_t *consumer) {
      */
     if (consumer->rd_consumer != NULL) {
         /* Destroy handle */
-        // FIXME: kafka_destroy hangs forever
+        // consumer is not closed here, close is bounded by its own deadline
         coio_call(wait_consumer_destroy, consumer->rd_consumer);
         consumer->rd_consumer = NULL;
     }
@@ -555,11 +1349,31 @@ consumer_destroy(struct lua_State *L, consumer_t *consumer) {
         consumer->poller = NULL;
     }
 
+    if (consumer->pending != NULL) {
+        destroy_msg_batch(consumer->pending);
+        consumer->pending = NULL;
+    }
+
+    if (consumer->partitions != NULL) {
+        destroy_partition_pool(consumer->partitions);
+        consumer->partitions = NULL;
+    }
+
     if (consumer->event_queues != NULL) {
         destroy_event_queues(L, consumer->event_queues);
         consumer->event_queues = NULL;
     }
 
+    if (consumer->tracker != NULL) {
+        destroy_msg_tracker(consumer->tracker);
+        consumer->tracker = NULL;
+    }
+
+    if (consumer->msgs_cond != NULL)
+        fiber_cond_delete(consumer->msgs_cond);
+
+    destroy_replay_buffer(consumer->replay);
+
     free(consumer);
 }
 
@@ -570,15 +1384,70 @@ lua_consumer_close(struct lua_State *L) {
         lua_pushboolean(L, 0);
         return 1;
     }
+    consumer_t *consumer = *consumer_p;
+    int timeout_ms = luaL_optint(L, 2, -1);
+
+    // paused partitions are not prefetched anymore, so there are no messages fetched only to be dropped
+    pthread_mutex_lock(&consumer->event_queues->pause.lock);
+    atomic_store(&consumer->event_queues->pause.user_paused, 1);
+    kafka_pause(consumer->rd_consumer);
+    pthread_mutex_unlock(&consumer->event_queues->pause.lock);
+
+    // nothing is pushed to consume queues after pollers are stopped
+    if (!consumer->closed) {
+        consumer_stop_pollers(consumer);
+        consumer->closed = 1;
+    }
+
+    // fibers waiting for messages must leave before consumer is destroyed
+    if (consumer->event_queues->notifier != NULL)
+        notifier_notify(consumer->event_queues->notifier);
+    fiber_cond_broadcast(consumer->msgs_cond);
+    while (consumer->waiters > 0)
+        fiber_sleep(0.001);
+
+    // close hangs forever while any of rdkafka messages is alive,
+    // so zero copy messages are copied and new ones are not tracked anymore
+    if (consumer->tracker != NULL)
+        release_tracked_msgs(consumer->tracker);
+
+    // offsets are stored automatically when messages are handed to Lua, so stored offsets go back
+    // to the first message of every partition which is taken by Lua but not delivered to application,
+    // such messages are passed by Lua and they are committed explicitly, queued ones are never stored
+    rd_kafka_topic_partition_list_t *released = NULL;
+    if (consumer->auto_offset_store)
+        released = rd_kafka_topic_partition_list_new(8);
+    if (released != NULL && lua_istable(L, 3)) {
+        int count = lua_objlen(L, 3);
+        for (int i = 1; i <= count; i++) {
+            lua_rawgeti(L, 3, i);
+            consumer_add_released_offset(released, lua_check_consumer_msg(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    long undelivered = consumer_release_queued_msgs(consumer, released);
+    // final commit of revoked partitions uses stored offsets, so they must not be ahead of committed ones
+    if (released != NULL && released->cnt > 0) {
+        rd_kafka_resp_err_t err = consumer_store_offsets(consumer, released);
+        if (err != RD_KAFKA_RESP_ERR_NO_ERROR)
+            error_callback(consumer->rd_consumer, err, rd_kafka_err2str(err), consumer->event_queues);
+    }
 
-    // unsubscribe consumer to make possible close it
-    rd_kafka_unsubscribe((*consumer_p)->rd_consumer);
-    rd_kafka_commit((*consumer_p)->rd_consumer, NULL, 0); // sync commit of current offsets
+    // unsubscribe consumer to make possible close it, partitions are revoked only after offsets are stored
+    rd_kafka_unsubscribe(consumer->rd_consumer);
 
-    // trying to close in background until success
-    coio_call(wait_consumer_close, (*consumer_p)->rd_consumer);
-    lua_pushboolean(L, 1);
-    return 1;
+    int rc = coio_call(wait_consumer_close, consumer->rd_consumer, timeout_ms, released, &undelivered);
+    if (released != NULL)
+        rd_kafka_topic_partition_list_destroy(released);
+    if (rc != 0) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "consumer close failed");
+    } else {
+        lua_pushboolean(L, 1);
+        lua_pushnil(L);
+    }
+    lua_pushinteger(L, undelivered);
+    return 3;
 }
 
 int
@@ -592,6 +1461,41 @@ lua_consumer_destroy(struct lua_State *L) {
     return 0;
 }
 
+static int
+lua_consumer_get_long_option(struct lua_State *L, const char *name, long default_value, long *value) {
+    lua_pushstring(L, name);
+    lua_gettable(L, -2);
+    *value = default_value;
+    if (lua_isnumber(L, -1))
+        *value = (long)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return *value < 0 ? -1 : 0;
+}
+
+/**
+ * Reads consume queue watermarks from config table on top of the stack
+ */
+static const char *
+lua_consumer_get_watermarks(struct lua_State *L, consumer_watermarks_t *watermarks) {
+    if (lua_consumer_get_long_option(L, "queue_high_watermark", CONSUMER_DEFAULT_HIGH_WATERMARK,
+                                     &watermarks->high_msgs) != 0)
+        return "consumer config 'queue_high_watermark' must be non negative number";
+    if (lua_consumer_get_long_option(L, "queue_low_watermark", watermarks->high_msgs / 2,
+                                     &watermarks->low_msgs) != 0)
+        return "consumer config 'queue_low_watermark' must be non negative number";
+    if (lua_consumer_get_long_option(L, "queue_high_watermark_bytes", 0, &watermarks->high_bytes) != 0)
+        return "consumer config 'queue_high_watermark_bytes' must be non negative number";
+    if (lua_consumer_get_long_option(L, "queue_low_watermark_bytes", watermarks->high_bytes / 2,
+                                     &watermarks->low_bytes) != 0)
+        return "consumer config 'queue_low_watermark_bytes' must be non negative number";
+
+    if (watermarks->high_msgs > 0 && watermarks->low_msgs >= watermarks->high_msgs)
+        return "consumer config 'queue_low_watermark' must be less than 'queue_high_watermark'";
+    if (watermarks->high_bytes > 0 && watermarks->low_bytes >= watermarks->high_bytes)
+        return "consumer config 'queue_low_watermark_bytes' must be less than 'queue_high_watermark_bytes'";
+    return NULL;
+}
+
 int
 lua_create_consumer(struct lua_State *L) {
     if (lua_gettop(L) != 1 || !lua_istable(L, 1))
@@ -641,15 +1545,146 @@ lua_create_consumer(struct lua_State *L) {
     lua_pop(L, 1);
     rd_kafka_conf_set_default_topic_conf(rd_config, topic_conf);
 
+    lua_pushstring(L, "queue_capacity");
+    lua_gettable(L, -2);
+    lua_Integer queue_capacity = DEFAULT_QUEUE_CAPACITY;
+    if (lua_isnumber(L, -1))
+        queue_capacity = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (queue_capacity < 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "consumer config 'queue_capacity' must be non negative number");
+        return 2;
+    }
+
+    lua_pushstring(L, "zero_copy");
+    lua_gettable(L, -2);
+    int zero_copy = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_pushstring(L, "consume_batch_size");
+    lua_gettable(L, -2);
+    lua_Integer batch_size = CONSUMER_POLL_BATCH_SIZE;
+    if (lua_isnumber(L, -1))
+        batch_size = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (batch_size <= 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "consumer config 'consume_batch_size' must be positive number");
+        return 2;
+    }
+
+    lua_pushstring(L, "cache_msg_fields");
+    lua_gettable(L, -2);
+    int cache_msg_fields = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_pushstring(L, "partition_queues");
+    lua_gettable(L, -2);
+    int partition_queues = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    long poller_threads = 0;
+    if (lua_consumer_get_long_option(L, "poller_threads", CONSUMER_DEFAULT_POLLER_THREADS, &poller_threads) != 0 ||
+        poller_threads == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "consumer config 'poller_threads' must be positive number");
+        return 2;
+    }
+
+    consumer_watermarks_t watermarks;
+    const char *watermarks_err = lua_consumer_get_watermarks(L, &watermarks);
+    if (watermarks_err != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, watermarks_err);
+        return 2;
+    }
+
+    long replay_buffer_bytes = 0;
+    if (lua_consumer_get_long_option(L, "replay_buffer_bytes", 0, &replay_buffer_bytes) != 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "consumer config 'replay_buffer_bytes' must be non negative number");
+        return 2;
+    }
+
+    runtime_t *runtime = NULL;
+    const char *runtime_err = lua_read_runtime_option(L, &runtime);
+    if (runtime_err != NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "consumer %s", runtime_err);
+        return 2;
+    }
+
+    thread_options_t *thread_options = NULL;
+    const char *thread_options_err = lua_read_thread_options(L, &thread_options);
+    if (thread_options_err != NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "consumer %s", thread_options_err);
+        return 2;
+    }
+
+    stats_filter_t *stats_filter = NULL;
+    const char *stats_filter_err = lua_read_stats_filter(L, &stats_filter);
+    if (stats_filter_err != NULL) {
+        destroy_thread_options(thread_options);
+        lua_pushnil(L);
+        lua_pushstring(L, stats_filter_err);
+        return 2;
+    }
+
+    header_filter_t *header_filter = NULL;
+    const char *header_filter_err = lua_read_header_filter(L, &header_filter);
+    if (header_filter_err != NULL) {
+        destroy_stats_filter(stats_filter);
+        destroy_thread_options(thread_options);
+        lua_pushnil(L);
+        lua_pushfstring(L, "consumer %s", header_filter_err);
+        return 2;
+    }
+
+    const codec_t *value_codec = NULL;
+    const char *value_codec_err = lua_read_codec_option(L, &value_codec);
+    if (value_codec_err != NULL) {
+        destroy_header_filter(header_filter);
+        destroy_stats_filter(stats_filter);
+        destroy_thread_options(thread_options);
+        lua_pushnil(L);
+        lua_pushfstring(L, "consumer %s", value_codec_err);
+        return 2;
+    }
+
     event_queues_t *event_queues = new_event_queues();
-    event_queues->consume_queue = new_queue();
+    if (event_queues == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "consumer failed to allocate event queues");
+        return 2;
+    }
+    event_queues->stats_filter = stats_filter;
+    event_queues->thread_options = thread_options;
+    event_queues->header_filter = header_filter;
+    event_queues->value_codec = value_codec;
+    if (thread_options_set_conf(rd_config, thread_options, errstr, sizeof(errstr)) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        lua_pushnil(L);
+        lua_pushstring(L, errstr);
+        return 2;
+    }
+    if (queue_capacity > 0)
+        event_queues->consume_queue = new_ring_queue(queue_capacity, 0);
+    else
+        event_queues->consume_queue = new_queue();
+    event_queues->notifier = new_notifier();
+    if (event_queues->notifier != NULL)
+        queue_set_notifier(event_queues->consume_queue, event_queues->notifier);
 
     for (int i = 0; i < MAX_QUEUE; i++) {
+        if (i == DELIVERY_REPORT_QUEUE)
+            continue;
+
         lua_pushstring(L, queue2str[i]);
         lua_gettable(L, -2);
         if (lua_isfunction(L, -1)) {
             event_queues->cb_refs[i] = luaL_ref(L, LUA_REGISTRYINDEX);
-            event_queues->queues[i] = new_queue();
+            event_queues->queues[i] = new_callback_queue(i, queue_capacity);
             switch (i) {
                 case LOG_QUEUE:
                     rd_kafka_conf_set_log_cb(rd_config, log_callback);
@@ -669,6 +1704,20 @@ lua_create_consumer(struct lua_State *L) {
         }
     }
 
+    if (event_queues->queues[REBALANCE_QUEUE] != NULL) {
+        event_queues->rebalance_notifier = new_notifier();
+        if (event_queues->rebalance_notifier != NULL)
+            queue_set_notifier(event_queues->queues[REBALANCE_QUEUE], event_queues->rebalance_notifier);
+    }
+
+    // partition queues are attached on every assign and replay buffer is dropped on every revoke,
+    // so callback is needed even without Lua one
+    if (partition_queues || replay_buffer_bytes > 0)
+        rd_kafka_conf_set_rebalance_cb(rd_config, rebalance_callback);
+
+    // results of automatic and synchronous commits are remembered for lag
+    rd_kafka_conf_set_offset_commit_cb(rd_config, offset_commit_callback);
+
     rd_kafka_conf_set_opaque(rd_config, event_queues);
 
     lua_pushstring(L, "options");
@@ -700,6 +1749,22 @@ lua_create_consumer(struct lua_State *L) {
     }
     lua_pop(L, 1);
 
+    // librdkafka stores offsets as soon as pollers fetch messages, so messages which are queued
+    // but not taken by application would be skipped after restart, offsets are stored by TX thread instead
+    char auto_offset_store_value[8];
+    size_t auto_offset_store_size = sizeof(auto_offset_store_value);
+    int auto_offset_store = 1;
+    if (rd_kafka_conf_get(rd_config, "enable.auto.offset.store", auto_offset_store_value,
+                          &auto_offset_store_size) == RD_KAFKA_CONF_OK)
+        auto_offset_store = strcmp(auto_offset_store_value, "true") == 0;
+    if (auto_offset_store &&
+        rd_kafka_conf_set(rd_config, "enable.auto.offset.store", "false", errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        rd_kafka_conf_destroy(rd_config);
+        lua_pushnil(L);
+        lua_pushstring(L, errstr);
+        return 2;
+    }
+
     rd_kafka_t *rd_consumer;
     if (!(rd_consumer = rd_kafka_new(RD_KAFKA_CONSUMER, rd_config, errstr, sizeof(errstr)))) {
         lua_pushnil(L);
@@ -715,8 +1780,49 @@ lua_create_consumer(struct lua_State *L) {
 
     rd_kafka_poll_set_consumer(rd_consumer);
 
-    // creating background thread for polling consumer
-    consumer_poller_t *poller = new_consumer_poller(rd_consumer);
+    rd_kafka_queue_t *commit_queue = NULL;
+    int commit_callback_ref = LUA_REFNIL;
+    lua_pushstring(L, "offset_commit_callback");
+    lua_gettable(L, -2);
+    if (lua_isfunction(L, -1)) {
+        commit_callback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        commit_queue = rd_kafka_queue_new(rd_consumer);
+    } else {
+        lua_pop(L, 1);
+    }
+
+    msg_tracker_t *tracker = NULL;
+    if (zero_copy)
+        tracker = new_msg_tracker();
+
+    // creating background thread for polling consumer or attaching consumer queue to shared runtime
+    consumer_poller_t *poller = new_consumer_poller(rd_consumer, tracker, batch_size, &watermarks, runtime);
+    if (poller == NULL && runtime != NULL) {
+        if (commit_queue != NULL)
+            rd_kafka_queue_destroy(commit_queue);
+        luaL_unref(L, LUA_REGISTRYINDEX, commit_callback_ref);
+        coio_call(wait_consumer_destroy, rd_consumer);
+        destroy_event_queues(L, event_queues);
+        if (tracker != NULL)
+            destroy_msg_tracker(tracker);
+        lua_pushnil(L);
+        lua_pushliteral(L, "failed to attach consumer to runtime");
+        return 2;
+    }
+
+    // partitions are assigned only after subscribe, so rebalance callback is set up in time
+    partition_pool_t *partitions = NULL;
+    if (partition_queues) {
+        partitions = new_partition_pool(rd_consumer, tracker, poller_threads, batch_size,
+                                        poller != NULL ? &poller->pending_msgs : NULL,
+                                        poller != NULL ? &poller->pending_bytes : NULL);
+        if (partitions != NULL) {
+            event_queues->rebalance_arg = partitions;
+            event_queues->on_assign = partition_pool_assign;
+            event_queues->on_revoke = partition_pool_revoke;
+            event_queues->on_resume = partition_pool_resume_filter;
+        }
+    }
 
     consumer_t *consumer;
     consumer = malloc(sizeof(consumer_t));
@@ -724,6 +1830,27 @@ lua_create_consumer(struct lua_State *L) {
     consumer->topics = NULL;
     consumer->event_queues = event_queues;
     consumer->poller = poller;
+    consumer->tracker = tracker;
+    consumer->pending = NULL;
+    consumer->partitions = partitions;
+    consumer->cache_msg_fields = cache_msg_fields;
+    consumer->commit_queue = commit_queue;
+    consumer->commit_callback_ref = commit_callback_ref;
+    // NULL on allocation failure, then commit_sync allocates queue on every call
+    consumer->commit_sync_queue = rd_kafka_queue_new(rd_consumer);
+    consumer->commit_sync_busy = 0;
+    consumer->commit_sync_seq = 0;
+    consumer->closed = 0;
+    consumer->auto_offset_store = auto_offset_store;
+    consumer->msgs_cond = fiber_cond_new();
+    consumer->notifier_owned = 0;
+    consumer->waiters = 0;
+    consumer->rate_sampled_at = metrics_now_us();
+    consumer->rate_msgs = 0;
+    consumer->rate_bytes = 0;
+    consumer->replay = NULL;
+    if (replay_buffer_bytes > 0)
+        consumer->replay = new_replay_buffer(event_queues->slab, replay_buffer_bytes);
 
     consumer_t **consumer_p = (consumer_t **)lua_newuserdata(L, sizeof(consumer));
     *consumer_p = consumer;
@@ -739,9 +1866,14 @@ lua_consumer_dump_conf(struct lua_State *L) {
     if (consumer_p == NULL || *consumer_p == NULL)
         return 0;
 
-    if ((*consumer_p)->rd_consumer != NULL)
-        return lua_librdkafka_dump_conf(L, (*consumer_p)->rd_consumer);
-    return 0;
+    if ((*consumer_p)->rd_consumer == NULL || lua_librdkafka_dump_conf(L, (*consumer_p)->rd_consumer) == 0)
+        return 0;
+    // offsets are still stored automatically, but by TX thread instead of librdkafka
+    if ((*consumer_p)->auto_offset_store) {
+        lua_pushliteral(L, "true");
+        lua_setfield(L, -2, "enable.auto.offset.store");
+    }
+    return 1;
 }
 
 int
@@ -789,10 +1921,154 @@ lua_consumer_call_pause_resume(struct lua_State *L, rd_kafka_resp_err_t (*fun)(r
 
 int
 lua_consumer_pause(struct lua_State *L) {
-    return lua_consumer_call_pause_resume(L, kafka_pause);
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    pause_state_t *pause = &consumer->event_queues->pause;
+    pthread_mutex_lock(&pause->lock);
+    atomic_store(&pause->user_paused, 1);
+    int rc = lua_consumer_call_pause_resume(L, kafka_pause);
+    pthread_mutex_unlock(&pause->lock);
+    return rc;
 }
 
 int
 lua_consumer_resume(struct lua_State *L) {
-    return lua_consumer_call_pause_resume(L, kafka_resume);
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    pause_state_t *pause = &consumer->event_queues->pause;
+    pthread_mutex_lock(&pause->lock);
+    atomic_store(&pause->user_paused, 0);
+    // poller pauses partitions again while consume queue is above high watermark
+    atomic_store(&pause->auto_paused, 0);
+    int rc = lua_consumer_call_pause_resume(L, consumer_resume_assignment);
+    pthread_mutex_unlock(&pause->lock);
+    return rc;
+}
+
+int
+lua_consumer_metrics(struct lua_State *L) {
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    event_queues_t *event_queues = consumer->event_queues;
+    metrics_t *metrics = &event_queues->metrics;
+
+    lua_createtable(L, 0, 10);
+    lua_set_metrics_field(L, "polled_msgs", metrics_get(&metrics->polled_msgs));
+    lua_set_metrics_field(L, "polled_bytes", metrics_get(&metrics->polled_bytes));
+    lua_set_metrics_field(L, "filtered_msgs", metrics_get(&metrics->filtered_msgs));
+    lua_set_metrics_field(L, "decode_errors", metrics_get(&metrics->decode_errors));
+    lua_set_metrics_field(L, "empty_polls", metrics_get(&metrics->empty_polls));
+    lua_set_metrics_field(L, "poller_sleeps", metrics_get(&metrics->sleeps));
+    lua_set_metrics_field(L, "replayed_msgs", metrics_get(&metrics->replayed_msgs));
+    lua_set_metrics_field(L, "dropped_callback_msgs", metrics_get(&metrics->dropped_callback_msgs));
+    lua_set_metrics_field(L, "consume_queue_batches", queue_count(event_queues->consume_queue));
+    lua_set_metrics_field(L, "consume_queue_push_failures", queue_push_failures(event_queues->consume_queue));
+    if (consumer->poller != NULL) {
+        consumer_poller_t *poller = consumer->poller;
+        lua_set_metrics_field(L, "pending_msgs", atomic_load_explicit(&poller->pending_msgs, memory_order_relaxed));
+        lua_set_metrics_field(L, "pending_bytes", atomic_load_explicit(&poller->pending_bytes, memory_order_relaxed));
+        lua_set_metrics_field(L, "auto_paused", atomic_load(&poller->pause->auto_paused));
+    }
+    lua_push_metrics_histogram(L, &metrics->consume_wait_us);
+    lua_setfield(L, -2, "consume_wait_us");
+    return 1;
+}
+
+static inline void
+lua_set_offset_field(struct lua_State *L, const char *name, int64_t offset) {
+    // unknown offsets are left nil
+    if (offset < 0)
+        return;
+    lua_pushnumber(L, (double)offset);
+    lua_setfield(L, -2, name);
+}
+
+int
+lua_consumer_lag(struct lua_State *L) {
+    consumer_t *consumer = lua_check_consumer(L, 1);
+    event_queues_t *event_queues = consumer->event_queues;
+
+    // assignment, positions and watermarks are local copies of librdkafka, so nothing waits for broker
+    rd_kafka_topic_partition_list_t *assignment = NULL;
+    rd_kafka_resp_err_t err = rd_kafka_assignment(consumer->rd_consumer, &assignment);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        lua_pushnil(L);
+        lua_pushstring(L, rd_kafka_err2str(err));
+        return 2;
+    }
+    rd_kafka_position(consumer->rd_consumer, assignment);
+
+    double total_lag = 0;
+    lua_createtable(L, 0, 4);
+    lua_createtable(L, assignment->cnt, 0);
+    for (int i = 0; i < assignment->cnt; i++) {
+        const rd_kafka_topic_partition_t *tp = &assignment->elems[i];
+        int64_t low = RD_KAFKA_OFFSET_INVALID;
+        int64_t high = RD_KAFKA_OFFSET_INVALID;
+        rd_kafka_get_watermark_offsets(consumer->rd_consumer, tp->topic, tp->partition, &low, &high);
+        int64_t committed = committed_offsets_get(event_queues, tp->topic, tp->partition);
+        int64_t position = tp->err == RD_KAFKA_RESP_ERR_NO_ERROR ? tp->offset : RD_KAFKA_OFFSET_INVALID;
+
+        lua_createtable(L, 0, 7);
+        lua_pushstring(L, tp->topic);
+        lua_setfield(L, -2, "topic");
+        lua_pushinteger(L, tp->partition);
+        lua_setfield(L, -2, "partition");
+        lua_set_offset_field(L, "committed", committed);
+        lua_set_offset_field(L, "position", position);
+        lua_set_offset_field(L, "low", low);
+        lua_set_offset_field(L, "high", high);
+
+        // lag is counted from committed offset, and from fetch position until the first commit
+        int64_t consumed = committed >= 0 ? committed : position;
+        if (high >= 0 && consumed >= 0) {
+            int64_t lag = high > consumed ? high - consumed : 0;
+            lua_set_offset_field(L, "lag", lag);
+            total_lag += (double)lag;
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "partitions");
+    rd_kafka_topic_partition_list_destroy(assignment);
+
+    lua_pushnumber(L, total_lag);
+    lua_setfield(L, -2, "lag");
+
+    int64_t now = metrics_now_us();
+    uint64_t msgs = metrics_get(&event_queues->metrics.polled_msgs);
+    uint64_t bytes = metrics_get(&event_queues->metrics.polled_bytes);
+    double elapsed = (double)(now - consumer->rate_sampled_at) / 1000000.0;
+    lua_pushnumber(L, elapsed > 0 ? (double)(msgs - consumer->rate_msgs) / elapsed : 0);
+    lua_setfield(L, -2, "msgs_per_sec");
+    lua_pushnumber(L, elapsed > 0 ? (double)(bytes - consumer->rate_bytes) / elapsed : 0);
+    lua_setfield(L, -2, "bytes_per_sec");
+    consumer->rate_sampled_at = now;
+    consumer->rate_msgs = msgs;
+    consumer->rate_bytes = bytes;
+    return 1;
+}
+
+/**
+ * FFI ABI
+ */
+
+int
+tnt_kafka_consumer_poll_into(consumer_t *consumer, msg_t **buf, int n) {
+    int count = 0;
+    while (count < n) {
+        msg_t *msg = consumer_pop_msg(consumer);
+        if (msg == NULL)
+            break;
+        consumer_auto_store_offset(consumer, msg);
+        msg->cache_fields = 0;
+        buf[count++] = msg;
+    }
+    return count;
+}
+
+int
+tnt_kafka_consumer_has_msgs(consumer_t *consumer) {
+    return consumer_has_msgs(consumer);
+}
+
+int
+tnt_kafka_consumer_store_offset(consumer_t *UNUSED(consumer), const msg_t *msg) {
+    return rd_kafka_offset_store(msg->topic, msg->partition, msg->last_offset);
 }
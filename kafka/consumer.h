@@ -5,24 +5,79 @@
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include <stdatomic.h>
+
 #include <librdkafka/rdkafka.h>
 
 #include <common.h>
 #include <queue.h>
 #include <callbacks.h>
 #include <consumer_msg.h>
+#include <partitions.h>
+#include <replay.h>
+#include <runtime.h>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 /**
  * Consumer
  */
 
+/**
+ * Default count of messages fetched by poller thread at once
+ */
+#define CONSUMER_POLL_BATCH_SIZE 64
+
+/**
+ * Default count of threads polling partition queues
+ */
+#define CONSUMER_DEFAULT_POLLER_THREADS 2
+
+/**
+ * Default count of messages pending in consume queue when consumer is paused
+ */
+#define CONSUMER_DEFAULT_HIGH_WATERMARK 50000
+
+/**
+ * Count of batches taken by shared runtime thread at once before serving other queues
+ */
+#define CONSUMER_SERVE_MAX_BATCHES 16
+
+/**
+ * Consume queue limits, poller pauses assigned partitions when any of high watermarks is reached
+ * and resumes them when pending messages drop to both low watermarks. Zero disables limit.
+ */
+typedef struct {
+    long high_msgs;
+    long low_msgs;
+    long high_bytes;
+    long low_bytes;
+} consumer_watermarks_t;
+
 typedef struct {
-    rd_kafka_t      *rd_consumer;
-    pthread_t       thread;
-    pthread_attr_t  attr;
-    int             should_stop;
-    pthread_mutex_t lock;
+    rd_kafka_t         *rd_consumer;
+    rd_kafka_queue_t   *rd_queue;
+    // not NULL when consumer is in zero copy mode
+    msg_tracker_t      *tracker;
+    rd_kafka_message_t **rd_msgs;
+    int                batch_size;
+
+    consumer_watermarks_t watermarks;
+    // messages pushed to consume queue or partition queues and not taken by TX thread yet
+    _Atomic long       pending_msgs;
+    _Atomic long       pending_bytes;
+    // consumer is paused by poller because of watermarks or by user, owned by event queues
+    pause_state_t      *pause;
+
+    // not NULL when consumer queue is served by shared runtime instead of own thread
+    runtime_handle_t   *handle;
+    // batch which does not fit into full consume queue, it is released by close after poller is stopped
+    msg_batch_t        *backlog;
+    int                errors_count;
+
+    pthread_t          thread;
+    pthread_attr_t     attr;
+    int                should_stop;
+    pthread_mutex_t    lock;
 } consumer_poller_t;
 
 typedef struct {
@@ -30,8 +85,61 @@ typedef struct {
     rd_kafka_topic_partition_list_t *topics;
     event_queues_t                  *event_queues;
     consumer_poller_t               *poller;
+    msg_tracker_t                   *tracker;
+    // batch which is partially taken by TX thread
+    msg_batch_t                     *pending;
+    // not NULL when every assigned partition has own queue
+    partition_pool_t                *partitions;
+    // message accessors materialize Lua values once
+    int                             cache_msg_fields;
+    // results of async commits, NULL when there is no commit callback
+    rd_kafka_queue_t                *commit_queue;
+    int                             commit_callback_ref;
+    // reply queue of commit_sync, results are told apart by sequence number passed as opaque,
+    // concurrent calls use temporary queues while it is busy
+    rd_kafka_queue_t                *commit_sync_queue;
+    int                             commit_sync_busy;
+    uintptr_t                       commit_sync_seq;
+    // poll threads are already stopped by close
+    int                             closed;
+    // enable.auto.offset.store, offsets are stored when messages are handed to application
+    // instead of librdkafka poll, so messages released on close are not stored
+    int                             auto_offset_store;
+    // only one fiber waits for notification of poll threads, the rest ones are parked on condition
+    struct fiber_cond               *msgs_cond;
+    int                             notifier_owned;
+    int                             waiters;
+    // delivered messages kept for local seeks, NULL when replay buffer is disabled
+    replay_buffer_t                 *replay;
+    // counters at previous lag call, rates are computed between calls
+    int64_t                         rate_sampled_at;
+    uint64_t                        rate_msgs;
+    uint64_t                        rate_bytes;
 } consumer_t;
 
+/**
+ * Takes next message to redeliver after local seek, then from pending batch, from consume queue
+ * or from partition queues, must be called from TX thread only
+ */
+msg_t *
+consumer_pop_msg(consumer_t *consumer);
+
+int
+consumer_has_msgs(consumer_t *consumer);
+
+/**
+ * Yields current fiber until consume or any of partition queues is not empty, but no longer than timeout.
+ * Many fibers may wait at once.
+ */
+void
+consumer_wait_msgs(consumer_t *consumer, double timeout);
+
+/**
+ * Store offsets, returns the first error of call or of any partition
+ */
+rd_kafka_resp_err_t
+consumer_store_offsets(consumer_t *consumer, rd_kafka_topic_partition_list_t *offsets);
+
 int
 lua_consumer_subscribe(struct lua_State *L);
 
@@ -41,9 +149,27 @@ lua_consumer_unsubscribe(struct lua_State *L);
 int
 lua_consumer_tostring(struct lua_State *L);
 
+/**
+ * Raw consumer pointer for FFI ABI
+ */
+int
+lua_consumer_raw(struct lua_State *L);
+
 int
 lua_consumer_poll_msg(struct lua_State *L);
 
+int
+lua_consumer_poll_batch(struct lua_State *L);
+
+/**
+ * Take one message waiting for it up to timeout
+ */
+int
+lua_consumer_poll(struct lua_State *L);
+
+int
+lua_consumer_wait_msg(struct lua_State *L);
+
 int
 lua_consumer_poll_logs(struct lua_State *L);
 
@@ -56,9 +182,36 @@ lua_consumer_poll_errors(struct lua_State *L);
 int
 lua_consumer_poll_rebalances(struct lua_State *L);
 
+/**
+ * Yield until rebalance is passed by librdkafka thread, but no longer than timeout
+ */
+int
+lua_consumer_wait_rebalance(struct lua_State *L);
+
 int
 lua_consumer_store_offset(struct lua_State *L);
 
+/**
+ * Store offsets of batch of messages by one call, only max offset of every partition is stored
+ */
+int
+lua_consumer_store_offsets(struct lua_State *L);
+
+/**
+ * Start commit of stored offsets, result is passed to commit callback if it is set
+ */
+int
+lua_consumer_commit_async(struct lua_State *L);
+
+/**
+ * Commit stored offsets and wait for result without blocking TX thread
+ */
+int
+lua_consumer_commit_sync(struct lua_State *L);
+
+int
+lua_consumer_poll_commits(struct lua_State *L);
+
 int
 lua_consumer_seek_partitions(struct lua_State *L);
 
@@ -86,4 +239,16 @@ lua_consumer_pause(struct lua_State *L);
 int
 lua_consumer_resume(struct lua_State *L);
 
+/**
+ * Counters and histograms of consumer, returns table which is flat except of histograms
+ */
+int
+lua_consumer_metrics(struct lua_State *L);
+
+/**
+ * Lag of assigned partitions and poll rates since previous call, uses local librdkafka state only
+ */
+int
+lua_consumer_lag(struct lua_State *L);
+
 #endif //TNT_KAFKA_CONSUMER_H
@@ -2,10 +2,12 @@
 #include <string.h>
 
 #include <tarantool/module.h>
+#include <msgpuck.h>
 
 #include <common.h>
 
 #include <consumer_msg.h>
+#include <abi.h>
 
 static const char null_literal[] = "NULL";
 
@@ -22,10 +24,119 @@ lua_check_consumer_msg(struct lua_State *L, int index) {
     return *msg_p;
 }
 
+static inline void
+offsets_add_msg(rd_kafka_topic_partition_list_t *list, const msg_t *msg) {
+    // batches usually contain few partitions, so linear search is cheaper than hashing
+    const char *topic = rd_kafka_topic_name(msg->topic);
+    rd_kafka_topic_partition_t *tp = rd_kafka_topic_partition_list_find(list, topic, msg->partition);
+    if (tp == NULL)
+        tp = rd_kafka_topic_partition_list_add(list, topic, msg->partition);
+    // committed offset is the offset of next message
+    if (tp->offset < msg->last_offset + 1)
+        tp->offset = msg->last_offset + 1;
+}
+
+rd_kafka_topic_partition_list_t *
+consumer_msgs_offsets(msg_t **msgs, int count) {
+    rd_kafka_topic_partition_list_t *list = rd_kafka_topic_partition_list_new(count);
+    if (list == NULL)
+        return NULL;
+    for (int i = 0; i < count; i++)
+        offsets_add_msg(list, msgs[i]);
+    return list;
+}
+
+rd_kafka_topic_partition_list_t *
+lua_consumer_msgs_offsets(struct lua_State *L, int index) {
+    int count = lua_objlen(L, index);
+    // messages are checked before allocation, so failed check does not leak list
+    for (int i = 1; i <= count; i++) {
+        lua_rawgeti(L, index, i);
+        lua_check_consumer_msg(L, -1);
+        lua_pop(L, 1);
+    }
+
+    rd_kafka_topic_partition_list_t *list = rd_kafka_topic_partition_list_new(count);
+    if (list == NULL)
+        return NULL;
+
+    for (int i = 1; i <= count; i++) {
+        lua_rawgeti(L, index, i);
+        offsets_add_msg(list, *(msg_t **)lua_touserdata(L, -1));
+        lua_pop(L, 1);
+    }
+    return list;
+}
+
+/**
+ * Keys of cached values in environment table of message userdata
+ */
+enum {
+    MSG_FIELD_TOPIC = 1,
+    MSG_FIELD_KEY,
+    MSG_FIELD_VALUE,
+    MSG_FIELD_HEADERS,
+    MSG_FIELDS_COUNT = MSG_FIELD_HEADERS,
+};
+
+void
+lua_push_consumer_msg(struct lua_State *L, msg_t *msg, int cache_fields) {
+    msg->cache_fields = cache_fields;
+
+    msg_t **msg_p = (msg_t **)lua_newuserdata(L, sizeof(msg_t *));
+    *msg_p = msg;
+
+    luaL_getmetatable(L, consumer_msg_label);
+    lua_setmetatable(L, -2);
+}
+
+/**
+ * Push cached value of message userdata on the first index
+ * @return 0 if value is not cached, nil values are never cached
+ */
+static int
+lua_consumer_msg_get_cached(struct lua_State *L, const msg_t *msg, int field) {
+    if (!msg->has_cache)
+        return 0;
+
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, field);
+    lua_remove(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Cache value on top of the stack, environment table is created on first use
+ */
+static void
+lua_consumer_msg_set_cached(struct lua_State *L, msg_t *msg, int field) {
+    if (!msg->cache_fields)
+        return;
+
+    if (!msg->has_cache) {
+        lua_createtable(L, MSG_FIELDS_COUNT, 0);
+        lua_setfenv(L, 1);
+        msg->has_cache = 1;
+    }
+
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, field);
+    lua_pop(L, 1);
+}
+
 int
 lua_consumer_msg_topic(struct lua_State *L) {
-    const msg_t *msg = lua_check_consumer_msg(L, 1);
+    msg_t *msg = lua_check_consumer_msg(L, 1);
+    if (lua_consumer_msg_get_cached(L, msg, MSG_FIELD_TOPIC))
+        return 1;
+
     lua_pushstring(L, rd_kafka_topic_name(msg->topic));
+    lua_consumer_msg_set_cached(L, msg, MSG_FIELD_TOPIC);
     return 1;
 }
 
@@ -49,29 +160,168 @@ int
 lua_consumer_msg_key(struct lua_State *L) {
     msg_t *msg = lua_check_consumer_msg(L, 1);
 
-    if (msg->key_len <= 0 || msg->key == NULL)
+    if (msg->key_len <= 0 || msg->key == NULL) {
         lua_pushnil(L);
-    else
-        lua_pushlstring(L, msg->key, msg->key_len);
+        return 1;
+    }
+    if (lua_consumer_msg_get_cached(L, msg, MSG_FIELD_KEY))
+        return 1;
+
+    lua_pushlstring(L, msg->key, msg->key_len);
+    lua_consumer_msg_set_cached(L, msg, MSG_FIELD_KEY);
     return 1;
 }
 
 int
 lua_consumer_msg_value(struct lua_State *L) {
+    msg_t *msg = lua_check_consumer_msg(L, 1);
+
+    if (msg->value_len <= 0 || msg->value == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (lua_consumer_msg_get_cached(L, msg, MSG_FIELD_VALUE))
+        return 1;
+
+    lua_pushlstring(L, msg->value, msg->value_len);
+    lua_consumer_msg_set_cached(L, msg, MSG_FIELD_VALUE);
+    return 1;
+}
+
+int
+lua_consumer_msg_value_ptr(struct lua_State *L) {
     const msg_t *msg = lua_check_consumer_msg(L, 1);
 
-    if (msg->value_len <= 0 || msg->value == NULL)
+    // ctype is resolved once, TX thread only
+    static uint32_t const_char_ptr_ctypeid = 0;
+    if (const_char_ptr_ctypeid == 0)
+        const_char_ptr_ctypeid = luaL_ctypeid(L, "const char *");
+
+    if (msg->value_len <= 0 || msg->value == NULL) {
         lua_pushnil(L);
+        lua_pushinteger(L, 0);
+        return 2;
+    }
+
+    *(const char **)luaL_pushcdata(L, const_char_ptr_ctypeid) = msg->value;
+    lua_pushinteger(L, (lua_Integer)msg->value_len);
+    return 2;
+}
+
+int
+consumer_msg_decode(msg_t *msg, const codec_t *codec, char *errstr, size_t errstr_size) {
+    // tombstones and empty values have nothing to decode
+    if (msg->value == NULL || msg->value_len == 0)
+        return 0;
+
+    codec_buf_t buf = {NULL, 0, 0};
+    int rc = codec->decode(msg->value, msg->value_len, &buf, errstr, errstr_size);
+    if (rc == CODEC_ERROR) {
+        free(buf.data);
+        msg->decode_state = MSG_DECODE_FAILED;
+        return -1;
+    }
+    if (rc == CODEC_SAME) {
+        free(buf.data);
+        msg->decode_state = MSG_DECODE_VALUE;
+        return 0;
+    }
+    msg->decoded = buf.data;
+    msg->decoded_len = buf.size;
+    msg->decode_state = MSG_DECODE_OWNED;
+    return 0;
+}
+
+const char *
+consumer_msg_msgpack(const msg_t *msg, size_t *len) {
+    switch (msg->decode_state) {
+        case MSG_DECODE_OWNED:
+            *len = msg->decoded_len;
+            return msg->decoded;
+        case MSG_DECODE_VALUE:
+            // value pointer is changed by release of zero copy message, so it is taken every time
+            *len = msg->value_len;
+            return msg->value;
+        default:
+            *len = 0;
+            return NULL;
+    }
+}
+
+static int
+lua_consumer_msg_decode_error(struct lua_State *L, const msg_t *msg) {
+    lua_pushnil(L);
+    if (msg->decode_state == MSG_DECODE_FAILED)
+        lua_pushliteral(L, "failed to decode value of message by consumer codec");
     else
-        lua_pushlstring(L, msg->value, msg->value_len);
+        lua_pushnil(L);
+    return 2;
+}
+
+int
+lua_consumer_msg_value_object(struct lua_State *L) {
+    const msg_t *msg = lua_check_consumer_msg(L, 1);
+
+    size_t len;
+    const char *data = consumer_msg_msgpack(msg, &len);
+    if (data == NULL)
+        return lua_consumer_msg_decode_error(L, msg);
+
+    // msgpack.object_from_raw and ctype are resolved once, TX thread only
+    static int object_from_raw_ref = LUA_NOREF;
+    static uint32_t const_char_ptr_ctypeid = 0;
+    if (object_from_raw_ref == LUA_NOREF) {
+        lua_getglobal(L, "require");
+        lua_pushliteral(L, "msgpack");
+        lua_call(L, 1, 1);
+        lua_getfield(L, -1, "object_from_raw");
+        if (!lua_isfunction(L, -1))
+            return luaL_error(L, "msgpack.object is not supported by this Tarantool version");
+        object_from_raw_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_pop(L, 1);
+        const_char_ptr_ctypeid = luaL_ctypeid(L, "const char *");
+    }
+
+    // object copies msgpack, so it outlives the message
+    lua_rawgeti(L, LUA_REGISTRYINDEX, object_from_raw_ref);
+    *(const char **)luaL_pushcdata(L, const_char_ptr_ctypeid) = data;
+    lua_pushinteger(L, (lua_Integer)len);
+    lua_call(L, 2, 1);
     return 1;
 }
 
 int
-lua_consumer_msg_headers(struct lua_State *L) {
+lua_consumer_msg_value_tuple(struct lua_State *L) {
     const msg_t *msg = lua_check_consumer_msg(L, 1);
+
+    size_t len;
+    const char *data = consumer_msg_msgpack(msg, &len);
+    if (data == NULL)
+        return lua_consumer_msg_decode_error(L, msg);
+
+    if (mp_typeof(*data) != MP_ARRAY) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "decoded value of message is not array");
+        return 2;
+    }
+
+    box_tuple_t *tuple = box_tuple_new(box_tuple_format_default(), data, data + len);
+    if (tuple == NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, box_error_message(box_error_last()));
+        return 2;
+    }
+    luaT_pushtuple(L, tuple);
+    return 1;
+}
+
+int
+lua_consumer_msg_headers(struct lua_State *L) {
+    msg_t *msg = lua_check_consumer_msg(L, 1);
     if (msg->headers == NULL)
         return 0;
+    if (lua_consumer_msg_get_cached(L, msg, MSG_FIELD_HEADERS))
+        return 1;
 
     lua_newtable(L);
 
@@ -89,6 +339,7 @@ lua_consumer_msg_headers(struct lua_State *L) {
             *(void **)luaL_pushcdata(L, luaL_ctypeid(L, "void *")) = NULL;
         lua_settable(L, -3);
     }
+    lua_consumer_msg_set_cached(L, msg, MSG_FIELD_HEADERS);
     return 1;
 }
 
@@ -139,11 +390,12 @@ lua_consumer_msg_gc(struct lua_State *L) {
 }
 
 msg_t *
-new_consumer_msg(rd_kafka_message_t *rd_message) {
+new_consumer_msg(slab_cache_t *slab, rd_kafka_message_t *rd_message) {
     size_t message_size = sizeof(msg_t) + rd_message->len + rd_message->key_len;
-    msg_t *msg = calloc(message_size, 1);
+    msg_t *msg = slab_alloc(slab, message_size);
     if (msg == NULL)
         return NULL;
+    memset(msg, 0, sizeof(msg_t));
 
     msg->topic = rd_message->rkt;
     msg->partition = rd_message->partition;
@@ -166,17 +418,291 @@ new_consumer_msg(rd_kafka_message_t *rd_message) {
         memcpy(msg->key, rd_message->key, rd_message->key_len);
     msg->key_len = rd_message->key_len;
     msg->offset = rd_message->offset;
+    msg->last_offset = rd_message->offset;
 
     return msg;
 }
 
+msg_t *
+new_zero_copy_consumer_msg(slab_cache_t *slab, msg_tracker_t *tracker, rd_kafka_message_t *rd_message) {
+    msg_t *msg = slab_alloc(slab, sizeof(msg_t));
+    if (msg == NULL) {
+        rd_kafka_message_destroy(rd_message);
+        return NULL;
+    }
+    memset(msg, 0, sizeof(msg_t));
+
+    msg->rd_message = rd_message;
+    msg->topic = rd_message->rkt;
+    msg->partition = rd_message->partition;
+    msg->value = rd_message->payload;
+    msg->value_len = rd_message->len;
+    msg->key = rd_message->key;
+    msg->key_len = rd_message->key_len;
+    msg->offset = rd_message->offset;
+    msg->last_offset = rd_message->offset;
+
+    // headers are owned by librdkafka message
+    rd_kafka_headers_t *hdrsp;
+    if (rd_kafka_message_headers(rd_message, &hdrsp) == RD_KAFKA_RESP_ERR_NO_ERROR)
+        msg->headers = hdrsp;
+
+    pthread_mutex_lock(&tracker->lock);
+
+    if (!tracker->closing) {
+        msg->tracker = tracker;
+        msg->next = tracker->head;
+        if (tracker->head != NULL)
+            tracker->head->prev = msg;
+        tracker->head = msg;
+        tracker->count++;
+    }
+
+    pthread_mutex_unlock(&tracker->lock);
+
+    if (msg->tracker == NULL) {
+        // consumer is closing so message can not outlive librdkafka one
+        msg_t *copy = new_consumer_msg(slab, rd_message);
+        rd_kafka_message_destroy(rd_message);
+        slab_free(msg);
+        return copy;
+    }
+
+    return msg;
+}
+
+msg_t *
+take_consumer_msg(slab_cache_t *slab, msg_tracker_t *tracker, rd_kafka_message_t *rd_message) {
+    if (tracker != NULL) {
+        // message keeps rdkafka one, it is released forcibly on close / destroy consumer
+        return new_zero_copy_consumer_msg(slab, tracker, rd_message);
+    }
+
+    msg_t *msg = new_consumer_msg(slab, rd_message);
+    // free rdkafka message instantly to prevent hang on close / destroy consumer
+    rd_kafka_message_destroy(rd_message);
+    return msg;
+}
+
+/**
+ * Replace pointers into librdkafka message with own copy and destroy it.
+ * Message must be already removed from tracker.
+ */
+static void
+detach_consumer_msg(msg_t *msg) {
+    rd_kafka_message_t *rd_message = msg->rd_message;
+
+    msg->detached = malloc(msg->value_len + msg->key_len + 1);
+    if (msg->detached != NULL) {
+        if (msg->value_len > 0)
+            memcpy(msg->detached, rd_message->payload, msg->value_len);
+        if (msg->key_len > 0)
+            memcpy(msg->detached + msg->value_len, rd_message->key, msg->key_len);
+        msg->value = msg->detached;
+        msg->key = msg->detached + msg->value_len;
+    } else {
+        msg->value = NULL;
+        msg->value_len = 0;
+        msg->key = NULL;
+        msg->key_len = 0;
+    }
+
+    if (msg->headers != NULL)
+        msg->headers = rd_kafka_headers_copy(msg->headers);
+
+    msg->rd_message = NULL;
+    rd_kafka_message_destroy(rd_message);
+}
+
+msg_t *
+copy_consumer_msg(slab_cache_t *slab, const msg_t *msg) {
+    msg_t *copy = slab_alloc(slab, sizeof(msg_t) + msg->value_len + msg->key_len);
+    if (copy == NULL)
+        return NULL;
+    memset(copy, 0, sizeof(msg_t));
+
+    if (msg->decode_state == MSG_DECODE_OWNED) {
+        copy->decoded = malloc(msg->decoded_len);
+        if (copy->decoded == NULL) {
+            slab_free(copy);
+            return NULL;
+        }
+        memcpy(copy->decoded, msg->decoded, msg->decoded_len);
+        copy->decoded_len = msg->decoded_len;
+    }
+    copy->decode_state = msg->decode_state;
+
+    copy->topic = msg->topic;
+    copy->partition = msg->partition;
+    copy->offset = msg->offset;
+    copy->last_offset = msg->last_offset;
+
+    // tombstones and messages without key keep NULL pointers
+    if (msg->value != NULL) {
+        copy->value = (char *)copy + sizeof(msg_t);
+        if (msg->value_len > 0)
+            memcpy(copy->value, msg->value, msg->value_len);
+    }
+    copy->value_len = msg->value_len;
+    if (msg->key != NULL) {
+        copy->key = (char *)copy + sizeof(msg_t) + msg->value_len;
+        if (msg->key_len > 0)
+            memcpy(copy->key, msg->key, msg->key_len);
+    }
+    copy->key_len = msg->key_len;
+
+    if (msg->headers != NULL)
+        copy->headers = rd_kafka_headers_copy(msg->headers);
+
+    return copy;
+}
+
 void
 destroy_consumer_msg(msg_t *msg) {
     if (msg == NULL)
         return;
-    if (msg->headers != NULL)
+
+    if (msg->rd_message != NULL) {
+        msg_tracker_t *tracker = msg->tracker;
+        if (tracker != NULL) {
+            pthread_mutex_lock(&tracker->lock);
+
+            if (msg->prev != NULL)
+                msg->prev->next = msg->next;
+            else
+                tracker->head = msg->next;
+            if (msg->next != NULL)
+                msg->next->prev = msg->prev;
+            tracker->count--;
+
+            pthread_mutex_unlock(&tracker->lock);
+        }
+        // headers are owned by librdkafka message
+        rd_kafka_message_destroy(msg->rd_message);
+    } else if (msg->headers != NULL) {
         rd_kafka_headers_destroy(msg->headers);
-    free(msg);
+    }
+
+    free(msg->detached);
+    free(msg->decoded);
+    slab_free(msg);
 
     return;
 }
+
+/**
+ * Batch of consumer messages
+ */
+
+msg_batch_t *
+new_msg_batch(slab_cache_t *slab, int capacity) {
+    msg_batch_t *batch = slab_alloc(slab, sizeof(msg_batch_t) + capacity * sizeof(msg_t *));
+    if (batch == NULL)
+        return NULL;
+    batch->count = 0;
+    batch->pos = 0;
+    batch->bytes = 0;
+    batch->next = NULL;
+    batch->pushed_at = 0;
+    return batch;
+}
+
+void
+destroy_msg_batch(msg_batch_t *batch) {
+    if (batch == NULL)
+        return;
+    for (int i = batch->pos; i < batch->count; i++)
+        destroy_consumer_msg(batch->msgs[i]);
+    slab_free(batch);
+}
+
+/**
+ * Zero copy messages tracking
+ */
+
+msg_tracker_t *
+new_msg_tracker() {
+    msg_tracker_t *tracker = calloc(1, sizeof(msg_tracker_t));
+    if (tracker == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&tracker->lock, NULL) != 0) {
+        free(tracker);
+        return NULL;
+    }
+
+    return tracker;
+}
+
+int
+release_tracked_msgs(msg_tracker_t *tracker) {
+    pthread_mutex_lock(&tracker->lock);
+
+    tracker->closing = 1;
+    msg_t *msg = tracker->head;
+    tracker->head = NULL;
+    int count = tracker->count;
+    tracker->count = 0;
+
+    pthread_mutex_unlock(&tracker->lock);
+
+    while (msg != NULL) {
+        msg_t *next = msg->next;
+        msg->tracker = NULL;
+        msg->prev = NULL;
+        msg->next = NULL;
+        detach_consumer_msg(msg);
+        msg = next;
+    }
+
+    return count;
+}
+
+void
+destroy_msg_tracker(msg_tracker_t *tracker) {
+    if (tracker == NULL)
+        return;
+    pthread_mutex_destroy(&tracker->lock);
+    free(tracker);
+}
+
+/**
+ * FFI ABI
+ */
+
+const char *
+tnt_kafka_msg_topic(const msg_t *msg) {
+    return rd_kafka_topic_name(msg->topic);
+}
+
+int32_t
+tnt_kafka_msg_partition(const msg_t *msg) {
+    return msg->partition;
+}
+
+int64_t
+tnt_kafka_msg_offset(const msg_t *msg) {
+    return msg->offset;
+}
+
+const char *
+tnt_kafka_msg_key(const msg_t *msg, size_t *len) {
+    *len = msg->key != NULL ? msg->key_len : 0;
+    return *len > 0 ? msg->key : NULL;
+}
+
+const char *
+tnt_kafka_msg_value(const msg_t *msg, size_t *len) {
+    *len = msg->value != NULL ? msg->value_len : 0;
+    return *len > 0 ? msg->value : NULL;
+}
+
+const char *
+tnt_kafka_msg_msgpack(const msg_t *msg, size_t *len) {
+    return consumer_msg_msgpack(msg, len);
+}
+
+void
+tnt_kafka_msg_free(msg_t *msg) {
+    destroy_consumer_msg(msg);
+}
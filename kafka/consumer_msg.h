@@ -5,13 +5,30 @@
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include <pthread.h>
+
 #include <librdkafka/rdkafka.h>
 
+#include <slab.h>
+#include <codec.h>
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 /**
  * Consumer Message
  */
-typedef struct {
+
+struct msg_tracker_t;
+
+enum {
+    MSG_DECODE_NONE = 0,
+    // decoded points to own msgpack
+    MSG_DECODE_OWNED,
+    // value itself is msgpack
+    MSG_DECODE_VALUE,
+    MSG_DECODE_FAILED,
+};
+
+typedef struct msg_t {
     rd_kafka_topic_t *topic;
     rd_kafka_headers_t *headers;
     int32_t           partition;
@@ -20,14 +37,132 @@ typedef struct {
     char              *key;
     size_t            key_len;
     int64_t           offset;
+    // greatest offset covered by message, greater than offset when following messages are filtered out
+    int64_t           last_offset;
+
+    // zero copy message keeps original librdkafka message, value, key and headers point into it
+    rd_kafka_message_t   *rd_message;
+    struct msg_tracker_t *tracker;
+    struct msg_t         *prev;
+    struct msg_t         *next;
+    // copy of value and key made on forced release of zero copy message
+    char                 *detached;
+
+    // msgpack of value made by consumer codec in poller thread
+    char                 *decoded;
+    size_t               decoded_len;
+    int                  decode_state;
+
+    // Lua values are materialized once and kept in environment table of message userdata
+    int                  cache_fields;
+    int                  has_cache;
 } msg_t;
 
+/**
+ * Registry of zero copy messages which still keep librdkafka messages alive.
+ * librdkafka consumer can not be closed while any of its messages exists,
+ * so such messages are released forcibly on close by copying their content.
+ */
+typedef struct msg_tracker_t {
+    pthread_mutex_t lock;
+    msg_t           *head;
+    int             count;
+    // new messages are copied right away after close has started
+    int             closing;
+} msg_tracker_t;
+
+msg_tracker_t *new_msg_tracker();
+
+/**
+ * Copy content of all tracked messages and destroy their librdkafka messages.
+ * Messages stay valid, must be called from TX thread only.
+ * @param tracker
+ * @return count of released messages
+ */
+int release_tracked_msgs(msg_tracker_t *tracker);
+
+void destroy_msg_tracker(msg_tracker_t *tracker);
+
 msg_t *lua_check_consumer_msg(struct lua_State *L, int index);
 
-msg_t *new_consumer_msg(rd_kafka_message_t *rd_message);
+/**
+ * Offsets to commit for messages: greatest offset + 1 of every partition
+ * @param msgs
+ * @param count
+ * @return NULL on allocation failure
+ */
+rd_kafka_topic_partition_list_t *consumer_msgs_offsets(msg_t **msgs, int count);
+
+/**
+ * The same as consumer_msgs_offsets for Lua list of messages
+ * @param L
+ * @param index index of list of messages
+ * @return NULL on allocation failure
+ */
+rd_kafka_topic_partition_list_t *lua_consumer_msgs_offsets(struct lua_State *L, int index);
+
+/**
+ * Push message userdata, accessors cache their results when cache_fields is set
+ * @param L
+ * @param msg
+ * @param cache_fields
+ */
+void lua_push_consumer_msg(struct lua_State *L, msg_t *msg, int cache_fields);
+
+msg_t *new_consumer_msg(slab_cache_t *slab, rd_kafka_message_t *rd_message);
+
+/**
+ * Wrap librdkafka message without copying, message ownership is taken in any case
+ * @param slab
+ * @param tracker
+ * @param rd_message
+ * @return
+ */
+msg_t *new_zero_copy_consumer_msg(slab_cache_t *slab, msg_tracker_t *tracker, rd_kafka_message_t *rd_message);
+
+/**
+ * Wrap polled message for TX thread, zero copy one when tracker is not NULL or copy otherwise.
+ * Message ownership is taken in any case.
+ * @param slab
+ * @param tracker
+ * @param rd_message
+ * @return
+ */
+msg_t *take_consumer_msg(slab_cache_t *slab, msg_tracker_t *tracker, rd_kafka_message_t *rd_message);
+
+/**
+ * Copy message with its headers and decoded value, copy does not refer to librdkafka message
+ * @param slab
+ * @param msg
+ * @return NULL on allocation failure
+ */
+msg_t *copy_consumer_msg(slab_cache_t *slab, const msg_t *msg);
 
 void destroy_consumer_msg(msg_t *msg);
 
+/**
+ * Batch of messages passed from poller thread to TX thread as single queue entry
+ */
+typedef struct {
+    int    count;
+    // position of first message which is not taken by TX thread yet
+    int    pos;
+    // total size of values and keys
+    size_t bytes;
+    // batches waiting for free space in full queue are chained
+    void   *next;
+    // time of push into queue for TX thread, microseconds
+    int64_t pushed_at;
+    msg_t  *msgs[];
+} msg_batch_t;
+
+msg_batch_t *new_msg_batch(slab_cache_t *slab, int capacity);
+
+/**
+ * Destroys batch with all messages which are not taken yet
+ */
+void destroy_msg_batch(msg_batch_t *batch);
+
 int lua_consumer_msg_topic(struct lua_State *L);
 
 int lua_consumer_msg_partition(struct lua_State *L);
@@ -40,6 +175,40 @@ int lua_consumer_msg_key(struct lua_State *L);
 
 int lua_consumer_msg_value(struct lua_State *L);
 
+/**
+ * Pointer to value and its length without interning Lua string.
+ * Pointer is valid while message is alive, pointers of zero copy messages are invalidated by consumer close.
+ */
+int lua_consumer_msg_value_ptr(struct lua_State *L);
+
+/**
+ * Decode value with codec, called from poller threads
+ * @param msg
+ * @param codec
+ * @param errstr
+ * @param errstr_size
+ * @return 0 on success, -1 when value could not be decoded
+ */
+int consumer_msg_decode(msg_t *msg, const codec_t *codec, char *errstr, size_t errstr_size);
+
+/**
+ * Msgpack of value decoded by consumer codec
+ * @param msg
+ * @param len
+ * @return NULL when consumer has no codec, value is empty or failed to decode
+ */
+const char *consumer_msg_msgpack(const msg_t *msg, size_t *len);
+
+/**
+ * Decoded value as msgpack.object
+ */
+int lua_consumer_msg_value_object(struct lua_State *L);
+
+/**
+ * Decoded value as tuple, value must be decoded to array
+ */
+int lua_consumer_msg_value_tuple(struct lua_State *L);
+
 int lua_consumer_msg_tostring(struct lua_State *L);
 
 int lua_consumer_msg_gc(struct lua_State *L);
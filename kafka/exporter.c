@@ -0,0 +1,369 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <librdkafka/rdkafka.h>
+#include <tarantool/module.h>
+#include <msgpuck.h>
+
+#include <common.h>
+#include <abi.h>
+
+#include "exporter.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Space exporter
+ */
+
+// empty key selects whole index
+static const char empty_key[] = { (char)0x90 };
+
+enum {
+    EXPORT_OK,
+    EXPORT_QUEUE_FULL,
+    EXPORT_ERROR,
+};
+
+static int
+exporter_reserve_buf(exporter_t *exporter, size_t size) {
+    if (size <= exporter->buf_size)
+        return 0;
+
+    size_t buf_size = exporter->buf_size > 0 ? exporter->buf_size : 1024;
+    while (buf_size < size)
+        buf_size *= 2;
+    char *buf = realloc(exporter->buf, buf_size);
+    if (buf == NULL)
+        return -1;
+    exporter->buf = buf;
+    exporter->buf_size = buf_size;
+    return 0;
+}
+
+/**
+ * Encode message value into exporter buffer
+ * @return length of value or -1 on allocation failure
+ */
+static ssize_t
+exporter_encode_value(exporter_t *exporter, box_tuple_t *tuple) {
+    if (exporter->fields_count == 0) {
+        size_t size = box_tuple_bsize(tuple);
+        if (exporter_reserve_buf(exporter, size) != 0)
+            return -1;
+        return box_tuple_to_buf(tuple, exporter->buf, exporter->buf_size);
+    }
+
+    // fields are copied as they are, missing ones are encoded as nil
+    const char *fields[EXPORTER_MAX_FIELDS];
+    size_t sizes[EXPORTER_MAX_FIELDS];
+    size_t size = mp_sizeof_array(exporter->fields_count);
+    for (int i = 0; i < exporter->fields_count; i++) {
+        fields[i] = box_tuple_field(tuple, exporter->fields[i] - 1);
+        sizes[i] = 1;
+        if (fields[i] != NULL) {
+            const char *end = fields[i];
+            mp_next(&end);
+            sizes[i] = end - fields[i];
+        }
+        size += sizes[i];
+    }
+
+    if (exporter_reserve_buf(exporter, size) != 0)
+        return -1;
+
+    char *pos = mp_encode_array(exporter->buf, exporter->fields_count);
+    for (int i = 0; i < exporter->fields_count; i++) {
+        if (fields[i] != NULL)
+            memcpy(pos, fields[i], sizes[i]);
+        else
+            *pos = (char)0xc0;
+        pos += sizes[i];
+    }
+    return pos - exporter->buf;
+}
+
+static int
+exporter_produce_tuple(exporter_t *exporter, box_tuple_t *tuple, const char **err) {
+    ssize_t value_len = exporter_encode_value(exporter, tuple);
+    if (value_len < 0) {
+        *err = "failed to allocate message buffer";
+        return EXPORT_ERROR;
+    }
+
+    // string keys are passed without msgpack header, so they are partitioned like keys of other clients
+    const char *key = NULL;
+    uint32_t key_len = 0;
+    if (exporter->key_field > 0) {
+        key = box_tuple_field(tuple, exporter->key_field - 1);
+        if (key != NULL && mp_typeof(*key) == MP_STR) {
+            key = mp_decode_str(&key, &key_len);
+        } else if (key != NULL) {
+            const char *end = key;
+            mp_next(&end);
+            key_len = end - key;
+        }
+    }
+
+    if (rd_kafka_produce(exporter->topic, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY,
+                         exporter->buf, value_len, key, key_len, NULL) == -1) {
+        rd_kafka_resp_err_t rd_err = rd_kafka_last_error();
+        if (rd_err == RD_KAFKA_RESP_ERR__QUEUE_FULL)
+            return EXPORT_QUEUE_FULL;
+        *err = rd_kafka_err2str(rd_err);
+        return EXPORT_ERROR;
+    }
+    return EXPORT_OK;
+}
+
+static int
+exporter_set_checkpoint(exporter_t *exporter, box_tuple_t *tuple, const char **err) {
+    uint32_t key_len = 0;
+    const char *key = box_tuple_extract_key(tuple, exporter->space_id, exporter->index_id, &key_len);
+    if (key == NULL) {
+        *err = box_error_message(box_error_last());
+        return -1;
+    }
+
+    char *checkpoint = realloc(exporter->checkpoint, key_len);
+    if (checkpoint == NULL) {
+        *err = "failed to allocate checkpoint";
+        return -1;
+    }
+    memcpy(checkpoint, key, key_len);
+    exporter->checkpoint = checkpoint;
+    exporter->checkpoint_len = key_len;
+    return 0;
+}
+
+/**
+ * Export next chunk of tuples
+ * @return EXPORT_OK when chunk is exported, EXPORT_QUEUE_FULL when chunk is interrupted by full queue
+ *         or EXPORT_ERROR
+ */
+static int
+exporter_export_chunk(exporter_t *exporter, long *count, int *done, const char **err) {
+    const char *key = exporter->key;
+    size_t key_len = exporter->key_len;
+    int type = exporter->iterator;
+    // iterator continues right after the last exported tuple
+    if (exporter->checkpoint != NULL) {
+        key = exporter->checkpoint;
+        key_len = exporter->checkpoint_len;
+        type = (type == ITER_LE || type == ITER_LT) ? ITER_LT : ITER_GT;
+    }
+
+    size_t region_used = box_region_used();
+    box_iterator_t *iterator = box_index_iterator(exporter->space_id, exporter->index_id, type, key, key + key_len);
+    if (iterator == NULL) {
+        *err = box_error_message(box_error_last());
+        return EXPORT_ERROR;
+    }
+
+    int rc = EXPORT_OK;
+    box_tuple_t *last = NULL;
+    long chunk = 0;
+    while (chunk < exporter->chunk_size && (exporter->limit == 0 || *count < exporter->limit)) {
+        box_tuple_t *tuple = NULL;
+        if (box_iterator_next(iterator, &tuple) != 0) {
+            *err = box_error_message(box_error_last());
+            rc = EXPORT_ERROR;
+            break;
+        }
+        if (tuple == NULL) {
+            *done = 1;
+            break;
+        }
+
+        rc = exporter_produce_tuple(exporter, tuple, err);
+        if (rc != EXPORT_OK)
+            break;
+        last = tuple;
+        chunk++;
+        (*count)++;
+    }
+
+    // tuple is referenced by iterator, so key is extracted before iterator is freed
+    if (last != NULL && exporter_set_checkpoint(exporter, last, err) != 0)
+        rc = EXPORT_ERROR;
+    box_iterator_free(iterator);
+    box_region_truncate(region_used);
+
+    if (exporter->limit != 0 && *count >= exporter->limit)
+        *done = 1;
+    return rc;
+}
+
+/**
+ * Checkpoint of non unique index does not tell apart tuples with the same key,
+ * so tuples sharing key of the last exported one would be skipped on resume
+ * @return 1 when index exists and is unique
+ */
+static int
+lua_exporter_index_is_unique(struct lua_State *L, uint32_t space_id, uint32_t index_id) {
+    const char *path[] = {"space", NULL, "index", NULL, "unique"};
+    lua_getglobal(L, "box");
+    int depth = 1;
+    for (int i = 0; i < 5 && lua_istable(L, -1); i++) {
+        if (path[i] != NULL)
+            lua_pushstring(L, path[i]);
+        else
+            lua_pushinteger(L, i == 1 ? space_id : index_id);
+        lua_gettable(L, -2);
+        depth++;
+    }
+    int unique = depth == 6 && lua_toboolean(L, -1);
+    lua_pop(L, depth);
+    return unique;
+}
+
+static const char *
+lua_read_exporter(struct lua_State *L, int index, producer_t *producer, exporter_t *exporter) {
+    memset(exporter, 0, sizeof(exporter_t));
+    exporter->key = empty_key;
+    exporter->key_len = sizeof(empty_key);
+    exporter->iterator = ITER_GE;
+    exporter->chunk_size = EXPORTER_DEFAULT_CHUNK_SIZE;
+
+    lua_getfield(L, index, "space_id");
+    if (!lua_isnumber(L, -1)) {
+        lua_pop(L, 1);
+        return "export option 'space_id' must be number";
+    }
+    exporter->space_id = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "index_id");
+    exporter->index_id = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    if (!lua_exporter_index_is_unique(L, exporter->space_id, exporter->index_id))
+        return "export index must be unique, otherwise tuples with the same key are skipped on resume";
+
+    lua_getfield(L, index, "iterator");
+    if (lua_isnumber(L, -1))
+        exporter->iterator = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (exporter->iterator != ITER_ALL && exporter->iterator != ITER_GE && exporter->iterator != ITER_GT &&
+        exporter->iterator != ITER_LE && exporter->iterator != ITER_LT)
+        return "export option 'iterator' must be one of ALL, GE, GT, LE, LT";
+
+    // key string is popped, but it is anchored by options table while export is in progress,
+    // so only strings are taken, converted numbers would not be anchored
+    size_t len = 0;
+    lua_getfield(L, index, "key");
+    const char *key = lua_type(L, -1) == LUA_TSTRING ? lua_tolstring(L, -1, &len) : NULL;
+    if (key != NULL) {
+        exporter->key = key;
+        exporter->key_len = len;
+    }
+    lua_pop(L, 1);
+
+    // checkpoint is copied, so it does not need to be anchored
+    lua_getfield(L, index, "after");
+    const char *after = lua_tolstring(L, -1, &len);
+    if (after != NULL) {
+        exporter->checkpoint = malloc(len);
+        if (exporter->checkpoint == NULL) {
+            lua_pop(L, 1);
+            return "failed to allocate checkpoint";
+        }
+        memcpy(exporter->checkpoint, after, len);
+        exporter->checkpoint_len = len;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "topic");
+    const char *topic = lua_tostring(L, -1);
+    if (topic == NULL) {
+        lua_pop(L, 1);
+        return "export option 'topic' must be string";
+    }
+    exporter->topic = tnt_kafka_producer_topic(producer, topic);
+    lua_pop(L, 1);
+    if (exporter->topic == NULL)
+        return "failed to create topic";
+
+    lua_getfield(L, index, "key_field");
+    exporter->key_field = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "fields");
+    if (lua_istable(L, -1)) {
+        int count = lua_objlen(L, -1);
+        if (count > EXPORTER_MAX_FIELDS) {
+            lua_pop(L, 1);
+            return "export option 'fields' contains too many fields";
+        }
+        for (int i = 1; i <= count; i++) {
+            lua_rawgeti(L, -1, i);
+            lua_Integer fieldno = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            if (fieldno <= 0) {
+                lua_pop(L, 1);
+                return "export option 'fields' must contain positive field numbers";
+            }
+            exporter->fields[exporter->fields_count++] = fieldno;
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "limit");
+    exporter->limit = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "chunk_size");
+    if (lua_isnumber(L, -1))
+        exporter->chunk_size = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (exporter->chunk_size <= 0 || exporter->limit < 0)
+        return "export options 'chunk_size' and 'limit' must be positive numbers";
+
+    return NULL;
+}
+
+int
+lua_producer_export_space(struct lua_State *L) {
+    if (lua_gettop(L) != 2 || !lua_istable(L, 2))
+        luaL_error(L, "Usage: count, checkpoint, err = producer:export_space(options)");
+
+    producer_t **producer_p = (producer_t **)luaL_checkudata(L, 1, producer_label);
+    if (producer_p == NULL || *producer_p == NULL || (*producer_p)->rd_producer == NULL) {
+        lua_pushinteger(L, 0);
+        lua_pushnil(L);
+        lua_pushliteral(L, "Broken producer");
+        return 3;
+    }
+
+    exporter_t exporter;
+    const char *err = lua_read_exporter(L, 2, *producer_p, &exporter);
+
+    long count = 0;
+    int done = 0;
+    while (err == NULL && !done) {
+        int rc = exporter_export_chunk(&exporter, &count, &done, &err);
+        if (rc == EXPORT_ERROR || done)
+            break;
+
+        // iterator is already freed, so data may be changed by other fibers while sleeping
+        fiber_sleep(rc == EXPORT_QUEUE_FULL ? 0.01 : 0);
+
+        // producer is kept by userdata on stack, but may be destroyed by another fiber
+        if (*producer_p == NULL || (*producer_p)->rd_producer == NULL)
+            err = "producer is closed";
+    }
+
+    lua_pushinteger(L, count);
+    if (exporter.checkpoint != NULL)
+        lua_pushlstring(L, exporter.checkpoint, exporter.checkpoint_len);
+    else
+        lua_pushnil(L);
+    if (err != NULL)
+        lua_pushstring(L, err);
+    else
+        lua_pushnil(L);
+
+    free(exporter.checkpoint);
+    free(exporter.buf);
+    return 3;
+}
@@ -0,0 +1,65 @@
+#ifndef TNT_KAFKA_EXPORTER_H
+#define TNT_KAFKA_EXPORTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <librdkafka/rdkafka.h>
+
+#include <producer.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Export of space tuples into Kafka.
+ * Tuples are walked by index iterator and their msgpack is passed to librdkafka right away,
+ * so neither tuples nor messages are materialized in Lua.
+ */
+
+/**
+ * Tuples read by one iterator, iterator is recreated from checkpoint after every chunk and yield
+ */
+#define EXPORTER_DEFAULT_CHUNK_SIZE 1000
+
+/**
+ * Max count of projected fields
+ */
+#define EXPORTER_MAX_FIELDS 64
+
+typedef struct {
+    uint32_t         space_id;
+    uint32_t         index_id;
+    int              iterator;
+    // msgpack arrays, start key is used until the first checkpoint
+    const char       *key;
+    size_t           key_len;
+    char             *checkpoint;
+    size_t           checkpoint_len;
+
+    rd_kafka_topic_t *topic;
+    // 1-based number of field used as message key, 0 for messages without key
+    uint32_t         key_field;
+    // 1-based numbers of fields of message value, whole tuple when there are no fields
+    uint32_t         fields[EXPORTER_MAX_FIELDS];
+    int              fields_count;
+
+    // 0 for all tuples of range
+    long             limit;
+    long             chunk_size;
+
+    // message value of projected fields
+    char             *buf;
+    size_t           buf_size;
+} exporter_t;
+
+/**
+ * Export range of space by table of options, returns count of exported tuples, checkpoint key and error.
+ * Yields, so producer may be closed while export is in progress.
+ */
+int
+lua_producer_export_space(struct lua_State *L);
+
+#endif // TNT_KAFKA_EXPORTER_H
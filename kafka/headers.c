@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <common.h>
+
+#include <headers.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Consumer filter of messages by header value
+ */
+
+static const char *
+lua_read_header_filter_values(struct lua_State *L, header_filter_t *filter) {
+    int count = lua_objlen(L, -1);
+    filter->values = calloc(count > 0 ? count : 1, sizeof(char *));
+    filter->values_len = calloc(count > 0 ? count : 1, sizeof(size_t));
+    if (filter->values == NULL || filter->values_len == NULL)
+        return "failed to allocate header filter";
+
+    for (int i = 1; i <= count; i++) {
+        lua_rawgeti(L, -1, i);
+        size_t len = 0;
+        const char *value = lua_isstring(L, -1) ? lua_tolstring(L, -1, &len) : NULL;
+        if (value == NULL) {
+            lua_pop(L, 1);
+            return "config 'header_filter.values' must be list of strings";
+        }
+
+        char *copy = malloc(len > 0 ? len : 1);
+        if (copy == NULL) {
+            lua_pop(L, 1);
+            return "failed to allocate header filter";
+        }
+        memcpy(copy, value, len);
+        filter->values[filter->values_count] = copy;
+        filter->values_len[filter->values_count] = len;
+        filter->values_count++;
+        lua_pop(L, 1);
+    }
+    return NULL;
+}
+
+static const char *
+lua_read_header_filter_fields(struct lua_State *L, header_filter_t *filter) {
+    lua_pushstring(L, "name");
+    lua_gettable(L, -2);
+    const char *name = lua_isstring(L, -1) ? lua_tostring(L, -1) : NULL;
+    if (name == NULL) {
+        lua_pop(L, 1);
+        return "config 'header_filter' must have string 'name'";
+    }
+    filter->name = strdup(name);
+    lua_pop(L, 1);
+    if (filter->name == NULL)
+        return "failed to allocate header filter";
+
+    lua_pushstring(L, "values");
+    lua_gettable(L, -2);
+    lua_pushstring(L, "prefix");
+    lua_gettable(L, -3);
+    // stack now contains: -1 => prefix; -2 => values; -3 => filter table
+    int has_values = !lua_isnil(L, -2);
+    int has_prefix = !lua_isnil(L, -1);
+    if (has_values == has_prefix) {
+        lua_pop(L, 2);
+        return "config 'header_filter' must have either 'values' or 'prefix'";
+    }
+
+    const char *err = NULL;
+    if (has_prefix) {
+        size_t len = 0;
+        const char *prefix = lua_isstring(L, -1) ? lua_tolstring(L, -1, &len) : NULL;
+        if (prefix == NULL) {
+            err = "config 'header_filter.prefix' must be string";
+        } else if ((filter->prefix = malloc(len > 0 ? len : 1)) == NULL) {
+            err = "failed to allocate header filter";
+        } else {
+            memcpy(filter->prefix, prefix, len);
+            filter->prefix_len = len;
+        }
+        lua_pop(L, 2);
+    } else {
+        lua_pop(L, 1);
+        if (!lua_istable(L, -1))
+            err = "config 'header_filter.values' must be list of strings";
+        else
+            err = lua_read_header_filter_values(L, filter);
+        lua_pop(L, 1);
+    }
+    if (err != NULL)
+        return err;
+
+    lua_pushstring(L, "pass_missing");
+    lua_gettable(L, -2);
+    filter->pass_missing = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return NULL;
+}
+
+const char *
+lua_read_header_filter(struct lua_State *L, header_filter_t **filter) {
+    *filter = NULL;
+
+    lua_pushstring(L, "header_filter");
+    lua_gettable(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return "config 'header_filter' must be table";
+    }
+
+    header_filter_t *new_filter = calloc(1, sizeof(header_filter_t));
+    if (new_filter == NULL) {
+        lua_pop(L, 1);
+        return "failed to allocate header filter";
+    }
+
+    const char *err = lua_read_header_filter_fields(L, new_filter);
+    lua_pop(L, 1);
+    if (err != NULL) {
+        destroy_header_filter(new_filter);
+        return err;
+    }
+
+    *filter = new_filter;
+    return NULL;
+}
+
+void
+destroy_header_filter(header_filter_t *filter) {
+    if (filter == NULL)
+        return;
+    free(filter->name);
+    for (int i = 0; i < filter->values_count; i++)
+        free(filter->values[i]);
+    free(filter->values);
+    free(filter->values_len);
+    free(filter->prefix);
+    free(filter);
+}
+
+static int
+header_filter_match(const header_filter_t *filter, rd_kafka_message_t *rd_msg) {
+    rd_kafka_headers_t *hdrs;
+    if (rd_kafka_message_headers(rd_msg, &hdrs) != RD_KAFKA_RESP_ERR_NO_ERROR)
+        return filter->pass_missing;
+
+    const void *value = NULL;
+    size_t size = 0;
+    if (rd_kafka_header_get_last(hdrs, filter->name, &value, &size) != RD_KAFKA_RESP_ERR_NO_ERROR)
+        return filter->pass_missing;
+    // null header is matched as empty one
+    if (value == NULL)
+        size = 0;
+
+    if (filter->prefix != NULL)
+        return size >= filter->prefix_len && (filter->prefix_len == 0 || memcmp(value, filter->prefix, filter->prefix_len) == 0);
+
+    for (int i = 0; i < filter->values_count; i++) {
+        if (filter->values_len[i] == size && (size == 0 || memcmp(value, filter->values[i], size) == 0))
+            return 1;
+    }
+    return 0;
+}
+
+int
+header_filter_skip(const header_filter_t *filter, msg_batch_t *batch, rd_kafka_message_t *rd_msg) {
+    if (header_filter_match(filter, rd_msg))
+        return 0;
+
+    // messages of batch are not visible to TX thread yet, so the previous one may be changed
+    if (batch != NULL) {
+        for (int i = batch->count - 1; i >= 0; i--) {
+            msg_t *msg = batch->msgs[i];
+            if (msg->partition == rd_msg->partition && msg->topic == rd_msg->rkt) {
+                msg->last_offset = rd_msg->offset;
+                return 1;
+            }
+        }
+    }
+
+    // otherwise offset is carried forward to the next passed message of partition, poller must not store it,
+    // since messages of previous batches may be not stored by application yet
+    return 1;
+}
+
+/**
+ * Headers templates
+ */
+
+int
+lua_copy_headers_template(struct lua_State *L, int index, rd_kafka_headers_t **hdrs) {
+    if (!lua_isuserdata(L, index) || !lua_getmetatable(L, index))
+        return -1;
+    luaL_getmetatable(L, headers_label);
+    int is_template = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if (!is_template)
+        return -1;
+
+    rd_kafka_headers_t *template = *(rd_kafka_headers_t **)lua_touserdata(L, index);
+    *hdrs = template != NULL ? rd_kafka_headers_copy(template) : NULL;
+    return 0;
+}
+
+int
+lua_create_headers_template(struct lua_State *L) {
+    if (lua_gettop(L) != 1 || !lua_istable(L, 1))
+        luaL_error(L, "Usage: headers, err = create_headers({key = value})");
+
+    rd_kafka_headers_t *hdrs = rd_kafka_headers_new(8);
+    if (hdrs == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "failed to allocate kafka headers");
+        return 2;
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        // converting of number key in place would break lua_next
+        if (!lua_isstring(L, -1) || lua_type(L, -2) != LUA_TSTRING) {
+            rd_kafka_headers_destroy(hdrs);
+            lua_pushnil(L);
+            lua_pushliteral(L, "headers must contain only string keys and string values");
+            return 2;
+        }
+
+        size_t hdr_value_len = 0;
+        const char *hdr_value = lua_tolstring(L, -1, &hdr_value_len);
+        size_t hdr_key_len = 0;
+        const char *hdr_key = lua_tolstring(L, -2, &hdr_key_len);
+        if (rd_kafka_header_add(hdrs, hdr_key, hdr_key_len, hdr_value, hdr_value_len) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            rd_kafka_headers_destroy(hdrs);
+            lua_pushnil(L);
+            lua_pushliteral(L, "failed to add kafka headers");
+            return 2;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    rd_kafka_headers_t **hdrs_p = (rd_kafka_headers_t **)lua_newuserdata(L, sizeof(hdrs));
+    *hdrs_p = hdrs;
+
+    luaL_getmetatable(L, headers_label);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+int
+lua_headers_template_gc(struct lua_State *L) {
+    rd_kafka_headers_t **hdrs_p = (rd_kafka_headers_t **)luaL_checkudata(L, 1, headers_label);
+    if (hdrs_p != NULL && *hdrs_p != NULL) {
+        rd_kafka_headers_destroy(*hdrs_p);
+        *hdrs_p = NULL;
+    }
+    return 0;
+}
+
+int
+lua_headers_template_tostring(struct lua_State *L) {
+    rd_kafka_headers_t **hdrs_p = (rd_kafka_headers_t **)luaL_checkudata(L, 1, headers_label);
+    lua_pushfstring(L, "Kafka Headers: %d", *hdrs_p != NULL ? (int)rd_kafka_header_cnt(*hdrs_p) : 0);
+    return 1;
+}
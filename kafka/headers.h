@@ -0,0 +1,79 @@
+#ifndef TNT_KAFKA_HEADERS_H
+#define TNT_KAFKA_HEADERS_H
+
+#include <stddef.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <librdkafka/rdkafka.h>
+
+#include <consumer_msg.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Consumer filter of messages by header value, applied by poller threads before messages are copied
+ */
+
+typedef struct {
+    char   *name;
+    // allowed values, header must be equal to one of them
+    char   **values;
+    size_t *values_len;
+    int    values_count;
+    // allowed prefix of value, NULL when values are used
+    char   *prefix;
+    size_t prefix_len;
+    // messages without header are passed instead of skipped
+    int    pass_missing;
+} header_filter_t;
+
+/**
+ * Read 'header_filter' of config table on top of the stack
+ * @param L
+ * @param filter NULL when option is not set
+ * @return error message or NULL
+ */
+const char *
+lua_read_header_filter(struct lua_State *L, header_filter_t **filter);
+
+void
+destroy_header_filter(header_filter_t *filter);
+
+/**
+ * Check message and take its offset into account when it is skipped:
+ * offset of skipped message is stored together with the previous message of its partition in batch,
+ * otherwise it is covered by offset of the next passed message of partition
+ * @param filter
+ * @param batch batch which is being filled, may be NULL
+ * @param rd_msg
+ * @return 1 if message must be skipped
+ */
+int
+header_filter_skip(const header_filter_t *filter, msg_batch_t *batch, rd_kafka_message_t *rd_msg);
+
+/**
+ * Prebuilt headers of produced messages, copied by C code without touching Lua tables
+ */
+
+/**
+ * Take copy of template if value at index is headers template userdata
+ * @param L
+ * @param index
+ * @param hdrs copy of template
+ * @return 0 if value is template
+ */
+int
+lua_copy_headers_template(struct lua_State *L, int index, rd_kafka_headers_t **hdrs);
+
+int
+lua_create_headers_template(struct lua_State *L);
+
+int
+lua_headers_template_gc(struct lua_State *L);
+
+int
+lua_headers_template_tostring(struct lua_State *L);
+
+#endif // TNT_KAFKA_HEADERS_H
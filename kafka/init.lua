@@ -1,9 +1,18 @@
 local log = require("log")
 local fiber = require('fiber')
+local msgpack = require('msgpack')
 local tnt_kafka = require("kafka.tntkafka")
 
 local DEFAULT_TIMEOUT_MS = 2000
 
+local function get_timeout_from_options(options, default_timeout_ms)
+    local timeout_ms = default_timeout_ms or DEFAULT_TIMEOUT_MS
+    if type(options) == 'table' and options.timeout_ms ~= nil then
+        timeout_ms = options.timeout_ms
+    end
+    return timeout_ms
+end
+
 local Consumer = {}
 
 Consumer.__index = Consumer
@@ -22,14 +31,11 @@ function Consumer.create(config)
         config = config,
         _consumer = consumer,
         _output_ch = fiber.channel(10000),
+        -- messages taken by message fiber but not moved to output channel before close
+        _unsent_msgs = {},
     }
     setmetatable(new, Consumer)
 
-    new._poll_msg_fiber = fiber.create(function()
-        new:_poll_msg()
-    end)
-    new._poll_msg_fiber:name('kafka_msg_poller')
-
     if config.log_callback ~= nil then
         new._poll_logs_fiber = fiber.create(function()
             new:_poll_logs()
@@ -58,21 +64,36 @@ function Consumer.create(config)
         new._poll_rebalances_fiber:name('kafka_rebalances_poller')
     end
 
+    if config.offset_commit_callback ~= nil then
+        new._poll_commits_fiber = fiber.create(function()
+            new:_poll_commits()
+        end)
+        new._poll_commits_fiber:name('kafka_commits_poller')
+    end
+
     return new, nil
 end
 
 function Consumer:_poll_msg()
     local msgs
-    while true do
+    while not self._closing do
         msgs = self._consumer:poll_msg(100)
         if #msgs > 0 then
-            for _, msg in ipairs(msgs) do
-                self._output_ch:put(msg)
+            for i, msg in ipairs(msgs) do
+                -- messages which are not moved to full channel are released by close
+                while not self._output_ch:put(msg, 0.1) do
+                    if self._closing then
+                        for j = i, #msgs do
+                            table.insert(self._unsent_msgs, msgs[j])
+                        end
+                        return
+                    end
+                end
             end
             fiber.yield()
         else
-            -- throttling poll
-            fiber.sleep(0.01)
+            -- waiting until poller thread pushes new messages, close is noticed within timeout
+            self._consumer:wait_msg(0.1)
         end
     end
 end
@@ -147,22 +168,116 @@ function Consumer:_poll_rebalances()
         elseif count > 0 then
             fiber.yield()
         else
-            -- throttling poll
-            fiber.sleep(0.5)
+            -- librdkafka thread is blocked until callback is invoked, so fiber is woken up right away
+            self._consumer:wait_rebalance(1)
         end
     end
 end
 
 jit.off(Consumer._poll_rebalances)
 
-function Consumer:close()
+function Consumer:_poll_commits()
+    local count, err
+    while true do
+        count, err = self._consumer:poll_commits(100)
+        if err ~= nil then
+            log.error("Consumer poll commits error: %s", err)
+            -- throttling poll
+            fiber.sleep(0.1)
+        elseif count > 0 then
+            fiber.yield()
+        else
+            -- throttling poll
+            fiber.sleep(0.1)
+        end
+    end
+end
+
+jit.off(Consumer._poll_commits)
+
+local SINK_MODES = {
+    value = 0,
+    fields = 1,
+}
+
+function Consumer:_sink(space_id, mode, batch_size, error_callback)
+    while true do
+        local _, err = self._consumer:sink_poll(space_id, mode, batch_size, 1)
+        if err ~= nil then
+            -- next batches must not store offsets over failed one
+            log.error("Consumer sink error: %s", err)
+            self._sink_fiber = nil
+            if error_callback ~= nil then
+                error_callback(err)
+            end
+            return
+        end
+    end
+end
+
+jit.off(Consumer._sink)
+
+function Consumer:start_sink(options)
+    if self._consumer == nil then
+        return "consumer is closed"
+    end
+    if self._sink_fiber ~= nil then
+        return "sink is already started"
+    end
+
+    local space = box.space[options.space]
+    if space == nil then
+        return string.format("space '%s' does not exist", options.space)
+    end
+    local mode = SINK_MODES[options.mode or 'value']
+    if mode == nil then
+        return string.format("unknown sink mode '%s'", options.mode)
+    end
+
+    local space_id = space.id
+    local batch_size = options.batch_size or 1000
+    self._sink_fiber = fiber.create(function()
+        self:_sink(space_id, mode, batch_size, options.error_callback)
+    end)
+    self._sink_fiber:name('kafka_sink')
+    return nil
+end
+
+function Consumer:stop_sink()
+    if self._sink_fiber ~= nil then
+        self._sink_fiber:cancel()
+        self._sink_fiber = nil
+    end
+end
+
+function Consumer:close(options)
     if self._consumer == nil then
         return false
     end
 
-    local ok = self._consumer:close()
+    self:stop_sink()
+
+    -- message fiber is stopped without cancel, so messages which it holds are not lost,
+    -- they are released by close together with ones left in channel and their offsets are stored again
+    self._closing = true
+    if self._poll_msg_fiber ~= nil then
+        while self._poll_msg_fiber:status() ~= 'dead' do
+            fiber.sleep(0.01)
+        end
+        self._poll_msg_fiber = nil
+    end
+    local released = {}
+    while self._output_ch:count() > 0 do
+        table.insert(released, self._output_ch:get())
+    end
+    for _, msg in ipairs(self._unsent_msgs) do
+        table.insert(released, msg)
+    end
+    self._unsent_msgs = {}
+
+    -- without timeout consumer waits for commit as long as it takes
+    local ok, err, dropped = self._consumer:close(get_timeout_from_options(options, -1), released)
 
-    self._poll_msg_fiber:cancel()
     self._output_ch:close()
 
     fiber.yield()
@@ -179,20 +294,15 @@ function Consumer:close()
     if self._poll_rebalances_fiber ~= nil then
         self._poll_rebalances_fiber:cancel()
     end
+    if self._poll_commits_fiber ~= nil then
+        self._poll_commits_fiber:cancel()
+    end
 
     self._consumer:destroy()
 
     self._consumer = nil
 
-    return ok
-end
-
-local function get_timeout_from_options(options)
-    local timeout_ms = DEFAULT_TIMEOUT_MS
-    if type(options) == 'table' and options.timeout_ms ~= nil then
-        timeout_ms = options.timeout_ms
-    end
-    return timeout_ms
+    return ok, err, #released + dropped
 end
 
 function Consumer:subscribe(topics)
@@ -204,13 +314,58 @@ function Consumer:unsubscribe(topics)
 end
 
 function Consumer:output()
+    -- messages are moved to channel only when it is used, so poll_batch can be used instead of it
+    if self._poll_msg_fiber == nil and not self._closing then
+        self._poll_msg_fiber = fiber.create(function()
+            self:_poll_msg()
+        end)
+        self._poll_msg_fiber:name('kafka_msg_poller')
+    end
     return self._output_ch
 end
 
+function Consumer:poll_batch(limit, timeout)
+    if self._consumer == nil then
+        return {}
+    end
+    return self._consumer:poll_batch(limit or 1000, timeout or 1)
+end
+
+function Consumer:poll(timeout)
+    if self._consumer == nil then
+        return nil
+    end
+    return self._consumer:poll(timeout or 1)
+end
+
+Consumer.poll_many = Consumer.poll_batch
+
+function Consumer:wait_msg(timeout)
+    if self._consumer == nil then
+        return
+    end
+    return self._consumer:wait_msg(timeout or 1)
+end
+
+function Consumer:poll_partition(topic, partition, limit)
+    if self._consumer == nil then
+        return {}
+    end
+    return self._consumer:poll_msg(limit or 1000, topic, partition)
+end
+
 function Consumer:store_offset(message)
     return self._consumer:store_offset(message)
 end
 
+function Consumer:store_offsets(messages)
+    return self._consumer:store_offsets(messages)
+end
+
+function Consumer:commit_async()
+    return self._consumer:commit_async()
+end
+
 function Consumer:pause()
     return self._consumer:pause()
 end
@@ -219,11 +374,30 @@ function Consumer:resume()
     return self._consumer:resume()
 end
 
+function Consumer:commit_sync(options)
+    local timeout_ms = get_timeout_from_options(options)
+    return self._consumer:commit_sync(timeout_ms)
+end
+
 function Consumer:seek_partitions(topic_partitions_list, options)
     local timeout_ms = get_timeout_from_options(options)
     return self._consumer:seek_partitions(topic_partitions_list, timeout_ms)
 end
 
+function Consumer:metrics()
+    if self._consumer == nil then
+        return
+    end
+    return self._consumer:metrics()
+end
+
+function Consumer:lag()
+    if self._consumer == nil then
+        return
+    end
+    return self._consumer:lag()
+end
+
 function Consumer:dump_conf()
     if self._consumer == nil then
         return
@@ -315,8 +489,8 @@ function Producer:_msg_delivery_poll()
             elseif count > 0 then
                 fiber.yield()
             else
-                -- throttling poll
-                fiber.sleep(0.01)
+                -- waiting until poller thread pushes new delivery reports
+                self._producer:wait_msg_delivery(1)
             end
         end
     end
@@ -386,23 +560,130 @@ function Producer:produce_async(msg)
     return err
 end
 
-local function dr_callback_factory(delivery_chan)
-    return function(err)
-        delivery_chan:put(err)
-    end
+function Producer:produce_batch(msgs)
+    return self._producer:produce_batch(msgs)
 end
 
 function Producer:produce(msg)
-    local delivery_chan = fiber.channel(1)
+    return self._producer:produce_sync(msg)
+end
+
+function Producer:init_transactions(options)
+    if self._producer == nil then
+        return "producer is closed", "fatal"
+    end
+    local timeout_ms = get_timeout_from_options(options)
+    return self._producer:init_transactions(timeout_ms)
+end
 
-    msg.dr_callback = dr_callback_factory(delivery_chan)
+function Producer:begin_transaction()
+    if self._producer == nil then
+        return "producer is closed", "fatal"
+    end
+    return self._producer:begin_transaction()
+end
 
-    local err = self._producer:produce(msg)
-    if err == nil then
-        err = delivery_chan:get()
+function Producer:send_offsets_to_transaction(consumer, messages, options)
+    if self._producer == nil then
+        return "producer is closed", "fatal"
+    end
+    local timeout_ms = get_timeout_from_options(options)
+    return self._producer:send_offsets_to_transaction(consumer._consumer, messages, timeout_ms)
+end
+
+function Producer:commit_transaction(options)
+    if self._producer == nil then
+        return "producer is closed", "fatal"
     end
+    local timeout_ms = get_timeout_from_options(options)
+    return self._producer:commit_transaction(timeout_ms)
+end
 
-    return err
+function Producer:abort_transaction(options)
+    if self._producer == nil then
+        return "producer is closed", "fatal"
+    end
+    local timeout_ms = get_timeout_from_options(options)
+    return self._producer:abort_transaction(timeout_ms)
+end
+
+-- runs fn(producer) in transaction, which is aborted when fn returns error or raises
+function Producer:transaction(fn, options)
+    local err, kind = self:begin_transaction()
+    if err ~= nil then
+        return err, kind
+    end
+
+    local ok, res = pcall(fn, self)
+    if not ok or res ~= nil then
+        self:abort_transaction(options)
+        if not ok then
+            error(res, 0)
+        end
+        return res, 'abort'
+    end
+
+    err, kind = self:commit_transaction(options)
+    if kind == 'abort' then
+        self:abort_transaction(options)
+    end
+    return err, kind
+end
+
+local function encode_key(key)
+    if key == nil then
+        return nil
+    end
+    if type(key) ~= 'table' then
+        key = {key}
+    end
+    return msgpack.encode(key)
+end
+
+-- exports range of space, returns count of exported tuples, checkpoint key to resume from and error
+function Producer:export_space(options)
+    if self._producer == nil then
+        return 0, nil, "producer is closed"
+    end
+
+    local space = box.space[options.space]
+    if space == nil then
+        return 0, nil, string.format("space '%s' does not exist", options.space)
+    end
+    local index = space.index[options.index or 0]
+    if index == nil then
+        return 0, nil, string.format("index '%s' does not exist", options.index)
+    end
+
+    local iterator = options.iterator or 'GE'
+    local iterator_type = box.index[iterator]
+    if iterator_type == nil then
+        return 0, nil, string.format("unknown iterator '%s'", iterator)
+    end
+
+    local count, checkpoint, err = self._producer:export_space({
+        space_id = space.id,
+        index_id = index.id,
+        iterator = iterator_type,
+        key = encode_key(options.key),
+        after = encode_key(options.after),
+        topic = options.topic,
+        key_field = options.key_field,
+        fields = options.fields,
+        limit = options.limit,
+        chunk_size = options.chunk_size,
+    })
+    if checkpoint ~= nil then
+        checkpoint = msgpack.decode(checkpoint)
+    end
+    return count, checkpoint, err
+end
+
+function Producer:metrics()
+    if self._producer == nil then
+        return
+    end
+    return self._producer:metrics()
 end
 
 function Producer:dump_conf()
@@ -442,12 +723,13 @@ function Producer:list_groups(options)
     return self._producer:list_groups(group, timeout_ms)
 end
 
-function Producer:close()
+function Producer:close(options)
     if self._producer == nil then
         return false
     end
 
-    local ok = self._producer:close()
+    -- without timeout producer waits until all messages are delivered
+    local ok, err, undelivered = self._producer:close(get_timeout_from_options(options, -1))
 
     self._msg_delivery_poll_fiber:cancel()
     if self._poll_logs_fiber ~= nil then
@@ -464,11 +746,49 @@ function Producer:close()
 
     self._producer = nil
 
-    return ok
+    return ok, err, undelivered
+end
+
+local Runtime = {}
+
+function Runtime.create(options)
+    local config = {threads = 1}
+    if options ~= nil then
+        if options.threads ~= nil then
+            config.threads = options.threads
+        end
+        config.thread_options = options.thread_options
+    end
+
+    return tnt_kafka.create_runtime(config)
+end
+
+local Headers = {}
+
+function Headers.create(headers)
+    if type(headers) ~= 'table' then
+        return nil, "headers must be table"
+    end
+
+    return tnt_kafka.create_headers(headers)
+end
+
+local MockCluster = {}
+
+function MockCluster.create(options)
+    local config = {brokers = 1}
+    if options ~= nil and options.brokers ~= nil then
+        config.brokers = options.brokers
+    end
+
+    return tnt_kafka.create_mock_cluster(config)
 end
 
 return {
     Consumer = Consumer,
     Producer = Producer,
+    Runtime = Runtime,
+    Headers = Headers,
+    MockCluster = MockCluster,
     _LIBRDKAFKA = tnt_kafka.librdkafka_version(),
 }
@@ -0,0 +1,69 @@
+#include <math.h>
+#include <time.h>
+
+#include "metrics.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int64_t
+metrics_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+metrics_histogram_observe(metrics_histogram_t *histogram, int64_t value) {
+    if (value < 0)
+        value = 0;
+
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll((uint64_t)value);
+    if (bucket >= METRICS_HISTOGRAM_BUCKETS)
+        bucket = METRICS_HISTOGRAM_BUCKETS - 1;
+
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, (uint64_t)value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+}
+
+void
+lua_set_metrics_field(struct lua_State *L, const char *name, uint64_t value) {
+    lua_pushnumber(L, (double)value);
+    lua_setfield(L, -2, name);
+}
+
+void
+lua_push_metrics_histogram(struct lua_State *L, const metrics_histogram_t *histogram) {
+    uint64_t counts[METRICS_HISTOGRAM_BUCKETS];
+    int last = 0;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        if (counts[i] > 0)
+            last = i;
+    }
+
+    lua_createtable(L, 0, 3);
+    lua_set_metrics_field(L, "count", atomic_load_explicit(&histogram->count, memory_order_relaxed));
+    lua_set_metrics_field(L, "sum", atomic_load_explicit(&histogram->sum, memory_order_relaxed));
+
+    // empty buckets above the last used one are skipped, they have the same cumulative count
+    lua_createtable(L, last + 2, 0);
+    uint64_t cumulative = 0;
+    int n = 0;
+    for (int i = 0; i <= last && i < METRICS_HISTOGRAM_BUCKETS - 1; i++) {
+        cumulative += counts[i];
+        lua_createtable(L, 0, 2);
+        lua_set_metrics_field(L, "le", (uint64_t)1 << i);
+        lua_set_metrics_field(L, "count", cumulative);
+        lua_rawseti(L, -2, ++n);
+    }
+    for (int i = n; i < METRICS_HISTOGRAM_BUCKETS; i++)
+        cumulative += counts[i];
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, HUGE_VAL);
+    lua_setfield(L, -2, "le");
+    lua_set_metrics_field(L, "count", cumulative);
+    lua_rawseti(L, -2, ++n);
+
+    lua_setfield(L, -2, "buckets");
+}
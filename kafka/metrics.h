@@ -0,0 +1,87 @@
+#ifndef TNT_KAFKA_METRICS_H
+#define TNT_KAFKA_METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Counters and latency histograms of hot paths.
+ * Values are updated with relaxed atomics, so any thread may update them without locking.
+ */
+
+#define METRICS_CACHE_LINE_SIZE 64
+
+/**
+ * Only every METRICS_PRODUCE_SAMPLE_RATE produce call is timed, so clock is not read twice on every produce
+ */
+#define METRICS_PRODUCE_SAMPLE_RATE 16
+
+/**
+ * Bucket i counts values less than 2^i microseconds, the last bucket is unbounded
+ */
+#define METRICS_HISTOGRAM_BUCKETS 32
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+} metrics_histogram_t;
+
+typedef struct {
+    // updated by poller threads and librdkafka threads
+    _Atomic uint64_t    polled_msgs;
+    _Atomic uint64_t    polled_bytes;
+    _Atomic uint64_t    filtered_msgs;
+    _Atomic uint64_t    decode_errors;
+    _Atomic uint64_t    empty_polls;
+    _Atomic uint64_t    sleeps;
+    _Atomic uint64_t    delivery_overflows;
+    _Atomic uint64_t    dropped_reports;
+    // logs, stats and errors which do not fit into full callback queues
+    _Atomic uint64_t    dropped_callback_msgs;
+    metrics_histogram_t delivery_lag_us;
+
+    // updated by TX thread only, kept apart from background ones to prevent false sharing
+    metrics_histogram_t consume_wait_us __attribute__((aligned(METRICS_CACHE_LINE_SIZE)));
+    metrics_histogram_t produce_call_us;
+    _Atomic uint64_t    replayed_msgs;
+} metrics_t;
+
+static inline void
+metrics_inc(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline uint64_t
+metrics_get(_Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/**
+ * Monotonic clock in microseconds
+ */
+int64_t
+metrics_now_us();
+
+void
+metrics_histogram_observe(metrics_histogram_t *histogram, int64_t value);
+
+/**
+ * Push histogram as table {count = N, sum = N, buckets = {{le = N, count = N}, ...}} with cumulative
+ * counts of buckets, so it maps onto Tarantool metrics histogram collector
+ */
+void
+lua_push_metrics_histogram(struct lua_State *L, const metrics_histogram_t *histogram);
+
+/**
+ * Set field of table on top of the stack
+ */
+void
+lua_set_metrics_field(struct lua_State *L, const char *name, uint64_t value);
+
+#endif // TNT_KAFKA_METRICS_H
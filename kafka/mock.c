@@ -0,0 +1,137 @@
+#include <stdlib.h>
+
+#include <tarantool/module.h>
+
+#include <common.h>
+#include <mock.h>
+
+static inline mock_cluster_t *
+lua_check_mock_cluster(struct lua_State *L, int index) {
+    mock_cluster_t **cluster_p = (mock_cluster_t **)luaL_checkudata(L, index, mock_cluster_label);
+    if (cluster_p == NULL || *cluster_p == NULL)
+        luaL_error(L, "Kafka mock cluster fatal error: failed to retrieve mock cluster from lua stack!");
+    return *cluster_p;
+}
+
+static void
+destroy_mock_cluster(mock_cluster_t *cluster) {
+    // brokers of cluster are served by own thread, which is joined here
+    if (cluster->cluster != NULL)
+        rd_kafka_mock_cluster_destroy(cluster->cluster);
+    if (cluster->rd_kafka != NULL)
+        rd_kafka_destroy(cluster->rd_kafka);
+    free(cluster);
+}
+
+int
+lua_create_mock_cluster(struct lua_State *L) {
+    if (lua_gettop(L) != 1 || !lua_istable(L, 1))
+        luaL_error(L, "Usage: cluster, err = create_mock_cluster(config)");
+
+    lua_getfield(L, 1, "brokers");
+    lua_Integer brokers = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 0;
+    lua_pop(L, 1);
+    if (brokers <= 0 || brokers > MOCK_CLUSTER_MAX_BROKERS) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "mock cluster config 'brokers' must be positive number not greater than %d",
+                        MOCK_CLUSTER_MAX_BROKERS);
+        return 2;
+    }
+
+    mock_cluster_t *cluster = calloc(1, sizeof(mock_cluster_t));
+    if (cluster == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "mock cluster: out of memory");
+        return 2;
+    }
+
+    // handle is used by cluster for logging only and never connects anywhere
+    char errstr[512];
+    cluster->rd_kafka = rd_kafka_new(RD_KAFKA_PRODUCER, rd_kafka_conf_new(), errstr, sizeof(errstr));
+    if (cluster->rd_kafka == NULL) {
+        destroy_mock_cluster(cluster);
+        lua_pushnil(L);
+        lua_pushstring(L, errstr);
+        return 2;
+    }
+
+    cluster->cluster = rd_kafka_mock_cluster_new(cluster->rd_kafka, (int)brokers);
+    if (cluster->cluster == NULL) {
+        destroy_mock_cluster(cluster);
+        lua_pushnil(L);
+        lua_pushliteral(L, "mock cluster: failed to create cluster");
+        return 2;
+    }
+
+    mock_cluster_t **cluster_p = (mock_cluster_t **)lua_newuserdata(L, sizeof(cluster));
+    *cluster_p = cluster;
+
+    luaL_getmetatable(L, mock_cluster_label);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+int
+lua_mock_cluster_bootstraps(struct lua_State *L) {
+    mock_cluster_t *cluster = lua_check_mock_cluster(L, 1);
+    lua_pushstring(L, rd_kafka_mock_cluster_bootstraps(cluster->cluster));
+    return 1;
+}
+
+int
+lua_mock_cluster_create_topic(struct lua_State *L) {
+    if (lua_gettop(L) != 4)
+        luaL_error(L, "Usage: err = cluster:create_topic(topic, partitions, replication_factor)");
+
+    mock_cluster_t *cluster = lua_check_mock_cluster(L, 1);
+    const char *topic = luaL_checkstring(L, 2);
+    int partitions = luaL_checkint(L, 3);
+    int replication_factor = luaL_checkint(L, 4);
+
+    rd_kafka_resp_err_t err = rd_kafka_mock_topic_create(cluster->cluster, topic, partitions, replication_factor);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        lua_pushstring(L, rd_kafka_err2str(err));
+        return 1;
+    }
+    return 0;
+}
+
+static ssize_t
+wait_mock_cluster_destroy(va_list args) {
+    mock_cluster_t *cluster = va_arg(args, mock_cluster_t *);
+    destroy_mock_cluster(cluster);
+    return 0;
+}
+
+int
+lua_mock_cluster_close(struct lua_State *L) {
+    mock_cluster_t **cluster_p = (mock_cluster_t **)luaL_checkudata(L, 1, mock_cluster_label);
+    if (cluster_p == NULL || *cluster_p == NULL) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    // clients of cluster should be closed before, otherwise they lose connection to brokers
+    coio_call(wait_mock_cluster_destroy, *cluster_p);
+    *cluster_p = NULL;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int
+lua_mock_cluster_gc(struct lua_State *L) {
+    mock_cluster_t **cluster_p = (mock_cluster_t **)luaL_checkudata(L, 1, mock_cluster_label);
+    if (cluster_p != NULL && *cluster_p != NULL) {
+        // fiber must not yield in gc
+        destroy_mock_cluster(*cluster_p);
+        *cluster_p = NULL;
+    }
+    return 0;
+}
+
+int
+lua_mock_cluster_tostring(struct lua_State *L) {
+    const mock_cluster_t *cluster = lua_check_mock_cluster(L, 1);
+    lua_pushfstring(L, "Kafka Mock Cluster: %p", cluster);
+    return 1;
+}
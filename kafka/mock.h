@@ -0,0 +1,55 @@
+#ifndef TNT_KAFKA_MOCK_H
+#define TNT_KAFKA_MOCK_H
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafka_mock.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * In-process mock cluster of librdkafka for benchmarks and tests without real brokers.
+ * Cluster lives while its own librdkafka handle is alive, consumers and producers connect
+ * to it by bootstrap servers like to the real one.
+ */
+
+#define MOCK_CLUSTER_MAX_BROKERS 16
+
+typedef struct {
+    rd_kafka_t              *rd_kafka;
+    rd_kafka_mock_cluster_t *cluster;
+} mock_cluster_t;
+
+/**
+ * Create mock cluster
+ * @param L config table with 'brokers' count
+ * @return mock cluster userdata or nil and error
+ */
+int
+lua_create_mock_cluster(struct lua_State *L);
+
+/**
+ * @return bootstrap servers of cluster
+ */
+int
+lua_mock_cluster_bootstraps(struct lua_State *L);
+
+/**
+ * Create topic with given count of partitions and replication factor
+ * @return error or nil
+ */
+int
+lua_mock_cluster_create_topic(struct lua_State *L);
+
+int
+lua_mock_cluster_close(struct lua_State *L);
+
+int
+lua_mock_cluster_gc(struct lua_State *L);
+
+int
+lua_mock_cluster_tostring(struct lua_State *L);
+
+#endif //TNT_KAFKA_MOCK_H
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <tarantool/module.h>
+
+#include <notifier.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Wakeup of TX thread fiber from background threads through eventfd (or pipe where eventfd is absent)
+ */
+
+notifier_t *
+new_notifier() {
+    notifier_t *notifier = malloc(sizeof(notifier_t));
+    if (notifier == NULL)
+        return NULL;
+
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        free(notifier);
+        return NULL;
+    }
+    notifier->read_fd = fd;
+    notifier->write_fd = fd;
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
+        free(notifier);
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    notifier->read_fd = fds[0];
+    notifier->write_fd = fds[1];
+#endif
+
+    atomic_init(&notifier->waiting, 0);
+    return notifier;
+}
+
+void
+destroy_notifier(notifier_t *notifier) {
+    if (notifier == NULL)
+        return;
+    close(notifier->read_fd);
+    if (notifier->write_fd != notifier->read_fd)
+        close(notifier->write_fd);
+    free(notifier);
+}
+
+void
+notifier_notify(notifier_t *notifier) {
+    // pairs with fence in notifier_prepare: either waiter sees pushed value or we see waiting flag
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&notifier->waiting, memory_order_relaxed) == 0)
+        return;
+    if (atomic_exchange(&notifier->waiting, 0) == 0)
+        return;
+
+    uint64_t value = 1;
+    ssize_t rc = write(notifier->write_fd, &value, sizeof(value));
+    // nonblocking descriptor may be full only if waiter is already notified
+    (void)rc;
+}
+
+void
+notifier_prepare(notifier_t *notifier) {
+    atomic_store(&notifier->waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void
+notifier_cancel(notifier_t *notifier) {
+    atomic_store(&notifier->waiting, 0);
+}
+
+void
+notifier_wait(notifier_t *notifier, double timeout) {
+    coio_wait(notifier->read_fd, COIO_READ, timeout);
+
+    atomic_store(&notifier->waiting, 0);
+    // draining descriptor to make next wait block
+    uint64_t buf[8];
+    while (read(notifier->read_fd, buf, sizeof(buf)) > 0)
+        ;
+}
@@ -0,0 +1,51 @@
+#ifndef TNT_KAFKA_NOTIFIER_H
+#define TNT_KAFKA_NOTIFIER_H
+
+#include <stdatomic.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Wakeup of TX thread fiber from background threads through eventfd (or pipe where eventfd is absent)
+ */
+
+typedef struct {
+    int         read_fd;
+    int         write_fd;
+    _Atomic int waiting;
+} notifier_t;
+
+notifier_t *
+new_notifier();
+
+void
+destroy_notifier(notifier_t *notifier);
+
+/**
+ * Wake up waiting fiber if any, may be called from any thread.
+ * Does not make syscall when nobody waits.
+ * @param notifier
+ */
+void
+notifier_notify(notifier_t *notifier);
+
+/**
+ * Announce that fiber is going to wait.
+ * Caller must check its condition once again after this call and
+ * call notifier_cancel if condition is already satisfied.
+ * @param notifier
+ */
+void
+notifier_prepare(notifier_t *notifier);
+
+void
+notifier_cancel(notifier_t *notifier);
+
+/**
+ * Yield current fiber until notification or timeout, must be called from TX thread after notifier_prepare.
+ * @param notifier
+ * @param timeout in seconds
+ */
+void
+notifier_wait(notifier_t *notifier, double timeout);
+
+#endif // TNT_KAFKA_NOTIFIER_H
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <common.h>
+#include <abi.h>
+
+#include <partitioner.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Registry of custom partitioners
+ */
+
+static const partitioner_t *partitioners[PARTITIONER_MAX_COUNT];
+
+static const char *const sticky_partitioner_name = "sticky";
+
+static const partitioner_t *
+partitioner_find(const char *name) {
+    for (int i = 0; i < PARTITIONER_MAX_COUNT && partitioners[i] != NULL; i++) {
+        if (strcmp(partitioners[i]->name, name) == 0)
+            return partitioners[i];
+    }
+    return NULL;
+}
+
+int
+partitioner_register(const partitioner_t *partitioner) {
+    if (partitioner == NULL || partitioner->name == NULL || partitioner->partition == NULL ||
+        strcmp(partitioner->name, sticky_partitioner_name) == 0)
+        return -1;
+    for (int i = 0; i < PARTITIONER_MAX_COUNT; i++) {
+        if (partitioners[i] == NULL) {
+            partitioners[i] = partitioner;
+            return 0;
+        }
+        if (strcmp(partitioners[i]->name, partitioner->name) == 0)
+            return -1;
+    }
+    return -1;
+}
+
+int
+tnt_kafka_register_partitioner(const partitioner_t *partitioner) {
+    return partitioner_register(partitioner);
+}
+
+int
+partitioner_is_known(const char *name) {
+    return strcmp(name, sticky_partitioner_name) == 0 || partitioner_find(name) != NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Partitioner setup
+ */
+
+static int32_t
+partitioner_ctx_partition(const rd_kafka_topic_t *rkt, const void *key, size_t key_len,
+                          int32_t partition_cnt, void *rkt_opaque, void *msg_opaque) {
+    partitioner_ctx_t *ctx = rkt_opaque;
+    return ctx->custom->partition(rkt, key, key_len, partition_cnt, ctx->custom->opaque, msg_opaque);
+}
+
+partitioner_ctx_t *
+new_partitioner_ctx(rd_kafka_conf_t *rd_config, rd_kafka_topic_conf_t *topic_conf, const char *name,
+                    char *errstr, size_t errstr_size) {
+    partitioner_ctx_t *ctx = calloc(1, sizeof(partitioner_ctx_t));
+    if (ctx == NULL) {
+        snprintf(errstr, errstr_size, "failed to allocate partitioner");
+        return NULL;
+    }
+
+    if (strcmp(name, sticky_partitioner_name) == 0) {
+        // librdkafka sticks keyless messages to one partition itself, partition is switched once per linger,
+        // so batches are filled before they are sent, keyed messages are partitioned like in Java client
+        char linger[32];
+        size_t linger_size = sizeof(linger);
+        if (rd_kafka_conf_get(rd_config, "linger.ms", linger, &linger_size) != RD_KAFKA_CONF_OK ||
+            atoi(linger) <= 0)
+            snprintf(linger, sizeof(linger), "1");
+        if (rd_kafka_conf_set(rd_config, "sticky.partitioning.linger.ms", linger,
+                              errstr, errstr_size) != RD_KAFKA_CONF_OK ||
+            rd_kafka_topic_conf_set(topic_conf, "partitioner", "murmur2_random",
+                                    errstr, errstr_size) != RD_KAFKA_CONF_OK) {
+            free(ctx);
+            return NULL;
+        }
+        return ctx;
+    }
+
+    ctx->custom = partitioner_find(name);
+    if (ctx->custom == NULL) {
+        snprintf(errstr, errstr_size, "unknown partitioner '%s'", name);
+        free(ctx);
+        return NULL;
+    }
+    // otherwise librdkafka partitions keyless messages itself and custom partitioner never gets them
+    if (rd_kafka_conf_set(rd_config, "sticky.partitioning.linger.ms", "0", errstr, errstr_size) != RD_KAFKA_CONF_OK) {
+        free(ctx);
+        return NULL;
+    }
+
+    rd_kafka_topic_conf_set_opaque(topic_conf, ctx);
+    rd_kafka_topic_conf_set_partitioner_cb(topic_conf, partitioner_ctx_partition);
+    return ctx;
+}
+
+void
+destroy_partitioner_ctx(partitioner_ctx_t *ctx) {
+    free(ctx);
+}
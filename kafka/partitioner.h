@@ -0,0 +1,72 @@
+#ifndef TNT_KAFKA_PARTITIONER_H
+#define TNT_KAFKA_PARTITIONER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <librdkafka/rdkafka.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Producer partitioners selected by 'partitioner' of default topic options.
+ * Names of librdkafka partitioners like 'murmur2_random' are passed to librdkafka as is,
+ * 'sticky' is murmur2_random with sticky partitioning of keyless messages during linger
+ * and registered custom partitioners are set up as partitioner callback.
+ */
+
+#define PARTITIONER_MAX_COUNT 16
+
+/**
+ * Partitioner callback, the same as librdkafka one, but rkt_opaque is opaque of registered partitioner.
+ * Called from TX thread on produce and from librdkafka threads for messages queued before topic metadata is known.
+ */
+typedef int32_t (*partitioner_cb_t)(const rd_kafka_topic_t *rkt, const void *key, size_t key_len,
+                                    int32_t partition_cnt, void *opaque, void *msg_opaque);
+
+typedef struct partitioner_t {
+    const char       *name;
+    partitioner_cb_t partition;
+    void             *opaque;
+} partitioner_t;
+
+/**
+ * Register custom partitioner, must be called from TX thread before creation of producers using it
+ * @param partitioner must outlive all producers using it
+ * @return 0 on success, -1 when name is taken or registry is full
+ */
+int
+partitioner_register(const partitioner_t *partitioner);
+
+/**
+ * Partitioner of producer
+ */
+typedef struct {
+    // NULL for sticky partitioner, which is set up in librdkafka config only
+    const partitioner_t *custom;
+} partitioner_ctx_t;
+
+/**
+ * Check whether partitioner is set up by the module instead of librdkafka
+ * @param name
+ * @return 1 for 'sticky' and registered partitioners
+ */
+int
+partitioner_is_known(const char *name);
+
+/**
+ * Set up partitioner in producer config and topic config
+ * @param rd_config
+ * @param topic_conf
+ * @param name known partitioner
+ * @param errstr
+ * @param errstr_size
+ * @return NULL on failure
+ */
+partitioner_ctx_t *
+new_partitioner_ctx(rd_kafka_conf_t *rd_config, rd_kafka_topic_conf_t *topic_conf, const char *name,
+                    char *errstr, size_t errstr_size);
+
+void
+destroy_partitioner_ctx(partitioner_ctx_t *ctx);
+
+#endif // TNT_KAFKA_PARTITIONER_H
@@ -0,0 +1,609 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <librdkafka/rdkafka.h>
+
+#include <common.h>
+#include <callbacks.h>
+#include <queue.h>
+#include <consumer_msg.h>
+
+#include "partitions.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Partitions registry
+ */
+
+static consumer_partition_t *
+new_consumer_partition(const char *topic, int32_t partition) {
+    consumer_partition_t *entry = malloc(sizeof(consumer_partition_t));
+    if (entry == NULL)
+        return NULL;
+
+    entry->topic = strdup(topic);
+    // several pollers push at once for a while when partition is reassigned to another poller
+    entry->queue = new_ring_queue(PARTITION_QUEUE_CAPACITY, QUEUE_F_MULTI_PRODUCER);
+    if (entry->topic == NULL || entry->queue == NULL) {
+        if (entry->queue != NULL)
+            destroy_queue(entry->queue);
+        free(entry->topic);
+        free(entry);
+        return NULL;
+    }
+
+    entry->partition = partition;
+    entry->rd_queue = NULL;
+    entry->poller_no = 0;
+    entry->backlog_head = NULL;
+    entry->backlog_tail = NULL;
+    entry->paused = 0;
+    entry->pending = NULL;
+    entry->metrics = NULL;
+    return entry;
+}
+
+static void
+destroy_consumer_partition(consumer_partition_t *entry) {
+    if (entry->pending != NULL)
+        destroy_msg_batch(entry->pending);
+
+    msg_batch_t *batch = NULL;
+    while ((batch = queue_pop(entry->queue)) != NULL)
+        destroy_msg_batch(batch);
+    destroy_queue(entry->queue);
+
+    while (entry->backlog_head != NULL) {
+        batch = entry->backlog_head;
+        entry->backlog_head = batch->next;
+        destroy_msg_batch(batch);
+    }
+
+    free(entry->topic);
+    free(entry);
+}
+
+/**
+ * Must be called with pool lock
+ */
+static consumer_partition_t *
+partition_pool_find(partition_pool_t *pool, const char *topic, int32_t partition) {
+    for (int i = 0; i < pool->count; i++) {
+        consumer_partition_t *entry = pool->partitions[i];
+        if (entry->partition == partition && strcmp(entry->topic, topic) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Must be called with pool lock
+ */
+static consumer_partition_t *
+partition_pool_add(partition_pool_t *pool, const char *topic, int32_t partition) {
+    if (pool->count == pool->capacity) {
+        int capacity = pool->capacity > 0 ? pool->capacity * 2 : 16;
+        consumer_partition_t **partitions = realloc(pool->partitions, capacity * sizeof(consumer_partition_t *));
+        if (partitions == NULL)
+            return NULL;
+        pool->partitions = partitions;
+        pool->capacity = capacity;
+    }
+
+    consumer_partition_t *entry = new_consumer_partition(topic, partition);
+    if (entry == NULL)
+        return NULL;
+
+    if (pool->event_queues->notifier != NULL)
+        queue_set_notifier(entry->queue, pool->event_queues->notifier);
+    entry->metrics = &pool->event_queues->metrics;
+    pool->partitions[pool->count++] = entry;
+    return entry;
+}
+
+static void
+partition_pool_pause_resume(partition_pool_t *pool, consumer_partition_t *entry, int pause) {
+    rd_kafka_topic_partition_list_t *list = rd_kafka_topic_partition_list_new(1);
+    if (list == NULL)
+        return;
+
+    rd_kafka_topic_partition_list_add(list, entry->topic, entry->partition);
+    if (pause)
+        rd_kafka_pause_partitions(pool->rd_consumer, list);
+    else
+        rd_kafka_resume_partitions(pool->rd_consumer, list);
+    rd_kafka_topic_partition_list_destroy(list);
+}
+
+void
+partition_pool_assign(void *arg, rd_kafka_topic_partition_list_t *partitions) {
+    partition_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (int i = 0; i < partitions->cnt; i++) {
+        rd_kafka_topic_partition_t *tp = &partitions->elems[i];
+        consumer_partition_t *entry = partition_pool_find(pool, tp->topic, tp->partition);
+        if (entry == NULL)
+            entry = partition_pool_add(pool, tp->topic, tp->partition);
+        // messages of partition without own queue are still consumed from consumer queue
+        if (entry == NULL || entry->rd_queue != NULL)
+            continue;
+
+        rd_kafka_queue_t *rd_queue = rd_kafka_queue_get_partition(pool->rd_consumer, tp->topic, tp->partition);
+        if (rd_queue == NULL)
+            continue;
+
+        entry->poller_no = pool->next_poller;
+        pool->next_poller = (pool->next_poller + 1) % pool->pollers_count;
+        rd_kafka_queue_forward(rd_queue, pool->pollers[entry->poller_no]->rd_queue);
+        entry->rd_queue = rd_queue;
+
+        // batches left from previous assignment are still waiting for TX thread
+        entry->paused = entry->backlog_head != NULL;
+        if (entry->paused)
+            partition_pool_pause_resume(pool, entry, 1);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+partition_pool_revoke(void *arg, rd_kafka_topic_partition_list_t *partitions) {
+    partition_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (int i = 0; i < pool->count; i++) {
+        consumer_partition_t *entry = pool->partitions[i];
+        if (entry->rd_queue == NULL)
+            continue;
+        if (partitions != NULL &&
+            rd_kafka_topic_partition_list_find(partitions, entry->topic, entry->partition) == NULL)
+            continue;
+
+        // messages which are already forwarded stay in poller queue and are delivered as usual
+        rd_kafka_queue_forward(entry->rd_queue, NULL);
+        rd_kafka_queue_destroy(entry->rd_queue);
+        entry->rd_queue = NULL;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+partition_pool_resume_filter(void *arg, rd_kafka_topic_partition_list_t *partitions) {
+    partition_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (int i = 0; i < pool->count; i++) {
+        consumer_partition_t *entry = pool->partitions[i];
+        if (entry->paused)
+            rd_kafka_topic_partition_list_del(partitions, entry->topic, entry->partition);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Partition poll threads
+ */
+
+/**
+ * Push batches waiting in backlogs, resumes partitions when their backlogs are empty
+ * @return 1 if any of backlogs is still not empty
+ */
+static int
+partition_pool_flush_backlogs(partition_pool_t *pool) {
+    // pause lock goes first as well as in resume of consumer
+    pause_state_t *pause = &pool->event_queues->pause;
+    pthread_mutex_lock(&pause->lock);
+    pthread_mutex_lock(&pool->lock);
+    int consumer_paused = atomic_load(&pause->auto_paused) || atomic_load(&pause->user_paused);
+
+    for (int i = 0; i < pool->count; i++) {
+        consumer_partition_t *entry = pool->partitions[i];
+        if (entry->backlog_head == NULL)
+            continue;
+
+        while (entry->backlog_head != NULL) {
+            // pushed batch may be freed by TX thread at once
+            msg_batch_t *next = entry->backlog_head->next;
+            if (queue_push(entry->queue, entry->backlog_head) != 0)
+                break;
+            entry->backlog_head = next;
+        }
+        if (entry->backlog_head != NULL)
+            continue;
+
+        entry->backlog_tail = NULL;
+        atomic_fetch_sub(&pool->backlogged, 1);
+        // partition stays paused until consumer is resumed too
+        if (entry->paused && entry->rd_queue != NULL && !consumer_paused)
+            partition_pool_pause_resume(pool, entry, 0);
+        entry->paused = 0;
+    }
+
+    int backlogged = atomic_load(&pool->backlogged) > 0;
+
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pause->lock);
+
+    return backlogged;
+}
+
+static void
+partition_poller_push(partition_poller_t *poller, consumer_partition_t *entry, msg_batch_t *batch) {
+    if (batch->count == 0) {
+        destroy_msg_batch(batch);
+        return;
+    }
+
+    partition_pool_t *pool = poller->pool;
+    if (pool->event_queues->value_codec != NULL)
+        decode_msg_batch(pool->rd_consumer, pool->event_queues, batch);
+    metrics_inc(&pool->event_queues->metrics.polled_msgs, batch->count);
+    metrics_inc(&pool->event_queues->metrics.polled_bytes, batch->bytes);
+    // counters are increased before push, because TX thread decreases them right after pop
+    if (pool->pending_msgs != NULL) {
+        atomic_fetch_add_explicit(pool->pending_msgs, batch->count, memory_order_relaxed);
+        atomic_fetch_add_explicit(pool->pending_bytes, batch->bytes, memory_order_relaxed);
+    }
+    batch->pushed_at = metrics_now_us();
+    // messages of partition are pushed by its poller, so order is kept without lock while there are no backlogs
+    if (atomic_load(&pool->backlogged) == 0 && queue_push(entry->queue, batch) == 0)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (entry->backlog_head == NULL && queue_push(entry->queue, batch) == 0) {
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    // TX thread does not keep up with partition, so only this partition is paused
+    batch->next = NULL;
+    if (entry->backlog_head == NULL) {
+        entry->backlog_head = batch;
+        atomic_fetch_add(&pool->backlogged, 1);
+    } else {
+        entry->backlog_tail->next = batch;
+    }
+    entry->backlog_tail = batch;
+
+    if (!entry->paused && entry->rd_queue != NULL) {
+        partition_pool_pause_resume(pool, entry, 1);
+        entry->paused = 1;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static consumer_partition_t *
+partition_poller_lookup(partition_poller_t *poller, rd_kafka_message_t *rd_msg) {
+    const char *topic = rd_kafka_topic_name(rd_msg->rkt);
+    consumer_partition_t *entry = poller->last;
+    if (entry != NULL && entry->partition == rd_msg->partition && strcmp(entry->topic, topic) == 0)
+        return entry;
+
+    pthread_mutex_lock(&poller->pool->lock);
+    entry = partition_pool_find(poller->pool, topic, rd_msg->partition);
+    pthread_mutex_unlock(&poller->pool->lock);
+
+    if (entry != NULL)
+        poller->last = entry;
+    return entry;
+}
+
+static void *
+partition_poll_loop(void *arg) {
+    partition_poller_t *poller = arg;
+    partition_pool_t *pool = poller->pool;
+
+    char errstr[256];
+    if (thread_options_apply(pool->event_queues->thread_options, "kafka_partition", "kpart",
+                             errstr, sizeof(errstr)) != 0)
+        error_callback(pool->rd_consumer, RD_KAFKA_RESP_ERR__FAIL, errstr, pool->event_queues);
+    slab_cache_t *slab = pool->event_queues->slab;
+    rd_kafka_message_t **rd_msgs = poller->rd_msgs;
+    int errors_count = 0;
+
+    while (!atomic_load(&poller->should_stop)) {
+        int backlogged = atomic_load(&pool->backlogged) > 0 && partition_pool_flush_backlogs(pool);
+
+        // polling more often while partitions are paused to resume them as soon as possible
+        rd_kafka_message_t *rd_msg = rd_kafka_consume_queue(poller->rd_queue, backlogged ? 100 : 1000);
+        if (rd_msg == NULL) {
+            metrics_inc(&pool->event_queues->metrics.empty_polls, 1);
+            continue;
+        }
+
+        rd_msgs[0] = rd_msg;
+        ssize_t count = 1;
+        if (pool->batch_size > 1) {
+            ssize_t rc = rd_kafka_consume_batch_queue(poller->rd_queue, 0, rd_msgs + 1, pool->batch_size - 1);
+            if (rc > 0)
+                count += rc;
+        }
+
+        // messages of every partition go one by one, so batch is pushed when partition changes
+        consumer_partition_t *current = NULL;
+        msg_batch_t *batch = NULL;
+        for (ssize_t i = 0; i < count; i++) {
+            rd_msg = rd_msgs[i];
+            rd_kafka_resp_err_t err = rd_msg->err;
+            if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+                // free rdkafka message instantly to prevent hang on close / destroy consumer
+                rd_kafka_message_destroy(rd_msg);
+
+                error_callback(pool->rd_consumer, err, rd_kafka_err2str(err), pool->event_queues);
+
+                errors_count++;
+                if (errors_count >= 50) {
+                    // throttling calls with 100ms sleep when there are too many errors one by one
+                    usleep(100000);
+                }
+                continue;
+            }
+
+            errors_count = 0;
+            consumer_partition_t *entry = partition_poller_lookup(poller, rd_msg);
+            if (entry == NULL) {
+                rd_kafka_message_destroy(rd_msg);
+                continue;
+            }
+
+            // only batch of the same partition may cover offset of skipped message
+            header_filter_t *header_filter = pool->event_queues->header_filter;
+            if (header_filter != NULL && header_filter_skip(header_filter, entry == current ? batch : NULL, rd_msg)) {
+                rd_kafka_message_destroy(rd_msg);
+                metrics_inc(&pool->event_queues->metrics.filtered_msgs, 1);
+                continue;
+            }
+
+            if (entry != current) {
+                if (batch != NULL)
+                    partition_poller_push(poller, current, batch);
+                current = entry;
+                batch = new_msg_batch(slab, count - i);
+            }
+            if (batch == NULL) {
+                rd_kafka_message_destroy(rd_msg);
+                continue;
+            }
+
+            msg_t *msg = take_consumer_msg(slab, pool->tracker, rd_msg);
+            if (msg != NULL) {
+                batch->msgs[batch->count++] = msg;
+                batch->bytes += msg->value_len + msg->key_len;
+            }
+        }
+
+        if (batch != NULL)
+            partition_poller_push(poller, current, batch);
+    }
+
+    pthread_exit(NULL);
+}
+
+static partition_poller_t *
+new_partition_poller(partition_pool_t *pool, int no) {
+    partition_poller_t *poller = malloc(sizeof(partition_poller_t));
+    if (poller == NULL)
+        return NULL;
+
+    poller->rd_msgs = malloc(pool->batch_size * sizeof(rd_kafka_message_t *));
+    poller->rd_queue = rd_kafka_queue_new(pool->rd_consumer);
+    if (poller->rd_msgs == NULL || poller->rd_queue == NULL) {
+        if (poller->rd_queue != NULL)
+            rd_kafka_queue_destroy(poller->rd_queue);
+        free(poller->rd_msgs);
+        free(poller);
+        return NULL;
+    }
+
+    poller->pool = pool;
+    poller->no = no;
+    poller->last = NULL;
+    atomic_init(&poller->should_stop, 0);
+
+    if (pthread_create(&poller->thread, NULL, partition_poll_loop, (void *)poller) != 0) {
+        rd_kafka_queue_destroy(poller->rd_queue);
+        free(poller->rd_msgs);
+        free(poller);
+        return NULL;
+    }
+
+    return poller;
+}
+
+/**
+ * Partitions pool
+ */
+
+partition_pool_t *
+new_partition_pool(rd_kafka_t *rd_consumer, msg_tracker_t *tracker, int threads, int batch_size,
+                   _Atomic long *pending_msgs, _Atomic long *pending_bytes) {
+    partition_pool_t *pool = malloc(sizeof(partition_pool_t));
+    if (pool == NULL)
+        return NULL;
+
+    pool->pollers = malloc(threads * sizeof(partition_poller_t *));
+    if (pool->pollers == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->rd_consumer = rd_consumer;
+    pool->event_queues = rd_kafka_opaque(rd_consumer);
+    pool->tracker = tracker;
+    pool->batch_size = batch_size;
+    pool->pending_msgs = pending_msgs;
+    pool->pending_bytes = pending_bytes;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->partitions = NULL;
+    pool->count = 0;
+    pool->capacity = 0;
+    atomic_init(&pool->backlogged, 0);
+    pool->pollers_count = 0;
+    pool->next_poller = 0;
+    pool->current = NULL;
+    pool->cursor = 0;
+
+    for (int i = 0; i < threads; i++) {
+        partition_poller_t *poller = new_partition_poller(pool, i);
+        if (poller == NULL) {
+            stop_partition_pool(pool);
+            destroy_partition_pool(pool);
+            return NULL;
+        }
+        pool->pollers[pool->pollers_count++] = poller;
+    }
+
+    return pool;
+}
+
+consumer_partition_t *
+partition_pool_get(partition_pool_t *pool, const char *topic, int32_t partition) {
+    pthread_mutex_lock(&pool->lock);
+
+    consumer_partition_t *entry = partition_pool_find(pool, topic, partition);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return entry;
+}
+
+static inline int
+consumer_partition_has_msgs(consumer_partition_t *entry) {
+    if (entry->pending != NULL && entry->pending->pos < entry->pending->count)
+        return 1;
+    return queue_count(entry->queue) > 0;
+}
+
+msg_t *
+consumer_partition_pop_msg(consumer_partition_t *entry) {
+    msg_batch_t *batch = entry->pending;
+    while (batch == NULL || batch->pos >= batch->count) {
+        if (batch != NULL)
+            destroy_msg_batch(batch);
+        batch = queue_pop(entry->queue);
+        entry->pending = batch;
+        if (batch == NULL)
+            return NULL;
+        if (entry->metrics != NULL)
+            metrics_histogram_observe(&entry->metrics->consume_wait_us, metrics_now_us() - batch->pushed_at);
+    }
+    return batch->msgs[batch->pos++];
+}
+
+msg_t *
+partition_pool_pop_msg(partition_pool_t *pool) {
+    consumer_partition_t *entry = pool->current;
+    if (entry == NULL || !consumer_partition_has_msgs(entry)) {
+        entry = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+
+        // round robin by batches, so busy partition does not starve other ones
+        for (int i = 0; i < pool->count; i++) {
+            pool->cursor = (pool->cursor + 1) % pool->count;
+            if (consumer_partition_has_msgs(pool->partitions[pool->cursor])) {
+                entry = pool->partitions[pool->cursor];
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->current = entry;
+        if (entry == NULL)
+            return NULL;
+    }
+
+    msg_t *msg = consumer_partition_pop_msg(entry);
+    if (entry->pending == NULL || entry->pending->pos >= entry->pending->count)
+        pool->current = NULL;
+    return msg;
+}
+
+int
+partition_pool_has_msgs(partition_pool_t *pool) {
+    if (pool->current != NULL && consumer_partition_has_msgs(pool->current))
+        return 1;
+
+    pthread_mutex_lock(&pool->lock);
+
+    int has_msgs = 0;
+    for (int i = 0; i < pool->count && !has_msgs; i++)
+        has_msgs = consumer_partition_has_msgs(pool->partitions[i]);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return has_msgs;
+}
+
+msg_batch_t *
+partition_pool_take_backlog(partition_pool_t *pool) {
+    msg_batch_t *batch = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (int i = 0; i < pool->count && batch == NULL; i++) {
+        consumer_partition_t *entry = pool->partitions[i];
+        batch = entry->backlog_head;
+        if (batch == NULL)
+            continue;
+        entry->backlog_head = batch->next;
+        if (entry->backlog_head == NULL) {
+            entry->backlog_tail = NULL;
+            atomic_fetch_sub(&pool->backlogged, 1);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return batch;
+}
+
+void
+stop_partition_pool(partition_pool_t *pool) {
+    for (int i = 0; i < pool->pollers_count; i++) {
+        partition_poller_t *poller = pool->pollers[i];
+        atomic_store(&poller->should_stop, 1);
+        // interrupting blocking poll
+        rd_kafka_queue_yield(poller->rd_queue);
+    }
+
+    for (int i = 0; i < pool->pollers_count; i++)
+        pthread_join(pool->pollers[i]->thread, NULL);
+
+    // queue handles keep reference to consumer, so they must be released before destroy
+    partition_pool_revoke(pool, NULL);
+    for (int i = 0; i < pool->pollers_count; i++) {
+        partition_poller_t *poller = pool->pollers[i];
+        if (poller->rd_queue != NULL) {
+            rd_kafka_queue_destroy(poller->rd_queue);
+            poller->rd_queue = NULL;
+        }
+    }
+}
+
+void
+destroy_partition_pool(partition_pool_t *pool) {
+    for (int i = 0; i < pool->pollers_count; i++) {
+        free(pool->pollers[i]->rd_msgs);
+        free(pool->pollers[i]);
+    }
+    free(pool->pollers);
+
+    for (int i = 0; i < pool->count; i++)
+        destroy_consumer_partition(pool->partitions[i]);
+    free(pool->partitions);
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
@@ -0,0 +1,178 @@
+#ifndef TNT_KAFKA_PARTITIONS_H
+#define TNT_KAFKA_PARTITIONS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include <librdkafka/rdkafka.h>
+
+#include <queue.h>
+#include <callbacks.h>
+#include <consumer_msg.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Partition queues of consumer.
+ * Every assigned partition is forwarded into queue of one of poller threads, so messages of
+ * different partitions are copied in parallel and are passed to TX thread by separate queues.
+ */
+
+/**
+ * Capacity of queue of message batches of every partition
+ */
+#define PARTITION_QUEUE_CAPACITY 1024
+
+typedef struct {
+    char               *topic;
+    int32_t            partition;
+    // forwarded partition queue, NULL when partition is not assigned, guarded by pool lock
+    rd_kafka_queue_t   *rd_queue;
+    int                poller_no;
+
+    // batches of messages for TX thread
+    queue_t            *queue;
+    // batches which do not fit into full queue, partition is paused until they are pushed,
+    // guarded by pool lock
+    msg_batch_t        *backlog_head;
+    msg_batch_t        *backlog_tail;
+    // paused because of backlog, it is not resumed while consumer is paused by user or by watermarks
+    int                paused;
+
+    // batch which is partially taken by TX thread
+    msg_batch_t        *pending;
+    metrics_t          *metrics;
+} consumer_partition_t;
+
+struct partition_pool_t;
+
+typedef struct {
+    struct partition_pool_t *pool;
+    int                     no;
+    rd_kafka_queue_t        *rd_queue;
+    rd_kafka_message_t      **rd_msgs;
+    // partition of last polled message, partitions are never freed while pool is alive
+    consumer_partition_t    *last;
+    _Atomic int             should_stop;
+    pthread_t               thread;
+} partition_poller_t;
+
+typedef struct partition_pool_t {
+    rd_kafka_t           *rd_consumer;
+    event_queues_t       *event_queues;
+    // not NULL when consumer is in zero copy mode
+    msg_tracker_t        *tracker;
+    int                  batch_size;
+    // counters of consumer poller which watermarks are applied to, decreased by TX thread
+    _Atomic long         *pending_msgs;
+    _Atomic long         *pending_bytes;
+
+    // known partitions are only appended, revoked ones are kept for the case of further assign
+    pthread_mutex_t      lock;
+    consumer_partition_t **partitions;
+    int                  count;
+    int                  capacity;
+
+    // count of partitions with not empty backlog
+    _Atomic int          backlogged;
+
+    partition_poller_t   **pollers;
+    int                  pollers_count;
+    int                  next_poller;
+
+    // partition which is read by TX thread and its position
+    consumer_partition_t *current;
+    int                  cursor;
+} partition_pool_t;
+
+/**
+ * Create pool and start poller threads
+ * @param rd_consumer
+ * @param tracker NULL if messages are copied
+ * @param threads count of poller threads
+ * @param batch_size
+ * @param pending_msgs counter of pending messages increased by pushes of pollers, may be NULL
+ * @param pending_bytes counter of pending bytes, may be NULL
+ * @return
+ */
+partition_pool_t *
+new_partition_pool(rd_kafka_t *rd_consumer, msg_tracker_t *tracker, int threads, int batch_size,
+                   _Atomic long *pending_msgs, _Atomic long *pending_bytes);
+
+/**
+ * Forward queues of newly assigned partitions to poller threads, called from rebalance callback
+ * @param arg pool
+ * @param partitions
+ */
+void
+partition_pool_assign(void *arg, rd_kafka_topic_partition_list_t *partitions);
+
+/**
+ * Detach queues of revoked partitions, called from rebalance callback
+ * @param arg pool
+ * @param partitions NULL for all partitions
+ */
+void
+partition_pool_revoke(void *arg, rd_kafka_topic_partition_list_t *partitions);
+
+/**
+ * Remove partitions paused because of their backlogs from list of partitions to resume,
+ * called with pause lock of consumer
+ * @param arg pool
+ * @param partitions
+ */
+void
+partition_pool_resume_filter(void *arg, rd_kafka_topic_partition_list_t *partitions);
+
+/**
+ * Find partition, must be called from TX thread only
+ * @param pool
+ * @param topic
+ * @param partition
+ * @return NULL if partition has never been assigned
+ */
+consumer_partition_t *
+partition_pool_get(partition_pool_t *pool, const char *topic, int32_t partition);
+
+/**
+ * Take next message of given partition, must be called from TX thread only
+ * @param partition
+ * @return
+ */
+msg_t *
+consumer_partition_pop_msg(consumer_partition_t *partition);
+
+/**
+ * Take next message of any partition switching partitions by batches, must be called from TX thread only
+ * @param pool
+ * @return
+ */
+msg_t *
+partition_pool_pop_msg(partition_pool_t *pool);
+
+int
+partition_pool_has_msgs(partition_pool_t *pool);
+
+/**
+ * Unlink next batch left in backlog of any partition, must be called after pool is stopped
+ * @param pool
+ * @return NULL when backlogs are empty
+ */
+msg_batch_t *
+partition_pool_take_backlog(partition_pool_t *pool);
+
+/**
+ * Stop poller threads and release queue handles, blocks so must be called via coio_call
+ * @param pool
+ */
+void
+stop_partition_pool(partition_pool_t *pool);
+
+/**
+ * Destroy pool and all not taken messages, pool must be stopped before
+ * @param pool
+ */
+void
+destroy_partition_pool(partition_pool_t *pool);
+
+#endif // TNT_KAFKA_PARTITIONS_H
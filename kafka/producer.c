@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdio.h>
 
 #include <librdkafka/rdkafka.h>
 #include <tarantool/module.h>
@@ -9,6 +10,8 @@
 #include <common.h>
 #include <callbacks.h>
 #include <queue.h>
+#include <consumer.h>
+#include <abi.h>
 
 #include "producer.h"
 
@@ -20,10 +23,12 @@
 
 static void *
 producer_poll_loop(void *arg) {
-    set_thread_name("kafka_producer");
-
     producer_poller_t *poller = arg;
-    int count = 0;
+    event_queues_t *event_queues = rd_kafka_opaque(poller->rd_producer);
+
+    char errstr[256];
+    if (thread_options_apply(event_queues->thread_options, "kafka_producer", "kprod", errstr, sizeof(errstr)) != 0)
+        error_callback(poller->rd_producer, RD_KAFKA_RESP_ERR__FAIL, errstr, event_queues);
     int should_stop = 0;
 
     while (true) {
@@ -39,29 +44,53 @@ producer_poll_loop(void *arg) {
             }
         }
 
-        {
-            count = rd_kafka_poll(poller->rd_producer, 1000);
-            if (count == 0) {
-                // throttling calls with 100ms sleep
-                usleep(100000);
-            }
-        }
+        // there is no need to sleep on empty poll, rd_kafka_poll is woken up as soon as event arrives
+        if (rd_kafka_poll(poller->rd_producer, 1000) == 0)
+            metrics_inc(&event_queues->metrics.empty_polls, 1);
     }
 
     pthread_exit(NULL);
 }
 
+/**
+ * Serve main queue from shared runtime thread without blocking
+ */
+static int
+producer_poller_serve(void *arg) {
+    producer_poller_t *poller = arg;
+    for (int i = 0; i < PRODUCER_SERVE_MAX_EVENTS; i++) {
+        if (rd_kafka_poll(poller->rd_producer, 0) == 0)
+            return 0;
+    }
+    // the rest of events is served after other queues of runtime thread
+    return 1;
+}
+
 static producer_poller_t *
-new_producer_poller(rd_kafka_t *rd_producer) {
+new_producer_poller(rd_kafka_t *rd_producer, runtime_t *runtime) {
     producer_poller_t *poller = malloc(sizeof(producer_poller_t));
     if (poller == NULL)
         return NULL;
 
     poller->rd_producer = rd_producer;
+    poller->rd_queue = NULL;
+    poller->handle = NULL;
     poller->should_stop = 0;
 
     pthread_mutex_init(&poller->lock, NULL);
     pthread_attr_init(&poller->attr);
+
+    if (runtime != NULL) {
+        poller->rd_queue = rd_kafka_queue_get_main(rd_producer);
+        poller->handle = runtime_attach(runtime, poller->rd_queue, producer_poller_serve, poller);
+        if (poller->handle == NULL) {
+            rd_kafka_queue_destroy(poller->rd_queue);
+            free(poller);
+            return NULL;
+        }
+        return poller;
+    }
+
     pthread_attr_setdetachstate(&poller->attr, PTHREAD_CREATE_JOINABLE);
     int rc = pthread_create(&poller->thread, &poller->attr, producer_poll_loop, (void *)poller);
     if (rc < 0) {
@@ -75,12 +104,24 @@ new_producer_poller(rd_kafka_t *rd_producer) {
 static ssize_t
 stop_poller(va_list args) {
     producer_poller_t *poller = va_arg(args, producer_poller_t *);
+    if (poller->handle != NULL) {
+        runtime_detach(poller->handle);
+        poller->handle = NULL;
+        // queue handle keeps reference to producer, so it must be released before destroy
+        rd_kafka_queue_destroy(poller->rd_queue);
+        poller->rd_queue = NULL;
+        return 0;
+    }
+
     pthread_mutex_lock(&poller->lock);
 
     poller->should_stop = 1;
 
     pthread_mutex_unlock(&poller->lock);
 
+    // interrupting blocking poll
+    rd_kafka_yield(poller->rd_producer);
+
     pthread_join(poller->thread, NULL);
 
     return 0;
@@ -101,20 +142,69 @@ destroy_producer_poller(producer_poller_t *poller) {
  * Producer
  */
 
+static inline uint32_t
+producer_topic_hash(const char *name) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline void
+producer_topics_index_insert(producer_topics_t *topics, int32_t element_no) {
+    uint32_t mask = topics->index_capacity - 1;
+    uint32_t slot = topics->hashes[element_no] & mask;
+    while (topics->index[slot] != 0)
+        slot = (slot + 1) & mask;
+    // zero marks empty slot, so element numbers are stored shifted by one
+    topics->index[slot] = element_no + 1;
+}
+
+static int
+producer_topics_reindex(producer_topics_t *topics, int32_t index_capacity) {
+    int32_t *index = calloc(index_capacity, sizeof(int32_t));
+    if (index == NULL)
+        return 1;
+
+    free(topics->index);
+    topics->index = index;
+    topics->index_capacity = index_capacity;
+    for (int32_t i = 0; i < topics->count; i++)
+        producer_topics_index_insert(topics, i);
+    return 0;
+}
+
 producer_topics_t *
 new_producer_topics(int32_t capacity) {
-    rd_kafka_topic_t **elements;
-    elements = malloc(sizeof(rd_kafka_topic_t *) * capacity);
-    if (elements == NULL)
+    producer_topics_t *topics = calloc(1, sizeof(producer_topics_t));
+    if (topics == NULL)
         return NULL;
 
-    producer_topics_t *topics;
-    topics = malloc(sizeof(producer_topics_t));
+    topics->elements = malloc(sizeof(rd_kafka_topic_t *) * capacity);
+    topics->hashes = malloc(sizeof(uint32_t) * capacity);
+    if (topics->elements == NULL || topics->hashes == NULL)
+        goto error;
+
     topics->capacity = capacity;
     topics->count = 0;
-    topics->elements = elements;
+
+    // index is kept at most half full, so probe sequences stay short
+    int32_t index_capacity = 16;
+    while (index_capacity < capacity * 2)
+        index_capacity <<= 1;
+    if (producer_topics_reindex(topics, index_capacity) != 0)
+        goto error;
 
     return topics;
+
+error:
+    free(topics->elements);
+    free(topics->hashes);
+    free(topics);
+    return NULL;
 }
 
 int
@@ -126,20 +216,39 @@ add_producer_topics(producer_topics_t *topics, rd_kafka_topic_t *element) {
             return 1;
         }
         topics->elements = new_elements;
+
+        uint32_t *new_hashes = realloc(topics->hashes, sizeof(uint32_t) * topics->capacity * 2);
+        if (new_hashes == NULL) {
+            printf("realloc failed to relloc topic hashes array.");
+            return 1;
+        }
+        topics->hashes = new_hashes;
         topics->capacity *= 2;
+
+        if (topics->index_capacity < topics->capacity * 2 &&
+            producer_topics_reindex(topics, topics->capacity * 2) != 0) {
+            printf("failed to grow topics index.");
+            return 1;
+        }
     }
-    topics->elements[topics->count++] = element;
+    topics->elements[topics->count] = element;
+    topics->hashes[topics->count] = producer_topic_hash(rd_kafka_topic_name(element));
+    producer_topics_index_insert(topics, topics->count);
+    topics->count++;
     return 0;
 }
 
 static rd_kafka_topic_t *
 find_producer_topic_by_name(producer_topics_t *topics, const char *name) {
-    rd_kafka_topic_t *topic;
-    for (int i = 0; i < topics->count; i++) {
-        topic = topics->elements[i];
-        if (strcmp(rd_kafka_topic_name(topic), name) == 0) {
+    uint32_t hash = producer_topic_hash(name);
+    uint32_t mask = topics->index_capacity - 1;
+    for (uint32_t slot = hash & mask; topics->index[slot] != 0; slot = (slot + 1) & mask) {
+        int32_t element_no = topics->index[slot] - 1;
+        if (topics->hashes[element_no] != hash)
+            continue;
+        rd_kafka_topic_t *topic = topics->elements[element_no];
+        if (strcmp(rd_kafka_topic_name(topic), name) == 0)
             return topic;
-        }
     }
     return NULL;
 }
@@ -153,6 +262,8 @@ destroy_producer_topics(producer_topics_t *topics) {
     }
 
     free(topics->elements);
+    free(topics->hashes);
+    free(topics->index);
     free(topics);
 }
 
@@ -171,6 +282,106 @@ lua_producer_tostring(struct lua_State *L) {
     return 1;
 }
 
+int
+lua_producer_raw(struct lua_State *L) {
+    producer_t *producer = lua_check_producer(L, 1);
+    *(void **)luaL_pushcdata(L, luaL_ctypeid(L, "void *")) = producer;
+    return 1;
+}
+
+static inline void
+producer_add_waiter(producer_t *producer, dr_msg_t *dr_msg) {
+    dr_msg->prev = NULL;
+    dr_msg->next = producer->waiters;
+    if (producer->waiters != NULL)
+        producer->waiters->prev = dr_msg;
+    producer->waiters = dr_msg;
+}
+
+static inline void
+producer_remove_waiter(producer_t *producer, dr_msg_t *dr_msg) {
+    if (dr_msg->prev != NULL)
+        dr_msg->prev->next = dr_msg->next;
+    else if (producer->waiters == dr_msg)
+        producer->waiters = dr_msg->next;
+    if (dr_msg->next != NULL)
+        dr_msg->next->prev = dr_msg->prev;
+    dr_msg->prev = NULL;
+    dr_msg->next = NULL;
+}
+
+/**
+ * Passes delivery report to the waiting fiber, waiter frees it.
+ * Report is freed here when fiber has given up waiting.
+ */
+static void
+producer_complete_waiter(producer_t *producer, dr_msg_t *dr_msg) {
+    producer_remove_waiter(producer, dr_msg);
+    if (dr_msg->fiber == NULL) {
+        destroy_dr_msg(dr_msg);
+        return;
+    }
+    dr_msg->done = 1;
+    fiber_wakeup(dr_msg->fiber);
+}
+
+/**
+ * Calls delivery report callback once with array of reports
+ * @return count of reports
+ */
+static int
+lua_producer_call_dr_reports(struct lua_State *L, producer_t *producer, int limit, char **err_str) {
+    queue_t *queue = producer->event_queues->queues[DELIVERY_REPORT_QUEUE];
+    if (queue == NULL)
+        return 0;
+
+    int count = 0;
+    dr_report_t *reports[PRODUCER_POLL_BATCH_SIZE];
+    lua_rawgeti(L, LUA_REGISTRYINDEX, producer->event_queues->cb_refs[DELIVERY_REPORT_QUEUE]);
+    lua_createtable(L, limit < PRODUCER_POLL_BATCH_SIZE ? limit : PRODUCER_POLL_BATCH_SIZE, 0);
+    while (count < limit) {
+        int batch_limit = limit - count;
+        if (batch_limit > PRODUCER_POLL_BATCH_SIZE)
+            batch_limit = PRODUCER_POLL_BATCH_SIZE;
+
+        int popped = queue_pop_batch(queue, (void **)reports, batch_limit);
+        for (int i = 0; i < popped; i++) {
+            dr_report_t *report = reports[i];
+            lua_createtable(L, 0, 5);
+
+            lua_pushstring(L, rd_kafka_topic_name(report->topic));
+            lua_setfield(L, -2, "topic");
+            lua_pushinteger(L, report->partition);
+            lua_setfield(L, -2, "partition");
+            luaL_pushint64(L, report->offset);
+            lua_setfield(L, -2, "offset");
+            luaL_pushint64(L, report->latency);
+            lua_setfield(L, -2, "latency");
+            if (report->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+                lua_pushstring(L, rd_kafka_err2str(report->err));
+                lua_setfield(L, -2, "err");
+            }
+
+            lua_rawseti(L, -2, ++count);
+            destroy_dr_report(report);
+        }
+
+        if (popped < batch_limit)
+            break;
+    }
+
+    if (count == 0) {
+        // pop table and callback
+        lua_pop(L, 2);
+        return 0;
+    }
+
+    /* do the call (1 arguments, 0 result) */
+    if (lua_pcall(L, 1, 0, 0) != 0)
+        *err_str = (char *)lua_tostring(L, -1);
+    return count;
+}
+
 int
 lua_producer_msg_delivery_poll(struct lua_State *L) {
     if (lua_gettop(L) != 2)
@@ -181,33 +392,52 @@ lua_producer_msg_delivery_poll(struct lua_State *L) {
     int events_limit = lua_tonumber(L, 2);
     int callbacks_count = 0;
     char *err_str = NULL;
-    dr_msg_t *dr_msg = NULL;
-
-    pthread_mutex_lock(&producer->event_queues->delivery_queue->lock);
+    dr_msg_t *dr_msgs[PRODUCER_POLL_BATCH_SIZE];
 
     while (events_limit > callbacks_count) {
-        dr_msg = queue_lockfree_pop(producer->event_queues->delivery_queue);
-        if (dr_msg == NULL)
-            break;
-        callbacks_count += 1;
-        lua_rawgeti(L, LUA_REGISTRYINDEX, dr_msg->dr_callback);
-        if (dr_msg->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
-            lua_pushstring(L, rd_kafka_err2str(dr_msg->err));
-        } else {
-            lua_pushnil(L);
-        }
-        /* do the call (1 arguments, 0 result) */
-        if (lua_pcall(L, 1, 0, 0) != 0) {
-            err_str = (char *)lua_tostring(L, -1);
+        int limit = events_limit - callbacks_count;
+        if (limit > PRODUCER_POLL_BATCH_SIZE)
+            limit = PRODUCER_POLL_BATCH_SIZE;
+
+        int count = queue_pop_batch(producer->event_queues->delivery_queue, (void **)dr_msgs, limit);
+        // overflow queue is drained after bounded one, reports are not ordered anyway
+        if (count < limit && producer->event_queues->delivery_overflow != NULL)
+            count += queue_pop_batch(producer->event_queues->delivery_overflow, (void **)dr_msgs + count,
+                                     limit - count);
+        // whole popped batch is processed even on error, otherwise callbacks are lost
+        for (int i = 0; i < count; i++) {
+            dr_msg_t *dr_msg = dr_msgs[i];
+            callbacks_count += 1;
+            if (dr_msg->dr_callback == LUA_REFNIL) {
+                producer_complete_waiter(producer, dr_msg);
+                continue;
+            }
+            lua_rawgeti(L, LUA_REGISTRYINDEX, dr_msg->dr_callback);
+            if (dr_msg->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+                lua_pushstring(L, rd_kafka_err2str(dr_msg->err));
+            } else {
+                lua_pushnil(L);
+            }
+            /* do the call (1 arguments, 0 result) */
+            if (lua_pcall(L, 1, 0, 0) != 0) {
+                if (err_str == NULL)
+                    err_str = (char *)lua_tostring(L, -1);
+                else
+                    lua_pop(L, 1);
+            }
+            luaL_unref(L, LUA_REGISTRYINDEX, dr_msg->dr_callback);
+            destroy_dr_msg(dr_msg);
         }
-        luaL_unref(L, LUA_REGISTRYINDEX, dr_msg->dr_callback);
-        destroy_dr_msg(dr_msg);
-        if (err_str != NULL) {
+
+        if (err_str != NULL || count < limit) {
             break;
         }
     }
 
-    pthread_mutex_unlock(&producer->event_queues->delivery_queue->lock);
+    if (err_str == NULL) {
+        int reports_count = lua_producer_call_dr_reports(L, producer, events_limit, &err_str);
+        callbacks_count += reports_count;
+    }
 
     lua_pushnumber(L, (double)callbacks_count);
     if (err_str != NULL) {
@@ -218,53 +448,171 @@ lua_producer_msg_delivery_poll(struct lua_State *L) {
     return 2;
 }
 
+int
+lua_producer_wait_msg_delivery(struct lua_State *L) {
+    if (lua_gettop(L) != 2)
+        luaL_error(L, "Usage: producer:wait_msg_delivery(timeout)");
+
+    producer_t *producer = lua_check_producer(L, 1);
+    double timeout = lua_tonumber(L, 2);
+
+    queue_t *reports_queue = producer->event_queues->queues[DELIVERY_REPORT_QUEUE];
+    if (reports_queue == NULL) {
+        queue_wait(producer->event_queues->delivery_queue, timeout);
+    } else {
+        // both queues share notifier, so waiting until any of them gets events
+        notifier_t *notifier = producer->event_queues->notifier;
+        if (notifier == NULL) {
+            fiber_sleep(timeout);
+        } else {
+            notifier_prepare(notifier);
+            if (queue_count(producer->event_queues->delivery_queue) > 0 || queue_count(reports_queue) > 0)
+                notifier_cancel(notifier);
+            else
+                notifier_wait(notifier, timeout);
+        }
+    }
+    if (fiber_is_cancelled())
+        return luaL_error(L, "fiber is cancelled");
+    return 0;
+}
+
 LUA_RDKAFKA_POLL_FUNC(producer, poll_logs, LOG_QUEUE, destroy_log_msg, push_log_cb_args)
-LUA_RDKAFKA_POLL_FUNC(producer, poll_stats, STATS_QUEUE, free, push_stats_cb_args)
+LUA_RDKAFKA_POLL_FUNC(producer, poll_stats, STATS_QUEUE, destroy_stats_msg, push_stats_cb_args)
 LUA_RDKAFKA_POLL_FUNC(producer, poll_errors, ERROR_QUEUE, destroy_error_msg, push_errors_cb_args)
 
-int
-lua_producer_produce(struct lua_State *L) {
-    if (lua_gettop(L) != 2 || !lua_istable(L, 2))
-        luaL_error(L, "Usage: err = producer:produce(msg)");
+/**
+ * Fields of message which is going to be produced, strings are owned by lua
+ */
+typedef struct {
+    const char         *topic;
+    char               *key;
+    size_t             key_len;
+    char               *value;
+    size_t             value_len;
+    rd_kafka_headers_t *hdrs;
+    // value encoded by producer codec and copies of numeric key and value,
+    // owned by message until they are copied by rd_kafka
+    char               *owned;
+    // RD_KAFKA_PARTITION_UA when partition is chosen by partitioner
+    int32_t            partition;
+} producer_msg_t;
+
+static void
+destroy_producer_msg(producer_msg_t *msg) {
+    if (msg->hdrs != NULL)
+        rd_kafka_headers_destroy(msg->hdrs);
+    msg->hdrs = NULL;
+    free(msg->owned);
+    msg->owned = NULL;
+}
+
+/**
+ * Encode value on top of the stack with producer codec
+ */
+static const char *
+lua_encode_producer_value(struct lua_State *L, const codec_t *codec, producer_msg_t *msg) {
+    // error is pushed to Lua right away, TX thread only
+    static char errstr[256];
+    codec_buf_t buf = {NULL, 0, 0};
+    if (lua_codec_encode(L, -1, codec, &buf, errstr, sizeof(errstr)) != 0) {
+        free(buf.data);
+        return errstr;
+    }
+    msg->owned = buf.data;
+    msg->value = buf.data;
+    msg->value_len = buf.size;
+    return NULL;
+}
+
+/**
+ * Numbers of key and value on top of the stack are converted to new strings, which are not anchored
+ * after pop, while batch keeps pointers until the whole run is produced, so they are copied
+ */
+static const char *
+lua_own_producer_msg_numbers(struct lua_State *L, producer_msg_t *msg) {
+    int key_converted = lua_type(L, -2) == LUA_TNUMBER;
+    int value_converted = msg->owned == NULL && lua_type(L, -1) == LUA_TNUMBER;
+    if (!key_converted && !value_converted)
+        return NULL;
+
+    size_t encoded_len = msg->owned != NULL ? msg->value_len : 0;
+    size_t size = encoded_len + (key_converted ? msg->key_len : 0) + (value_converted ? msg->value_len : 0);
+    char *owned = realloc(msg->owned, size);
+    if (owned == NULL)
+        return "failed to allocate producer message";
+
+    char *pos = owned + encoded_len;
+    if (msg->owned != NULL)
+        msg->value = owned;
+    if (value_converted) {
+        memcpy(pos, msg->value, msg->value_len);
+        msg->value = pos;
+        pos += msg->value_len;
+    }
+    if (key_converted) {
+        memcpy(pos, msg->key, msg->key_len);
+        msg->key = pos;
+    }
+    msg->owned = owned;
+    return NULL;
+}
+
+static const char *
+lua_read_producer_msg_fields(struct lua_State *L, const codec_t *codec, producer_msg_t *msg) {
+    lua_pushliteral(L, "partition");
+    lua_gettable(L, -2);
+    if (!lua_isnil(L, -1)) {
+        if (lua_type(L, -1) != LUA_TNUMBER || lua_tointeger(L, -1) < 0 || lua_tointeger(L, -1) > INT32_MAX) {
+            lua_pop(L, 1);
+            return "producer message 'partition' must be non negative number";
+        }
+        msg->partition = (int32_t)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
 
     lua_pushliteral(L, "topic");
     lua_gettable(L, -2);
-    const char *topic = lua_tostring(L, -1);
+    msg->topic = lua_tostring(L, -1);
     lua_pop(L, 1);
-    if (topic == NULL) {
-        lua_pushliteral(L, "producer message must contains non nil 'topic' key");
-        return 1;
-    }
+    if (msg->topic == NULL)
+        return "producer message must contains non nil 'topic' key";
 
+    // key and value stay on the stack until strings which are not anchored by message table are copied
     lua_pushliteral(L, "key");
     lua_gettable(L, -2);
-    size_t key_len;
     // rd_kafka will copy key so no need to worry about this cast
-    char *key = (char *)lua_tolstring(L, -1, &key_len);
-
-    lua_pop(L, 1);
+    msg->key = (char *)lua_tolstring(L, -1, &msg->key_len);
 
     lua_pushliteral(L, "value");
-    lua_gettable(L, -2);
-    size_t value_len;
-    // rd_kafka will copy value so no need to worry about this cast
-    char *value = (char *)lua_tolstring(L, -1, &value_len);
+    lua_gettable(L, -3);
+    if (codec != NULL && !lua_isnil(L, -1) && lua_type(L, -1) != LUA_TSTRING) {
+        // strings are passed as already encoded values
+        const char *err = lua_encode_producer_value(L, codec, msg);
+        if (err != NULL) {
+            lua_pop(L, 2);
+            return err;
+        }
+    } else {
+        // rd_kafka will copy value so no need to worry about this cast
+        msg->value = (char *)lua_tolstring(L, -1, &msg->value_len);
+    }
 
-    lua_pop(L, 1);
+    const char *err = lua_own_producer_msg_numbers(L, msg);
+    lua_pop(L, 2);
+    if (err != NULL)
+        return err;
 
-    if (key == NULL && value == NULL) {
-        lua_pushliteral(L, "producer message must contains non nil key or value");
-        return 1;
-    }
+    if (msg->key == NULL && msg->value == NULL)
+        return "producer message must contains non nil key or value";
 
-    rd_kafka_headers_t *hdrs = NULL;
     lua_pushliteral(L, "headers");
     lua_gettable(L, -2);
     if (lua_istable(L, -1)) {
-        hdrs = rd_kafka_headers_new(8);
-        if (hdrs == NULL) {
-            lua_pushliteral(L, "failed to allocate kafka headers");
-            return 1;
+        msg->hdrs = rd_kafka_headers_new(8);
+        if (msg->hdrs == NULL) {
+            lua_pop(L, 1);
+            return "failed to allocate kafka headers";
         }
 
         lua_pushnil(L);
@@ -275,69 +623,223 @@ lua_producer_produce(struct lua_State *L) {
             const char *hdr_key = lua_tolstring(L, -2, &hdr_key_len);
 
             rd_kafka_resp_err_t err = rd_kafka_header_add(
-                    hdrs, hdr_key, hdr_key_len, hdr_value, hdr_value_len);
+                    msg->hdrs, hdr_key, hdr_key_len, hdr_value, hdr_value_len);
             if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
-                lua_pushliteral(L, "failed to add kafka headers");
-                goto error;
+                // pop value, key and headers table
+                lua_pop(L, 3);
+                rd_kafka_headers_destroy(msg->hdrs);
+                msg->hdrs = NULL;
+                return "failed to add kafka headers";
             }
 
             lua_pop(L, 1);
         }
+    } else if (lua_isuserdata(L, -1)) {
+        // prebuilt headers are copied as a whole
+        if (lua_copy_headers_template(L, -1, &msg->hdrs) != 0) {
+            lua_pop(L, 1);
+            return "producer message headers must be table or headers created by kafka.Headers.create";
+        }
     }
 
     lua_pop(L, 1);
+    return NULL;
+}
 
-    // create delivery callback queue if got msg id
-    dr_msg_t *dr_msg = NULL;
+/**
+ * Reads message from table on top of the stack, stack stays unchanged.
+ * Returns error string on failure, nothing has to be freed then.
+ */
+static const char *
+lua_read_producer_msg(struct lua_State *L, const codec_t *codec, producer_msg_t *msg) {
+    memset(msg, 0, sizeof(producer_msg_t));
+    msg->partition = RD_KAFKA_PARTITION_UA;
+    const char *err = lua_read_producer_msg_fields(L, codec, msg);
+    if (err != NULL)
+        destroy_producer_msg(msg);
+    return err;
+}
+
+/**
+ * Creates delivery report message if table on top of the stack contains delivery callback
+ */
+static const char *
+lua_read_producer_dr_msg(struct lua_State *L, producer_t *producer, dr_msg_t **dr_msg) {
+    *dr_msg = NULL;
     lua_pushliteral(L, "dr_callback");
     lua_gettable(L, -2);
     if (lua_isfunction(L, -1)) {
-        dr_msg = new_dr_msg(luaL_ref(L, LUA_REGISTRYINDEX), RD_KAFKA_RESP_ERR_NO_ERROR);
-        if (dr_msg == NULL) {
-            lua_pushliteral(L, "failed to create callback message");
-            goto error;
+        int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        *dr_msg = new_dr_msg(producer->event_queues->slab, ref, RD_KAFKA_RESP_ERR_NO_ERROR);
+        if (*dr_msg == NULL) {
+            luaL_unref(L, LUA_REGISTRYINDEX, ref);
+            return "failed to create callback message";
         }
     } else {
         lua_pop(L, 1);
     }
+    return NULL;
+}
 
-    // pop msg
-    lua_pop(L, 1);
+static void
+lua_destroy_producer_dr_msg(struct lua_State *L, dr_msg_t *dr_msg) {
+    if (dr_msg == NULL)
+        return;
+    luaL_unref(L, LUA_REGISTRYINDEX, dr_msg->dr_callback);
+    destroy_dr_msg(dr_msg);
+}
 
-    producer_t *producer = lua_check_producer(L, 1);
+static rd_kafka_topic_t *
+producer_get_topic(producer_t *producer, const char *topic, const char **err) {
     rd_kafka_topic_t *rd_topic = find_producer_topic_by_name(producer->topics, topic);
     if (rd_topic == NULL) {
         rd_topic = rd_kafka_topic_new(producer->rd_producer, topic, NULL);
         if (rd_topic == NULL) {
-            lua_pushstring(L, rd_kafka_err2str(rd_kafka_last_error()));
-            goto error;
+            *err = rd_kafka_err2str(rd_kafka_last_error());
+            return NULL;
         }
         if (add_producer_topics(producer->topics, rd_topic) != 0) {
-            lua_pushstring(L, "Unexpected error: failed to add new topic to topic list!");
-            goto error;
+            *err = "Unexpected error: failed to add new topic to topic list!";
+            return NULL;
         }
     }
+    return rd_topic;
+}
 
+/**
+ * @return start time of sampled produce call or -1
+ */
+static inline int64_t
+producer_call_started(producer_t *producer) {
+    return producer->produce_calls++ % METRICS_PRODUCE_SAMPLE_RATE == 0 ? metrics_now_us() : -1;
+}
+
+static inline void
+producer_call_finished(producer_t *producer, int64_t started_at) {
+    if (started_at >= 0)
+        metrics_histogram_observe(&producer->event_queues->metrics.produce_call_us, metrics_now_us() - started_at);
+}
+
+/**
+ * Produces single message, headers are taken by rd_kafka on success and destroyed on failure
+ */
+static rd_kafka_resp_err_t
+producer_produce_msg(producer_t *producer, rd_kafka_topic_t *rd_topic, producer_msg_t *msg, dr_msg_t *dr_msg) {
+    int64_t started_at = producer_call_started(producer);
     rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
-    if (hdrs == NULL) {
-        int rc = rd_kafka_produce(rd_topic, -1, RD_KAFKA_MSG_F_COPY, value, value_len, key, key_len, dr_msg);
+    if (msg->hdrs == NULL) {
+        int rc = rd_kafka_produce(rd_topic, msg->partition, RD_KAFKA_MSG_F_COPY,
+                                  msg->value, msg->value_len, msg->key, msg->key_len, dr_msg);
         if (rc != 0)
             err = rd_kafka_last_error();
     } else {
         err = rd_kafka_producev(
                 producer->rd_producer,
                 RD_KAFKA_V_RKT(rd_topic),
-                RD_KAFKA_V_PARTITION(-1),
+                RD_KAFKA_V_PARTITION(msg->partition),
                 RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
-                RD_KAFKA_V_VALUE(value, value_len),
-                RD_KAFKA_V_KEY(key, key_len),
-                RD_KAFKA_V_HEADERS(hdrs),
+                RD_KAFKA_V_VALUE(msg->value, msg->value_len),
+                RD_KAFKA_V_KEY(msg->key, msg->key_len),
+                RD_KAFKA_V_HEADERS(msg->hdrs),
                 RD_KAFKA_V_OPAQUE(dr_msg),
                 RD_KAFKA_V_END);
         if (err != RD_KAFKA_RESP_ERR_NO_ERROR)
-            rd_kafka_headers_destroy(hdrs);
+            rd_kafka_headers_destroy(msg->hdrs);
+    }
+    msg->hdrs = NULL;
+    // value is copied by rd_kafka
+    free(msg->owned);
+    msg->owned = NULL;
+    producer_call_finished(producer, started_at);
+    return err;
+}
+
+int
+lua_producer_produce(struct lua_State *L) {
+    if (lua_gettop(L) != 2 || !lua_istable(L, 2))
+        luaL_error(L, "Usage: err = producer:produce(msg)");
+
+    producer_t *producer = lua_check_producer(L, 1);
+    producer_msg_t msg;
+    const char *err_str = lua_read_producer_msg(L, producer->event_queues->value_codec, &msg);
+    if (err_str != NULL) {
+        lua_pushstring(L, err_str);
+        return 1;
+    }
+
+    // create delivery callback queue if got msg id
+    dr_msg_t *dr_msg = NULL;
+    err_str = lua_read_producer_dr_msg(L, producer, &dr_msg);
+    if (err_str != NULL)
+        goto error;
+
+    // pop msg
+    lua_pop(L, 1);
+
+    rd_kafka_topic_t *rd_topic = producer_get_topic(producer, msg.topic, &err_str);
+    if (rd_topic == NULL)
+        goto error;
+
+    rd_kafka_resp_err_t err = producer_produce_msg(producer, rd_topic, &msg, dr_msg);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        lua_destroy_producer_dr_msg(L, dr_msg);
+        lua_pushstring(L, rd_kafka_err2str(err));
+        return 1;
+    }
+    return 0;
+
+error:
+    destroy_producer_msg(&msg);
+    lua_destroy_producer_dr_msg(L, dr_msg);
+    lua_pushstring(L, err_str);
+    return 1;
+}
+
+int
+lua_producer_produce_sync(struct lua_State *L) {
+    if (lua_gettop(L) != 2 || !lua_istable(L, 2))
+        luaL_error(L, "Usage: err = producer:produce_sync(msg)");
+
+    producer_t *producer = lua_check_producer(L, 1);
+    producer_msg_t msg;
+    const char *err_str = lua_read_producer_msg(L, producer->event_queues->value_codec, &msg);
+    if (err_str != NULL) {
+        lua_pushstring(L, err_str);
+        return 1;
     }
 
+    rd_kafka_topic_t *rd_topic = producer_get_topic(producer, msg.topic, &err_str);
+    if (rd_topic == NULL)
+        goto error;
+
+    // delivery report wakes up current fiber directly without any lua objects
+    dr_msg_t *dr_msg = new_dr_msg(producer->event_queues->slab, LUA_REFNIL, RD_KAFKA_RESP_ERR_NO_ERROR);
+    if (dr_msg == NULL) {
+        err_str = "failed to create callback message";
+        goto error;
+    }
+    dr_msg->fiber = fiber_self();
+
+    rd_kafka_resp_err_t err = producer_produce_msg(producer, rd_topic, &msg, dr_msg);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        destroy_dr_msg(dr_msg);
+        lua_pushstring(L, rd_kafka_err2str(err));
+        return 1;
+    }
+
+    producer_add_waiter(producer, dr_msg);
+    while (!dr_msg->done) {
+        fiber_yield();
+        if (!dr_msg->done && fiber_is_cancelled()) {
+            // orphaned waiter stays in list, it is freed by delivery poll when report arrives
+            // or by destroy of producer when librdkafka never reports, e.g. after purge
+            dr_msg->fiber = NULL;
+            return luaL_error(L, "fiber is cancelled");
+        }
+    }
+
+    err = dr_msg->err;
+    destroy_dr_msg(dr_msg);
     if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
         lua_pushstring(L, rd_kafka_err2str(err));
         return 1;
@@ -345,8 +847,150 @@ lua_producer_produce(struct lua_State *L) {
     return 0;
 
 error:
-    if (hdrs != NULL)
-        rd_kafka_headers_destroy(hdrs);
+    destroy_producer_msg(&msg);
+    lua_pushstring(L, err_str);
+    return 1;
+}
+
+static inline void
+lua_set_failed_batch_msg(struct lua_State *L, int failed_index, int msg_index, const char *err) {
+    lua_pushstring(L, err);
+    lua_rawseti(L, failed_index, msg_index);
+}
+
+/**
+ * Submits run of messages to one topic at once, failed messages are added to failed table.
+ * Encoded values of run are freed as they are copied by rd_kafka.
+ */
+static int
+lua_producer_produce_run(struct lua_State *L, producer_t *producer, int failed_index, rd_kafka_topic_t *rd_topic,
+                         rd_kafka_message_t *rkmessages, int *indices, char **owned, int count) {
+    if (count == 0)
+        return 0;
+
+    int failed = 0;
+    int64_t started_at = producer_call_started(producer);
+    // messages keep own partitions, RD_KAFKA_PARTITION_UA ones are partitioned by partitioner
+    int produced = rd_kafka_produce_batch(rd_topic, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY | RD_KAFKA_MSG_F_PARTITION,
+                                          rkmessages, count);
+    producer_call_finished(producer, started_at);
+    for (int i = 0; i < count; i++) {
+        free(owned[i]);
+        owned[i] = NULL;
+    }
+    if (produced == count)
+        return 0;
+
+    for (int i = 0; i < count; i++) {
+        if (rkmessages[i].err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            failed++;
+            lua_set_failed_batch_msg(L, failed_index, indices[i], rd_kafka_err2str(rkmessages[i].err));
+            lua_destroy_producer_dr_msg(L, rkmessages[i]._private);
+        }
+    }
+    return failed;
+}
+
+int
+lua_producer_produce_batch(struct lua_State *L) {
+    if (lua_gettop(L) != 2 || !lua_istable(L, 2))
+        luaL_error(L, "Usage: failed, err = producer:produce_batch(msgs)");
+
+    producer_t *producer = lua_check_producer(L, 1);
+    int count = lua_objlen(L, 2);
+    if (count == 0)
+        return 0;
+
+    rd_kafka_message_t *rkmessages = calloc(count, sizeof(rd_kafka_message_t));
+    int *indices = malloc(count * sizeof(int));
+    char **owned = calloc(count, sizeof(char *));
+    if (rkmessages == NULL || indices == NULL || owned == NULL) {
+        free(rkmessages);
+        free(indices);
+        free(owned);
+        lua_pushnil(L);
+        lua_pushliteral(L, "failed to allocate messages batch");
+        return 2;
+    }
+
+    // table with errors of failed messages by their indexes
+    lua_newtable(L);
+    int failed_index = lua_gettop(L);
+    int failed = 0;
+
+    // consecutive messages to the same topic are submitted at once,
+    // messages with headers are produced one by one keeping order of messages
+    rd_kafka_topic_t *run_topic = NULL;
+    int run_count = 0;
+
+    for (int i = 1; i <= count; i++) {
+        lua_rawgeti(L, 2, i);
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_set_failed_batch_msg(L, failed_index, i, "producer message must be table");
+            failed++;
+            continue;
+        }
+
+        producer_msg_t msg;
+        dr_msg_t *dr_msg = NULL;
+        const char *err_str = lua_read_producer_msg(L, producer->event_queues->value_codec, &msg);
+        if (err_str == NULL)
+            err_str = lua_read_producer_dr_msg(L, producer, &dr_msg);
+
+        // pop msg
+        lua_pop(L, 1);
+
+        rd_kafka_topic_t *rd_topic = NULL;
+        if (err_str == NULL)
+            rd_topic = producer_get_topic(producer, msg.topic, &err_str);
+
+        if (err_str != NULL) {
+            destroy_producer_msg(&msg);
+            lua_destroy_producer_dr_msg(L, dr_msg);
+            lua_set_failed_batch_msg(L, failed_index, i, err_str);
+            failed++;
+            continue;
+        }
+
+        if (run_count > 0 && (rd_topic != run_topic || msg.hdrs != NULL)) {
+            failed += lua_producer_produce_run(L, producer, failed_index, run_topic, rkmessages, indices, owned, run_count);
+            run_count = 0;
+        }
+
+        if (msg.hdrs != NULL) {
+            // rd_kafka_produce_batch does not support headers
+            rd_kafka_resp_err_t err = producer_produce_msg(producer, rd_topic, &msg, dr_msg);
+            if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+                lua_destroy_producer_dr_msg(L, dr_msg);
+                lua_set_failed_batch_msg(L, failed_index, i, rd_kafka_err2str(err));
+                failed++;
+            }
+            continue;
+        }
+
+        rd_kafka_message_t *rkmessage = &rkmessages[run_count];
+        memset(rkmessage, 0, sizeof(rd_kafka_message_t));
+        rkmessage->payload = msg.value;
+        rkmessage->len = msg.value_len;
+        rkmessage->key = msg.key;
+        rkmessage->key_len = msg.key_len;
+        rkmessage->partition = msg.partition;
+        rkmessage->_private = dr_msg;
+        indices[run_count] = i;
+        owned[run_count] = msg.owned;
+        run_topic = rd_topic;
+        run_count++;
+    }
+
+    failed += lua_producer_produce_run(L, producer, failed_index, run_topic, rkmessages, indices, owned, run_count);
+
+    free(rkmessages);
+    free(indices);
+    free(owned);
+
+    if (failed == 0)
+        return 0;
     return 1;
 }
 
@@ -354,12 +998,28 @@ static ssize_t
 producer_flush(va_list args) {
     rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
     rd_kafka_t *rd_producer = va_arg(args, rd_kafka_t *);
-    while (true) {
-        err = rd_kafka_flush(rd_producer, 1000);
-        if (err != RD_KAFKA_RESP_ERR__TIMED_OUT) {
-            break;
+    int timeout_ms = va_arg(args, int);
+    int *undelivered = va_arg(args, int *);
+
+    // negative timeout means waiting until all messages are delivered
+    if (timeout_ms < 0) {
+        while (true) {
+            err = rd_kafka_flush(rd_producer, 1000);
+            if (err != RD_KAFKA_RESP_ERR__TIMED_OUT) {
+                break;
+            }
         }
+        return 0;
     }
+
+    if (rd_kafka_flush(rd_producer, timeout_ms) != RD_KAFKA_RESP_ERR__TIMED_OUT)
+        return 0;
+
+    // messages left after deadline are purged, so destroy does not wait for them,
+    // their delivery reports have __PURGE_QUEUE or __PURGE_INFLIGHT error
+    *undelivered = rd_kafka_outq_len(rd_producer);
+    rd_kafka_purge(rd_producer, RD_KAFKA_PURGE_F_QUEUE | RD_KAFKA_PURGE_F_INFLIGHT);
+    rd_kafka_poll(rd_producer, 0);
     return 0;
 }
 
@@ -377,6 +1037,12 @@ destroy_producer(struct lua_State *L, producer_t *producer) {
         producer->topics = NULL;
     }
 
+    // main queue handle of shared runtime must not outlive librdkafka handle
+    if (producer->poller != NULL && producer->poller->handle != NULL) {
+        destroy_producer_poller(producer->poller);
+        producer->poller = NULL;
+    }
+
     /*
      * Here we close producer and only then destroys other stuff.
      * Otherwise raise condition is possible when e.g.
@@ -394,6 +1060,30 @@ destroy_producer(struct lua_State *L, producer_t *producer) {
         producer->poller = NULL;
     }
 
+    dr_msg_t *dr_msg;
+    if (producer->event_queues != NULL) {
+        // waiting fibers get delivery reports which are not polled yet
+        queue_t *delivery_queues[] = {producer->event_queues->delivery_queue,
+                                      producer->event_queues->delivery_overflow};
+        for (size_t i = 0; i < sizeof(delivery_queues) / sizeof(delivery_queues[0]); i++) {
+            while (delivery_queues[i] != NULL && (dr_msg = queue_pop(delivery_queues[i])) != NULL) {
+                if (dr_msg->dr_callback == LUA_REFNIL) {
+                    producer_complete_waiter(producer, dr_msg);
+                } else {
+                    luaL_unref(L, LUA_REGISTRYINDEX, dr_msg->dr_callback);
+                    destroy_dr_msg(dr_msg);
+                }
+            }
+        }
+    }
+
+    // and the rest ones will never get reports, orphaned ones are freed
+    while (producer->waiters != NULL) {
+        dr_msg = producer->waiters;
+        dr_msg->err = RD_KAFKA_RESP_ERR__DESTROY;
+        producer_complete_waiter(producer, dr_msg);
+    }
+
     if (producer->event_queues != NULL) {
         destroy_event_queues(L, producer->event_queues);
         producer->event_queues = NULL;
@@ -410,17 +1100,172 @@ lua_producer_close(struct lua_State *L) {
         return 1;
     }
 
-    if ((*producer_p)->rd_producer != NULL) {
-        coio_call(producer_flush, (*producer_p)->rd_producer);
-    }
-
+    // stopping poller before flush, so delivery reports are pushed only from flushing thread
     if ((*producer_p)->poller != NULL) {
         destroy_producer_poller((*producer_p)->poller);
         (*producer_p)->poller = NULL;
     }
 
+    int undelivered = 0;
+    if ((*producer_p)->rd_producer != NULL) {
+        coio_call(producer_flush, (*producer_p)->rd_producer, luaL_optint(L, 2, -1), &undelivered);
+    }
+
     lua_pushboolean(L, 1);
-    return 1;
+    lua_pushnil(L);
+    lua_pushinteger(L, undelivered);
+    return 3;
+}
+
+/**
+ * Transactions
+ */
+
+/**
+ * Push error of transactional call and its kind: "fatal", "abort" when transaction must be aborted,
+ * "retriable" when call may be retried or nil otherwise
+ * @return count of pushed values
+ */
+static int
+lua_push_transaction_error(struct lua_State *L, rd_kafka_error_t *error) {
+    if (error == NULL)
+        return 0;
+
+    lua_pushstring(L, rd_kafka_error_string(error));
+    if (rd_kafka_error_is_fatal(error))
+        lua_pushliteral(L, "fatal");
+    else if (rd_kafka_error_txn_requires_abort(error))
+        lua_pushliteral(L, "abort");
+    else if (rd_kafka_error_is_retriable(error))
+        lua_pushliteral(L, "retriable");
+    else
+        lua_pushnil(L);
+    rd_kafka_error_destroy(error);
+    return 2;
+}
+
+static ssize_t
+wait_producer_init_transactions(va_list args) {
+    rd_kafka_t *rd_producer = va_arg(args, rd_kafka_t *);
+    int timeout_ms = va_arg(args, int);
+    rd_kafka_error_t **error = va_arg(args, rd_kafka_error_t **);
+    *error = rd_kafka_init_transactions(rd_producer, timeout_ms);
+    return 0;
+}
+
+static ssize_t
+wait_producer_commit_transaction(va_list args) {
+    rd_kafka_t *rd_producer = va_arg(args, rd_kafka_t *);
+    int timeout_ms = va_arg(args, int);
+    rd_kafka_error_t **error = va_arg(args, rd_kafka_error_t **);
+    *error = rd_kafka_commit_transaction(rd_producer, timeout_ms);
+    return 0;
+}
+
+static ssize_t
+wait_producer_abort_transaction(va_list args) {
+    rd_kafka_t *rd_producer = va_arg(args, rd_kafka_t *);
+    int timeout_ms = va_arg(args, int);
+    rd_kafka_error_t **error = va_arg(args, rd_kafka_error_t **);
+    *error = rd_kafka_abort_transaction(rd_producer, timeout_ms);
+    return 0;
+}
+
+static ssize_t
+wait_producer_send_offsets_to_transaction(va_list args) {
+    rd_kafka_t *rd_producer = va_arg(args, rd_kafka_t *);
+    rd_kafka_topic_partition_list_t *offsets = va_arg(args, rd_kafka_topic_partition_list_t *);
+    rd_kafka_consumer_group_metadata_t *group_metadata = va_arg(args, rd_kafka_consumer_group_metadata_t *);
+    int timeout_ms = va_arg(args, int);
+    rd_kafka_error_t **error = va_arg(args, rd_kafka_error_t **);
+    *error = rd_kafka_send_offsets_to_transaction(rd_producer, offsets, group_metadata, timeout_ms);
+    return 0;
+}
+
+int
+lua_producer_init_transactions(struct lua_State *L) {
+    if (lua_gettop(L) != 2)
+        luaL_error(L, "Usage: err, kind = producer:init_transactions(timeout_ms)");
+
+    producer_t *producer = lua_check_producer(L, 1);
+    int timeout_ms = luaL_checkint(L, 2);
+
+    rd_kafka_error_t *error = NULL;
+    coio_call(wait_producer_init_transactions, producer->rd_producer, timeout_ms, &error);
+    return lua_push_transaction_error(L, error);
+}
+
+int
+lua_producer_begin_transaction(struct lua_State *L) {
+    if (lua_gettop(L) != 1)
+        luaL_error(L, "Usage: err, kind = producer:begin_transaction()");
+
+    producer_t *producer = lua_check_producer(L, 1);
+    // only local state is changed, so there is no need to leave TX thread
+    return lua_push_transaction_error(L, rd_kafka_begin_transaction(producer->rd_producer));
+}
+
+int
+lua_producer_send_offsets_to_transaction(struct lua_State *L) {
+    if (lua_gettop(L) != 4 || !lua_istable(L, 3))
+        luaL_error(L, "Usage: err, kind = producer:send_offsets_to_transaction(consumer, msgs, timeout_ms)");
+
+    producer_t *producer = lua_check_producer(L, 1);
+    consumer_t **consumer_p = (consumer_t **)luaL_checkudata(L, 2, consumer_label);
+    if (consumer_p == NULL || *consumer_p == NULL || (*consumer_p)->rd_consumer == NULL) {
+        lua_pushliteral(L, "Broken consumer");
+        return 1;
+    }
+    int timeout_ms = luaL_checkint(L, 4);
+
+    if (lua_objlen(L, 3) == 0)
+        return 0;
+
+    // whole batch of consumed messages is committed as greatest offsets of their partitions
+    rd_kafka_topic_partition_list_t *offsets = lua_consumer_msgs_offsets(L, 3);
+    if (offsets == NULL)
+        luaL_error(L, "Out of memory: failed to allocate rd_kafka_topic_partition_list_t");
+
+    rd_kafka_consumer_group_metadata_t *group_metadata = rd_kafka_consumer_group_metadata((*consumer_p)->rd_consumer);
+    if (group_metadata == NULL) {
+        rd_kafka_topic_partition_list_destroy(offsets);
+        lua_pushliteral(L, "consumer has no group metadata, 'group.id' must be set");
+        return 1;
+    }
+
+    rd_kafka_error_t *error = NULL;
+    coio_call(wait_producer_send_offsets_to_transaction,
+              producer->rd_producer, offsets, group_metadata, timeout_ms, &error);
+    rd_kafka_consumer_group_metadata_destroy(group_metadata);
+    rd_kafka_topic_partition_list_destroy(offsets);
+    return lua_push_transaction_error(L, error);
+}
+
+int
+lua_producer_commit_transaction(struct lua_State *L) {
+    if (lua_gettop(L) != 2)
+        luaL_error(L, "Usage: err, kind = producer:commit_transaction(timeout_ms)");
+
+    producer_t *producer = lua_check_producer(L, 1);
+    int timeout_ms = luaL_checkint(L, 2);
+
+    // flushes all messages of transaction, so it takes as long as delivery of whole batch
+    rd_kafka_error_t *error = NULL;
+    coio_call(wait_producer_commit_transaction, producer->rd_producer, timeout_ms, &error);
+    return lua_push_transaction_error(L, error);
+}
+
+int
+lua_producer_abort_transaction(struct lua_State *L) {
+    if (lua_gettop(L) != 2)
+        luaL_error(L, "Usage: err, kind = producer:abort_transaction(timeout_ms)");
+
+    producer_t *producer = lua_check_producer(L, 1);
+    int timeout_ms = luaL_checkint(L, 2);
+
+    rd_kafka_error_t *error = NULL;
+    coio_call(wait_producer_abort_transaction, producer->rd_producer, timeout_ms, &error);
+    return lua_push_transaction_error(L, error);
 }
 
 int
@@ -465,6 +1310,7 @@ lua_create_producer(struct lua_State *L) {
     rd_kafka_conf_t *rd_config = rd_kafka_conf_new();
 
     rd_kafka_topic_conf_t *topic_conf = rd_kafka_topic_conf_new();
+    char partitioner_name[64] = "";
     lua_pushstring(L, "default_topic_options");
     lua_gettable(L, -2);
     if (lua_istable(L, -1)) {
@@ -480,7 +1326,10 @@ lua_create_producer(struct lua_State *L) {
 
             const char *value = lua_tostring(L, -1);
             const char *key = lua_tostring(L, -2);
-            if (rd_kafka_topic_conf_set(topic_conf, key, value, errstr, sizeof(errstr))) {
+            if (strcmp(key, "partitioner") == 0 && partitioner_is_known(value)) {
+                // set up when producer options including linger are known
+                snprintf(partitioner_name, sizeof(partitioner_name), "%s", value);
+            } else if (rd_kafka_topic_conf_set(topic_conf, key, value, errstr, sizeof(errstr))) {
                 lua_pushnil(L);
                 lua_pushstring(L, errstr);
                 return 2;
@@ -495,8 +1344,77 @@ lua_create_producer(struct lua_State *L) {
     lua_pop(L, 1);
     rd_kafka_conf_set_default_topic_conf(rd_config, topic_conf);
 
+    lua_pushstring(L, "queue_capacity");
+    lua_gettable(L, -2);
+    lua_Integer queue_capacity = DEFAULT_QUEUE_CAPACITY;
+    if (lua_isnumber(L, -1))
+        queue_capacity = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (queue_capacity < 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "producer config 'queue_capacity' must be non negative number");
+        return 2;
+    }
+
+    runtime_t *runtime = NULL;
+    const char *runtime_err = lua_read_runtime_option(L, &runtime);
+    if (runtime_err != NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "producer %s", runtime_err);
+        return 2;
+    }
+
+    thread_options_t *thread_options = NULL;
+    const char *thread_options_err = lua_read_thread_options(L, &thread_options);
+    if (thread_options_err != NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "producer %s", thread_options_err);
+        return 2;
+    }
+
+    stats_filter_t *stats_filter = NULL;
+    const char *stats_filter_err = lua_read_stats_filter(L, &stats_filter);
+    if (stats_filter_err != NULL) {
+        destroy_thread_options(thread_options);
+        lua_pushnil(L);
+        lua_pushstring(L, stats_filter_err);
+        return 2;
+    }
+
+    const codec_t *value_codec = NULL;
+    const char *value_codec_err = lua_read_codec_option(L, &value_codec);
+    if (value_codec_err != NULL) {
+        destroy_stats_filter(stats_filter);
+        destroy_thread_options(thread_options);
+        lua_pushnil(L);
+        lua_pushfstring(L, "producer %s", value_codec_err);
+        return 2;
+    }
+
     event_queues_t *event_queues = new_event_queues();
-    event_queues->delivery_queue = new_queue();
+    if (event_queues == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "producer failed to allocate event queues");
+        return 2;
+    }
+    event_queues->stats_filter = stats_filter;
+    event_queues->thread_options = thread_options;
+    event_queues->value_codec = value_codec;
+    if (thread_options_set_conf(rd_config, thread_options, errstr, sizeof(errstr)) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        lua_pushnil(L);
+        lua_pushstring(L, errstr);
+        return 2;
+    }
+    if (queue_capacity > 0)
+        event_queues->delivery_queue = new_ring_queue(queue_capacity, 0);
+    else
+        event_queues->delivery_queue = new_queue();
+    event_queues->delivery_overflow = new_queue();
+    event_queues->notifier = new_notifier();
+    if (event_queues->notifier != NULL) {
+        queue_set_notifier(event_queues->delivery_queue, event_queues->notifier);
+        queue_set_notifier(event_queues->delivery_overflow, event_queues->notifier);
+    }
     rd_kafka_conf_set_dr_msg_cb(rd_config, msg_delivery_callback);
 
     for (int i = 0; i < MAX_QUEUE; i++) {
@@ -507,7 +1425,7 @@ lua_create_producer(struct lua_State *L) {
         lua_gettable(L, -2);
         if (lua_isfunction(L, -1)) {
             event_queues->cb_refs[i] = luaL_ref(L, LUA_REGISTRYINDEX);
-            event_queues->queues[i] = new_queue();
+            event_queues->queues[i] = new_callback_queue(i, queue_capacity);
             switch (i) {
                 case LOG_QUEUE:
                     rd_kafka_conf_set_log_cb(rd_config, log_callback);
@@ -518,6 +1436,11 @@ lua_create_producer(struct lua_State *L) {
                 case STATS_QUEUE:
                     rd_kafka_conf_set_stats_cb(rd_config, stats_callback);
                     break;
+                case DELIVERY_REPORT_QUEUE:
+                    // reports are polled by the same fiber as delivery queue
+                    if (event_queues->notifier != NULL)
+                        queue_set_notifier(event_queues->queues[i], event_queues->notifier);
+                    break;
             }
         } else {
             lua_pop(L, 1);
@@ -555,6 +1478,17 @@ lua_create_producer(struct lua_State *L) {
     }
     lua_pop(L, 1);
 
+    if (partitioner_name[0] != '\0') {
+        // topic config is owned by config now, but it is not copied until rd_kafka_new
+        event_queues->partitioner = new_partitioner_ctx(rd_config, topic_conf, partitioner_name,
+                                                        errstr, sizeof(errstr));
+        if (event_queues->partitioner == NULL) {
+            lua_pushnil(L);
+            lua_pushstring(L, errstr);
+            return 2;
+        }
+    }
+
     rd_kafka_t *rd_producer;
     if (!(rd_producer = rd_kafka_new(RD_KAFKA_PRODUCER, rd_config, errstr, sizeof(errstr)))) {
         lua_pushnil(L);
@@ -568,8 +1502,15 @@ lua_create_producer(struct lua_State *L) {
         return 2;
     }
 
-    // creating background thread for polling consumer
-    producer_poller_t *poller = new_producer_poller(rd_producer);
+    // creating background thread for polling producer or attaching main queue to shared runtime
+    producer_poller_t *poller = new_producer_poller(rd_producer, runtime);
+    if (poller == NULL && runtime != NULL) {
+        coio_call(wait_producer_destroy, rd_producer);
+        destroy_event_queues(L, event_queues);
+        lua_pushnil(L);
+        lua_pushliteral(L, "failed to attach producer to runtime");
+        return 2;
+    }
 
     producer_t *producer;
     producer = malloc(sizeof(producer_t));
@@ -577,6 +1518,8 @@ lua_create_producer(struct lua_State *L) {
     producer->topics = new_producer_topics(256);
     producer->event_queues = event_queues;
     producer->poller = poller;
+    producer->waiters = NULL;
+    producer->produce_calls = 0;
 
     producer_t **producer_p = (producer_t **)lua_newuserdata(L, sizeof(producer));
     *producer_p = producer;
@@ -623,3 +1566,55 @@ lua_producer_list_groups(struct lua_State *L) {
     }
     return 0;
 }
+
+int
+lua_producer_metrics(struct lua_State *L) {
+    producer_t *producer = lua_check_producer(L, 1);
+    event_queues_t *event_queues = producer->event_queues;
+    metrics_t *metrics = &event_queues->metrics;
+
+    lua_createtable(L, 0, 10);
+    lua_set_metrics_field(L, "empty_polls", metrics_get(&metrics->empty_polls));
+    lua_set_metrics_field(L, "delivery_sleeps", metrics_get(&metrics->sleeps));
+    if (producer->rd_producer != NULL)
+        lua_set_metrics_field(L, "out_queue_msgs", rd_kafka_outq_len(producer->rd_producer));
+    if (event_queues->delivery_queue != NULL) {
+        lua_set_metrics_field(L, "delivery_queue_depth", queue_count(event_queues->delivery_queue));
+        lua_set_metrics_field(L, "delivery_queue_push_failures", queue_push_failures(event_queues->delivery_queue));
+    }
+    lua_set_metrics_field(L, "delivery_overflows", metrics_get(&metrics->delivery_overflows));
+    lua_set_metrics_field(L, "dropped_reports", metrics_get(&metrics->dropped_reports));
+    lua_set_metrics_field(L, "dropped_callback_msgs", metrics_get(&metrics->dropped_callback_msgs));
+    lua_push_metrics_histogram(L, &metrics->produce_call_us);
+    lua_setfield(L, -2, "produce_call_us");
+    lua_push_metrics_histogram(L, &metrics->delivery_lag_us);
+    lua_setfield(L, -2, "delivery_lag_us");
+    return 1;
+}
+
+/**
+ * FFI ABI
+ */
+
+rd_kafka_topic_t *
+tnt_kafka_producer_topic(producer_t *producer, const char *name) {
+    const char *err = NULL;
+    return producer_get_topic(producer, name, &err);
+}
+
+int
+tnt_kafka_produce_raw(producer_t *producer, rd_kafka_topic_t *topic,
+                      const char *key, size_t key_len, const char *value, size_t value_len) {
+    int64_t started_at = producer_call_started(producer);
+    int rc = rd_kafka_produce(topic, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY,
+                              (void *)value, value_len, key, key_len, NULL);
+    producer_call_finished(producer, started_at);
+    if (rc != 0)
+        return rd_kafka_last_error();
+    return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+const char *
+tnt_kafka_err2str(int err) {
+    return rd_kafka_err2str(err);
+}
@@ -1,6 +1,8 @@
 #ifndef TNT_KAFKA_PRODUCER_H
 #define TNT_KAFKA_PRODUCER_H
 
+#include <stdint.h>
+
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -8,24 +10,46 @@
 #include <librdkafka/rdkafka.h>
 
 #include <queue.h>
+#include <runtime.h>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 /**
  * Producer
  */
 
+/**
+ * Count of delivery reports popped from delivery queue at once
+ */
+#define PRODUCER_POLL_BATCH_SIZE 64
+
+/**
+ * Count of events served by shared runtime thread at once before serving other queues
+ */
+#define PRODUCER_SERVE_MAX_EVENTS 1024
+
 typedef struct {
-    rd_kafka_t      *rd_producer;
-    pthread_t       thread;
-    pthread_attr_t  attr;
-    int             should_stop;
-    pthread_mutex_t lock;
+    rd_kafka_t       *rd_producer;
+    // main queue and its handle are not NULL when producer is served by shared runtime
+    rd_kafka_queue_t *rd_queue;
+    runtime_handle_t *handle;
+    pthread_t        thread;
+    pthread_attr_t   attr;
+    int              should_stop;
+    pthread_mutex_t  lock;
 } producer_poller_t;
 
+/**
+ * Producer topics registry, topics are looked up by name through open addressing hash index
+ */
 typedef struct {
     rd_kafka_topic_t **elements;
+    // hashes of elements names
+    uint32_t *hashes;
     int32_t count;
     int32_t capacity;
+    // element number + 1 or 0 for empty slot, capacity is power of two
+    int32_t *index;
+    int32_t index_capacity;
 } producer_topics_t;
 
 producer_topics_t *new_producer_topics(int32_t capacity);
@@ -41,14 +65,27 @@ typedef struct {
     producer_topics_t *topics;
     event_queues_t    *event_queues;
     producer_poller_t *poller;
+    // delivery reports waited by fibers in produce_sync
+    dr_msg_t          *waiters;
+    // count of produce calls, sampled ones are timed
+    unsigned          produce_calls;
 } producer_t;
 
 int
 lua_producer_tostring(struct lua_State *L);
 
+/**
+ * Raw producer pointer for FFI ABI
+ */
+int
+lua_producer_raw(struct lua_State *L);
+
 int
 lua_producer_msg_delivery_poll(struct lua_State *L);
 
+int
+lua_producer_wait_msg_delivery(struct lua_State *L);
+
 int
 lua_producer_poll_logs(struct lua_State *L);
 
@@ -61,6 +98,31 @@ lua_producer_poll_errors(struct lua_State *L);
 int
 lua_producer_produce(struct lua_State *L);
 
+int
+lua_producer_produce_batch(struct lua_State *L);
+
+int
+lua_producer_produce_sync(struct lua_State *L);
+
+/**
+ * Transactional API, every call returns error and its kind or nothing on success.
+ * Blocking calls are made in coio threads.
+ */
+int
+lua_producer_init_transactions(struct lua_State *L);
+
+int
+lua_producer_begin_transaction(struct lua_State *L);
+
+int
+lua_producer_send_offsets_to_transaction(struct lua_State *L);
+
+int
+lua_producer_commit_transaction(struct lua_State *L);
+
+int
+lua_producer_abort_transaction(struct lua_State *L);
+
 int
 lua_producer_close(struct lua_State *L);
 
@@ -79,4 +141,10 @@ lua_producer_metadata(struct lua_State *L);
 int
 lua_producer_list_groups(struct lua_State *L);
 
+/**
+ * Counters and histograms of producer, returns table which is flat except of histograms
+ */
+int
+lua_producer_metrics(struct lua_State *L);
+
 #endif //TNT_KAFKA_PRODUCER_H
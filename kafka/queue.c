@@ -2,11 +2,15 @@
 #include <pthread.h>
 #include <unistd.h>
 
+#include <tarantool/module.h>
+
+#include <ring.h>
+#include <notifier.h>
 #include <queue.h>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 /**
- * General thread safe queue based on licked list
+ * General thread safe queue based on licked list or on bounded ring buffer
  */
 
 /**
@@ -20,6 +24,9 @@ void *
 queue_lockfree_pop(queue_t *queue) {
     void *output = NULL;
 
+    if (queue->ring != NULL)
+        return ring_pop(queue->ring);
+
     if (queue->head != NULL) {
         output = queue->head->value;
         queue_node_t *tmp = queue->head;
@@ -37,6 +44,10 @@ queue_lockfree_pop(queue_t *queue) {
 
 void *
 queue_pop(queue_t *queue) {
+    // consumer side of ring is lock free
+    if (queue->ring != NULL)
+        return ring_pop(queue->ring);
+
     pthread_mutex_lock(&queue->lock);
 
     void *output = queue_lockfree_pop(queue);
@@ -46,6 +57,30 @@ queue_pop(queue_t *queue) {
     return output;
 }
 
+int
+queue_pop_batch(queue_t *queue, void **values, int limit) {
+    if (limit <= 0)
+        return 0;
+
+    if (queue->ring != NULL)
+        return (int)ring_pop_batch(queue->ring, values, (size_t)limit);
+
+    int count = 0;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (count < limit) {
+        void *value = queue_lockfree_pop(queue);
+        if (value == NULL)
+            break;
+        values[count++] = value;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return count;
+}
+
 /**
  * Push without locking mutex.
  * Caller must lock and unlock queue mutex by itself.
@@ -60,6 +95,9 @@ queue_lockfree_push(queue_t *queue, void *value) {
         return -1;
     }
 
+    if (queue->ring != NULL)
+        return ring_push(queue->ring, value);
+
     queue_node_t *new_node;
     new_node = malloc(sizeof(queue_node_t));
     if (new_node == NULL) {
@@ -89,13 +127,63 @@ queue_push(queue_t *queue, void *value) {
         return -1;
     }
 
+    int output = 0;
+    // single producer ring does not need any locking
+    if (queue->ring != NULL && !(queue->flags & QUEUE_F_MULTI_PRODUCER)) {
+        output = ring_push(queue->ring, value);
+    } else {
+        pthread_mutex_lock(&queue->lock);
+
+        output = queue_lockfree_push(queue, value);
+
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    if (output == 0 && queue->notifier != NULL)
+        notifier_notify(queue->notifier);
+    else if (output != 0)
+        atomic_fetch_add_explicit(&queue->push_failures, 1, memory_order_relaxed);
+
+    return output;
+}
+
+long
+queue_push_failures(queue_t *queue) {
+    return atomic_load_explicit(&queue->push_failures, memory_order_relaxed);
+}
+
+int
+queue_count(queue_t *queue) {
+    if (queue->ring != NULL)
+        return (int)ring_count(queue->ring);
+
     pthread_mutex_lock(&queue->lock);
 
-    int output = queue_lockfree_push(queue, value);
+    int count = queue->count;
 
     pthread_mutex_unlock(&queue->lock);
 
-    return output;
+    return count;
+}
+
+void
+queue_set_notifier(queue_t *queue, notifier_t *notifier) {
+    queue->notifier = notifier;
+}
+
+void
+queue_wait(queue_t *queue, double timeout) {
+    if (queue->notifier == NULL) {
+        fiber_sleep(timeout);
+        return;
+    }
+
+    notifier_prepare(queue->notifier);
+    if (queue_count(queue) > 0) {
+        notifier_cancel(queue->notifier);
+        return;
+    }
+    notifier_wait(queue->notifier, timeout);
 }
 
 queue_t *
@@ -115,6 +203,26 @@ new_queue() {
     queue->head = NULL;
     queue->tail = NULL;
     queue->count = 0;
+    queue->ring = NULL;
+    queue->flags = 0;
+    queue->notifier = NULL;
+    atomic_init(&queue->push_failures, 0);
+
+    return queue;
+}
+
+queue_t *
+new_ring_queue(size_t capacity, int flags) {
+    queue_t *queue = new_queue();
+    if (queue == NULL)
+        return NULL;
+
+    queue->ring = new_ring(capacity);
+    if (queue->ring == NULL) {
+        destroy_queue(queue);
+        return NULL;
+    }
+    queue->flags = flags;
 
     return queue;
 }
@@ -123,6 +231,7 @@ void
 destroy_queue(queue_t *queue) {
     if (queue == NULL)
         return;
+    destroy_ring(queue->ring);
     pthread_mutex_destroy(&queue->lock);
     free(queue);
 }
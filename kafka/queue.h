@@ -1,13 +1,24 @@
 #ifndef TNT_KAFKA_QUEUE_H
 #define TNT_KAFKA_QUEUE_H
 
+#include <stddef.h>
 #include <pthread.h>
+#include <stdatomic.h>
+
+#include <ring.h>
+#include <notifier.h>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 /**
- * General thread safe queue based on licked list
+ * General thread safe queue based on licked list or on bounded ring buffer
  */
 
+/**
+ * Queue may be pushed from several threads at once.
+ * Ring based queue serializes producers on queue mutex, consumer side stays lock free.
+ */
+#define QUEUE_F_MULTI_PRODUCER 0x1
+
 typedef struct queue_node_t {
     void *value;
     struct queue_node_t *next;
@@ -18,6 +29,11 @@ typedef struct {
     queue_node_t    *head;
     queue_node_t    *tail;
     int              count;
+    ring_t          *ring;
+    int              flags;
+    notifier_t      *notifier;
+    // pushes failed because bounded queue is full or allocation failed
+    _Atomic long     push_failures;
 } queue_t;
 
 /**
@@ -33,6 +49,17 @@ queue_lockfree_pop(queue_t *queue);
 void *
 queue_pop(queue_t *queue);
 
+/**
+ * Pop up to limit values at once.
+ * Ring based queue must be popped from single consumer thread only.
+ * @param queue
+ * @param values
+ * @param limit
+ * @return count of popped values
+ */
+int
+queue_pop_batch(queue_t *queue, void **values, int limit);
+
 /**
  * Push without locking mutex.
  * Caller must lock and unlock queue mutex by itself.
@@ -44,12 +71,62 @@ queue_pop(queue_t *queue);
 int
 queue_lockfree_push(queue_t *queue, void *value);
 
+/**
+ * Push value.
+ * Ring based queue without QUEUE_F_MULTI_PRODUCER flag must be pushed from single producer thread only.
+ * @param queue
+ * @param value
+ * @return 0 on success, -1 on allocation failure or if bounded queue is full
+ */
 int
 queue_push(queue_t *queue, void *value);
 
+/**
+ * Approximate count of values in queue
+ * @param queue
+ * @return
+ */
+int
+queue_count(queue_t *queue);
+
+/**
+ * Count of failed pushes since queue creation
+ * @param queue
+ * @return
+ */
+long
+queue_push_failures(queue_t *queue);
+
+/**
+ * Wake notifier up on every push, notifier may be shared between several queues
+ * @param queue
+ * @param notifier
+ */
+void
+queue_set_notifier(queue_t *queue, notifier_t *notifier);
+
+/**
+ * Yield current fiber while queue is empty, but no longer than timeout.
+ * Sleeps for whole timeout when queue has no notifier.
+ * Must be called from TX thread only.
+ * @param queue
+ * @param timeout in seconds
+ */
+void
+queue_wait(queue_t *queue, double timeout);
+
 queue_t *
 new_queue();
 
+/**
+ * Create queue based on bounded single consumer ring buffer
+ * @param capacity rounded up to the nearest power of two
+ * @param flags
+ * @return
+ */
+queue_t *
+new_ring_queue(size_t capacity, int flags);
+
 void destroy_queue(queue_t *queue);
 
 #endif // TNT_KAFKA_QUEUE_H
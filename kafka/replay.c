@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <replay.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Partition ring
+ */
+
+#define REPLAY_RING_MIN_CAPACITY 64
+
+static size_t
+replay_msg_size(const msg_t *msg) {
+    size_t size = sizeof(msg_t) + msg->value_len + msg->key_len;
+    if (msg->decode_state == MSG_DECODE_OWNED)
+        size += msg->decoded_len;
+    return size;
+}
+
+static inline msg_t *
+replay_ring_at(const replay_ring_t *ring, int i) {
+    return ring->msgs[(ring->head + i) % ring->capacity];
+}
+
+static void
+replay_ring_set_pos(replay_buffer_t *buffer, replay_ring_t *ring, int pos) {
+    int was_replaying = ring->replay_pos < ring->count;
+    ring->replay_pos = pos;
+    int is_replaying = ring->replay_pos < ring->count;
+    buffer->replaying += is_replaying - was_replaying;
+}
+
+static void
+replay_ring_clear(replay_buffer_t *buffer, replay_ring_t *ring) {
+    if (ring->replay_pos < ring->count)
+        buffer->replaying--;
+    for (int i = 0; i < ring->count; i++)
+        destroy_consumer_msg(replay_ring_at(ring, i));
+    ring->head = 0;
+    ring->count = 0;
+    ring->bytes = 0;
+    ring->replay_pos = 0;
+}
+
+static void
+replay_ring_evict(replay_ring_t *ring) {
+    msg_t *msg = ring->msgs[ring->head];
+    ring->bytes -= replay_msg_size(msg);
+    destroy_consumer_msg(msg);
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count--;
+    if (ring->replay_pos > 0)
+        ring->replay_pos--;
+}
+
+static int
+replay_ring_push(replay_ring_t *ring, msg_t *msg) {
+    if (ring->count == ring->capacity) {
+        int capacity = ring->capacity > 0 ? ring->capacity * 2 : REPLAY_RING_MIN_CAPACITY;
+        msg_t **msgs = malloc(capacity * sizeof(msg_t *));
+        if (msgs == NULL)
+            return -1;
+        for (int i = 0; i < ring->count; i++)
+            msgs[i] = replay_ring_at(ring, i);
+        free(ring->msgs);
+        ring->msgs = msgs;
+        ring->head = 0;
+        ring->capacity = capacity;
+    }
+    ring->msgs[(ring->head + ring->count) % ring->capacity] = msg;
+    ring->count++;
+    return 0;
+}
+
+static void
+destroy_replay_ring(replay_buffer_t *buffer, replay_ring_t *ring) {
+    replay_ring_clear(buffer, ring);
+    free(ring->msgs);
+    free(ring->topic);
+    free(ring);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Replay buffer
+ */
+
+replay_buffer_t *
+new_replay_buffer(slab_cache_t *slab, size_t limit_bytes) {
+    replay_buffer_t *buffer = calloc(1, sizeof(replay_buffer_t));
+    if (buffer == NULL)
+        return NULL;
+    buffer->slab = slab;
+    buffer->limit_bytes = limit_bytes;
+    return buffer;
+}
+
+static replay_ring_t *
+replay_buffer_find_ring(replay_buffer_t *buffer, const char *topic, int32_t partition) {
+    // consumers usually have few partitions and lookups happen on seek or on change of partition only
+    for (int i = 0; i < buffer->rings_count; i++) {
+        replay_ring_t *ring = buffer->rings[i];
+        if (ring->partition == partition && strcmp(ring->topic, topic) == 0)
+            return ring;
+    }
+    return NULL;
+}
+
+static replay_ring_t *
+replay_buffer_get_ring(replay_buffer_t *buffer, rd_kafka_topic_t *rkt, int32_t partition) {
+    replay_ring_t *ring = buffer->last;
+    if (ring != NULL && ring->rkt == rkt && ring->partition == partition)
+        return ring;
+
+    const char *topic = rd_kafka_topic_name(rkt);
+    ring = replay_buffer_find_ring(buffer, topic, partition);
+    if (ring == NULL) {
+        if (buffer->rings_count == buffer->rings_capacity) {
+            int capacity = buffer->rings_capacity > 0 ? buffer->rings_capacity * 2 : 8;
+            replay_ring_t **rings = realloc(buffer->rings, capacity * sizeof(replay_ring_t *));
+            if (rings == NULL)
+                return NULL;
+            buffer->rings = rings;
+            buffer->rings_capacity = capacity;
+        }
+
+        ring = calloc(1, sizeof(replay_ring_t));
+        if (ring == NULL)
+            return NULL;
+        ring->topic = strdup(topic);
+        if (ring->topic == NULL) {
+            free(ring);
+            return NULL;
+        }
+        ring->partition = partition;
+        buffer->rings[buffer->rings_count++] = ring;
+    }
+
+    ring->rkt = rkt;
+    buffer->last = ring;
+    return ring;
+}
+
+/**
+ * Fetch positions are reset on revoke, so buffered windows are not followed by prefetched messages anymore
+ */
+static void
+replay_buffer_sync(replay_buffer_t *buffer, uint64_t revokes) {
+    if (buffer->revokes == revokes)
+        return;
+    replay_buffer_clear(buffer);
+    buffer->revokes = revokes;
+}
+
+void
+replay_buffer_add(replay_buffer_t *buffer, const msg_t *msg, uint64_t revokes) {
+    replay_buffer_sync(buffer, revokes);
+
+    replay_ring_t *ring = replay_buffer_get_ring(buffer, msg->topic, msg->partition);
+    if (ring == NULL)
+        return;
+
+    // offsets go back when librdkafka resets fetch position, e.g. on out of range error
+    if (ring->count > 0 && msg->offset <= replay_ring_at(ring, ring->count - 1)->last_offset)
+        replay_ring_clear(buffer, ring);
+
+    // window must have no holes, so it starts again right after message which does not fit at all
+    size_t size = replay_msg_size(msg);
+    if (size > buffer->limit_bytes) {
+        replay_ring_clear(buffer, ring);
+        return;
+    }
+    while (ring->count > 0 && ring->bytes + size > buffer->limit_bytes)
+        replay_ring_evict(ring);
+
+    msg_t *copy = copy_consumer_msg(buffer->slab, msg);
+    if (copy == NULL || replay_ring_push(ring, copy) != 0) {
+        destroy_consumer_msg(copy);
+        replay_ring_clear(buffer, ring);
+        return;
+    }
+    ring->bytes += size;
+    replay_ring_set_pos(buffer, ring, ring->count);
+}
+
+int
+replay_buffer_has_msgs(const replay_buffer_t *buffer) {
+    return buffer->replaying > 0;
+}
+
+msg_t *
+replay_buffer_pop(replay_buffer_t *buffer, const char *topic, int32_t partition, int *replaying) {
+    *replaying = 0;
+    if (buffer->replaying == 0)
+        return NULL;
+
+    replay_ring_t *ring = NULL;
+    if (topic != NULL) {
+        ring = replay_buffer_find_ring(buffer, topic, partition);
+        if (ring == NULL || ring->replay_pos >= ring->count)
+            return NULL;
+    } else {
+        for (int i = 0; i < buffer->rings_count; i++) {
+            if (buffer->rings[i]->replay_pos < buffer->rings[i]->count) {
+                ring = buffer->rings[i];
+                break;
+            }
+        }
+        if (ring == NULL)
+            return NULL;
+    }
+
+    // buffered message stays in ring, so it may be redelivered once again by next seek
+    *replaying = 1;
+    msg_t *msg = copy_consumer_msg(buffer->slab, replay_ring_at(ring, ring->replay_pos));
+    if (msg != NULL)
+        replay_ring_set_pos(buffer, ring, ring->replay_pos + 1);
+    return msg;
+}
+
+int
+replay_buffer_seek(replay_buffer_t *buffer, const char *topic, int32_t partition, int64_t offset,
+                   uint64_t revokes) {
+    replay_buffer_sync(buffer, revokes);
+
+    replay_ring_t *ring = replay_buffer_find_ring(buffer, topic, partition);
+    if (ring == NULL)
+        return -1;
+
+    // logical offsets like beginning, end and stored one are resolved by librdkafka
+    if (offset < 0 || ring->count == 0 || offset < replay_ring_at(ring, 0)->offset ||
+        offset > replay_ring_at(ring, ring->count - 1)->last_offset + 1) {
+        replay_ring_clear(buffer, ring);
+        return -1;
+    }
+
+    // the first message not less than offset, offsets of compacted topics and transactions have holes
+    int low = 0;
+    int high = ring->count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (replay_ring_at(ring, mid)->offset < offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    replay_ring_set_pos(buffer, ring, low);
+    return 0;
+}
+
+void
+replay_buffer_clear(replay_buffer_t *buffer) {
+    for (int i = 0; i < buffer->rings_count; i++)
+        replay_ring_clear(buffer, buffer->rings[i]);
+}
+
+void
+destroy_replay_buffer(replay_buffer_t *buffer) {
+    if (buffer == NULL)
+        return;
+    for (int i = 0; i < buffer->rings_count; i++)
+        destroy_replay_ring(buffer, buffer->rings[i]);
+    free(buffer->rings);
+    free(buffer);
+}
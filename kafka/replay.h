@@ -0,0 +1,109 @@
+#ifndef TNT_KAFKA_REPLAY_H
+#define TNT_KAFKA_REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <librdkafka/rdkafka.h>
+
+#include <slab.h>
+#include <consumer_msg.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Replay buffer of consumer keeps copies of recently delivered messages of every partition,
+ * so seek into this window is served by TX thread without refetching messages from brokers.
+ * Local seek does not move fetch position of librdkafka: buffered messages are redelivered
+ * and then consumption goes on with already prefetched ones. Used by TX thread only.
+ */
+
+typedef struct {
+    char             *topic;
+    int32_t          partition;
+    rd_kafka_topic_t *rkt;
+
+    // circular array of copies of delivered messages ordered by offset
+    msg_t            **msgs;
+    int              head;
+    int              count;
+    int              capacity;
+    size_t           bytes;
+
+    // index of next message to redeliver after local seek, equals count when there is nothing to redeliver
+    int              replay_pos;
+} replay_ring_t;
+
+typedef struct {
+    slab_cache_t  *slab;
+    // limit of every partition ring
+    size_t        limit_bytes;
+    // buffered messages are dropped when partitions are revoked
+    uint64_t      revokes;
+
+    replay_ring_t **rings;
+    int           rings_count;
+    int           rings_capacity;
+    // ring of last added message, consecutive messages mostly belong to one partition
+    replay_ring_t *last;
+    // count of rings with messages to redeliver
+    int           replaying;
+} replay_buffer_t;
+
+/**
+ * @param slab allocator of copies of messages
+ * @param limit_bytes size of messages kept for every partition
+ * @return NULL on allocation failure
+ */
+replay_buffer_t *
+new_replay_buffer(slab_cache_t *slab, size_t limit_bytes);
+
+/**
+ * Remember copy of message delivered to application, the oldest messages of partition are evicted
+ * @param buffer
+ * @param msg
+ * @param revokes counter of revokes of consumer, buffer is cleared when it is changed
+ */
+void
+replay_buffer_add(replay_buffer_t *buffer, const msg_t *msg, uint64_t revokes);
+
+/**
+ * @return 1 when there are messages to redeliver
+ */
+int
+replay_buffer_has_msgs(const replay_buffer_t *buffer);
+
+/**
+ * Take copy of next message to redeliver
+ * @param buffer
+ * @param topic NULL for any partition
+ * @param partition
+ * @param replaying set to 1 when there is message to redeliver even if it is not copied
+ * @return NULL when there is nothing to redeliver or on allocation failure
+ */
+msg_t *
+replay_buffer_pop(replay_buffer_t *buffer, const char *topic, int32_t partition, int *replaying);
+
+/**
+ * Seek partition locally when offset is inside buffered window, otherwise messages of partition are dropped,
+ * since librdkafka refetches them after seek
+ * @param buffer
+ * @param topic
+ * @param partition
+ * @param offset
+ * @param revokes counter of revokes of consumer
+ * @return 0 when seek is served by buffer, -1 when it must be passed to librdkafka
+ */
+int
+replay_buffer_seek(replay_buffer_t *buffer, const char *topic, int32_t partition, int64_t offset,
+                   uint64_t revokes);
+
+/**
+ * Drop all buffered messages
+ */
+void
+replay_buffer_clear(replay_buffer_t *buffer);
+
+void
+destroy_replay_buffer(replay_buffer_t *buffer);
+
+#endif // TNT_KAFKA_REPLAY_H
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <ring.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Bounded lock free single producer / single consumer ring buffer
+ */
+
+ring_t *
+new_ring(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    ring_t *ring = NULL;
+    if (posix_memalign((void **)&ring, RING_CACHE_LINE_SIZE, sizeof(ring_t)) != 0)
+        return NULL;
+
+    ring->slots = calloc(size, sizeof(void *));
+    if (ring->slots == NULL) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->cached_head = 0;
+    ring->cached_tail = 0;
+
+    return ring;
+}
+
+void
+destroy_ring(ring_t *ring) {
+    if (ring == NULL)
+        return;
+    free(ring->slots);
+    free(ring);
+}
+
+int
+ring_push(ring_t *ring, void *value) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (tail - ring->cached_head > ring->mask) {
+        // refresh consumer position only when ring looks full to avoid cache line bouncing
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail - ring->cached_head > ring->mask)
+            return -1;
+    }
+
+    ring->slots[tail & ring->mask] = value;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+void *
+ring_pop(ring_t *ring) {
+    void *value = NULL;
+    if (ring_pop_batch(ring, &value, 1) == 0)
+        return NULL;
+    return value;
+}
+
+size_t
+ring_pop_batch(ring_t *ring, void **values, size_t limit) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (ring->cached_tail - head < limit) {
+        // refresh producer position only when not enough values seen already
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    }
+
+    size_t count = ring->cached_tail - head;
+    if (count > limit)
+        count = limit;
+
+    for (size_t i = 0; i < count; i++)
+        values[i] = ring->slots[(head + i) & ring->mask];
+
+    if (count > 0)
+        atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
+}
+
+size_t
+ring_count(ring_t *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return tail - head;
+}
+
+size_t
+ring_capacity(const ring_t *ring) {
+    return ring->mask + 1;
+}
@@ -0,0 +1,80 @@
+#ifndef TNT_KAFKA_RING_H
+#define TNT_KAFKA_RING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Bounded lock free single producer / single consumer ring buffer
+ */
+
+#define RING_CACHE_LINE_SIZE 64
+
+typedef struct {
+    /* read only after creation */
+    void            **slots;
+    size_t            mask;
+    char              pad0[RING_CACHE_LINE_SIZE - sizeof(void **) - sizeof(size_t)];
+
+    /* consumer side: index of the next slot to read and last seen tail */
+    _Atomic size_t    head;
+    size_t            cached_tail;
+    char              pad1[RING_CACHE_LINE_SIZE - 2 * sizeof(size_t)];
+
+    /* producer side: index of the next slot to write and last seen head */
+    _Atomic size_t    tail;
+    size_t            cached_head;
+    char              pad2[RING_CACHE_LINE_SIZE - 2 * sizeof(size_t)];
+} ring_t;
+
+/**
+ * Create ring with capacity rounded up to the nearest power of two.
+ * @param capacity
+ * @return
+ */
+ring_t *
+new_ring(size_t capacity);
+
+void
+destroy_ring(ring_t *ring);
+
+/**
+ * Push value, must be called from single producer thread only.
+ * @param ring
+ * @param value
+ * @return 0 on success, -1 if ring is full
+ */
+int
+ring_push(ring_t *ring, void *value);
+
+/**
+ * Pop value, must be called from single consumer thread only.
+ * @param ring
+ * @return NULL if ring is empty
+ */
+void *
+ring_pop(ring_t *ring);
+
+/**
+ * Pop up to limit values at once, must be called from single consumer thread only.
+ * @param ring
+ * @param values
+ * @param limit
+ * @return count of popped values
+ */
+size_t
+ring_pop_batch(ring_t *ring, void **values, size_t limit);
+
+/**
+ * Approximate count of values, may be called from any thread.
+ * @param ring
+ * @return
+ */
+size_t
+ring_count(ring_t *ring);
+
+size_t
+ring_capacity(const ring_t *ring);
+
+#endif // TNT_KAFKA_RING_H
@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <tarantool/module.h>
+
+#include <common.h>
+#include <metrics.h>
+
+#include <runtime.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Runtime shared by many consumers and producers
+ */
+
+static int
+new_nonblocking_pipe(int *read_fd, int *write_fd) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    *read_fd = fds[0];
+    *write_fd = fds[1];
+    return 0;
+}
+
+static void
+drain_fd(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+static void
+runtime_thread_wakeup(runtime_thread_t *thread) {
+    char c = 1;
+    ssize_t rc = write(thread->wakeup_write_fd, &c, 1);
+    // nonblocking pipe may be full only if thread is already woken up
+    (void)rc;
+}
+
+static void
+runtime_handle_unref(runtime_handle_t *handle) {
+    if (atomic_fetch_sub(&handle->refs, 1) != 1)
+        return;
+    close(handle->read_fd);
+    close(handle->write_fd);
+    pthread_mutex_destroy(&handle->serve_lock);
+    free(handle);
+}
+
+/**
+ * Serve handle without lock of thread, so callbacks blocked in serve do not block attach of TX thread
+ */
+static int
+runtime_handle_serve(runtime_handle_t *handle) {
+    int busy = 0;
+    pthread_mutex_lock(&handle->serve_lock);
+    if (!handle->detached)
+        busy = handle->serve(handle->arg);
+    pthread_mutex_unlock(&handle->serve_lock);
+    return busy;
+}
+
+static void *
+runtime_loop(void *arg) {
+    runtime_thread_t *thread = arg;
+
+    char errstr[sizeof(thread->error)];
+    int rc = thread_options_apply(thread->runtime->thread_options, "kafka_runtime", "krt", errstr, sizeof(errstr));
+    pthread_mutex_lock(&thread->lock);
+    thread->started = rc == 0 ? 1 : -1;
+    if (rc != 0)
+        memcpy(thread->error, errstr, sizeof(errstr));
+    pthread_cond_signal(&thread->started_cond);
+    pthread_mutex_unlock(&thread->lock);
+    if (rc != 0)
+        pthread_exit(NULL);
+
+    // descriptors are polled without lock, so they are copied together with handles they belong to,
+    // every copied handle is referenced, so detached one stays valid until the copy is rebuilt
+    struct pollfd *fds = NULL;
+    runtime_handle_t **polled = NULL;
+    int polled_capacity = 0;
+    int polled_count = 0;
+    unsigned polled_version = 0;
+    int rebuild = 1;
+    int busy = 0;
+    int64_t last_tick = metrics_now_us();
+
+    while (!atomic_load(&thread->should_stop)) {
+        if (rebuild || polled_version != atomic_load(&thread->version)) {
+            // the last reference of detached handle is dropped out of lock
+            for (int i = 0; i < polled_count; i++)
+                runtime_handle_unref(polled[i]);
+            polled_count = 0;
+
+            pthread_mutex_lock(&thread->lock);
+            polled_version = atomic_load(&thread->version);
+            if (polled_capacity < thread->count + 1) {
+                int capacity = thread->count + 1 > polled_capacity * 2 ? thread->count + 1 : polled_capacity * 2;
+                struct pollfd *new_fds = realloc(fds, capacity * sizeof(struct pollfd));
+                if (new_fds != NULL)
+                    fds = new_fds;
+                runtime_handle_t **new_polled = realloc(polled, capacity * sizeof(runtime_handle_t *));
+                if (new_polled != NULL)
+                    polled = new_polled;
+                if (new_fds == NULL || new_polled == NULL) {
+                    // out of memory, trying again a bit later
+                    pthread_mutex_unlock(&thread->lock);
+                    usleep(RUNTIME_BUSY_TICK_MS * 1000);
+                    continue;
+                }
+                polled_capacity = capacity;
+            }
+
+            for (int i = 0; i < thread->count; i++) {
+                polled[i] = thread->handles[i];
+                atomic_fetch_add(&polled[i]->refs, 1);
+            }
+            polled_count = thread->count;
+            pthread_mutex_unlock(&thread->lock);
+
+            fds[0].fd = thread->wakeup_read_fd;
+            fds[0].events = POLLIN;
+            for (int i = 0; i < polled_count; i++) {
+                fds[i + 1].fd = polled[i]->read_fd;
+                fds[i + 1].events = POLLIN;
+                busy |= polled[i]->busy;
+            }
+            rebuild = 0;
+        }
+
+        int timeout_ms = RUNTIME_TICK_MS - (int)((metrics_now_us() - last_tick) / 1000);
+        if (timeout_ms < 0)
+            timeout_ms = 0;
+        if (busy && timeout_ms > RUNTIME_BUSY_TICK_MS)
+            timeout_ms = RUNTIME_BUSY_TICK_MS;
+        rc = poll(fds, polled_count + 1, timeout_ms);
+
+        if (rc > 0 && (fds[0].revents & POLLIN))
+            drain_fd(thread->wakeup_read_fd);
+        // handles could be attached or detached while polling
+        if (atomic_load(&thread->should_stop) || polled_version != atomic_load(&thread->version))
+            continue;
+
+        int64_t now = metrics_now_us();
+        int tick = now - last_tick >= RUNTIME_TICK_MS * 1000;
+        if (tick)
+            last_tick = now;
+
+        busy = 0;
+        for (int i = 0; i < polled_count; i++) {
+            runtime_handle_t *handle = polled[i];
+            int ready = rc > 0 && (fds[i + 1].revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+            if (ready)
+                drain_fd(handle->read_fd);
+            if (ready || tick || handle->busy)
+                handle->busy = runtime_handle_serve(handle);
+            busy |= handle->busy;
+        }
+    }
+
+    for (int i = 0; i < polled_count; i++)
+        runtime_handle_unref(polled[i]);
+    free(fds);
+    free(polled);
+    pthread_exit(NULL);
+}
+
+static void
+stop_runtime_threads(runtime_t *runtime, int count) {
+    for (int i = 0; i < count; i++) {
+        runtime_thread_t *thread = &runtime->threads[i];
+        atomic_store(&thread->should_stop, 1);
+        runtime_thread_wakeup(thread);
+    }
+
+    for (int i = 0; i < count; i++) {
+        runtime_thread_t *thread = &runtime->threads[i];
+        pthread_join(thread->thread, NULL);
+        pthread_mutex_destroy(&thread->lock);
+        pthread_cond_destroy(&thread->started_cond);
+        close(thread->wakeup_read_fd);
+        close(thread->wakeup_write_fd);
+        free(thread->handles);
+    }
+}
+
+runtime_t *
+new_runtime(int threads, thread_options_t *thread_options, char *errstr, size_t errstr_size) {
+    snprintf(errstr, errstr_size, "failed to start runtime threads");
+
+    runtime_t *runtime = malloc(sizeof(runtime_t));
+    if (runtime == NULL) {
+        destroy_thread_options(thread_options);
+        return NULL;
+    }
+
+    runtime->threads = calloc(threads, sizeof(runtime_thread_t));
+    if (runtime->threads == NULL) {
+        destroy_thread_options(thread_options);
+        free(runtime);
+        return NULL;
+    }
+    runtime->thread_options = thread_options;
+    atomic_init(&runtime->refs, 1);
+
+    int started = 0;
+    int failed = 0;
+    for (; started < threads; started++) {
+        runtime_thread_t *thread = &runtime->threads[started];
+        thread->runtime = runtime;
+        if (new_nonblocking_pipe(&thread->wakeup_read_fd, &thread->wakeup_write_fd) != 0)
+            break;
+        pthread_mutex_init(&thread->lock, NULL);
+        pthread_cond_init(&thread->started_cond, NULL);
+        if (pthread_create(&thread->thread, NULL, runtime_loop, thread) != 0) {
+            pthread_cond_destroy(&thread->started_cond);
+            pthread_mutex_destroy(&thread->lock);
+            close(thread->wakeup_read_fd);
+            close(thread->wakeup_write_fd);
+            break;
+        }
+
+        pthread_mutex_lock(&thread->lock);
+        while (thread->started == 0)
+            pthread_cond_wait(&thread->started_cond, &thread->lock);
+        if (thread->started < 0) {
+            failed = 1;
+            snprintf(errstr, errstr_size, "%s", thread->error);
+        }
+        pthread_mutex_unlock(&thread->lock);
+        if (failed) {
+            // failed thread is already finished, but it still must be joined
+            started++;
+            break;
+        }
+    }
+
+    if (started < threads || failed) {
+        stop_runtime_threads(runtime, started);
+        destroy_thread_options(runtime->thread_options);
+        free(runtime->threads);
+        free(runtime);
+        return NULL;
+    }
+
+    runtime->threads_count = threads;
+    return runtime;
+}
+
+void
+runtime_ref(runtime_t *runtime) {
+    atomic_fetch_add(&runtime->refs, 1);
+}
+
+void
+runtime_unref(runtime_t *runtime) {
+    if (atomic_fetch_sub(&runtime->refs, 1) != 1)
+        return;
+
+    stop_runtime_threads(runtime, runtime->threads_count);
+    destroy_thread_options(runtime->thread_options);
+    free(runtime->threads);
+    free(runtime);
+}
+
+runtime_handle_t *
+runtime_attach(runtime_t *runtime, rd_kafka_queue_t *rd_queue, runtime_serve_t serve, void *arg) {
+    runtime_handle_t *handle = malloc(sizeof(runtime_handle_t));
+    if (handle == NULL)
+        return NULL;
+
+    if (new_nonblocking_pipe(&handle->read_fd, &handle->write_fd) != 0) {
+        free(handle);
+        return NULL;
+    }
+    handle->rd_queue = rd_queue;
+    handle->serve = serve;
+    handle->arg = arg;
+    // events which are enqueued before io event is enabled do not trigger it, so first serve is forced
+    handle->busy = 1;
+    pthread_mutex_init(&handle->serve_lock, NULL);
+    handle->detached = 0;
+    atomic_init(&handle->refs, 1);
+
+    // the least loaded thread is just a hint, it may change before handle is added
+    runtime_thread_t *thread = NULL;
+    int min_count = 0;
+    for (int i = 0; i < runtime->threads_count; i++) {
+        int count = atomic_load(&runtime->threads[i].load);
+        if (thread == NULL || count < min_count) {
+            thread = &runtime->threads[i];
+            min_count = count;
+        }
+    }
+    handle->thread = thread;
+
+    pthread_mutex_lock(&thread->lock);
+    if (thread->count == thread->capacity) {
+        int capacity = thread->capacity > 0 ? thread->capacity * 2 : 8;
+        runtime_handle_t **handles = realloc(thread->handles, capacity * sizeof(runtime_handle_t *));
+        if (handles == NULL) {
+            pthread_mutex_unlock(&thread->lock);
+            runtime_handle_unref(handle);
+            return NULL;
+        }
+        thread->handles = handles;
+        thread->capacity = capacity;
+    }
+    thread->handles[thread->count++] = handle;
+    atomic_fetch_add(&thread->load, 1);
+    atomic_fetch_add(&thread->version, 1);
+    pthread_mutex_unlock(&thread->lock);
+
+    runtime_ref(runtime);
+    rd_kafka_queue_io_event_enable(rd_queue, handle->write_fd, "1", 1);
+    runtime_thread_wakeup(thread);
+    return handle;
+}
+
+void
+runtime_detach(runtime_handle_t *handle) {
+    runtime_thread_t *thread = handle->thread;
+
+    rd_kafka_queue_io_event_enable(handle->rd_queue, -1, NULL, 0);
+
+    pthread_mutex_lock(&thread->lock);
+    for (int i = 0; i < thread->count; i++) {
+        if (thread->handles[i] == handle) {
+            thread->handles[i] = thread->handles[--thread->count];
+            atomic_fetch_sub(&thread->load, 1);
+            break;
+        }
+    }
+    atomic_fetch_add(&thread->version, 1);
+    pthread_mutex_unlock(&thread->lock);
+
+    // runtime thread may still keep handle in its copy of list, but serve is not called anymore
+    pthread_mutex_lock(&handle->serve_lock);
+    handle->detached = 1;
+    pthread_mutex_unlock(&handle->serve_lock);
+    runtime_thread_wakeup(thread);
+
+    runtime_t *runtime = thread->runtime;
+    runtime_handle_unref(handle);
+    runtime_unref(runtime);
+}
+
+/**
+ * Lua API
+ */
+
+static inline runtime_t *
+lua_check_runtime(struct lua_State *L, int index) {
+    runtime_t **runtime_p = (runtime_t **)luaL_checkudata(L, index, runtime_label);
+    if (runtime_p == NULL || *runtime_p == NULL)
+        luaL_error(L, "Kafka runtime fatal error: failed to retrieve runtime from lua stack!");
+    return *runtime_p;
+}
+
+const char *
+lua_read_runtime_option(struct lua_State *L, runtime_t **runtime) {
+    *runtime = NULL;
+
+    lua_pushstring(L, "runtime");
+    lua_gettable(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+
+    int is_runtime = 0;
+    if (lua_isuserdata(L, -1) && lua_getmetatable(L, -1)) {
+        luaL_getmetatable(L, runtime_label);
+        is_runtime = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+    if (!is_runtime) {
+        lua_pop(L, 1);
+        return "config 'runtime' must be kafka runtime";
+    }
+
+    *runtime = *(runtime_t **)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (*runtime == NULL)
+        return "config 'runtime' is already closed";
+    return NULL;
+}
+
+int
+lua_create_runtime(struct lua_State *L) {
+    if (lua_gettop(L) != 1 || !lua_istable(L, 1))
+        luaL_error(L, "Usage: runtime, err = create_runtime(config)");
+
+    lua_getfield(L, 1, "threads");
+    lua_Integer threads = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 0;
+    lua_pop(L, 1);
+    if (threads <= 0 || threads > RUNTIME_MAX_THREADS) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "runtime config 'threads' must be positive number not greater than %d",
+                        RUNTIME_MAX_THREADS);
+        return 2;
+    }
+
+    thread_options_t *thread_options = NULL;
+    const char *thread_options_err = lua_read_thread_options(L, &thread_options);
+    if (thread_options_err != NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "runtime %s", thread_options_err);
+        return 2;
+    }
+
+    char errstr[256];
+    runtime_t *runtime = new_runtime((int)threads, thread_options, errstr, sizeof(errstr));
+    if (runtime == NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, errstr);
+        return 2;
+    }
+
+    runtime_t **runtime_p = (runtime_t **)lua_newuserdata(L, sizeof(runtime));
+    *runtime_p = runtime;
+
+    luaL_getmetatable(L, runtime_label);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+int
+lua_runtime_stat(struct lua_State *L) {
+    runtime_t *runtime = lua_check_runtime(L, 1);
+
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, runtime->threads_count);
+    lua_setfield(L, -2, "threads");
+
+    lua_createtable(L, runtime->threads_count, 0);
+    for (int i = 0; i < runtime->threads_count; i++) {
+        // TX thread never takes lock of runtime thread to read stat
+        lua_pushinteger(L, atomic_load(&runtime->threads[i].load));
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "handles");
+    return 1;
+}
+
+static ssize_t
+wait_runtime_unref(va_list args) {
+    runtime_t *runtime = va_arg(args, runtime_t *);
+    runtime_unref(runtime);
+    return 0;
+}
+
+int
+lua_runtime_close(struct lua_State *L) {
+    runtime_t **runtime_p = (runtime_t **)luaL_checkudata(L, 1, runtime_label);
+    if (runtime_p == NULL || *runtime_p == NULL) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    // threads keep serving attached instances until the last of them is destroyed
+    coio_call(wait_runtime_unref, *runtime_p);
+    *runtime_p = NULL;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int
+lua_runtime_gc(struct lua_State *L) {
+    runtime_t **runtime_p = (runtime_t **)luaL_checkudata(L, 1, runtime_label);
+    if (runtime_p != NULL && *runtime_p != NULL) {
+        // fiber must not yield in gc, threads are woken up at once, so join is short
+        runtime_unref(*runtime_p);
+        *runtime_p = NULL;
+    }
+    return 0;
+}
+
+int
+lua_runtime_tostring(struct lua_State *L) {
+    const runtime_t *runtime = lua_check_runtime(L, 1);
+    lua_pushfstring(L, "Kafka Runtime: %p", runtime);
+    return 1;
+}
@@ -0,0 +1,159 @@
+#ifndef TNT_KAFKA_RUNTIME_H
+#define TNT_KAFKA_RUNTIME_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <librdkafka/rdkafka.h>
+
+#include <thread_options.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Runtime shared by many consumers and producers.
+ * Small pool of threads waits on io event fds of librdkafka queues of all attached instances
+ * and serves only those queues which have events, so idle instances do not cost a thread each.
+ */
+
+#define RUNTIME_MAX_THREADS 64
+
+/**
+ * Every attached queue is served at least once per tick, even without io events
+ */
+#define RUNTIME_TICK_MS 1000
+
+/**
+ * Queues which have not finished their work are served again after this timeout
+ */
+#define RUNTIME_BUSY_TICK_MS 10
+
+/**
+ * Serve queue without blocking, called from runtime thread only
+ * @param arg
+ * @return non zero if there is more work, e.g. when batch does not fit into full queue
+ */
+typedef int (*runtime_serve_t)(void *arg);
+
+struct runtime_thread_t;
+
+typedef struct {
+    struct runtime_thread_t *thread;
+    rd_kafka_queue_t        *rd_queue;
+    // librdkafka writes to pipe when queue gets events
+    int                     read_fd;
+    int                     write_fd;
+    runtime_serve_t         serve;
+    void                    *arg;
+    // changed by runtime thread only
+    int                     busy;
+
+    // held while handle is served, so detach waits for serve in progress only
+    pthread_mutex_t         serve_lock;
+    int                     detached;
+    // list of thread and every copy of list taken by runtime thread hold reference
+    _Atomic int             refs;
+} runtime_handle_t;
+
+struct runtime_t;
+
+typedef struct runtime_thread_t {
+    struct runtime_t  *runtime;
+    // guards list of handles only and is never held while any of them is served,
+    // so TX thread taking it on attach is not blocked by callbacks of served instances
+    pthread_mutex_t   lock;
+    runtime_handle_t  **handles;
+    int               count;
+    int               capacity;
+    // count of handles read without lock by attach and stat
+    _Atomic int       load;
+    // changed on every attach and detach, so poll results of stale handles are dropped
+    _Atomic unsigned  version;
+    // interrupts poll on attach, detach and stop
+    int               wakeup_read_fd;
+    int               wakeup_write_fd;
+    _Atomic int       should_stop;
+    // 1 when thread is started, -1 when thread options are failed to apply
+    int               started;
+    pthread_cond_t    started_cond;
+    char              error[256];
+    pthread_t         thread;
+} runtime_thread_t;
+
+typedef struct runtime_t {
+    runtime_thread_t *threads;
+    int              threads_count;
+    thread_options_t *thread_options;
+    // Lua object and every attached handle hold reference
+    _Atomic int      refs;
+} runtime_t;
+
+/**
+ * Start runtime threads and wait until thread options are applied to all of them
+ * @param threads
+ * @param thread_options ownership is taken, may be NULL
+ * @param errstr
+ * @param errstr_size
+ * @return NULL on failure
+ */
+runtime_t *
+new_runtime(int threads, thread_options_t *thread_options, char *errstr, size_t errstr_size);
+
+void
+runtime_ref(runtime_t *runtime);
+
+/**
+ * Release reference, threads are stopped and joined on the last one
+ * @param runtime
+ */
+void
+runtime_unref(runtime_t *runtime);
+
+/**
+ * Attach queue to the least loaded runtime thread, io events of queue are enabled
+ * @param runtime
+ * @param rd_queue must outlive handle
+ * @param serve
+ * @param arg
+ * @return NULL on failure
+ */
+runtime_handle_t *
+runtime_attach(runtime_t *runtime, rd_kafka_queue_t *rd_queue, runtime_serve_t serve, void *arg);
+
+/**
+ * Detach queue, serve is never called after return.
+ * Blocks while handle is served, so must not be called from TX thread directly.
+ * Handle memory is freed as soon as runtime thread drops its copy of handles list.
+ * @param handle
+ */
+void
+runtime_detach(runtime_handle_t *handle);
+
+/**
+ * Read 'runtime' option of config table on top of the stack
+ * @param L
+ * @param runtime NULL when option is not set
+ * @return error message or NULL
+ */
+const char *
+lua_read_runtime_option(struct lua_State *L, runtime_t **runtime);
+
+int
+lua_create_runtime(struct lua_State *L);
+
+int
+lua_runtime_stat(struct lua_State *L);
+
+int
+lua_runtime_close(struct lua_State *L);
+
+int
+lua_runtime_gc(struct lua_State *L);
+
+int
+lua_runtime_tostring(struct lua_State *L);
+
+#endif // TNT_KAFKA_RUNTIME_H
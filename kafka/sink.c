@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <librdkafka/rdkafka.h>
+#include <tarantool/module.h>
+#include <msgpuck.h>
+
+#include <common.h>
+#include <consumer_msg.h>
+
+#include "sink.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Consumed messages sink
+ */
+
+typedef struct {
+    uint32_t space_id;
+    int      mode;
+    // tuples of fields mode
+    char     *buf;
+    size_t   buf_size;
+    char     err[256];
+} sink_t;
+
+static const char *
+sink_encode_fields(sink_t *sink, const msg_t *msg, const char **end) {
+    const char *topic = rd_kafka_topic_name(msg->topic);
+    uint32_t topic_len = strlen(topic);
+
+    size_t size = mp_sizeof_array(5) + mp_sizeof_str(topic_len) +
+                  mp_sizeof_uint(msg->partition) + mp_sizeof_uint(msg->offset) +
+                  (msg->key != NULL ? mp_sizeof_str(msg->key_len) : mp_sizeof_nil()) +
+                  (msg->value != NULL ? mp_sizeof_str(msg->value_len) : mp_sizeof_nil());
+    if (size > sink->buf_size) {
+        char *buf = realloc(sink->buf, size);
+        if (buf == NULL)
+            return NULL;
+        sink->buf = buf;
+        sink->buf_size = size;
+    }
+
+    char *pos = mp_encode_array(sink->buf, 5);
+    pos = mp_encode_str(pos, topic, topic_len);
+    pos = mp_encode_uint(pos, msg->partition);
+    pos = mp_encode_uint(pos, msg->offset);
+    pos = msg->key != NULL ? mp_encode_str(pos, msg->key, msg->key_len) : mp_encode_nil(pos);
+    pos = msg->value != NULL ? mp_encode_str(pos, msg->value, msg->value_len) : mp_encode_nil(pos);
+    *end = pos;
+    return sink->buf;
+}
+
+static int
+sink_replace_msg(sink_t *sink, const msg_t *msg) {
+    const char *tuple = NULL;
+    const char *tuple_end = NULL;
+    if (sink->mode == SINK_MODE_VALUE) {
+        tuple = msg->value;
+        tuple_end = msg->value + msg->value_len;
+        // value comes from outside, so it is checked before it reaches box
+        const char *pos = tuple;
+        if (tuple == NULL || msg->value_len == 0 || mp_typeof(*tuple) != MP_ARRAY ||
+            mp_check(&pos, tuple_end) != 0 || pos != tuple_end) {
+            snprintf(sink->err, sizeof(sink->err), "value of message %s[%d] at offset %lld is not msgpack array",
+                     rd_kafka_topic_name(msg->topic), msg->partition, (long long)msg->offset);
+            return -1;
+        }
+    } else {
+        tuple = sink_encode_fields(sink, msg, &tuple_end);
+        if (tuple == NULL) {
+            snprintf(sink->err, sizeof(sink->err), "failed to allocate tuple");
+            return -1;
+        }
+    }
+
+    if (box_replace(sink->space_id, tuple, tuple_end, NULL) != 0) {
+        snprintf(sink->err, sizeof(sink->err), "%s", box_error_message(box_error_last()));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Replace messages by one transaction
+ */
+static int
+sink_replace_batch(sink_t *sink, msg_t **msgs, int count) {
+    if (box_txn_begin() != 0) {
+        snprintf(sink->err, sizeof(sink->err), "%s", box_error_message(box_error_last()));
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (sink_replace_msg(sink, msgs[i]) != 0) {
+            box_txn_rollback();
+            return -1;
+        }
+    }
+
+    // yields until WAL write
+    if (box_txn_commit() != 0) {
+        snprintf(sink->err, sizeof(sink->err), "%s", box_error_message(box_error_last()));
+        return -1;
+    }
+    return 0;
+}
+
+int
+lua_consumer_sink_poll(struct lua_State *L) {
+    if (lua_gettop(L) != 5)
+        luaL_error(L, "Usage: count, err = consumer:sink_poll(space_id, mode, batch_size, timeout)");
+
+    consumer_t **consumer_p = (consumer_t **)luaL_checkudata(L, 1, consumer_label);
+    if (consumer_p == NULL || *consumer_p == NULL || (*consumer_p)->rd_consumer == NULL) {
+        lua_pushinteger(L, 0);
+        lua_pushliteral(L, "Broken consumer");
+        return 2;
+    }
+
+    sink_t sink;
+    memset(&sink, 0, sizeof(sink));
+    sink.space_id = luaL_checkint(L, 2);
+    sink.mode = luaL_checkint(L, 3);
+    int batch_size = luaL_checkint(L, 4);
+    double timeout = luaL_checknumber(L, 5);
+    if (batch_size <= 0 || batch_size > SINK_MAX_BATCH_SIZE)
+        luaL_error(L, "sink batch size must be positive number not greater than %d", SINK_MAX_BATCH_SIZE);
+    if (box_txn()) {
+        lua_pushinteger(L, 0);
+        lua_pushliteral(L, "sink must not be called inside transaction");
+        return 2;
+    }
+
+    if (!consumer_has_msgs(*consumer_p) && timeout > 0) {
+        consumer_wait_msgs(*consumer_p, timeout);
+        if (fiber_is_cancelled())
+            return luaL_error(L, "fiber is cancelled");
+        if (*consumer_p == NULL || (*consumer_p)->rd_consumer == NULL) {
+            lua_pushinteger(L, 0);
+            lua_pushliteral(L, "consumer is closed");
+            return 2;
+        }
+    }
+
+    msg_t **msgs = malloc(batch_size * sizeof(msg_t *));
+    if (msgs == NULL)
+        luaL_error(L, "Out of memory: failed to allocate sink batch");
+
+    int count = 0;
+    msg_t *msg = NULL;
+    while (count < batch_size && (msg = consumer_pop_msg(*consumer_p)) != NULL)
+        msgs[count++] = msg;
+
+    int rc = 0;
+    if (count > 0)
+        rc = sink_replace_batch(&sink, msgs, count);
+
+    // commit yields, so consumer may be closed meanwhile
+    if (rc == 0 && count > 0) {
+        if (*consumer_p == NULL || (*consumer_p)->rd_consumer == NULL) {
+            snprintf(sink.err, sizeof(sink.err), "consumer is closed, offsets are not stored");
+            rc = -1;
+        } else {
+            rd_kafka_topic_partition_list_t *offsets = consumer_msgs_offsets(msgs, count);
+            if (offsets == NULL) {
+                snprintf(sink.err, sizeof(sink.err), "failed to allocate offsets, offsets are not stored");
+                rc = -1;
+            } else {
+                rd_kafka_resp_err_t err = consumer_store_offsets(*consumer_p, offsets);
+                rd_kafka_topic_partition_list_destroy(offsets);
+                if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+                    snprintf(sink.err, sizeof(sink.err), "%s", rd_kafka_err2str(err));
+                    rc = -1;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+        destroy_consumer_msg(msgs[i]);
+    free(msgs);
+    free(sink.buf);
+
+    lua_pushinteger(L, rc == 0 ? count : 0);
+    if (rc != 0)
+        lua_pushstring(L, sink.err);
+    else
+        lua_pushnil(L);
+    return 2;
+}
@@ -0,0 +1,36 @@
+#ifndef TNT_KAFKA_SINK_H
+#define TNT_KAFKA_SINK_H
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <consumer.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Sink of consumed messages into space.
+ * Every batch is replaced into space by one box transaction and offsets are stored only after its commit,
+ * so messages are delivered at least once with one WAL write per batch.
+ */
+
+enum {
+    // message value is msgpack array which is replaced as is
+    SINK_MODE_VALUE,
+    // tuple {topic, partition, offset, key, value} is built for every message
+    SINK_MODE_FIELDS,
+};
+
+/**
+ * Max size of batch replaced by one transaction
+ */
+#define SINK_MAX_BATCH_SIZE 100000
+
+/**
+ * Replace next batch of messages into space, waits for messages no longer than timeout.
+ * Returns count of replaced messages and error, offsets are not stored for failed batch.
+ */
+int
+lua_consumer_sink_poll(struct lua_State *L);
+
+#endif // TNT_KAFKA_SINK_H
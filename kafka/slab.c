@@ -0,0 +1,180 @@
+#include <stdlib.h>
+
+#include <slab.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Pool of fixed size objects
+ */
+
+mempool_t *
+new_mempool(size_t obj_size) {
+    mempool_t *pool = NULL;
+    if (posix_memalign((void **)&pool, SLAB_CACHE_LINE_SIZE, sizeof(mempool_t)) != 0)
+        return NULL;
+
+    // keeping objects aligned as malloc does
+    obj_size = (obj_size + sizeof(slab_obj_t) + 15) & ~(size_t)15;
+
+    pool->obj_size = obj_size;
+    pool->objs_per_chunk = (SLAB_CHUNK_SIZE - sizeof(void *)) / obj_size;
+    if (pool->objs_per_chunk < 1)
+        pool->objs_per_chunk = 1;
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        free(pool);
+        return NULL;
+    }
+    pool->free = NULL;
+    pool->chunks = NULL;
+    atomic_init(&pool->returned, NULL);
+    atomic_init(&pool->refs, 1);
+
+    return pool;
+}
+
+static void
+destroy_mempool(mempool_t *pool) {
+    void *chunk = pool->chunks;
+    while (chunk != NULL) {
+        void *next = *(void **)chunk;
+        free(chunk);
+        chunk = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+static inline void
+mempool_unref(mempool_t *pool) {
+    if (atomic_fetch_sub_explicit(&pool->refs, 1, memory_order_acq_rel) == 1)
+        destroy_mempool(pool);
+}
+
+/**
+ * Split new chunk into objects, must be called under pool lock
+ */
+static int
+mempool_grow(mempool_t *pool) {
+    // chunk starts with pointer to the next chunk, objects follow it with 16 bytes alignment
+    size_t offset = 16;
+    char *chunk = malloc(offset + pool->obj_size * pool->objs_per_chunk);
+    if (chunk == NULL)
+        return -1;
+
+    *(void **)chunk = pool->chunks;
+    pool->chunks = chunk;
+
+    for (int i = pool->objs_per_chunk - 1; i >= 0; i--) {
+        slab_obj_t *obj = (slab_obj_t *)(chunk + offset + pool->obj_size * i);
+        obj->pool = pool;
+        obj->next = pool->free;
+        pool->free = obj;
+    }
+    return 0;
+}
+
+void *
+mempool_alloc(mempool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+
+    slab_obj_t *obj = pool->free;
+    if (obj == NULL) {
+        // taking whole returned stack at once, so there is no ABA problem
+        obj = atomic_exchange_explicit(&pool->returned, NULL, memory_order_acquire);
+        if (obj == NULL && mempool_grow(pool) == 0)
+            obj = pool->free;
+    }
+    if (obj != NULL)
+        pool->free = obj->next;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (obj == NULL)
+        return NULL;
+
+    atomic_fetch_add_explicit(&pool->refs, 1, memory_order_relaxed);
+    obj->next = NULL;
+    return (char *)obj + sizeof(slab_obj_t);
+}
+
+static inline void
+mempool_free(mempool_t *pool, slab_obj_t *obj) {
+    slab_obj_t *head = atomic_load_explicit(&pool->returned, memory_order_relaxed);
+    do {
+        obj->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->returned, &head, obj,
+                                                    memory_order_release, memory_order_relaxed));
+    mempool_unref(pool);
+}
+
+void
+mempool_release(mempool_t *pool) {
+    if (pool == NULL)
+        return;
+    mempool_unref(pool);
+}
+
+/**
+ * Size classes
+ */
+
+slab_cache_t *
+new_slab_cache() {
+    slab_cache_t *cache = calloc(1, sizeof(slab_cache_t));
+    if (cache == NULL)
+        return NULL;
+
+    // all pools are created at once so lookup needs no locking, chunks are allocated on demand anyway
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        cache->classes[i] = new_mempool((SLAB_MIN_CLASS_SIZE << i) - sizeof(slab_obj_t));
+        if (cache->classes[i] == NULL) {
+            destroy_slab_cache(cache);
+            return NULL;
+        }
+    }
+
+    return cache;
+}
+
+void *
+slab_alloc(slab_cache_t *cache, size_t size) {
+    if (cache != NULL) {
+        size_t class_size = SLAB_MIN_CLASS_SIZE;
+        for (int i = 0; i < SLAB_CLASSES; i++, class_size <<= 1) {
+            if (size + sizeof(slab_obj_t) <= class_size) {
+                void *ptr = mempool_alloc(cache->classes[i]);
+                if (ptr != NULL)
+                    return ptr;
+                break;
+            }
+        }
+    }
+
+    slab_obj_t *obj = malloc(sizeof(slab_obj_t) + size);
+    if (obj == NULL)
+        return NULL;
+    obj->pool = NULL;
+    obj->next = NULL;
+    return (char *)obj + sizeof(slab_obj_t);
+}
+
+void
+slab_free(void *ptr) {
+    if (ptr == NULL)
+        return;
+
+    slab_obj_t *obj = (slab_obj_t *)((char *)ptr - sizeof(slab_obj_t));
+    if (obj->pool == NULL)
+        free(obj);
+    else
+        mempool_free(obj->pool, obj);
+}
+
+void
+destroy_slab_cache(slab_cache_t *cache) {
+    if (cache == NULL)
+        return;
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        mempool_release(cache->classes[i]);
+    free(cache);
+}
@@ -0,0 +1,109 @@
+#ifndef TNT_KAFKA_SLAB_H
+#define TNT_KAFKA_SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Pooled allocator for objects which are allocated by background threads and freed by TX thread
+ * (or vice versa). Objects are taken from per size class pools and returned to the owning pool
+ * through lock free stack, so steady state operation does not touch malloc at all.
+ */
+
+#define SLAB_CACHE_LINE_SIZE 64
+
+/**
+ * Smallest size class including object header, every next class is twice bigger
+ */
+#define SLAB_MIN_CLASS_SIZE 64
+#define SLAB_CLASSES 11
+
+/**
+ * Size of memory block which is split into objects of one size class
+ */
+#define SLAB_CHUNK_SIZE 65536
+
+struct mempool_t;
+
+/**
+ * Header placed before every allocated object
+ */
+typedef struct slab_obj_t {
+    // NULL when object is allocated by malloc
+    struct mempool_t  *pool;
+    struct slab_obj_t *next;
+} slab_obj_t;
+
+typedef struct mempool_t {
+    /* read only after creation */
+    size_t                  obj_size;
+    int                     objs_per_chunk;
+    char                    pad0[SLAB_CACHE_LINE_SIZE - sizeof(size_t) - sizeof(int)];
+
+    /* allocation side */
+    pthread_mutex_t         lock;
+    slab_obj_t              *free;
+    void                    *chunks;
+
+    /* free side: objects returned from other threads */
+    _Atomic(slab_obj_t *)   returned __attribute__((aligned(SLAB_CACHE_LINE_SIZE)));
+    // owner reference plus one reference per allocated object
+    _Atomic long            refs;
+} mempool_t;
+
+/**
+ * Create pool of objects of given size
+ * @param obj_size
+ * @return
+ */
+mempool_t *
+new_mempool(size_t obj_size);
+
+void *
+mempool_alloc(mempool_t *pool);
+
+/**
+ * Drop owner reference, pool memory is freed as soon as all objects are returned.
+ * No allocations are allowed after that.
+ * @param pool
+ */
+void
+mempool_release(mempool_t *pool);
+
+/**
+ * Set of pools for size classes
+ */
+typedef struct {
+    mempool_t *classes[SLAB_CLASSES];
+} slab_cache_t;
+
+slab_cache_t *
+new_slab_cache();
+
+/**
+ * Allocate object of given size from size class pool or from malloc for huge objects.
+ * Cache may be NULL, then malloc is used.
+ * @param cache
+ * @param size
+ * @return
+ */
+void *
+slab_alloc(slab_cache_t *cache, size_t size);
+
+/**
+ * Return object allocated by slab_alloc or mempool_alloc to its owner, may be called from any thread
+ * @param ptr
+ */
+void
+slab_free(void *ptr);
+
+/**
+ * Release all pools of cache, objects allocated from it stay valid until freed
+ * @param cache
+ */
+void
+destroy_slab_cache(slab_cache_t *cache);
+
+#endif //TNT_KAFKA_SLAB_H
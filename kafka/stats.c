@@ -0,0 +1,471 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Filter of statistics fields
+ */
+
+stats_filter_t *
+new_stats_filter() {
+    return calloc(1, sizeof(stats_filter_t));
+}
+
+int
+stats_filter_add(stats_filter_t *filter, const char *path) {
+    stats_path_t *paths = realloc(filter->paths, (filter->count + 1) * sizeof(stats_path_t));
+    if (paths == NULL)
+        return -1;
+    filter->paths = paths;
+
+    stats_path_t *new_path = &paths[filter->count];
+    new_path->count = 0;
+    new_path->segments = malloc(STATS_MAX_DEPTH * sizeof(char *));
+    new_path->lengths = malloc(STATS_MAX_DEPTH * sizeof(size_t));
+    if (new_path->segments == NULL || new_path->lengths == NULL)
+        goto error;
+
+    const char *start = path;
+    while (1) {
+        const char *dot = strchr(start, '.');
+        size_t len = dot != NULL ? (size_t)(dot - start) : strlen(start);
+        if (len == 0 || new_path->count == STATS_MAX_DEPTH)
+            goto error;
+
+        char *segment = strndup(start, len);
+        if (segment == NULL)
+            goto error;
+        new_path->segments[new_path->count] = segment;
+        new_path->lengths[new_path->count] = len;
+        new_path->count++;
+
+        if (dot == NULL)
+            break;
+        start = dot + 1;
+    }
+
+    filter->count++;
+    return 0;
+
+error:
+    for (int i = 0; i < new_path->count; i++)
+        free(new_path->segments[i]);
+    free(new_path->segments);
+    free(new_path->lengths);
+    return -1;
+}
+
+void
+destroy_stats_filter(stats_filter_t *filter) {
+    if (filter == NULL)
+        return;
+    for (int i = 0; i < filter->count; i++) {
+        for (int j = 0; j < filter->paths[i].count; j++)
+            free(filter->paths[i].segments[j]);
+        free(filter->paths[i].segments);
+        free(filter->paths[i].lengths);
+    }
+    free(filter->paths);
+    free(filter);
+}
+
+const char *
+lua_read_stats_filter(struct lua_State *L, stats_filter_t **filter) {
+    *filter = NULL;
+
+    lua_pushstring(L, "stats_fields");
+    lua_gettable(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return "config 'stats_fields' must be list of strings";
+    }
+
+    stats_filter_t *new_filter = new_stats_filter();
+    if (new_filter == NULL) {
+        lua_pop(L, 1);
+        return "failed to allocate stats filter";
+    }
+
+    int count = lua_objlen(L, -1);
+    for (int i = 1; i <= count; i++) {
+        lua_rawgeti(L, -1, i);
+        const char *path = lua_tostring(L, -1);
+        if (path == NULL || stats_filter_add(new_filter, path) != 0) {
+            lua_pop(L, 2);
+            destroy_stats_filter(new_filter);
+            return "config 'stats_fields' must contain dot separated paths like 'brokers.*.rtt.avg'";
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    *filter = new_filter;
+    return NULL;
+}
+
+/**
+ * Parsing of statistics JSON.
+ * librdkafka JSON is trusted, so parser only tracks structure, keys and string values are kept escaped.
+ */
+
+enum {
+    STATS_SKIP,
+    STATS_DESCEND,
+    STATS_ALL,
+};
+
+enum {
+    STATS_NUMBER = 'n',
+    STATS_STRING = 's',
+    STATS_TRUE = 't',
+    STATS_FALSE = 'f',
+};
+
+typedef struct {
+    const char           *pos;
+    const char           *end;
+    const stats_filter_t *filter;
+
+    // keys of current path
+    const char           *keys[STATS_MAX_DEPTH];
+    size_t               key_lens[STATS_MAX_DEPTH];
+    char                 indices[STATS_MAX_DEPTH][16];
+
+    // encoded fields
+    char                 *data;
+    size_t               size;
+    size_t               capacity;
+    int                  failed;
+} stats_parser_t;
+
+static void
+stats_write(stats_parser_t *parser, const void *data, size_t len) {
+    if (parser->failed)
+        return;
+
+    if (parser->size + len > parser->capacity) {
+        size_t capacity = parser->capacity > 0 ? parser->capacity * 2 : 4096;
+        while (capacity < parser->size + len)
+            capacity *= 2;
+        char *new_data = realloc(parser->data, capacity);
+        if (new_data == NULL) {
+            parser->failed = 1;
+            return;
+        }
+        parser->data = new_data;
+        parser->capacity = capacity;
+    }
+
+    memcpy(parser->data + parser->size, data, len);
+    parser->size += len;
+}
+
+static void
+stats_write_str(stats_parser_t *parser, const char *str, size_t len) {
+    uint32_t len32 = (uint32_t)len;
+    stats_write(parser, &len32, sizeof(len32));
+    stats_write(parser, str, len);
+}
+
+static void
+stats_emit(stats_parser_t *parser, int depth, char type, const char *str, size_t len, double number) {
+    uint8_t depth8 = (uint8_t)depth;
+    stats_write(parser, &depth8, sizeof(depth8));
+    for (int i = 0; i < depth; i++)
+        stats_write_str(parser, parser->keys[i], parser->key_lens[i]);
+
+    stats_write(parser, &type, sizeof(type));
+    if (type == STATS_NUMBER)
+        stats_write(parser, &number, sizeof(number));
+    else if (type == STATS_STRING)
+        stats_write_str(parser, str, len);
+}
+
+static inline void
+stats_skip_ws(stats_parser_t *parser) {
+    while (parser->pos < parser->end &&
+           (*parser->pos == ' ' || *parser->pos == '\t' || *parser->pos == '\n' || *parser->pos == '\r'))
+        parser->pos++;
+}
+
+static int
+stats_parse_string(stats_parser_t *parser, const char **str, size_t *len) {
+    if (parser->pos >= parser->end || *parser->pos != '"')
+        return -1;
+
+    const char *start = ++parser->pos;
+    while (parser->pos < parser->end && *parser->pos != '"') {
+        if (*parser->pos == '\\')
+            parser->pos++;
+        parser->pos++;
+    }
+    if (parser->pos >= parser->end)
+        return -1;
+
+    *str = start;
+    *len = parser->pos - start;
+    parser->pos++;
+    return 0;
+}
+
+/**
+ * Match current path of given depth with filter
+ */
+static int
+stats_match(const stats_parser_t *parser, int depth) {
+    int mode = STATS_SKIP;
+    for (int i = 0; i < parser->filter->count; i++) {
+        const stats_path_t *path = &parser->filter->paths[i];
+        int count = path->count < depth ? path->count : depth;
+        int matched = 1;
+        for (int j = 0; j < count && matched; j++) {
+            const char *segment = path->segments[j];
+            matched = (path->lengths[j] == 1 && segment[0] == '*') ||
+                      (path->lengths[j] == parser->key_lens[j] &&
+                       memcmp(segment, parser->keys[j], parser->key_lens[j]) == 0);
+        }
+        if (!matched)
+            continue;
+        if (path->count <= depth)
+            return STATS_ALL;
+        mode = STATS_DESCEND;
+    }
+    return mode;
+}
+
+static int
+stats_parse_value(stats_parser_t *parser, int depth, int mode);
+
+static int
+stats_parse_container(stats_parser_t *parser, int depth, int mode, int is_array) {
+    char closing = is_array ? ']' : '}';
+
+    parser->pos++;
+    stats_skip_ws(parser);
+    if (parser->pos < parser->end && *parser->pos == closing) {
+        parser->pos++;
+        return 0;
+    }
+
+    // keys are not tracked for skipped values
+    if (mode != STATS_SKIP && depth >= STATS_MAX_DEPTH)
+        return -1;
+
+    for (int index = 0; ; index++) {
+        const char *key = NULL;
+        size_t key_len = 0;
+        if (!is_array) {
+            stats_skip_ws(parser);
+            if (stats_parse_string(parser, &key, &key_len) != 0)
+                return -1;
+            stats_skip_ws(parser);
+            if (parser->pos >= parser->end || *parser->pos != ':')
+                return -1;
+            parser->pos++;
+        } else if (mode != STATS_SKIP) {
+            key = parser->indices[depth];
+            key_len = snprintf(parser->indices[depth], sizeof(parser->indices[depth]), "%d", index);
+        }
+
+        int child_mode = mode;
+        if (mode != STATS_SKIP) {
+            parser->keys[depth] = key;
+            parser->key_lens[depth] = key_len;
+            if (mode == STATS_DESCEND)
+                child_mode = stats_match(parser, depth + 1);
+        }
+
+        if (stats_parse_value(parser, depth + 1, child_mode) != 0)
+            return -1;
+
+        stats_skip_ws(parser);
+        if (parser->pos >= parser->end)
+            return -1;
+        if (*parser->pos == ',') {
+            parser->pos++;
+            continue;
+        }
+        if (*parser->pos == closing) {
+            parser->pos++;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+static int
+stats_parse_value(stats_parser_t *parser, int depth, int mode) {
+    // skipped values are not deeper than tracked ones in practice, this only guards the stack
+    if (depth > STATS_MAX_DEPTH * 4)
+        return -1;
+
+    stats_skip_ws(parser);
+    if (parser->pos >= parser->end)
+        return -1;
+
+    char c = *parser->pos;
+    if (c == '{' || c == '[')
+        return stats_parse_container(parser, depth, mode, c == '[');
+
+    if (c == '"') {
+        const char *str = NULL;
+        size_t len = 0;
+        if (stats_parse_string(parser, &str, &len) != 0)
+            return -1;
+        if (mode == STATS_ALL)
+            stats_emit(parser, depth, STATS_STRING, str, len, 0);
+        return 0;
+    }
+
+    const char *start = parser->pos;
+    while (parser->pos < parser->end && *parser->pos != ',' && *parser->pos != '}' && *parser->pos != ']' &&
+           *parser->pos != ' ' && *parser->pos != '\n' && *parser->pos != '\r' && *parser->pos != '\t')
+        parser->pos++;
+    size_t len = parser->pos - start;
+    if (len == 0)
+        return -1;
+    if (mode != STATS_ALL)
+        return 0;
+
+    if (len == 4 && memcmp(start, "true", 4) == 0) {
+        stats_emit(parser, depth, STATS_TRUE, NULL, 0, 0);
+    } else if (len == 5 && memcmp(start, "false", 5) == 0) {
+        stats_emit(parser, depth, STATS_FALSE, NULL, 0, 0);
+    } else if (!(len == 4 && memcmp(start, "null", 4) == 0)) {
+        char number[64];
+        if (len >= sizeof(number))
+            return -1;
+        memcpy(number, start, len);
+        number[len] = '\0';
+        stats_emit(parser, depth, STATS_NUMBER, NULL, 0, strtod(number, NULL));
+    }
+    return 0;
+}
+
+/**
+ * Statistics message
+ */
+
+stats_msg_t *
+new_raw_stats_msg(char *json) {
+    stats_msg_t *msg = malloc(sizeof(stats_msg_t));
+    if (msg == NULL)
+        return NULL;
+    msg->json = json;
+    msg->size = 0;
+    return msg;
+}
+
+stats_msg_t *
+new_filtered_stats_msg(const stats_filter_t *filter, const char *json, size_t json_len) {
+    stats_parser_t parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.pos = json;
+    parser.end = json + json_len;
+    parser.filter = filter;
+
+    stats_msg_t *msg = NULL;
+    if (stats_parse_value(&parser, 0, STATS_DESCEND) == 0 && !parser.failed) {
+        msg = malloc(sizeof(stats_msg_t) + parser.size);
+        if (msg != NULL) {
+            msg->json = NULL;
+            msg->size = parser.size;
+            if (parser.size > 0)
+                memcpy(msg->data, parser.data, parser.size);
+        }
+    }
+
+    free(parser.data);
+    return msg;
+}
+
+void
+destroy_stats_msg(stats_msg_t *msg) {
+    if (msg == NULL)
+        return;
+    free(msg->json);
+    free(msg);
+}
+
+static const char *
+stats_read_str(const char *pos, const char **str, size_t *len) {
+    uint32_t len32;
+    memcpy(&len32, pos, sizeof(len32));
+    *str = pos + sizeof(len32);
+    *len = len32;
+    return *str + len32;
+}
+
+void
+lua_push_stats_msg(struct lua_State *L, const stats_msg_t *msg) {
+    if (msg->json != NULL) {
+        lua_pushstring(L, msg->json);
+        return;
+    }
+
+    lua_newtable(L);
+
+    const char *pos = msg->data;
+    const char *end = msg->data + msg->size;
+    while (pos < end) {
+        uint8_t depth = (uint8_t)*pos++;
+        const char *key = NULL;
+        size_t key_len = 0;
+
+        // walking down from result table, creating missing tables
+        lua_pushvalue(L, -1);
+        for (int i = 0; i < depth; i++) {
+            pos = stats_read_str(pos, &key, &key_len);
+            if (i == depth - 1)
+                break;
+
+            lua_pushlstring(L, key, key_len);
+            lua_rawget(L, -2);
+            if (!lua_istable(L, -1)) {
+                lua_pop(L, 1);
+                lua_newtable(L);
+                lua_pushlstring(L, key, key_len);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, -4);
+            }
+            lua_remove(L, -2);
+        }
+
+        char type = *pos++;
+        if (depth == 0) {
+            // whole document is selected by scalar root, which is not the case for librdkafka
+            lua_pop(L, 1);
+            if (type == STATS_NUMBER)
+                pos += sizeof(double);
+            else if (type == STATS_STRING)
+                pos = stats_read_str(pos, &key, &key_len);
+            continue;
+        }
+
+        lua_pushlstring(L, key, key_len);
+        if (type == STATS_NUMBER) {
+            double number;
+            memcpy(&number, pos, sizeof(number));
+            pos += sizeof(number);
+            lua_pushnumber(L, number);
+        } else if (type == STATS_STRING) {
+            const char *str = NULL;
+            size_t len = 0;
+            pos = stats_read_str(pos, &str, &len);
+            lua_pushlstring(L, str, len);
+        } else {
+            lua_pushboolean(L, type == STATS_TRUE);
+        }
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+    }
+}
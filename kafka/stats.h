@@ -0,0 +1,88 @@
+#ifndef TNT_KAFKA_STATS_H
+#define TNT_KAFKA_STATS_H
+
+#include <stddef.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Statistics of librdkafka.
+ * JSON may be parsed by background thread, so only requested fields are passed to TX thread.
+ */
+
+/**
+ * Max depth of JSON path, librdkafka statistics are not deeper
+ */
+#define STATS_MAX_DEPTH 16
+
+/**
+ * Path like "brokers.*.rtt.avg", "*" matches any key, path of object selects all its fields
+ */
+typedef struct {
+    char   **segments;
+    size_t *lengths;
+    int    count;
+} stats_path_t;
+
+typedef struct {
+    stats_path_t *paths;
+    int          count;
+} stats_filter_t;
+
+stats_filter_t *
+new_stats_filter();
+
+/**
+ * @param filter
+ * @param path dot separated keys
+ * @return 0 on success
+ */
+int
+stats_filter_add(stats_filter_t *filter, const char *path);
+
+void
+destroy_stats_filter(stats_filter_t *filter);
+
+/**
+ * Read 'stats_fields' list of paths from config table on top of the stack
+ * @param L
+ * @param filter NULL when option is not set
+ * @return error or NULL
+ */
+const char *
+lua_read_stats_filter(struct lua_State *L, stats_filter_t **filter);
+
+typedef struct {
+    // whole JSON when there is no filter
+    char   *json;
+    // selected fields: depth, keys and value of every field one by one
+    size_t size;
+    char   data[];
+} stats_msg_t;
+
+/**
+ * Wrap JSON, ownership is taken
+ */
+stats_msg_t *
+new_raw_stats_msg(char *json);
+
+/**
+ * Parse JSON and keep selected fields only
+ * @return NULL on allocation failure or invalid JSON
+ */
+stats_msg_t *
+new_filtered_stats_msg(const stats_filter_t *filter, const char *json, size_t json_len);
+
+void
+destroy_stats_msg(stats_msg_t *msg);
+
+/**
+ * Push JSON string or nested table of selected fields
+ */
+void
+lua_push_stats_msg(struct lua_State *L, const stats_msg_t *msg);
+
+#endif // TNT_KAFKA_STATS_H
@@ -0,0 +1,336 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#include <common.h>
+#include <callbacks.h>
+
+#include <thread_options.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * CPU affinity, scheduling and naming of background threads
+ */
+
+static const struct {
+    const char *name;
+    int        policy;
+} sched_policies[] = {
+        {"other", SCHED_OTHER},
+#ifdef __linux__
+        {"batch", SCHED_BATCH},
+        {"idle", SCHED_IDLE},
+#endif
+        {"fifo", SCHED_FIFO},
+        {"rr", SCHED_RR},
+};
+
+static int
+thread_options_add_cpu(thread_options_t *options, int cpu) {
+    for (int i = 0; i < options->cpus_count; i++) {
+        if (options->cpus[i] == cpu)
+            return 0;
+    }
+    int *cpus = realloc(options->cpus, (options->cpus_count + 1) * sizeof(int));
+    if (cpus == NULL)
+        return -1;
+    options->cpus = cpus;
+    options->cpus[options->cpus_count++] = cpu;
+    return 0;
+}
+
+#ifdef __linux__
+/**
+ * Add cpus of NUMA node from its sysfs cpulist like "0-3,8-11"
+ */
+static const char *
+thread_options_add_numa_node(thread_options_t *options, int node) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return "config 'thread_options.numa_node' is unknown NUMA node";
+
+    char buf[4096];
+    size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[len] = '\0';
+
+    char *pos = buf;
+    while (*pos != '\0' && *pos != '\n') {
+        char *end;
+        long first = strtol(pos, &end, 10);
+        if (end == pos)
+            break;
+        long last = first;
+        pos = end;
+        if (*pos == '-') {
+            last = strtol(pos + 1, &end, 10);
+            pos = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < THREAD_MAX_CPUS; cpu++) {
+            if (thread_options_add_cpu(options, (int)cpu) != 0)
+                return "failed to allocate thread options";
+        }
+        if (*pos == ',')
+            pos++;
+    }
+
+    if (options->cpus_count == 0)
+        return "config 'thread_options.numa_node' has no CPUs";
+    return NULL;
+}
+#endif
+
+static const char *
+lua_read_thread_options_fields(struct lua_State *L, thread_options_t *options) {
+    lua_getfield(L, -1, "cpu_affinity");
+    if (!lua_isnil(L, -1)) {
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            return "config 'thread_options.cpu_affinity' must be array of CPU numbers";
+        }
+#ifndef __linux__
+        lua_pop(L, 1);
+        return "config 'thread_options.cpu_affinity' is not supported on this platform";
+#else
+        size_t count = lua_objlen(L, -1);
+        for (size_t i = 1; i <= count; i++) {
+            lua_rawgeti(L, -1, (int)i);
+            int is_number = lua_isnumber(L, -1);
+            lua_Integer cpu = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            if (!is_number || cpu < 0 || cpu >= THREAD_MAX_CPUS) {
+                lua_pop(L, 1);
+                return "config 'thread_options.cpu_affinity' must be array of CPU numbers";
+            }
+            if (thread_options_add_cpu(options, (int)cpu) != 0) {
+                lua_pop(L, 1);
+                return "failed to allocate thread options";
+            }
+        }
+#endif
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "numa_node");
+    if (!lua_isnil(L, -1)) {
+        if (!lua_isnumber(L, -1) || lua_tointeger(L, -1) < 0) {
+            lua_pop(L, 1);
+            return "config 'thread_options.numa_node' must be non negative number";
+        }
+        if (options->cpus_count > 0) {
+            lua_pop(L, 1);
+            return "config 'thread_options' must have either 'cpu_affinity' or 'numa_node'";
+        }
+#ifndef __linux__
+        lua_pop(L, 1);
+        return "config 'thread_options.numa_node' is not supported on this platform";
+#else
+        const char *err = thread_options_add_numa_node(options, (int)lua_tointeger(L, -1));
+        if (err != NULL) {
+            lua_pop(L, 1);
+            return err;
+        }
+#endif
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "sched_policy");
+    if (!lua_isnil(L, -1)) {
+        const char *name = lua_isstring(L, -1) ? lua_tostring(L, -1) : "";
+        for (size_t i = 0; i < sizeof(sched_policies) / sizeof(sched_policies[0]); i++) {
+            if (strcmp(name, sched_policies[i].name) == 0)
+                options->sched_policy = sched_policies[i].policy;
+        }
+        if (options->sched_policy < 0) {
+            lua_pop(L, 1);
+            return "config 'thread_options.sched_policy' must be one of 'other', 'batch', 'idle', 'fifo', 'rr'";
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "sched_priority");
+    if (!lua_isnil(L, -1)) {
+        int policy = options->sched_policy;
+        if (!lua_isnumber(L, -1) || (policy != SCHED_FIFO && policy != SCHED_RR)) {
+            lua_pop(L, 1);
+            return "config 'thread_options.sched_priority' must be number and is allowed for 'fifo' and 'rr' policies only";
+        }
+        options->sched_priority = (int)lua_tointeger(L, -1);
+        if (options->sched_priority < sched_get_priority_min(policy) ||
+            options->sched_priority > sched_get_priority_max(policy)) {
+            lua_pop(L, 1);
+            return "config 'thread_options.sched_priority' is out of range of scheduling policy";
+        }
+    } else if (options->sched_policy == SCHED_FIFO || options->sched_policy == SCHED_RR) {
+        options->sched_priority = sched_get_priority_min(options->sched_policy);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "nice");
+    if (!lua_isnil(L, -1)) {
+        if (!lua_isnumber(L, -1) || lua_tointeger(L, -1) < -20 || lua_tointeger(L, -1) > 19) {
+            lua_pop(L, 1);
+            return "config 'thread_options.nice' must be number from -20 to 19";
+        }
+#ifndef __linux__
+        lua_pop(L, 1);
+        return "config 'thread_options.nice' is not supported on this platform";
+#else
+        options->has_nice = 1;
+        options->nice = (int)lua_tointeger(L, -1);
+#endif
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "name_suffix");
+    if (!lua_isnil(L, -1)) {
+        if (!lua_isstring(L, -1)) {
+            lua_pop(L, 1);
+            return "config 'thread_options.name_suffix' must be string";
+        }
+        snprintf(options->name_suffix, sizeof(options->name_suffix), "%s", lua_tostring(L, -1));
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "librdkafka_threads");
+    options->librdkafka_threads = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    return NULL;
+}
+
+const char *
+lua_read_thread_options(struct lua_State *L, thread_options_t **options) {
+    *options = NULL;
+
+    lua_getfield(L, -1, "thread_options");
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return "config 'thread_options' must be table";
+    }
+
+    thread_options_t *new_options = calloc(1, sizeof(thread_options_t));
+    if (new_options == NULL) {
+        lua_pop(L, 1);
+        return "failed to allocate thread options";
+    }
+    new_options->sched_policy = -1;
+
+    const char *err = lua_read_thread_options_fields(L, new_options);
+    lua_pop(L, 1);
+    if (err != NULL) {
+        destroy_thread_options(new_options);
+        return err;
+    }
+
+    *options = new_options;
+    return NULL;
+}
+
+void
+destroy_thread_options(thread_options_t *options) {
+    if (options == NULL)
+        return;
+    free(options->cpus);
+    free(options);
+}
+
+static int
+thread_options_apply_sched(const thread_options_t *options, char *errstr, size_t errstr_size) {
+    int rc;
+#ifdef __linux__
+    if (options->cpus_count > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int i = 0; i < options->cpus_count; i++)
+            CPU_SET(options->cpus[i], &set);
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (rc != 0) {
+            snprintf(errstr, errstr_size, "failed to set CPU affinity of thread: %s", strerror(rc));
+            return -1;
+        }
+    }
+#endif
+
+    if (options->sched_policy >= 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = options->sched_priority;
+        rc = pthread_setschedparam(pthread_self(), options->sched_policy, &param);
+        if (rc != 0) {
+            snprintf(errstr, errstr_size, "failed to set scheduling policy of thread: %s", strerror(rc));
+            return -1;
+        }
+    }
+
+#ifdef __linux__
+    // nice value is per thread on Linux
+    if (options->has_nice && setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), options->nice) != 0) {
+        snprintf(errstr, errstr_size, "failed to set nice value of thread: %s", strerror(errno));
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+int
+thread_options_apply(const thread_options_t *options, const char *name, const char *short_name,
+                     char *errstr, size_t errstr_size) {
+    if (options == NULL || options->name_suffix[0] == '\0') {
+        set_thread_name(name);
+    } else {
+        char full_name[THREAD_NAME_SIZE];
+        snprintf(full_name, sizeof(full_name), "%s:%s", short_name, options->name_suffix);
+        set_thread_name(full_name);
+    }
+
+    if (options == NULL)
+        return 0;
+    return thread_options_apply_sched(options, errstr, errstr_size);
+}
+
+static rd_kafka_resp_err_t
+thread_options_on_thread_start(rd_kafka_t *rk, rd_kafka_thread_type_t UNUSED(thread_type),
+                               const char *UNUSED(thread_name), void *ic_opaque) {
+    // librdkafka threads keep their own names
+    char errstr[256];
+    if (thread_options_apply_sched(ic_opaque, errstr, sizeof(errstr)) != 0)
+        error_callback(rk, RD_KAFKA_RESP_ERR__FAIL, errstr, rd_kafka_opaque(rk));
+    return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+static rd_kafka_resp_err_t
+thread_options_on_new(rd_kafka_t *rk, const rd_kafka_conf_t *UNUSED(conf), void *ic_opaque,
+                      char *UNUSED(errstr), size_t UNUSED(errstr_size)) {
+    return rd_kafka_interceptor_add_on_thread_start(rk, "tnt_kafka_thread_options",
+                                                    thread_options_on_thread_start, ic_opaque);
+}
+
+rd_kafka_resp_err_t
+thread_options_set_conf(rd_kafka_conf_t *conf, thread_options_t *options, char *errstr, size_t errstr_size) {
+    if (options == NULL || !options->librdkafka_threads)
+        return RD_KAFKA_RESP_ERR_NO_ERROR;
+
+    rd_kafka_resp_err_t err = rd_kafka_conf_interceptor_add_on_new(conf, "tnt_kafka_thread_options",
+                                                                   thread_options_on_new, options);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR)
+        snprintf(errstr, errstr_size, "failed to set up thread options of librdkafka threads: %s",
+                 rd_kafka_err2str(err));
+    return err;
+}
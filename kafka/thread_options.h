@@ -0,0 +1,74 @@
+#ifndef TNT_KAFKA_THREAD_OPTIONS_H
+#define TNT_KAFKA_THREAD_OPTIONS_H
+
+#include <stddef.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <librdkafka/rdkafka.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * CPU affinity, scheduling and naming of background threads of consumer, producer or runtime
+ */
+
+/**
+ * Thread name is limited by 15 chars on Linux, so longer names are truncated
+ */
+#define THREAD_NAME_SIZE 16
+
+#define THREAD_MAX_CPUS 1024
+
+typedef struct {
+    // cpus threads are pinned to, empty set keeps inherited affinity
+    int  *cpus;
+    int  cpus_count;
+    // -1 keeps inherited policy
+    int  sched_policy;
+    int  sched_priority;
+    int  has_nice;
+    int  nice;
+    char name_suffix[THREAD_NAME_SIZE];
+    // apply affinity and scheduling to librdkafka threads too
+    int  librdkafka_threads;
+} thread_options_t;
+
+/**
+ * Read 'thread_options' of config table on top of the stack
+ * @param L
+ * @param options NULL when option is not set
+ * @return error message or NULL
+ */
+const char *
+lua_read_thread_options(struct lua_State *L, thread_options_t **options);
+
+void
+destroy_thread_options(thread_options_t *options);
+
+/**
+ * Name current thread and apply affinity and scheduling options to it
+ * @param options may be NULL, then thread is only named
+ * @param name used without suffix
+ * @param short_name used with suffix as "short_name:suffix"
+ * @param errstr
+ * @param errstr_size
+ * @return 0 on success, thread is named even on failure
+ */
+int
+thread_options_apply(const thread_options_t *options, const char *name, const char *short_name,
+                     char *errstr, size_t errstr_size);
+
+/**
+ * Set up interceptor applying options to librdkafka threads if they are asked for
+ * @param conf
+ * @param options must outlive librdkafka handle
+ * @param errstr
+ * @param errstr_size
+ * @return
+ */
+rd_kafka_resp_err_t
+thread_options_set_conf(rd_kafka_conf_t *conf, thread_options_t *options, char *errstr, size_t errstr_size);
+
+#endif // TNT_KAFKA_THREAD_OPTIONS_H
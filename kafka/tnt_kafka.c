@@ -6,6 +6,11 @@
 #include <consumer.h>
 #include <consumer_msg.h>
 #include <producer.h>
+#include <exporter.h>
+#include <sink.h>
+#include <runtime.h>
+#include <headers.h>
+#include <mock.h>
 
 #include <tnt_kafka.h>
 
@@ -20,19 +25,31 @@ luaopen_kafka_tntkafka(lua_State *L) {
             {"subscribe", lua_consumer_subscribe},
             {"unsubscribe", lua_consumer_unsubscribe},
             {"poll_msg", lua_consumer_poll_msg},
+            {"poll_batch", lua_consumer_poll_batch},
+            {"poll", lua_consumer_poll},
+            {"wait_msg", lua_consumer_wait_msg},
             {"poll_logs", lua_consumer_poll_logs},
             {"poll_stats", lua_consumer_poll_stats},
             {"poll_errors", lua_consumer_poll_errors},
             {"poll_rebalances", lua_consumer_poll_rebalances},
+            {"wait_rebalance", lua_consumer_wait_rebalance},
             {"store_offset", lua_consumer_store_offset},
+            {"store_offsets", lua_consumer_store_offsets},
+            {"commit_async", lua_consumer_commit_async},
+            {"commit_sync", lua_consumer_commit_sync},
+            {"poll_commits", lua_consumer_poll_commits},
+            {"sink_poll", lua_consumer_sink_poll},
             {"seek_partitions", lua_consumer_seek_partitions},
             {"dump_conf", lua_consumer_dump_conf},
             {"metadata", lua_consumer_metadata},
             {"list_groups", lua_consumer_list_groups},
             {"pause", lua_consumer_pause},
             {"resume", lua_consumer_resume},
+            {"metrics", lua_consumer_metrics},
+            {"lag", lua_consumer_lag},
             {"close", lua_consumer_close},
             {"destroy", lua_consumer_destroy},
+            {"_raw", lua_consumer_raw},
             {"__tostring", lua_consumer_tostring},
             {NULL, NULL}
     };
@@ -52,6 +69,9 @@ luaopen_kafka_tntkafka(lua_State *L) {
             {"offset", lua_consumer_msg_offset},
             {"key", lua_consumer_msg_key},
             {"value", lua_consumer_msg_value},
+            {"value_ptr", lua_consumer_msg_value_ptr},
+            {"value_object", lua_consumer_msg_value_object},
+            {"value_tuple", lua_consumer_msg_value_tuple},
             {"__tostring", lua_consumer_msg_tostring},
             {"__gc", lua_consumer_msg_gc},
             {NULL, NULL}
@@ -67,15 +87,26 @@ luaopen_kafka_tntkafka(lua_State *L) {
 
     static const struct luaL_Reg producer_methods [] = {
             {"produce", lua_producer_produce},
+            {"produce_batch", lua_producer_produce_batch},
+            {"produce_sync", lua_producer_produce_sync},
             {"msg_delivery_poll", lua_producer_msg_delivery_poll},
+            {"wait_msg_delivery", lua_producer_wait_msg_delivery},
             {"poll_logs", lua_producer_poll_logs},
             {"poll_stats", lua_producer_poll_stats},
             {"poll_errors", lua_producer_poll_errors},
             {"dump_conf", lua_producer_dump_conf},
             {"metadata", lua_producer_metadata},
             {"list_groups", lua_producer_list_groups},
+            {"metrics", lua_producer_metrics},
+            {"init_transactions", lua_producer_init_transactions},
+            {"begin_transaction", lua_producer_begin_transaction},
+            {"send_offsets_to_transaction", lua_producer_send_offsets_to_transaction},
+            {"commit_transaction", lua_producer_commit_transaction},
+            {"abort_transaction", lua_producer_abort_transaction},
+            {"export_space", lua_producer_export_space},
             {"close", lua_producer_close},
             {"destroy", lua_producer_destroy},
+            {"_raw", lua_producer_raw},
             {"__tostring", lua_producer_tostring},
             {NULL, NULL}
     };
@@ -88,10 +119,60 @@ luaopen_kafka_tntkafka(lua_State *L) {
     lua_setfield(L, -2, "__metatable");
     lua_pop(L, 1);
 
+    static const struct luaL_Reg runtime_methods [] = {
+            {"stat", lua_runtime_stat},
+            {"close", lua_runtime_close},
+            {"__tostring", lua_runtime_tostring},
+            {"__gc", lua_runtime_gc},
+            {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, runtime_label);
+    lua_pushvalue(L, -1);
+    luaL_register(L, NULL, runtime_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushstring(L, runtime_label);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+
+    static const struct luaL_Reg headers_methods [] = {
+            {"__tostring", lua_headers_template_tostring},
+            {"__gc", lua_headers_template_gc},
+            {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, headers_label);
+    lua_pushvalue(L, -1);
+    luaL_register(L, NULL, headers_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushstring(L, headers_label);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+
+    static const struct luaL_Reg mock_cluster_methods [] = {
+            {"bootstraps", lua_mock_cluster_bootstraps},
+            {"create_topic", lua_mock_cluster_create_topic},
+            {"close", lua_mock_cluster_close},
+            {"__tostring", lua_mock_cluster_tostring},
+            {"__gc", lua_mock_cluster_gc},
+            {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, mock_cluster_label);
+    lua_pushvalue(L, -1);
+    luaL_register(L, NULL, mock_cluster_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushstring(L, mock_cluster_label);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+
     lua_newtable(L);
     static const struct luaL_Reg meta [] = {
         {"create_consumer", lua_create_consumer},
         {"create_producer", lua_create_producer},
+        {"create_runtime", lua_create_runtime},
+        {"create_headers", lua_create_headers_template},
+        {"create_mock_cluster", lua_create_mock_cluster},
         {"librdkafka_version", lua_librdkafka_version},
         {NULL, NULL}
     };
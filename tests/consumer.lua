@@ -2,20 +2,25 @@ local box = require("box")
 local json = require("json")
 local log = require("log")
 local fiber = require('fiber')
+local ffi = require('ffi')
 local tnt_kafka = require('kafka')
+local kafka_abi = require('kafka.abi')
 
 local consumer = nil
+local runtime = nil
 local errors = {}
 local logs = {}
 local stats = {}
 local rebalances = {}
+local commits = {}
 
-local function create(brokers, additional_opts)
+local function create(brokers, additional_opts, additional_config)
     local err
     errors = {}
     logs = {}
     stats = {}
     rebalances = {}
+    commits = {}
     local error_callback = function(err)
         log.error("got error: %s", err)
         table.insert(errors, err)
@@ -32,6 +37,10 @@ local function create(brokers, additional_opts)
         log.info("got rebalance msg: %s", json.encode(msg))
         table.insert(rebalances, msg)
     end
+    local offset_commit_callback = function(err, partitions)
+        log.info("got commit result: %s", err)
+        table.insert(commits, {err = err, partitions = partitions})
+    end
 
     local options = {
         ["enable.auto.offset.store"] = "false",
@@ -50,7 +59,7 @@ local function create(brokers, additional_opts)
             end
         end
     end
-    consumer, err = tnt_kafka.Consumer.create({
+    local config = {
         brokers = brokers,
         options = options,
         error_callback = error_callback,
@@ -60,7 +69,17 @@ local function create(brokers, additional_opts)
         default_topic_options = {
             ["auto.offset.reset"] = "earliest",
         },
-    })
+    }
+    if additional_config ~= nil then
+        for key, value in pairs(additional_config) do
+            config[key] = value
+        end
+        -- functions can not be passed from tests, so callback of commit results is only switched on
+        if additional_config.offset_commit_callback == true then
+            config.offset_commit_callback = offset_commit_callback
+        end
+    end
+    consumer, err = tnt_kafka.Consumer.create(config)
     if err ~= nil then
         log.error("got err %s", err)
         box.error{code = 500, reason = err}
@@ -68,6 +87,19 @@ local function create(brokers, additional_opts)
     log.info("consumer created")
 end
 
+local function create_with_runtime(brokers, additional_opts, threads)
+    local err
+    runtime, err = tnt_kafka.Runtime.create({threads = threads})
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+    create(brokers, additional_opts, {runtime = runtime})
+end
+
+local function runtime_stat()
+    return runtime:stat()
+end
+
 local function subscribe(topics)
     log.info("consumer subscribing")
     log.info(topics)
@@ -140,6 +172,201 @@ local function consume(timeout)
     return consumed
 end
 
+local function consume_batch(timeout)
+    log.info("consume batch called")
+
+    local consumed = {}
+    local deadline = fiber.clock() + timeout
+    while fiber.clock() < deadline do
+        local msgs = consumer:poll_batch(100, 0.2)
+        for _, msg in ipairs(msgs) do
+            append_message(consumed, msg)
+            local err = consumer:store_offset(msg)
+            if err ~= nil then
+                log.error("got error '%s' while committing msg from topic '%s'", err, msg:topic())
+            end
+        end
+    end
+
+    return consumed
+end
+
+local function consume_by_poll(timeout, fibers_count)
+    log.info("consume by poll called")
+
+    local consumed = {}
+    local deadline = fiber.clock() + timeout
+    local done = fiber.channel(fibers_count)
+    for _ = 1, fibers_count do
+        fiber.create(function()
+            while fiber.clock() < deadline do
+                local msg = consumer:poll(0.2)
+                if msg ~= nil then
+                    append_message(consumed, msg)
+                    consumer:store_offset(msg)
+                end
+            end
+            done:put(true)
+        end)
+    end
+    for _ = 1, fibers_count do
+        done:get()
+    end
+
+    return consumed
+end
+
+local function consume_decoded(timeout)
+    log.info("consume decoded called")
+
+    local decoded = {}
+    local deadline = fiber.clock() + timeout
+    while fiber.clock() < deadline do
+        local msgs = consumer:poll_batch(100, 0.2)
+        for _, msg in ipairs(msgs) do
+            local obj, err = msg:value_object()
+            if obj ~= nil then
+                table.insert(decoded, obj:decode())
+            else
+                table.insert(decoded, {err = err})
+            end
+            consumer:store_offset(msg)
+        end
+    end
+
+    return decoded
+end
+
+local function consume_batch_and_commit(timeout)
+    log.info("consume batch and commit called")
+
+    local consumed = {}
+    local deadline = fiber.clock() + timeout
+    while fiber.clock() < deadline do
+        local msgs = consumer:poll_batch(100, 0.2)
+        for _, msg in ipairs(msgs) do
+            append_message(consumed, msg)
+        end
+        if #msgs > 0 then
+            local err = consumer:store_offsets(msgs)
+            if err ~= nil then
+                log.error("got error '%s' while storing offsets", err)
+            end
+            err = consumer:commit_async()
+            if err ~= nil then
+                log.error("got error '%s' while committing", err)
+            end
+        end
+    end
+
+    local err = consumer:commit_sync({timeout_ms = 5000})
+    if err ~= nil then
+        log.warn("got error '%s' while committing sync", err)
+    end
+    return consumed
+end
+
+local function sink(space_name, timeout)
+    log.info("sink called")
+
+    local space = box.schema.space.create(space_name, {if_not_exists = true})
+    space:create_index('pk', {parts = {{1, 'string'}, {2, 'unsigned'}, {3, 'unsigned'}}, if_not_exists = true})
+    space:truncate()
+
+    local sink_errors = {}
+    local err = consumer:start_sink({
+        space = space_name,
+        mode = 'fields',
+        batch_size = 10,
+        error_callback = function(err)
+            table.insert(sink_errors, err)
+        end,
+    })
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+
+    fiber.sleep(timeout)
+    consumer:stop_sink()
+
+    local consumed = {}
+    for _, tuple in space:pairs() do
+        table.insert(consumed, {
+            topic = tuple[1],
+            partition = tuple[2],
+            offset = tuple[3],
+            key = tuple[4],
+            value = tuple[5],
+        })
+    end
+    space:drop()
+    return {consumed, sink_errors}
+end
+
+local function consume_value_ptrs(timeout)
+    log.info("consume value pointers called")
+
+    local consumed = {}
+    local cached = 0
+    local deadline = fiber.clock() + timeout
+    while fiber.clock() < deadline do
+        local msgs = consumer:poll_batch(100, 0.2)
+        for _, msg in ipairs(msgs) do
+            local ptr, len = msg:value_ptr()
+            local value = nil
+            if ptr ~= nil then
+                value = ffi.string(ptr, len)
+            end
+            -- cached value must be the same as one read in place
+            if value ~= msg:value() then
+                log.error("got wrong cached value of msg from topic '%s'", msg:topic())
+            else
+                append_message(consumed, msg)
+            end
+            -- headers table is built on every call unless it is cached
+            local headers = msg:headers()
+            if headers ~= nil and rawequal(headers, msg:headers()) then
+                cached = cached + 1
+            end
+            consumer:store_offset(msg)
+        end
+    end
+
+    return {consumed, cached}
+end
+
+local function consume_ffi(timeout)
+    log.info("consume ffi called")
+
+    local consumed = {}
+    local handle = kafka_abi.consumer_handle(consumer)
+    local buf = kafka_abi.msg_buf(100)
+    local deadline = fiber.clock() + timeout
+    while fiber.clock() < deadline do
+        local count = kafka_abi.poll_into(handle, buf, 100)
+        if count == 0 then
+            consumer:wait_msg(0.2)
+        end
+        for i = 0, count - 1 do
+            local msg = buf[i]
+            table.insert(consumed, {
+                value = msg:value(),
+                key = msg:key(),
+                topic = msg:topic(),
+                partition = msg:partition(),
+                offset = msg:offset(),
+            })
+            local err = kafka_abi.store_offset(handle, msg)
+            if err ~= nil then
+                log.error("got error '%s' while committing msg from topic '%s'", err, msg:topic())
+            end
+            msg:free()
+        end
+    end
+
+    return consumed
+end
+
 local function get_errors()
     return errors
 end
@@ -156,6 +383,10 @@ local function get_rebalances()
     return rebalances
 end
 
+local function get_commits()
+    return commits
+end
+
 local function dump_conf()
     return consumer:dump_conf()
 end
@@ -168,6 +399,10 @@ local function list_groups(timeout_ms)
     return consumer:list_groups({timeout_ms = timeout_ms})
 end
 
+local function lag()
+    return consumer:lag()
+end
+
 local function pause()
     return consumer:pause()
 end
@@ -183,9 +418,69 @@ local function close()
         log.error("got err %s", err)
         box.error{code = 500, reason = err}
     end
+    if runtime ~= nil then
+        runtime:close()
+        runtime = nil
+    end
     log.info("consumer closed")
 end
 
+local function close_after_prefetch(count, timeout_ms)
+    -- messages are left in consume queue, because nobody takes them
+    local deadline = fiber.clock() + 30
+    while consumer:metrics().polled_msgs < count and fiber.clock() < deadline do
+        fiber.sleep(0.1)
+    end
+
+    local started = fiber.clock()
+    local ok, err, undelivered = consumer:close({timeout_ms = timeout_ms})
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+    return {ok = ok, undelivered = undelivered, elapsed = fiber.clock() - started}
+end
+
+local function close_after_output(count, timeout_ms)
+    -- messages are moved to output channel, but application does not read them
+    local out = consumer:output()
+    local deadline = fiber.clock() + 30
+    while out:count() < count and fiber.clock() < deadline do
+        fiber.sleep(0.1)
+    end
+    return close_after_prefetch(count, timeout_ms)
+end
+
+local function wait_auto_paused(expected)
+    local deadline = fiber.clock() + 30
+    while consumer:metrics().auto_paused ~= expected and fiber.clock() < deadline do
+        fiber.sleep(0.1)
+    end
+    return consumer:metrics().auto_paused
+end
+
+local function consume_around_watermarks(count)
+    local result = {}
+    -- nobody takes messages, so pending ones reach high watermark
+    result.paused = wait_auto_paused(1)
+
+    -- resume by user does not leave consumer resumed while consume queue is full
+    consumer:resume()
+    result.paused_after_resume = wait_auto_paused(1)
+
+    local consumed = 0
+    local deadline = fiber.clock() + 30
+    while consumed < count and fiber.clock() < deadline do
+        consumed = consumed + #consumer:poll_batch(2, 0.2)
+        if result.paused_while_draining == nil and consumed > 0 then
+            -- messages of partially taken batch are still pending
+            result.paused_while_draining = consumer:metrics().auto_paused
+        end
+    end
+    result.consumed = consumed
+    result.resumed = wait_auto_paused(0)
+    return result
+end
+
 local function test_seek_partitions()
     log.info('Test seek')
     local messages = {}
@@ -204,21 +499,73 @@ local function test_seek_partitions()
     return messages
 end
 
+local function consume_and_replay(count, timeout)
+    local out = consumer:output()
+
+    local consumed = {}
+    local first
+    for _ = 1, count do
+        local msg = out:get(timeout)
+        if msg == nil then
+            break
+        end
+        first = first or msg
+        append_message(consumed, msg)
+    end
+    if first == nil then
+        return {consumed = consumed, replayed = {}}
+    end
+
+    -- rewinding to the first message, so all of them are redelivered from replay buffer
+    local err = consumer:seek_partitions({
+        {first:topic(), first:partition(), first:offset()}
+    }, 1000)
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+
+    local replayed = {}
+    for _ = 1, #consumed do
+        local msg = out:get(timeout)
+        if msg == nil then
+            break
+        end
+        append_message(replayed, msg)
+    end
+
+    return {consumed = consumed, replayed = replayed, replayed_msgs = consumer:metrics().replayed_msgs}
+end
+
 return {
     create = create,
+    create_with_runtime = create_with_runtime,
+    runtime_stat = runtime_stat,
     subscribe = subscribe,
     unsubscribe = unsubscribe,
     consume = consume,
+    consume_batch = consume_batch,
+    consume_decoded = consume_decoded,
+    consume_by_poll = consume_by_poll,
+    consume_batch_and_commit = consume_batch_and_commit,
+    sink = sink,
+    consume_value_ptrs = consume_value_ptrs,
+    consume_ffi = consume_ffi,
     close = close,
+    close_after_prefetch = close_after_prefetch,
+    close_after_output = close_after_output,
     get_errors = get_errors,
     get_logs = get_logs,
     get_stats = get_stats,
     get_rebalances = get_rebalances,
+    get_commits = get_commits,
     dump_conf = dump_conf,
     metadata = metadata,
     list_groups = list_groups,
+    lag = lag,
     pause = pause,
     resume = resume,
 
+    consume_around_watermarks = consume_around_watermarks,
     test_seek_partitions = test_seek_partitions,
+    consume_and_replay = consume_and_replay,
 }
@@ -1,6 +1,8 @@
 local box = require('box')
 local log = require('log')
 local json = require('json')
+local fio = require('fio')
+local fiber = require('fiber')
 local tnt_kafka = require('kafka')
 
 local TOPIC_NAME = "test_producer"
@@ -9,12 +11,14 @@ local producer = nil
 local errors = {}
 local logs = {}
 local stats = {}
+local delivery_reports = {}
 
-local function create(brokers, additional_opts)
+local function create(brokers, additional_opts, with_delivery_reports, stats_fields)
     local err
     errors = {}
     logs = {}
     stats = {}
+    delivery_reports = {}
     local error_callback = function(err)
         log.error("got error: %s", err)
         table.insert(errors, err)
@@ -37,7 +41,7 @@ local function create(brokers, additional_opts)
         end
     end
 
-    producer, err = tnt_kafka.Producer.create({
+    local config = {
         brokers = brokers,
         options = options,
         log_callback = log_callback,
@@ -46,7 +50,24 @@ local function create(brokers, additional_opts)
         default_topic_options = {
             ["partitioner"] = "murmur2_random",
         },
-    })
+        stats_fields = stats_fields,
+    }
+    if with_delivery_reports then
+        config.delivery_report_callback = function(reports)
+            log.info("got %d delivery reports", #reports)
+            for _, report in ipairs(reports) do
+                table.insert(delivery_reports, {
+                    topic = report.topic,
+                    partition = report.partition,
+                    offset = tonumber(report.offset),
+                    latency = tonumber(report.latency),
+                    err = report.err,
+                })
+            end
+        end
+    end
+
+    producer, err = tnt_kafka.Producer.create(config)
     if err ~= nil then
         log.error("got err %s", err)
         box.error{code = 500, reason = err}
@@ -69,6 +90,334 @@ local function produce(messages)
     end
 end
 
+local function produce_with_headers_template(topic, messages, headers)
+    local template, err = tnt_kafka.Headers.create(headers)
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+    for _, message in ipairs(messages) do
+        err = producer:produce({topic = topic, key = message.key, value = message.value, headers = template})
+        if err ~= nil then
+            box.error{code = 500, reason = err}
+        end
+    end
+end
+
+local function produce_batch(topic, messages)
+    local msgs = {}
+    for i, message in ipairs(messages) do
+        msgs[i] = {
+            topic = topic,
+            key = message.key,
+            value = message.value,
+            headers = message.headers,
+        }
+    end
+    local failed, err = producer:produce_batch(msgs)
+    if err ~= nil then
+        log.error("got error '%s' while sending batch", err)
+        box.error{code = 500, reason = err}
+    end
+    if failed == nil then
+        return nil
+    end
+
+    local result = {}
+    for index, msg_err in pairs(failed) do
+        table.insert(result, {index, msg_err})
+    end
+    table.sort(result, function(a, b) return a[1] < b[1] end)
+    return result
+end
+
+local function produce_in_transactions(topic, messages, batch_size)
+    local err, kind = producer:init_transactions({timeout_ms = 10000})
+    if err ~= nil then
+        log.error("got error '%s' while initializing transactions", err)
+        return {err, kind}
+    end
+
+    for first = 1, #messages, batch_size do
+        err, kind = producer:transaction(function()
+            local msgs = {}
+            for i = first, math.min(first + batch_size - 1, #messages) do
+                table.insert(msgs, {topic = topic, key = messages[i].key, value = messages[i].value})
+            end
+            local failed = producer:produce_batch(msgs)
+            if failed ~= nil then
+                return "failed to produce batch"
+            end
+        end, {timeout_ms = 10000})
+        if err ~= nil then
+            log.error("got error '%s' while committing transaction", err)
+            return {err, kind}
+        end
+    end
+    return nil
+end
+
+local function produce_committed_and_aborted(topic, committed, aborted)
+    local err, kind = producer:init_transactions({timeout_ms = 10000})
+    if err ~= nil then
+        return {err, kind}
+    end
+
+    local function produce_values(values)
+        local msgs = {}
+        for _, value in ipairs(values) do
+            table.insert(msgs, {topic = topic, key = value, value = value})
+        end
+        return producer:produce_batch(msgs) ~= nil and "failed to produce batch" or nil
+    end
+
+    err, kind = producer:transaction(function()
+        return produce_values(committed)
+    end, {timeout_ms = 10000})
+    if err ~= nil then
+        return {err, kind}
+    end
+
+    -- messages are written to topic, but transaction is aborted, so read_committed consumers skip them
+    err, kind = producer:transaction(function()
+        local produce_err = produce_values(aborted)
+        if produce_err ~= nil then
+            return produce_err
+        end
+        return "aborted by test"
+    end, {timeout_ms = 10000})
+    return {err, kind}
+end
+
+local function begin_transaction()
+    return {producer:begin_transaction()}
+end
+
+local function export_space(topic, count, chunk_size)
+    local space = box.schema.space.create(topic, {if_not_exists = true})
+    space:create_index('pk', {parts = {{1, 'unsigned'}}, if_not_exists = true})
+    space:truncate()
+    for i = 1, count do
+        space:insert({i, string.format("key_%d", i), string.format("value_%d", i)})
+    end
+
+    -- half of space is exported by first call and the rest one is resumed from checkpoint
+    local options = {
+        space = topic,
+        topic = topic,
+        key_field = 2,
+        fields = {3},
+        limit = math.floor(count / 2),
+        chunk_size = chunk_size,
+    }
+    local first, checkpoint, err = producer:export_space(options)
+    if err ~= nil then
+        log.error("got error '%s' while exporting space", err)
+        return {first, err}
+    end
+
+    options.limit = nil
+    options.after = checkpoint
+    local second
+    second, checkpoint, err = producer:export_space(options)
+    if err ~= nil then
+        log.error("got error '%s' while exporting space", err)
+    end
+    space:drop()
+    return {first, second, checkpoint, err}
+end
+
+local function export_space_by_non_unique_index(topic)
+    local space = box.schema.space.create(topic, {if_not_exists = true})
+    space:create_index('pk', {parts = {{1, 'unsigned'}}, if_not_exists = true})
+    space:create_index('group', {parts = {{2, 'string'}}, unique = false, if_not_exists = true})
+    space:truncate()
+    space:insert({1, "group_1"})
+
+    local count, _, err = producer:export_space({space = topic, index = 'group', topic = topic})
+    space:drop()
+    return {count, err}
+end
+
+local function produce_with_runtime(brokers, topic, messages, producers_count)
+    local runtime, err = tnt_kafka.Runtime.create({threads = 2})
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+
+    local producers = {}
+    for i = 1, producers_count do
+        producers[i], err = tnt_kafka.Producer.create({brokers = brokers, runtime = runtime})
+        if err ~= nil then
+            box.error{code = 500, reason = err}
+        end
+    end
+    local stat = runtime:stat()
+
+    -- sync produce waits for delivery report which is served by runtime thread
+    local errors = {}
+    for i, message in ipairs(messages) do
+        err = producers[(i - 1) % producers_count + 1]:produce({
+            topic = topic,
+            key = message.key,
+            value = message.value,
+        })
+        if err ~= nil then
+            table.insert(errors, err)
+        end
+    end
+
+    for _, p in ipairs(producers) do
+        p:close()
+    end
+    runtime:close()
+    return {stat, errors}
+end
+
+local function produce_with_partitioner(brokers, topic, keyless_count, partition, partitioned_count, keys)
+    local partitions = {}
+    local p, err = tnt_kafka.Producer.create({
+        brokers = brokers,
+        -- sticky partition is kept during linger, so all keyless messages go to one partition
+        options = {["linger.ms"] = "1000"},
+        default_topic_options = {partitioner = "sticky"},
+        delivery_report_callback = function(reports)
+            for _, report in ipairs(reports) do
+                table.insert(partitions, report.partition)
+            end
+        end,
+    })
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+
+    local function produce_and_wait(msgs)
+        local wait_for = #partitions + #msgs
+        local failed = p:produce_batch(msgs)
+        if failed ~= nil then
+            box.error{code = 500, reason = "failed to produce batch"}
+        end
+        local deadline = fiber.clock() + 10
+        while #partitions < wait_for and fiber.clock() < deadline do
+            fiber.sleep(0.1)
+        end
+    end
+
+    local msgs = {}
+    for i = 1, keyless_count do
+        table.insert(msgs, {topic = topic, value = string.format("keyless_%d", i)})
+    end
+    produce_and_wait(msgs)
+    local keyless = partitions
+    partitions = {}
+
+    msgs = {}
+    for i = 1, partitioned_count do
+        table.insert(msgs, {topic = topic, value = string.format("partitioned_%d", i), partition = partition})
+    end
+    produce_and_wait(msgs)
+    local partitioned = partitions
+
+    -- keyed messages are produced one by one, so reports are matched with keys
+    local keyed = {}
+    for _, key in ipairs(keys) do
+        partitions = {}
+        produce_and_wait({{topic = topic, key = key, value = key}})
+        table.insert(keyed, partitions[1])
+    end
+
+    p:close()
+    return {keyless = keyless, partitioned = partitioned, keyed = keyed}
+end
+
+local function produce_with_codec(brokers, topic, values, tuples, raw_values)
+    local p, err = tnt_kafka.Producer.create({brokers = brokers, value_codec = "json"})
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+
+    local msgs = {}
+    for _, value in ipairs(values) do
+        table.insert(msgs, {topic = topic, value = value})
+    end
+    for _, value in ipairs(tuples) do
+        table.insert(msgs, {topic = topic, value = box.tuple.new(value)})
+    end
+    -- strings are sent as already encoded values
+    for _, value in ipairs(raw_values) do
+        table.insert(msgs, {topic = topic, value = value})
+    end
+
+    -- the first message is encoded by produce and the rest ones by produce_batch
+    err = p:produce(msgs[1])
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+    local failed = p:produce_batch({unpack(msgs, 2)})
+    if failed ~= nil then
+        box.error{code = 500, reason = "failed to produce batch"}
+    end
+    p:close()
+end
+
+local function produce_to_mock_cluster(messages)
+    local cluster, err = tnt_kafka.MockCluster.create({brokers = 2})
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+    err = cluster:create_topic("test_mock_cluster", 2, 2)
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+
+    local p
+    p, err = tnt_kafka.Producer.create({brokers = cluster:bootstraps()})
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+
+    local errors = {}
+    for _, msg in ipairs(messages) do
+        err = p:produce({topic = "test_mock_cluster", key = msg, value = msg})
+        if err ~= nil then
+            table.insert(errors, err)
+        end
+    end
+
+    p:close()
+    cluster:close()
+    return errors
+end
+
+local function get_thread_names()
+    local names = {}
+    for _, task in ipairs(fio.listdir('/proc/self/task') or {}) do
+        local file = fio.open(fio.pathjoin('/proc/self/task', task, 'comm'), {'O_RDONLY'})
+        if file ~= nil then
+            local name = file:read(64)
+            file:close()
+            table.insert(names, (name:gsub('%s+$', '')))
+        end
+    end
+    return names
+end
+
+local function create_with_thread_options(brokers, thread_options)
+    local p, err = tnt_kafka.Producer.create({brokers = brokers, thread_options = thread_options})
+    if err ~= nil then
+        return {err = err}
+    end
+
+    -- poller thread names itself after start
+    fiber.sleep(0.1)
+    local names = get_thread_names()
+    p:close()
+    return {names = names}
+end
+
+local function get_metrics()
+    return producer:metrics()
+end
+
 local function dump_conf()
     return producer:dump_conf()
 end
@@ -85,6 +434,10 @@ local function get_stats()
     return stats
 end
 
+local function get_delivery_reports()
+    return delivery_reports
+end
+
 local function metadata(timeout_ms, topic)
     return producer:metadata({timeout_ms = timeout_ms, topic = topic})
 end
@@ -93,6 +446,56 @@ local function list_groups(timeout_ms)
     return producer:list_groups({timeout_ms = timeout_ms})
 end
 
+local function close_by_deadline(messages, timeout_ms)
+    for _, msg in ipairs(messages) do
+        local err = producer:produce_async({topic = TOPIC_NAME, key = msg, value = msg})
+        if err ~= nil then
+            box.error{code = 500, reason = err}
+        end
+    end
+
+    local started = fiber.clock()
+    local ok, err, undelivered = producer:close({timeout_ms = timeout_ms})
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+    return {ok = ok, undelivered = undelivered, elapsed = fiber.clock() - started}
+end
+
+local function produce_sync_cases(brokers)
+    local result = {}
+    local p, err = tnt_kafka.Producer.create({brokers = brokers})
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+    result.succeeded = p:produce({topic = TOPIC_NAME, key = "sync", value = "sync"}) == nil
+    p:close()
+
+    -- nothing is delivered to unreachable broker, so reports arrive only after message timeout or purge
+    p, err = tnt_kafka.Producer.create({
+        brokers = "127.0.0.1:12345",
+        options = {["message.timeout.ms"] = "1000"},
+    })
+    if err ~= nil then
+        box.error{code = 500, reason = err}
+    end
+    result.error = p:produce({topic = TOPIC_NAME, value = "error"})
+
+    local waiter = fiber.new(function()
+        return p:produce({topic = TOPIC_NAME, value = "cancelled"})
+    end)
+    waiter:set_joinable(true)
+    fiber.sleep(0.1)
+    waiter:cancel()
+    local ok, cancel_err = waiter:join()
+    result.cancelled = not ok and tostring(cancel_err) or nil
+
+    -- message of cancelled fiber is purged and its orphaned waiter is freed by close
+    local _, _, undelivered = p:close({timeout_ms = 0})
+    result.undelivered = undelivered
+    return result
+end
+
 local function close()
     local _, err = producer:close()
     if err ~= nil then
@@ -104,10 +507,26 @@ end
 return {
     create = create,
     produce = produce,
+    produce_batch = produce_batch,
+    produce_with_headers_template = produce_with_headers_template,
+    produce_in_transactions = produce_in_transactions,
+    produce_committed_and_aborted = produce_committed_and_aborted,
+    begin_transaction = begin_transaction,
+    export_space = export_space,
+    export_space_by_non_unique_index = export_space_by_non_unique_index,
+    produce_with_runtime = produce_with_runtime,
+    produce_with_partitioner = produce_with_partitioner,
+    produce_with_codec = produce_with_codec,
+    produce_to_mock_cluster = produce_to_mock_cluster,
+    create_with_thread_options = create_with_thread_options,
+    get_metrics = get_metrics,
     get_errors = get_errors,
     get_logs = get_logs,
     get_stats = get_stats,
+    get_delivery_reports = get_delivery_reports,
     close = close,
+    close_by_deadline = close_by_deadline,
+    produce_sync_cases = produce_sync_cases,
     dump_conf = dump_conf,
     metadata = metadata,
     list_groups = list_groups,
@@ -157,6 +157,74 @@ def test_consumer_seek_partitions():
             assert item['value'] == value
 
 
+def test_consumer_should_consume_msgs_through_shared_runtime():
+    messages = [{"key": "test1", "value": "runtime_%d" % i} for i in range(20)]
+
+    write_into_kafka("test_consume_runtime", messages)
+
+    server = get_server()
+
+    try:
+        server.call("consumer.create_with_runtime",
+                    [KAFKA_HOST, {"group.id": "should_consume_through_runtime"}, 2])
+        stat = server.call("consumer.runtime_stat", [])[0]
+        assert stat['threads'] == 2
+        assert sum(stat['handles']) == 1
+
+        server.call("consumer.subscribe", [["test_consume_runtime"]])
+
+        # rebalance callback is called from runtime thread and waits for Lua callback in TX thread
+        response = server.call("consumer.consume", [10])[0]
+        assert set(get_message_values(response)) == {msg["value"] for msg in messages}
+
+        rebalances = server.call("consumer.get_rebalances", [])[0]
+        assert any('assigned' in rebalance for rebalance in rebalances)
+
+    finally:
+        # revoke on close is served by runtime thread as well
+        server.call("consumer.close", [])
+
+
+def test_consumer_should_pause_and_resume_by_watermarks():
+    messages = [{"key": "test1", "value": "watermark_%d" % i} for i in range(50)]
+
+    topic = 'test_consumer_watermarks' + randomword(15)
+    write_into_kafka(topic, messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_pause_by_watermarks"},
+                         {"queue_high_watermark": 10, "queue_low_watermark": 2}):
+        server.call('consumer.subscribe', [[topic]])
+
+        result = server.call("consumer.consume_around_watermarks", [len(messages)])[0]
+        assert result['paused'] == 1
+        assert result['paused_after_resume'] == 1
+        assert result['paused_while_draining'] == 1
+        assert result['consumed'] == len(messages)
+        assert result['resumed'] == 0
+
+
+def test_consumer_should_replay_msgs_on_seek_inside_replay_buffer():
+    messages = [{"key": "test1", "value": "replay_%d" % i} for i in range(10)]
+
+    topic = 'test_consumer_replay' + randomword(15)
+    write_into_kafka(topic, messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_replay_msgs"},
+                         {"replay_buffer_bytes": 1024 * 1024}):
+        server.call('consumer.subscribe', [[topic]])
+
+        response = server.call("consumer.consume_and_replay", [len(messages), 10])[0]
+
+        consumed = get_message_values(response['consumed'])
+        assert consumed == [msg["value"] for msg in messages]
+        assert get_message_values(response['replayed']) == consumed
+        assert response['replayed_msgs'] == len(messages)
+
+
 def test_consumer_should_consume_msgs_from_multiple_topics():
     message1 = {
         "key": "test1",
@@ -374,6 +442,26 @@ def test_consumer_should_log_rebalances():
         assert len(response.data[0]) > 0
 
 
+def test_consumer_should_assign_partitions_cooperatively():
+    messages = [{"key": "test1", "value": "cooperative_%d" % i} for i in range(10)]
+
+    write_into_kafka("test_consume_cooperative", messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_assign_cooperatively",
+                                              "partition.assignment.strategy": "cooperative-sticky"}):
+        server.call("consumer.subscribe", [["test_consume_cooperative"]])
+
+        response = server.call("consumer.consume", [10])[0]
+        assert set(get_message_values(response)) == {msg["value"] for msg in messages}
+
+        rebalances = server.call("consumer.get_rebalances", [])[0]
+        assigned = [rebalance for rebalance in rebalances if 'assigned' in rebalance]
+        assert len(assigned) > 0
+        assert all(rebalance.get('cooperative') for rebalance in assigned)
+
+
 def test_consumer_should_continue_consuming_from_last_committed_offset():
     message1 = {
         "key": "test1",
@@ -480,3 +568,299 @@ def test_consumer_should_be_closed():
 
     with create_consumer(server, '127.0.0.1:12345', {"group.id": None}):
         pass
+
+
+def test_consumer_should_be_closed_by_deadline_without_losing_prefetched_msgs():
+    messages = [{'key': 'close_%d' % i, 'value': 'close_%d' % i} for i in range(5)]
+
+    server = get_server()
+
+    write_into_kafka("test_consumer_close", messages)
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_be_closed_by_deadline"}):
+        server.call("consumer.subscribe", [["test_consumer_close"]])
+
+        result = server.call("consumer.close_after_prefetch", [len(messages), 1000])[0]
+        assert result['ok']
+        assert result['undelivered'] == len(messages)
+        assert result['elapsed'] < 3
+
+    # released messages are not committed, so they are consumed again
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_be_closed_by_deadline"}):
+        server.call("consumer.subscribe", [["test_consumer_close"]])
+
+        response = server.call("consumer.consume", [10])[0]
+
+        assert set(get_message_values(response)) == set(get_message_values(messages))
+
+
+def test_consumer_should_rewind_auto_stored_offsets_of_released_msgs_on_close():
+    messages = [{'key': 'close_auto_%d' % i, 'value': 'close_auto_%d' % i} for i in range(5)]
+
+    server = get_server()
+
+    write_into_kafka("test_consumer_close_auto_store", messages)
+
+    # offsets of queued messages are not stored, they are stored only when messages are handed to Lua
+    opts = {"group.id": "should_rewind_auto_stored_offsets", "enable.auto.offset.store": "true"}
+    with create_consumer(server, KAFKA_HOST, opts):
+        server.call("consumer.subscribe", [["test_consumer_close_auto_store"]])
+
+        result = server.call("consumer.close_after_prefetch", [len(messages), 5000])[0]
+        assert result['ok']
+        assert result['undelivered'] == len(messages)
+
+    # released messages come back, offsets of ones left in output channel are rewound and committed
+    with create_consumer(server, KAFKA_HOST, opts):
+        server.call("consumer.subscribe", [["test_consumer_close_auto_store"]])
+
+        result = server.call("consumer.close_after_output", [len(messages), 5000])[0]
+        assert result['ok']
+        assert result['undelivered'] == len(messages)
+
+    with create_consumer(server, KAFKA_HOST, opts):
+        server.call("consumer.subscribe", [["test_consumer_close_auto_store"]])
+
+        response = server.call("consumer.consume", [10])[0]
+
+        assert set(get_message_values(response)) == set(get_message_values(messages))
+
+
+def test_consumer_should_consume_msgs_with_zero_copy():
+    message1 = {
+        "key": "test1",
+        "value": "test1",
+        "headers": {"key1": "value1"},
+    }
+
+    message2 = {
+        "key": "",
+        "value": "test2",
+    }
+
+    write_into_kafka("test_consume_zero_copy", (
+        message1,
+        message2,
+    ))
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_consume_msgs_with_zero_copy"}, {"zero_copy": True}):
+        server.call("consumer.subscribe", [["test_consume_zero_copy"]])
+
+        response = server.call("consumer.consume", [10])[0]
+
+        assert set(get_message_values(response)) == {
+            "test1",
+            "test2",
+        }
+
+        for msg in filter(lambda x: 'value' in x, response):
+            if msg['value'] == 'test1':
+                assert msg['key'] == 'test1'
+                assert msg['headers'] == {'key1': 'value1'}
+
+
+def test_consumer_should_consume_msgs_by_batches():
+    messages = [{"key": "test1", "value": "batch_%d" % i} for i in range(100)]
+
+    write_into_kafka("test_consume_batch", messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_consume_msgs_by_batches"},
+                         {"consume_batch_size": 16}):
+        server.call("consumer.subscribe", [["test_consume_batch"]])
+
+        response = server.call("consumer.consume_batch", [10])[0]
+
+        assert set(get_message_values(response)) == {msg["value"] for msg in messages}
+
+
+def test_consumer_should_consume_msgs_by_poll_from_many_fibers():
+    messages = [{"key": "test1", "value": "poll_%d" % i} for i in range(100)]
+
+    write_into_kafka("test_consume_poll", messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_consume_msgs_by_poll"}):
+        server.call("consumer.subscribe", [["test_consume_poll"]])
+
+        response = server.call("consumer.consume_by_poll", [10, 4])[0]
+
+        values = get_message_values(response)
+        assert len(values) == len(messages)
+        assert set(values) == {msg["value"] for msg in messages}
+
+
+def test_consumer_should_consume_msgs_by_partition_queues():
+    messages = [{"key": "test1", "value": "partition_%d" % i} for i in range(100)]
+
+    write_into_kafka("test_consume_partition_queues", messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_consume_msgs_by_partition_queues"},
+                         {"partition_queues": True, "poller_threads": 2}):
+        server.call("consumer.subscribe", [["test_consume_partition_queues"]])
+
+        response = server.call("consumer.consume_batch", [10])[0]
+
+        assert set(get_message_values(response)) == {msg["value"] for msg in messages}
+
+
+def test_consumer_should_skip_msgs_by_header_filter():
+    messages = [
+        {"key": "test1", "value": "header_filter_%d" % i, "headers": {"tenant": "tenant_%d" % (i % 3)}}
+        for i in range(30)
+    ]
+    messages.append({"key": "test1", "value": "header_filter_missing"})
+
+    write_into_kafka("test_consume_header_filter", messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_skip_msgs_by_header_filter"},
+                         {"consume_batch_size": 16,
+                          "header_filter": {"name": "tenant", "values": ["tenant_0", "tenant_1"]}}):
+        server.call("consumer.subscribe", [["test_consume_header_filter"]])
+
+        response = server.call("consumer.consume_batch", [10])[0]
+
+        assert set(get_message_values(response)) == {
+            msg["value"] for msg in messages if msg.get("headers", {}).get("tenant") in ("tenant_0", "tenant_1")
+        }
+
+
+def test_consumer_should_decode_json_values():
+    values = [
+        {"id": 1, "name": "first", "tags": ["a", "b"], "price": 1.5, "active": True},
+        {"id": 2, "name": "second \u2603", "tags": [], "price": -3, "active": False, "extra": None},
+    ]
+    messages = [{"key": "test1", "value": json.dumps(value)} for value in values]
+    messages.append({"key": "test1", "value": "{broken"})
+
+    write_into_kafka("test_consume_json_codec", messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_decode_json_values"},
+                         {"value_codec": "json"}):
+        server.call("consumer.subscribe", [["test_consume_json_codec"]])
+
+        response = server.call("consumer.consume_decoded", [10])[0]
+
+        assert response[:2] == values
+        assert response[2] == {"err": "failed to decode value of message by consumer codec"}
+
+
+def test_consumer_should_consume_msgs_with_cached_fields():
+    messages = [{"key": "test1", "value": "cached_%d" % i, "headers": {"tenant": "tenant_0"}} for i in range(10)]
+
+    write_into_kafka("test_consume_cached_fields", messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_consume_msgs_with_cached_fields"},
+                         {"cache_msg_fields": True}):
+        server.call("consumer.subscribe", [["test_consume_cached_fields"]])
+
+        consumed, cached = server.call("consumer.consume_value_ptrs", [10])[0]
+
+        assert set(get_message_values(consumed)) == {msg["value"] for msg in messages}
+        assert cached == len(messages)
+
+    # accessors of messages without cache materialize fields on every call
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_consume_msgs_without_cached_fields"}):
+        server.call("consumer.subscribe", [["test_consume_cached_fields"]])
+
+        consumed, cached = server.call("consumer.consume_value_ptrs", [10])[0]
+
+        assert set(get_message_values(consumed)) == {msg["value"] for msg in messages}
+        assert cached == 0
+
+
+def test_consumer_should_consume_msgs_by_ffi():
+    messages = [{"key": "test1", "value": "ffi_%d" % i} for i in range(100)]
+
+    write_into_kafka("test_consume_ffi", messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_consume_msgs_by_ffi"}):
+        server.call("consumer.subscribe", [["test_consume_ffi"]])
+
+        response = server.call("consumer.consume_ffi", [10])[0]
+
+        assert set(get_message_values(response)) == {msg["value"] for msg in messages}
+
+
+def test_consumer_should_store_offsets_by_batches_and_commit_async():
+    messages = [{"key": "test1", "value": "commit_%d" % i} for i in range(100)]
+
+    write_into_kafka("test_consume_commit_async", messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_commit_async"}, {"offset_commit_callback": True}):
+        server.call("consumer.subscribe", [["test_consume_commit_async"]])
+
+        response = server.call("consumer.consume_batch_and_commit", [10])[0]
+        assert set(get_message_values(response)) == {msg["value"] for msg in messages}
+
+        time.sleep(1)
+
+        expected = {}
+        for msg in response:
+            expected[msg['partition']] = max(expected.get(msg['partition'], -1), msg['offset'] + 1)
+
+        committed = {}
+        for commit in server.call("consumer.get_commits", [])[0]:
+            if commit.get('err') is not None:
+                continue
+            for tp in commit['partitions']:
+                if tp['topic'] == "test_consume_commit_async" and tp['offset'] >= 0:
+                    committed[tp['partition']] = max(committed.get(tp['partition'], -1), tp['offset'])
+
+        assert committed == expected
+
+
+def test_consumer_should_report_lag():
+    messages = [{"key": "test1", "value": "lag_%d" % i} for i in range(10)]
+
+    write_into_kafka("test_consume_commit_async", messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_report_lag"}):
+        server.call("consumer.subscribe", [["test_consume_commit_async"]])
+
+        response = server.call("consumer.consume_batch_and_commit", [10])[0]
+        assert len(response) >= len(messages)
+
+        lag = server.call("consumer.lag", [])[0]
+        assert lag['lag'] == 0
+        assert len(lag['partitions']) > 0
+        for tp in lag['partitions']:
+            assert tp['topic'] == "test_consume_commit_async"
+            assert tp['committed'] == tp['high']
+            assert tp['lag'] == 0
+        assert lag['msgs_per_sec'] > 0
+
+
+def test_consumer_should_sink_msgs_into_space():
+    messages = [{"key": "test1", "value": "sink_%d" % i} for i in range(100)]
+
+    write_into_kafka("test_consume_sink", messages)
+
+    server = get_server()
+
+    with create_consumer(server, KAFKA_HOST, {"group.id": "should_sink_msgs"}):
+        server.call("consumer.subscribe", [["test_consume_sink"]])
+
+        consumed, errors = server.call("consumer.sink", ["test_consume_sink", 10])[0]
+
+        assert errors == []
+        assert set(get_message_values(consumed)) == {msg["value"] for msg in messages}
+        assert all(msg["topic"] == "test_consume_sink" and msg["key"] == "test1" for msg in consumed)
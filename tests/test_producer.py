@@ -20,6 +20,38 @@ def get_server():
                                 connect_now=True)
 
 
+def read_from_kafka(topic, group_id, **consumer_options):
+    loop = asyncio.get_event_loop_policy().new_event_loop()
+    kafka_output = []
+
+    async def consume():
+        consumer = AIOKafkaConsumer(
+            topic,
+            group_id=group_id,
+            bootstrap_servers='localhost:9092',
+            auto_offset_reset="earliest",
+            **consumer_options,
+        )
+        await consumer.start()
+
+        try:
+            async for msg in consumer:
+                kafka_output.append(msg)
+
+        finally:
+            await consumer.stop()
+
+    async def read():
+        try:
+            await asyncio.wait_for(consume(), 10)
+        except asyncio.TimeoutError:
+            pass
+
+    loop.run_until_complete(read())
+    loop.close()
+    return kafka_output
+
+
 def test_producer_should_produce_msgs():
     server = get_server()
 
@@ -78,6 +110,23 @@ def test_producer_should_produce_msgs():
     server.call("producer.close", [])
 
 
+def test_producer_should_produce_msgs_with_headers_template():
+    server = get_server()
+
+    server.call("producer.create", [KAFKA_HOST])
+
+    messages = [{'key': str(i), 'value': 'template_%d' % i} for i in range(5)]
+    headers = {'tenant': 'tenant_0', 'source': 'billing'}
+    server.call("producer.produce_with_headers_template", ["test_producer_headers_template", messages, headers])
+
+    kafka_output = read_from_kafka("test_producer_headers_template", "test_headers_template_group")
+    assert [msg.value.decode('utf8') for msg in kafka_output] == [msg['value'] for msg in messages]
+    for msg in kafka_output:
+        assert {k: v.decode('utf8') for k, v in msg.headers} == headers
+
+    server.call("producer.close", [])
+
+
 def test_producer_should_log_errors():
     server = get_server()
 
@@ -93,6 +142,28 @@ def test_producer_should_log_errors():
     server.call("producer.close", [])
 
 
+def test_producer_should_be_closed_by_deadline():
+    server = get_server()
+
+    server.call("producer.create", ["kafka:9090"])
+
+    messages = ['deadline_%d' % i for i in range(5)]
+    result = server.call("producer.close_by_deadline", [messages, 1000])[0]
+    assert result['ok']
+    assert result['undelivered'] >= len(messages)
+    assert result['elapsed'] < 3
+
+
+def test_producer_should_wait_for_delivery_reports_of_sync_produce():
+    server = get_server()
+
+    result = server.call("producer.produce_sync_cases", [KAFKA_HOST])[0]
+    assert result['succeeded']
+    assert result['error'] == "Local: Message timed out"
+    assert 'fiber is cancelled' in result['cancelled']
+    assert result['undelivered'] >= 1
+
+
 def test_producer_stats():
     server = get_server()
 
@@ -112,6 +183,26 @@ def test_producer_stats():
     server.call("producer.close", [])
 
 
+def test_producer_should_pass_selected_stats_fields():
+    server = get_server()
+
+    server.call("producer.create", ["kafka:9090", None, False, ["name", "type", "brokers.*.name"]])
+
+    time.sleep(2)
+
+    response = server.call("producer.get_stats", [])
+    assert len(response) > 0
+    assert len(response[0]) > 0
+    stat = response[0][0]
+
+    assert 'rdkafka#producer' in stat['name']
+    assert stat['type'] == 'producer'
+    assert stat['brokers']['kafka:9090/bootstrap'] == {'name': 'kafka:9090/bootstrap'}
+    assert 'txmsgs' not in stat
+
+    server.call("producer.close", [])
+
+
 def test_producer_dump_conf():
     server = get_server()
 
@@ -176,3 +267,343 @@ def test_producer_should_log_debug():
     assert len(response[0]) > 0
 
     server.call("producer.close", [])
+
+
+def test_producer_should_produce_msgs_by_batch():
+    server = get_server()
+
+    server.call("producer.create", [KAFKA_HOST])
+
+    messages = [
+        {'key': '1', 'value': '1'},
+        {'key': '2', 'value': '2'},
+        {'key': '3', 'value': '3', 'headers': {'header1_key': 'header1_value'}},
+        {'key': '4', 'value': '4'},
+    ]
+    failed = server.call("producer.produce_batch", ["test_producer_batch", messages])[0]
+    assert failed is None
+
+    loop = asyncio.get_event_loop_policy().new_event_loop()
+
+    async def test():
+        kafka_output = []
+
+        async def consume():
+            consumer = AIOKafkaConsumer(
+                'test_producer_batch',
+                group_id="test_group",
+                bootstrap_servers='localhost:9092',
+                auto_offset_reset="earliest",
+            )
+            await consumer.start()
+
+            try:
+                async for msg in consumer:
+                    kafka_msg = {
+                        'key': msg.key if msg.key is None else msg.key.decode('utf8'),
+                        'value': msg.value if msg.value is None else msg.value.decode('utf8')
+                    }
+                    if msg.headers:
+                        kafka_msg['headers'] = {}
+                        for k, v in msg.headers:
+                            kafka_msg['headers'][k] = v.decode('utf8')
+                    kafka_output.append(kafka_msg)
+
+            finally:
+                await consumer.stop()
+
+        try:
+            await asyncio.wait_for(consume(), 10)
+        except asyncio.TimeoutError:
+            pass
+
+        assert kafka_output == messages
+
+    loop.run_until_complete(test())
+    loop.close()
+
+    server.call("producer.close", [])
+
+
+def test_producer_batch_should_return_failed_msgs():
+    server = get_server()
+
+    server.call("producer.create", [KAFKA_HOST])
+
+    messages = [
+        {'key': '1', 'value': '1'},
+        {},
+        {'key': '3', 'value': '3'},
+    ]
+    failed = server.call("producer.produce_batch", ["test_producer_batch_failed", messages])[0]
+    assert failed == [[2, "producer message must contains non nil key or value"]]
+
+    server.call("producer.close", [])
+
+
+def test_producer_delivery_reports():
+    server = get_server()
+
+    server.call("producer.create", [KAFKA_HOST, None, True])
+
+    messages = [{'key': str(i), 'value': str(i)} for i in range(10)]
+    server.call("producer.produce", [messages])
+
+    time.sleep(2)
+
+    reports = server.call("producer.get_delivery_reports", [])[0]
+    assert len(reports) == len(messages)
+    for report in reports:
+        assert report['topic'] == 'test_producer'
+        assert report['offset'] >= 0
+        assert report['latency'] >= 0
+        assert 'err' not in report
+
+    server.call("producer.close", [])
+
+
+def test_producer_should_collect_metrics():
+    server = get_server()
+
+    server.call("producer.create", [KAFKA_HOST])
+
+    messages = [{'key': str(i), 'value': str(i)} for i in range(10)]
+    failed = server.call("producer.produce_batch", ["test_producer_metrics", messages])[0]
+    assert failed is None
+
+    time.sleep(2)
+
+    metrics = server.call("producer.get_metrics", [])[0]
+
+    assert metrics['produce_call_us']['count'] >= 1
+    assert metrics['delivery_lag_us']['count'] == len(messages)
+    assert metrics['delivery_lag_us']['buckets'][-1]['count'] == len(messages)
+    assert metrics['delivery_overflows'] == 0
+    assert metrics['dropped_reports'] == 0
+    assert metrics['dropped_callback_msgs'] == 0
+    assert metrics['out_queue_msgs'] == 0
+    assert metrics['delivery_queue_depth'] == 0
+
+    server.call("producer.close", [])
+
+
+def test_producer_should_produce_msgs_in_transactions():
+    server = get_server()
+
+    server.call("producer.create", [KAFKA_HOST, {"transactional.id": "test_producer_transactions"}])
+
+    messages = [{'key': str(i), 'value': 'txn_%d' % i} for i in range(1000)]
+    response = server.call("producer.produce_in_transactions", ["test_producer_transactions", messages, 300])
+    assert response[0] is None
+
+    metrics = server.call("producer.get_metrics", [])[0]
+    assert metrics['delivery_lag_us']['count'] == len(messages)
+
+    server.call("producer.close", [])
+
+
+def test_producer_should_hide_aborted_transactions_from_read_committed_consumers():
+    server = get_server()
+
+    server.call("producer.create", [KAFKA_HOST, {"transactional.id": "test_producer_aborted_transactions"}])
+
+    topic = "test_producer_read_committed"
+    committed = ['committed_%d' % i for i in range(10)]
+    aborted = ['aborted_%d' % i for i in range(10)]
+    response = server.call("producer.produce_committed_and_aborted", [topic, committed, aborted])[0]
+    assert response == ["aborted by test", "abort"]
+
+    server.call("producer.close", [])
+
+    response = server.call("producer.begin_transaction", [])[0]
+    assert response == ["producer is closed", "fatal"]
+
+    kafka_output = read_from_kafka(topic, "test_read_committed_group", isolation_level="read_committed")
+    assert sorted(msg.value.decode('utf8') for msg in kafka_output) == sorted(committed)
+
+    # aborted messages are still written to log
+    kafka_output = read_from_kafka(topic, "test_read_uncommitted_group")
+    assert sorted(msg.value.decode('utf8') for msg in kafka_output) == sorted(committed + aborted)
+
+
+def test_producer_should_export_space():
+    server = get_server()
+
+    server.call("producer.create", [KAFKA_HOST])
+
+    count = 100
+    first, second, checkpoint, err = server.call("producer.export_space", ["test_producer_export_space", count, 7])[0]
+    assert err is None
+    assert first == count // 2
+    assert first + second == count
+    assert checkpoint == [count]
+
+    loop = asyncio.get_event_loop_policy().new_event_loop()
+
+    async def test():
+        kafka_output = []
+
+        async def consume():
+            consumer = AIOKafkaConsumer(
+                'test_producer_export_space',
+                group_id="test_export_group",
+                bootstrap_servers='localhost:9092',
+                auto_offset_reset="earliest",
+            )
+            await consumer.start()
+
+            try:
+                async for msg in consumer:
+                    kafka_output.append((msg.key, msg.value))
+
+            finally:
+                await consumer.stop()
+
+        try:
+            await asyncio.wait_for(consume(), 10)
+        except asyncio.TimeoutError:
+            pass
+
+        # projection of single short string field is msgpack array of one fixstr
+        expected = []
+        for i in range(1, count + 1):
+            value = ("value_%d" % i).encode()
+            expected.append((("key_%d" % i).encode(), bytes([0x91, 0xa0 | len(value)]) + value))
+        # order is kept within partition only
+        assert sorted(kafka_output) == sorted(expected)
+
+    loop.run_until_complete(test())
+    loop.close()
+
+    server.call("producer.close", [])
+
+
+def test_producer_should_not_export_space_by_non_unique_index():
+    server = get_server()
+
+    server.call("producer.create", [KAFKA_HOST])
+
+    count, err = server.call("producer.export_space_by_non_unique_index", ["test_producer_export_non_unique"])[0]
+    assert count == 0
+    assert 'must be unique' in err
+
+    server.call("producer.close", [])
+
+
+def test_producer_should_produce_msgs_through_shared_runtime():
+    server = get_server()
+
+    messages = [{'key': str(i), 'value': 'runtime_%d' % i} for i in range(30)]
+    stat, errors = server.call("producer.produce_with_runtime",
+                               [KAFKA_HOST, "test_producer_runtime", messages, 3])[0]
+    assert errors == []
+    assert stat['threads'] == 2
+    assert sum(stat['handles']) == 3
+
+    loop = asyncio.get_event_loop_policy().new_event_loop()
+
+    async def test():
+        kafka_output = []
+
+        async def consume():
+            consumer = AIOKafkaConsumer(
+                'test_producer_runtime',
+                group_id="test_runtime_group",
+                bootstrap_servers='localhost:9092',
+                auto_offset_reset="earliest",
+            )
+            await consumer.start()
+
+            try:
+                async for msg in consumer:
+                    kafka_output.append({'key': msg.key.decode('utf8'), 'value': msg.value.decode('utf8')})
+
+            finally:
+                await consumer.stop()
+
+        try:
+            await asyncio.wait_for(consume(), 10)
+        except asyncio.TimeoutError:
+            pass
+
+        assert sorted(kafka_output, key=lambda m: int(m['key'])) == messages
+
+    loop.run_until_complete(test())
+    loop.close()
+
+
+def murmur2(data):
+    # the same hash as in Java client and murmur2 partitioners of librdkafka
+    m = 0x5bd1e995
+    length = len(data)
+    h = (0x9747b28c ^ length) & 0xffffffff
+    for i in range(0, length - length % 4, 4):
+        k = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | (data[i + 3] << 24)
+        k = (k * m) & 0xffffffff
+        k ^= k >> 24
+        k = (k * m) & 0xffffffff
+        h = ((h * m) & 0xffffffff) ^ k
+    tail = length - length % 4
+    extra = length % 4
+    if extra >= 3:
+        h ^= data[tail + 2] << 16
+    if extra >= 2:
+        h ^= data[tail + 1] << 8
+    if extra >= 1:
+        h ^= data[tail]
+        h = (h * m) & 0xffffffff
+    h ^= h >> 13
+    h = (h * m) & 0xffffffff
+    h ^= h >> 15
+    return h
+
+
+def test_producer_should_partition_msgs():
+    server = get_server()
+
+    keys = ['key_%d' % i for i in range(10)]
+    result = server.call("producer.produce_with_partitioner",
+                         [KAFKA_HOST, "test_producer_partitioner", 20, 2, 5, keys])[0]
+    assert len(result['keyless']) == 20
+    assert len(set(result['keyless'])) == 1
+    assert result['partitioned'] == [2] * 5
+    # default consistent_random partitioner of librdkafka hashes keys by crc32 instead
+    assert result['keyed'] == [(murmur2(key.encode('utf-8')) & 0x7fffffff) % 3 for key in keys]
+
+
+def test_producer_should_encode_values_by_codec():
+    server = get_server()
+
+    values = [
+        {"id": 1, "name": "first", "tags": ["a", "b"], "price": 1.5},
+        {"id": 2, "name": "second \u2603", "active": False},
+    ]
+    tuples = [[3, "third", [1, 2]], [4, "fourth"]]
+    raw_values = ['{"id": 5}']
+    server.call("producer.produce_with_codec", [KAFKA_HOST, "test_producer_json_codec", values, tuples, raw_values])
+
+    kafka_output = read_from_kafka("test_producer_json_codec", "test_producer_json_codec_group")
+    expected = values + tuples + [json.loads(value) for value in raw_values]
+    decoded = [json.loads(msg.value.decode('utf8')) for msg in kafka_output]
+    def order(value):
+        return json.dumps(value, sort_keys=True)
+    assert sorted(decoded, key=order) == sorted(expected, key=order)
+
+
+def test_producer_should_produce_msgs_to_mock_cluster():
+    server = get_server()
+
+    errors = server.call("producer.produce_to_mock_cluster", [['mock_%d' % i for i in range(10)]])[0]
+    assert errors == []
+
+
+def test_producer_should_apply_thread_options():
+    server = get_server()
+
+    result = server.call("producer.create_with_thread_options",
+                         [KAFKA_HOST, {'name_suffix': 'orders', 'cpu_affinity': [0], 'sched_policy': 'other'}])[0]
+    assert 'err' not in result
+    assert 'kprod:orders' in result['names']
+
+    result = server.call("producer.create_with_thread_options", [KAFKA_HOST, {'sched_policy': 'unknown'}])[0]
+    assert result['err'].startswith("producer config 'thread_options.sched_policy' must be one of")